@@ -44,8 +44,10 @@
 #include <mutex>
 #include <fstream>
 #include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>   
 #include <richedit.h>
 #include <commctrl.h>
@@ -58,6 +60,18 @@ using std::max;
 #include <shlobj.h>
 #include <map>
 #include <functional>
+#include <deque>
+#include <condition_variable>
+#include <random>
+
+// x86/x64 SIMD kernels (SSE2 baseline, SSSE3 selected at runtime)
+#if defined(_M_X64) || defined(_M_IX86)
+#define NOVA_SIMD_X86 1
+#include <intrin.h>
+#include <tmmintrin.h>
+#else
+#define NOVA_SIMD_X86 0
+#endif
 
 #pragma comment(lib, "wininet.lib")
 #pragma comment(lib, "user32.lib")
@@ -101,7 +115,12 @@ static constexpr const wchar_t* NOVA_VERSION = L"1.5.0";
 #define MIN_WIN_H       500
 #define WM_AI_DONE      (WM_APP + 1)
 #define WM_ENGINE_READY (WM_APP + 2)
-#define WM_EXEC_DONE    (WM_APP + 3)
+#define WM_EXEC_DONE    (WM_APP + 3)   // lParam = heap ExecResult*
+#define WM_AI_PROGRESS  (WM_APP + 4)   // wParam = parts done, lParam = parts total
+#define WM_ATTACH_PROGRESS (WM_APP + 5) // wParam = files done, lParam = files total
+#define WM_ATTACH_DONE  (WM_APP + 6)   // lParam = heap std::vector<Attachment>*
+#define WM_EXEC_OUTPUT  (WM_APP + 7)   // lParam = heap std::string* (live command output), wParam = 1 for the header line
+#define WM_RECIPE_DONE  (WM_APP + 8)   // lParam = heap ExecResult* (a replayed recipe)
 
 // Button command IDs (main window)
 #define IDC_BTN_SEND     101
@@ -173,43 +192,44 @@ struct ProviderPreset {
     bool           needsApiKey;
     const char*    defaultModel;
     ProtocolType   protocol;
+    bool           vision;         // the default model takes image input
 };
 
 static const ProviderPreset g_providerPresets[PROV_COUNT] = {
     // 1. llama-server
-    { L"llama-server (local)",    "127.0.0.1", 8080,  "/completion",           false, false, "",                        ProtocolType::LlamaLegacy  },
+    { L"llama-server (local)",    "127.0.0.1", 8080,  "/completion",           false, false, "",                        ProtocolType::LlamaLegacy,  false },
     // 2. Ollama
-    { L"Ollama",                  "127.0.0.1", 11434, "/v1/chat/completions",  false, false, "llama3:latest",           ProtocolType::OpenAICompat },
+    { L"Ollama",                  "127.0.0.1", 11434, "/v1/chat/completions",  false, false, "llama3:latest",           ProtocolType::OpenAICompat, false },
     // 3. LM Studio
-    { L"LM Studio",              "127.0.0.1", 1234,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat },
+    { L"LM Studio",              "127.0.0.1", 1234,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat, false },
     // 4. vLLM
-    { L"vLLM",                   "127.0.0.1", 8000,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat },
+    { L"vLLM",                   "127.0.0.1", 8000,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat, false },
     // 5. KoboldCpp
-    { L"KoboldCpp",              "127.0.0.1", 5001,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat },
+    { L"KoboldCpp",              "127.0.0.1", 5001,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat, false },
     // 6. Jan
-    { L"Jan",                    "127.0.0.1", 1337,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat },
+    { L"Jan",                    "127.0.0.1", 1337,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat, false },
     // 7. GPT4All
-    { L"GPT4All",                "127.0.0.1", 4891,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat },
+    { L"GPT4All",                "127.0.0.1", 4891,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat, false },
     // 8. Custom Local
-    { L"Custom Local",           "127.0.0.1", 8080,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat },
+    { L"Custom Local",           "127.0.0.1", 8080,  "/v1/chat/completions",  false, false, "",                        ProtocolType::OpenAICompat, false },
     // 9. OpenAI
-    { L"OpenAI",                 "api.openai.com",       443, "/v1/chat/completions",  true, true, "gpt-4o-mini",      ProtocolType::OpenAICompat },
+    { L"OpenAI",                 "api.openai.com",       443, "/v1/chat/completions",  true, true, "gpt-4o-mini",      ProtocolType::OpenAICompat, true },
     // 10. Anthropic
-    { L"Anthropic (Claude)",     "api.anthropic.com",    443, "/v1/messages",           true, true, "claude-3-haiku-20240307", ProtocolType::Anthropic },
+    { L"Anthropic (Claude)",     "api.anthropic.com",    443, "/v1/messages",           true, true, "claude-3-haiku-20240307", ProtocolType::Anthropic, true },
     // 11. Google Gemini
-    { L"Google Gemini",          "generativelanguage.googleapis.com", 443, "/v1beta/models/", true, true, "gemini-1.5-flash", ProtocolType::Gemini },
+    { L"Google Gemini",          "generativelanguage.googleapis.com", 443, "/v1beta/models/", true, true, "gemini-1.5-flash", ProtocolType::Gemini, true },
     // 12. Groq
-    { L"Groq",                   "api.groq.com",         443, "/openai/v1/chat/completions", true, true, "llama3-8b-8192", ProtocolType::OpenAICompat },
+    { L"Groq",                   "api.groq.com",         443, "/openai/v1/chat/completions", true, true, "llama3-8b-8192", ProtocolType::OpenAICompat, false },
     // 13. Mistral AI
-    { L"Mistral AI",             "api.mistral.ai",       443, "/v1/chat/completions",  true, true, "mistral-small-latest", ProtocolType::OpenAICompat },
+    { L"Mistral AI",             "api.mistral.ai",       443, "/v1/chat/completions",  true, true, "mistral-small-latest", ProtocolType::OpenAICompat, true },
     // 14. Together AI
-    { L"Together AI",            "api.together.xyz",     443, "/v1/chat/completions",  true, true, "meta-llama/Llama-3-8b-chat-hf", ProtocolType::OpenAICompat },
+    { L"Together AI",            "api.together.xyz",     443, "/v1/chat/completions",  true, true, "meta-llama/Llama-3-8b-chat-hf", ProtocolType::OpenAICompat, false },
     // 15. OpenRouter
-    { L"OpenRouter",             "openrouter.ai",        443, "/api/v1/chat/completions", true, true, "meta-llama/llama-3-8b-instruct", ProtocolType::OpenAICompat },
+    { L"OpenRouter",             "openrouter.ai",        443, "/api/v1/chat/completions", true, true, "meta-llama/llama-3-8b-instruct", ProtocolType::OpenAICompat, false },
     // 16. xAI (Grok)
-    { L"xAI (Grok)",            "api.x.ai",             443, "/v1/chat/completions",  true, true, "grok-beta",        ProtocolType::OpenAICompat },
+    { L"xAI (Grok)",            "api.x.ai",             443, "/v1/chat/completions",  true, true, "grok-beta",        ProtocolType::OpenAICompat, false },
     // 17. Custom Cloud
-    { L"Custom Cloud",           "api.example.com",      443, "/v1/chat/completions",  true, true, "",                 ProtocolType::OpenAICompat },
+    { L"Custom Cloud",           "api.example.com",      443, "/v1/chat/completions",  true, true, "",                 ProtocolType::OpenAICompat, false },
 };
 
 struct NovaConfig {
@@ -227,22 +247,46 @@ struct NovaConfig {
     bool         autoStartEngine = true;
     std::string  modelPath    = "models\\llama3.gguf";
     int          enginePort   = 8080;
+    bool         sendImages   = true;   // attach image pixels (not just the GDI+ summary) for vision providers
+    int          vision       = -1;     // the model takes images: -1 = judge by provider and model name, 0 = no, 1 = yes
+    int          summaryWorkers = 0;    // concurrent chunk summaries for large files (0 = auto)
+    std::string  workspaceDir;          // folder indexed for prompts (empty = no workspace index)
+    int          execTimeoutSec  = 300; // EXEC commands are killed after this long
+    int          execMaxOutputMB = 16;  // ...or once they have printed this much
+    int          execFeedbackTokens = 1000;  // EXEC output fed back to the model is condensed to about this
+    int          compileCacheMB  = 512; // size cap of the compile cache (0 = off)
+    int          buildJobs       = 0;   // parallel compiles in multi-file builds (0 = one per core)
+    int          agentMaxSteps   = 12;  // EXEC results fed back per user message (0 = no limit)
+    int          agentMaxMinutes = 15;  // ...wall time per user message
+    int          agentMaxTokens  = 300000;  // ...estimated tokens sent and received per user message
 };
 
 struct Attachment {
     std::wstring path;
     std::wstring displayName;
     std::string  textContent;
+    std::string  fullText;      // whole text when too large to inline; condensed at send time
+    bool         streamExtract = false;   // document too large to inline: re-extracted page by page into the summarizer at send time
+    std::vector<float> features;    // numeric descriptors from the analyser (image stats, audio spectrum)
+    ULONGLONG    fileSize   = 0;
+    bool         fromFolder = false;   // expanded from a dropped folder (ranks after explicit picks)
     bool         isImage = false;
     bool         isAudio = false;
     bool         isText  = false;
     bool         isVideo = false;
 };
 
+// Image bytes prepared for a vision request (already resized/re-encoded for the provider)
+struct ImagePayload {
+    std::string       mime;
+    std::vector<BYTE> bytes;
+    UINT              width  = 0;
+    UINT              height = 0;
+};
+
 struct ChatRequest {
-    std::wstring userText;
-    bool         hasAttachment = false;
-    Attachment   attachment;
+    std::wstring            userText;
+    std::vector<Attachment> attachments;
 };
 
 // ══════════════════════════════════════════════════════════════════
@@ -265,6 +309,7 @@ struct LoadedPlugin {
     typedef const char* (*ExecuteToolFunc)(const char*);
     GetToolSchemaFunc fnGetSchema = nullptr;
     ExecuteToolFunc fnExecute = nullptr;
+    std::unique_ptr<std::mutex> callMutex = std::make_unique<std::mutex>();   // ExecuteTool returns a buffer the plugin owns
 };
 
 class PluginManager {
@@ -280,11 +325,20 @@ private:
         }
         return output;
     }
+    // Tool names as the function-calling APIs accept them
+    static bool ValidToolName(const std::string& name) {
+        if (name.empty() || name.size() > 64) return false;
+        for (char c : name) if (!isalnum((unsigned char)c) && c != '_' && c != '-') return false;
+        return true;
+    }
 public:
     void ScanAndLoad(const std::wstring& pluginDir) {
-        m_plugins.clear(); m_aggregatedPrompt = "=== AVAILABLE TOOLS ===\n";
-        if (!std::filesystem::exists(pluginDir)) return;
-        for (const auto& entry : std::filesystem::directory_iterator(pluginDir)) {
+        m_plugins.clear();
+        m_aggregatedPrompt = "\n=== TOOLS ===\nThese run inside Nova and answer at once. When one fits, call it as a tool (not through EXEC:); "
+                             "independent calls may go in the same reply.\n";
+        std::error_code ec;
+        if (!std::filesystem::exists(pluginDir, ec)) return;
+        for (const auto& entry : std::filesystem::directory_iterator(pluginDir, ec)) {
             if (entry.path().extension() == L".dll") {
                 UniqueHModule hMod(LoadLibraryW(entry.path().c_str()));
                 if (!hMod) continue;
@@ -296,10 +350,14 @@ public:
                         std::string rawSchema = rawSchemaPtr;
                         std::string minSchema = MinifyJsonString(rawSchema);
                         std::string toolName = DecodeJsonString(rawSchema, "name"); 
-                        if (!toolName.empty()) {
+                        if (!ValidToolName(toolName)) {
+                            DevLog("[PluginManager] Skipped %S: tool name \"%s\" must be 1-64 letters, digits, '_' or '-'\n",
+                                   entry.path().filename().c_str(), toolName.c_str());
+                        } else {
                             LoadedPlugin plugin; plugin.name = toolName; plugin.minifiedSchema = minSchema;
                             plugin.handle = std::move(hMod); plugin.fnGetSchema = fnSchema; plugin.fnExecute = fnExec;
-                            m_aggregatedPrompt += minSchema + "\n"; m_plugins[toolName] = std::move(plugin);
+                            m_aggregatedPrompt += "- " + toolName + ": " + DecodeJsonString(rawSchema, "description") + "\n";
+                            m_plugins[toolName] = std::move(plugin);
                             DevLog("[PluginManager] Loaded: %s\n", toolName.c_str());
                         }
                     }
@@ -307,10 +365,18 @@ public:
             }
         }
     }
+    size_t Count() const { return m_plugins.size(); }
+    std::vector<std::string> Schemas() const {
+        std::vector<std::string> out;
+        for (const auto& kv : m_plugins) out.push_back(kv.second.minifiedSchema);
+        return out;
+    }
     std::string GetPluginSystemPrompt() const { return m_plugins.empty() ? "" : m_aggregatedPrompt; }
+    // Calls to different plugins may run at the same time; one plugin's calls take turns
     std::string ExecutePlugin(const std::string& toolName, const std::string& jsonArgs) {
         auto it = m_plugins.find(toolName);
         if (it != m_plugins.end() && it->second.fnExecute) {
+            std::lock_guard<std::mutex> lk(*it->second.callMutex);
             const char* res = it->second.fnExecute(jsonArgs.c_str());
             return res ? std::string(res) : "{\"error\": \"Plugin returned null\"}";
         }
@@ -329,6 +395,7 @@ public:
     std::atomic<AppState> state{ AppState::Offline };
     std::atomic<bool> aiRunning{false};      // Moved here for safety
     std::atomic<bool> abortInference{false}; // The Kill-Switch flag
+    std::atomic<bool> execRunning{false};    // an EXEC command is running (Stop kills it)
 
     AppStateManager(const AppStateManager&) = delete;
     AppStateManager& operator=(const AppStateManager&) = delete;
@@ -369,8 +436,7 @@ HFONT hFontBtn      = nullptr;
 HFONT hFontIndicator = nullptr;
 WNDPROC OldEditProc = nullptr;
 
-bool       g_hasAttachment = false;
-Attachment g_attachment;
+std::vector<Attachment> g_attachments;
 
 std::mutex        historyMutex;
 std::wstring      conversationHistory;
@@ -402,6 +468,7 @@ std::string WStringToString(const std::wstring& w);
 std::wstring StringToWString(const std::string& s);
 std::string UrlEncode(const std::string& s);
 std::string Base64Encode(const std::vector<BYTE>& data);
+void Base64EncodeInto(std::string& out, const BYTE* data, size_t n);
 std::string ExtractReply(const std::string& raw, ProtocolType proto);
 
 void SaveConfig();
@@ -423,14 +490,17 @@ std::string FetchNews(const std::string& q);
 std::string FetchWiki(const std::string& q);
 std::string AnalyzeAndFetch(const std::string& lower, const std::string& orig);
 
-std::string AnalyzeImageGDIPlus(const std::wstring& path);
-std::string AnalyzeWavDetailed(const std::wstring& path);
+std::string AnalyzeImageGDIPlus(const std::wstring& path, std::vector<float>* features = nullptr);
+bool PrepareImagePayload(const std::wstring& path, ProviderType prov, ImagePayload& out);
+std::string AnalyzeWavDetailed(const std::wstring& path, std::vector<float>* features = nullptr);
+std::string AnalyzeCompressedAudio(const std::wstring& path, const std::string& ext, std::vector<float>* features = nullptr);
 std::string AnalyzeVideoFile(const std::wstring& path, const std::string& ext);
 bool LoadAttachment(const std::wstring& path, Attachment& out);
 void OpenAttachDialog();
+void OnDropFiles(HDROP drop);
 void ClearAttachment();
 
-void AIThreadFunc(std::wstring userMsg, std::string webInfo, bool hasAttach, Attachment attach);
+void AIThreadFunc(std::wstring userMsg, std::string webInfo, std::vector<Attachment> attachments);
 DWORD WINAPI ChatThreadProc(LPVOID param);
 void ProcessChat();
 void SetAppState(AppState s);
@@ -567,23 +637,6 @@ std::string GetExeDir() {
     return WStringToString(dir);
 }
 
-std::string IndexProjectDirectory(const std::string& targetPath) {
-    std::string indexMap = "PROJECT DIRECTORY MAP:\n";
-    
-    for (const auto& entry : std::filesystem::recursive_directory_iterator(targetPath)) {
-        if (entry.is_regular_file()) {
-            std::string ext = entry.path().extension().string();
-            // Only index code files to save context window limits
-            if (ext == ".cpp" || ext == ".h" || ext == ".py" || ext == ".js") {
-                indexMap += "- " + entry.path().filename().string() + " (Path: " + entry.path().string() + ")\n";
-            }
-        }
-    }
-    
-    // Inject this map silently into the next LLM prompt so Nova "knows" the workspace
-    return indexMap;
-}
-
 std::string GetDesktopDir() {
     wchar_t path[MAX_PATH];
     if (SHGetSpecialFolderPathW(NULL, path, CSIDL_DESKTOP, FALSE))
@@ -591,22 +644,186 @@ std::string GetDesktopDir() {
     return "";
 }
 
-std::string Base64Encode(const std::vector<BYTE>& data) {
+#if NOVA_SIMD_X86
+static bool CpuHasSSSE3() {
+    int info[4] = {};
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+}
+#endif
+
+// Appends base64 of data to out in place — callers encode straight into the request body
+void Base64EncodeInto(std::string& out, const BYTE* data, size_t n) {
     static const char* tbl = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    std::string out;
-    out.reserve(((data.size() + 2) / 3) * 4);
-    for (size_t i = 0; i < data.size(); i += 3) {
+    size_t base = out.size();
+    out.resize(base + ((n + 2) / 3) * 4);
+    char* dst = &out[base];
+    size_t i = 0;
+#if NOVA_SIMD_X86
+    static const bool ssse3 = CpuHasSSSE3();
+    if (ssse3) {
+        // 12 input bytes -> 16 output chars per iteration (Mula/Lemire split + LUT shift)
+        const __m128i shuf   = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+        const __m128i maskAC = _mm_set1_epi32(0x0fc0fc00), mulAC = _mm_set1_epi32(0x04000040);
+        const __m128i maskBD = _mm_set1_epi32(0x003f03f0), mulBD = _mm_set1_epi32(0x01000010);
+        const __m128i shiftLut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                               '/' - 63, 'A', 0, 0);
+        for (; i + 16 <= n; i += 12, dst += 16) {
+            __m128i in  = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i)), shuf);
+            __m128i idx = _mm_or_si128(_mm_mulhi_epu16(_mm_and_si128(in, maskAC), mulAC),
+                                       _mm_mullo_epi16(_mm_and_si128(in, maskBD), mulBD));
+            __m128i red = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+            red = _mm_or_si128(red, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+            _mm_storeu_si128((__m128i*)dst, _mm_add_epi8(_mm_shuffle_epi8(shiftLut, red), idx));
+        }
+    }
+#endif
+    for (; i < n; i += 3) {
         DWORD val = (DWORD)data[i] << 16;
-        if (i + 1 < data.size()) val |= (DWORD)data[i+1] << 8;
-        if (i + 2 < data.size()) val |= (DWORD)data[i+2];
-        out += tbl[(val >> 18) & 0x3F];
-        out += tbl[(val >> 12) & 0x3F];
-        out += (i + 1 < data.size()) ? tbl[(val >>  6) & 0x3F] : '=';
-        out += (i + 2 < data.size()) ? tbl[(val >>  0) & 0x3F] : '=';
+        if (i + 1 < n) val |= (DWORD)data[i+1] << 8;
+        if (i + 2 < n) val |= (DWORD)data[i+2];
+        *dst++ = tbl[(val >> 18) & 0x3F];
+        *dst++ = tbl[(val >> 12) & 0x3F];
+        *dst++ = (i + 1 < n) ? tbl[(val >>  6) & 0x3F] : '=';
+        *dst++ = (i + 2 < n) ? tbl[(val >>  0) & 0x3F] : '=';
     }
+}
+
+std::string Base64Encode(const std::vector<BYTE>& data) {
+    std::string out;
+    Base64EncodeInto(out, data.data(), data.size());
     return out;
 }
 
+// Unaligned little/big-endian field readers for binary container parsing
+static inline WORD      ReadLE16(const BYTE* p) { return (WORD)(p[0] | p[1] << 8); }
+static inline DWORD     ReadLE32(const BYTE* p) { return (DWORD)p[0] | (DWORD)p[1] << 8 | (DWORD)p[2] << 16 | (DWORD)p[3] << 24; }
+static inline ULONGLONG ReadLE64(const BYTE* p) { return (ULONGLONG)ReadLE32(p) | (ULONGLONG)ReadLE32(p + 4) << 32; }
+static inline WORD      ReadBE16(const BYTE* p) { return (WORD)(p[0] << 8 | p[1]); }
+static inline DWORD     ReadBE32(const BYTE* p) { return (DWORD)p[0] << 24 | (DWORD)p[1] << 16 | (DWORD)p[2] << 8 | (DWORD)p[3]; }
+static inline ULONGLONG ReadBE64(const BYTE* p) { return (ULONGLONG)ReadBE32(p) << 32 | ReadBE32(p + 4); }
+
+// Read-only memory-mapped view of a whole file. Pages are only faulted in when touched,
+// so header parsers can seek around multi-GB files without reading them.
+class MappedFile {
+public:
+    explicit MappedFile(const std::wstring& path) {
+        m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                             OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) return;
+        LARGE_INTEGER sz = {};
+        if (!GetFileSizeEx(m_file, &sz) || sz.QuadPart <= 0) return;
+        m_map = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_map) return;
+        m_data = (const BYTE*)MapViewOfFile(m_map, FILE_MAP_READ, 0, 0, 0);
+        if (m_data) m_size = (ULONGLONG)sz.QuadPart;
+    }
+    ~MappedFile() {
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_map) CloseHandle(m_map);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool        IsOpen() const { return m_data != nullptr; }
+    const BYTE* Data()   const { return m_data; }
+    ULONGLONG   Size()   const { return m_size; }
+
+private:
+    HANDLE      m_file = INVALID_HANDLE_VALUE;
+    HANDLE      m_map  = nullptr;
+    const BYTE* m_data = nullptr;
+    ULONGLONG   m_size = 0;
+};
+
+// XXH64 — fast non-cryptographic 64-bit hash, used for content-addressed caches
+static inline ULONGLONG XxRotl(ULONGLONG x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static ULONGLONG XXH64(const void* input, size_t len, ULONGLONG seed = 0) {
+    const ULONGLONG P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL, P3 = 1609587929392839161ULL,
+                    P4 = 9650029242287828579ULL,  P5 = 2870177450012600261ULL;
+    auto round = [&](ULONGLONG acc, ULONGLONG v) { acc += v * P2; return XxRotl(acc, 31) * P1; };
+    auto merge = [&](ULONGLONG acc, ULONGLONG v) { acc ^= round(0, v); return acc * P1 + P4; };
+
+    const BYTE* p   = (const BYTE*)input;
+    const BYTE* end = p + len;
+    ULONGLONG h;
+    if (len >= 32) {
+        ULONGLONG v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        do {
+            v1 = round(v1, ReadLE64(p));      v2 = round(v2, ReadLE64(p + 8));
+            v3 = round(v3, ReadLE64(p + 16)); v4 = round(v4, ReadLE64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = XxRotl(v1, 1) + XxRotl(v2, 7) + XxRotl(v3, 12) + XxRotl(v4, 18);
+        h = merge(h, v1); h = merge(h, v2); h = merge(h, v3); h = merge(h, v4);
+    } else {
+        h = seed + P5;
+    }
+    h += (ULONGLONG)len;
+    for (; p + 8 <= end; p += 8) { h ^= round(0, ReadLE64(p)); h = XxRotl(h, 27) * P1 + P4; }
+    if (p + 4 <= end)            { h ^= (ULONGLONG)ReadLE32(p) * P1; h = XxRotl(h, 23) * P2 + P3; p += 4; }
+    for (; p < end; ++p)         { h ^= (ULONGLONG)*p * P5; h = XxRotl(h, 11) * P1; }
+    h ^= h >> 33; h *= P2;
+    h ^= h >> 29; h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static ULONGLONG XXH64(const std::string& s, ULONGLONG seed = 0) { return XXH64(s.data(), s.size(), seed); }
+
+// Fixed set of worker threads draining a FIFO queue. Wait() blocks until every job
+// submitted so far has finished; the destructor drains the queue and joins.
+class WorkerPool {
+public:
+    explicit WorkerPool(int threads) {
+        for (int i = 0; i < (std::max)(threads, 1); i++) m_threads.emplace_back([this] { Run(); });
+    }
+    ~WorkerPool() {
+        { std::lock_guard<std::mutex> lk(m_mutex); m_stop = true; }
+        m_wake.notify_all();
+        for (auto& t : m_threads) t.join();
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void Submit(std::function<void()> job) {
+        { std::lock_guard<std::mutex> lk(m_mutex); m_jobs.push_back(std::move(job)); m_pending++; }
+        m_wake.notify_one();
+    }
+    void Wait() {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_idle.wait(lk, [this] { return m_pending == 0; });
+    }
+    int Size() const { return (int)m_threads.size(); }
+
+private:
+    void Run() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lk(m_mutex);
+                m_wake.wait(lk, [this] { return m_stop || !m_jobs.empty(); });
+                if (m_jobs.empty()) return;
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            job();
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if (--m_pending == 0) m_idle.notify_all();
+        }
+    }
+
+    std::vector<std::thread>          m_threads;
+    std::deque<std::function<void()>> m_jobs;
+    std::mutex                        m_mutex;
+    std::condition_variable           m_wake, m_idle;
+    size_t                            m_pending = 0;
+    bool                              m_stop    = false;
+};
+
 // ════════════════════════════════════════════════════════════════
 // CONFIGURATION (nova_config.ini)
 // ════════════════════════════════════════════════════════════════
@@ -628,6 +845,18 @@ void SaveConfig() {
     f << "auto_start_engine=" << (g_config.autoStartEngine ? 1 : 0) << "\n";
     f << "model_path="       << g_config.modelPath          << "\n";
     f << "engine_port="      << g_config.enginePort         << "\n";
+    f << "send_images="      << (g_config.sendImages ? 1 : 0) << "\n";
+    f << "vision="           << g_config.vision             << "\n";
+    f << "summary_workers="  << g_config.summaryWorkers     << "\n";
+    f << "workspace_dir="    << g_config.workspaceDir       << "\n";
+    f << "exec_timeout_sec=" << g_config.execTimeoutSec     << "\n";
+    f << "exec_max_output_mb=" << g_config.execMaxOutputMB  << "\n";
+    f << "exec_feedback_tokens=" << g_config.execFeedbackTokens << "\n";
+    f << "compile_cache_mb=" << g_config.compileCacheMB     << "\n";
+    f << "build_jobs="       << g_config.buildJobs          << "\n";
+    f << "agent_max_steps="  << g_config.agentMaxSteps      << "\n";
+    f << "agent_max_minutes=" << g_config.agentMaxMinutes   << "\n";
+    f << "agent_max_tokens=" << g_config.agentMaxTokens     << "\n";
     DevLog("[Config] Saved: provider=%d host=%s port=%d model=%s\n",
            (int)g_config.provider, g_config.host.c_str(), g_config.port, g_config.model.c_str());
 }
@@ -670,6 +899,18 @@ void LoadConfig() {
         else if (key == "auto_start_engine") g_config.autoStartEngine = (val == "1");
         else if (key == "model_path")        g_config.modelPath = val;
         else if (key == "engine_port")       g_config.enginePort = atoi(val.c_str());
+        else if (key == "send_images")       g_config.sendImages = (val == "1");
+        else if (key == "vision")            g_config.vision = atoi(val.c_str());
+        else if (key == "summary_workers")   g_config.summaryWorkers = atoi(val.c_str());
+        else if (key == "workspace_dir")     g_config.workspaceDir = val;
+        else if (key == "exec_timeout_sec")  g_config.execTimeoutSec = atoi(val.c_str());
+        else if (key == "exec_max_output_mb") g_config.execMaxOutputMB = atoi(val.c_str());
+        else if (key == "exec_feedback_tokens") g_config.execFeedbackTokens = atoi(val.c_str());
+        else if (key == "compile_cache_mb")  g_config.compileCacheMB = atoi(val.c_str());
+        else if (key == "build_jobs")        g_config.buildJobs = atoi(val.c_str());
+        else if (key == "agent_max_steps")   g_config.agentMaxSteps = atoi(val.c_str());
+        else if (key == "agent_max_minutes") g_config.agentMaxMinutes = atoi(val.c_str());
+        else if (key == "agent_max_tokens")  g_config.agentMaxTokens = atoi(val.c_str());
     }
     DevLog("[Config] Loaded: provider=%d (%S) host=%s port=%d model=%s\n",
            (int)g_config.provider, g_providerPresets[g_config.provider].displayName,
@@ -716,9 +957,10 @@ void StartLocalEngine() {
     si.wShowWindow = SW_HIDE;
 
     char cmd[1024];
-    sprintf_s(cmd, "engine\\llama-server.exe -m \"%s\" --alias default --port %d -c %d -ngl %d --host 127.0.0.1",
+    sprintf_s(cmd, "engine\\llama-server.exe -m \"%s\" --alias default --port %d -c %d -ngl %d --host 127.0.0.1%s",
               g_config.modelPath.c_str(), g_config.enginePort,
-              g_config.contextSize, g_config.gpuLayers);
+              g_config.contextSize, g_config.gpuLayers,
+              AppStateManager::Instance().GetPluginManager().Count() ? " --jinja" : "");   // tool calls need the model's own chat template
 
     if (CreateProcessA(NULL, cmd, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &g_serverPi)) {
         CloseHandle(g_serverPi.hThread);
@@ -770,7 +1012,7 @@ static std::string ExtensionOf(const std::wstring& path) {
     return ext;
 }
 
-std::string AnalyzeImageGDIPlus(const std::wstring& path) {
+std::string AnalyzeImageGDIPlus(const std::wstring& path, std::vector<float>* features) {
     using namespace Gdiplus;
     Bitmap bmp(path.c_str());
     if (bmp.GetLastStatus() != Ok) return "ERROR: Could not load image with GDI+.";
@@ -833,6 +1075,13 @@ std::string AnalyzeImageGDIPlus(const std::wstring& path) {
     int avgBright = (avgR * 299 + avgG * 587 + avgB * 114) / 1000;
     int avgEdge   = (int)(edgeSum / std::max(1LL, count));
 
+    if (features) {
+        // width, height, mean R/G/B, brightness, edge density, then neutral/red/green/blue/transparent shares
+        float n = (float)count;
+        *features = { (float)w, (float)h, (float)avgR, (float)avgG, (float)avgB, (float)avgBright, (float)avgEdge,
+                      hueNeutral / n, hueRed / n, hueGreen / n, hueBlue / n, transparentPx / n };
+    }
+
     const char* brightDesc = avgBright > 200 ? "very bright/high-key" : avgBright > 140 ? "bright"
                            : avgBright > 100 ? "balanced mid-tone" : avgBright > 60 ? "dark" : "very dark/low-key";
     const char* sharpDesc  = avgEdge > 30 ? "high detail / sharp" : avgEdge > 15 ? "moderate detail"
@@ -861,370 +1110,9335 @@ std::string AnalyzeImageGDIPlus(const std::wstring& path) {
     return buf;
 }
 
-std::string AnalyzeWavDetailed(const std::wstring& path) {
-    std::ifstream f(path, std::ios::binary);
-    if (!f) return "ERROR: Could not open WAV file.";
+// Per-provider pixel budget. Sizes land on each API's cheapest tile grid so we never
+// upload pixels the provider would throw away (or bill for) on its side.
+struct VisionProfile { UINT maxLong; UINT maxShort; ULONG jpegQuality; };
 
-    char riff[4]; f.read(riff, 4);
-    if (std::string(riff, 4) != "RIFF") return "ERROR: Not a valid RIFF/WAV file.";
-    DWORD chunkSize; f.read((char*)&chunkSize, 4);
-    char wave[4]; f.read(wave, 4);
-    if (std::string(wave, 4) != "WAVE") return "ERROR: Not a WAVE file.";
-
-    WORD audioFmt = 0, channels = 0, bitsPerSample = 0, blockAlign = 0;
-    DWORD sampleRate = 0, byteRate = 0, dataSize = 0;
-    bool fmtFound = false;
+static VisionProfile VisionProfileFor(ProviderType prov) {
+    switch (g_providerPresets[prov].protocol) {
+    case ProtocolType::Anthropic:   return { 1568, 1568, 82 };  // larger long edges are resized server-side
+    case ProtocolType::Gemini:      return {  768,  768, 82 };  // one 768x768 tile = 258 tokens
+    case ProtocolType::LlamaLegacy: return {  896,  896, 85 };  // CLIP/SigLIP projectors top out near 896px
+    default: break;
+    }
+    if (g_providerPresets[prov].needsApiKey) return { 1024, 768, 80 }; // OpenAI-style 512px tiles: 2x2 grid max
+    return { 896, 896, 85 };  // local OpenAI-compatible servers (Ollama, LM Studio...) also feed a CLIP encoder
+}
 
-    char id[4]; DWORD sz;
-    while (f.read(id, 4) && f.read((char*)&sz, 4)) {
-        std::string tag(id, 4);
-        if (tag == "fmt ") {
-            f.read((char*)&audioFmt, 2); f.read((char*)&channels, 2);
-            f.read((char*)&sampleRate, 4); f.read((char*)&byteRate, 4);
-            f.read((char*)&blockAlign, 2); f.read((char*)&bitsPerSample, 2);
-            if (sz > 16) f.ignore(sz - 16);
-            fmtFound = true;
-        } else if (tag == "data") { dataSize = sz; break; }
-        else f.ignore(sz);
-    }
-    if (!fmtFound) return "ERROR: Could not find fmt chunk.";
-
-    double duration = (byteRate > 0) ? (double)dataSize / byteRate : 0.0;
-    int mins = (int)duration / 60, secs = (int)duration % 60;
-    const char* fmtName = (audioFmt == 1 ? "PCM" : audioFmt == 3 ? "IEEE Float" : "compressed");
-
-    double rmsSum = 0.0, peak = 0.0, prevSample = 0.0;
-    double leftRms = 0, rightRms = 0;
-    long long totalSamples = 0, silentSamples = 0, zeroCrossings = 0;
-    const long long MAX_SAMPLES = 5000000;
-
-    if (audioFmt == 1 && bitsPerSample == 16 && channels >= 1) {
-        std::vector<int16_t> buf(4096);
-        long long samplesRead = 0;
-        while (samplesRead < MAX_SAMPLES) {
-            size_t toRead = std::min((size_t)4096, (size_t)(MAX_SAMPLES - samplesRead));
-            f.read((char*)buf.data(), toRead * 2);
-            std::streamsize got = f.gcount() / 2;
-            if (got <= 0) break;
-            for (int i = 0; i < got; i++) {
-                double s = buf[i] / 32768.0;
-                rmsSum += s * s;
-                if (fabs(s) > peak) peak = fabs(s);
-                if (fabs(s) < 0.01) silentSamples++;
-                if ((s >= 0) != (prevSample >= 0)) zeroCrossings++;
-                prevSample = s;
-                if (channels == 2) { if (i % 2 == 0) leftRms += s * s; else rightRms += s * s; }
-                totalSamples++;
-            }
-            samplesRead += got;
-        }
-    }
-
-    char buf[2048];
-    if (totalSamples > 0) {
-        double rms = sqrt(rmsSum / totalSamples);
-        double rmsDb = (rms > 1e-10) ? 20.0 * log10(rms) : -999.0;
-        double peakDb = (peak > 1e-10) ? 20.0 * log10(peak) : -999.0;
-        double dynRange = peakDb - rmsDb;
-        double silencePct = (double)silentSamples / totalSamples * 100.0;
-        sprintf_s(buf,
-            "=== WAV ANALYSIS ===\nFormat: %s | %d-bit | %lu Hz | %d ch | %d:%02d\n"
-            "RMS: %.1f dBFS | Peak: %.1f dBFS | Dynamic range: %.1f dB | Silence: %.1f%%\n"
-            "Analyse this audio and give detailed feedback.",
-            fmtName, (int)bitsPerSample, sampleRate, (int)channels, mins, secs,
-            rmsDb, peakDb, dynRange, silencePct);
-    } else {
-        sprintf_s(buf,
-            "=== WAV FILE ===\nFormat: %s | %d-bit | %lu Hz | %d ch | %d:%02d\n"
-            "Note: Sample-level analysis not available for format %s.",
-            fmtName, (int)bitsPerSample, sampleRate, (int)channels, mins, secs, fmtName);
+static bool GetEncoderClsid(const WCHAR* mime, CLSID* clsid) {
+    using namespace Gdiplus;
+    UINT num = 0, size = 0;
+    if (GetImageEncodersSize(&num, &size) != Ok || size == 0) return false;
+    std::vector<BYTE> buf(size);
+    ImageCodecInfo* codecs = (ImageCodecInfo*)buf.data();
+    if (GetImageEncoders(num, size, codecs) != Ok) return false;
+    for (UINT i = 0; i < num; i++) {
+        if (wcscmp(codecs[i].MimeType, mime) == 0) { *clsid = codecs[i].Clsid; return true; }
     }
-    return buf;
+    return false;
 }
 
-std::string AnalyzeVideoFile(const std::wstring& path, const std::string& ext) {
-    std::string nameA = WStringToString(path.substr(path.find_last_of(L"\\/")+1));
-    WIN32_FILE_ATTRIBUTE_DATA fa = {};
-    GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &fa);
-    ULONGLONG fileSize = ((ULONGLONG)fa.nFileSizeHigh << 32) | fa.nFileSizeLow;
+// Bake EXIF rotation into the pixels — the re-encoded JPEG carries no EXIF block
+static bool ApplyExifOrientation(Gdiplus::Bitmap& bmp) {
+    using namespace Gdiplus;
+    UINT sz = bmp.GetPropertyItemSize(PropertyTagOrientation);
+    if (sz == 0) return false;
+    std::vector<BYTE> buf(sz);
+    PropertyItem* item = (PropertyItem*)buf.data();
+    if (bmp.GetPropertyItem(PropertyTagOrientation, sz, item) != Ok || item->type != PropertyTagTypeShort) return false;
+    switch (*(WORD*)item->value) {
+    case 2: bmp.RotateFlip(RotateNoneFlipX);   return true;
+    case 3: bmp.RotateFlip(Rotate180FlipNone); return true;
+    case 4: bmp.RotateFlip(RotateNoneFlipY);   return true;
+    case 5: bmp.RotateFlip(Rotate90FlipX);     return true;
+    case 6: bmp.RotateFlip(Rotate90FlipNone);  return true;
+    case 7: bmp.RotateFlip(Rotate270FlipX);    return true;
+    case 8: bmp.RotateFlip(Rotate270FlipNone); return true;
+    }
+    return false;
+}
 
-    // Try ffprobe for detailed analysis
-    std::string exeDir = GetExeDir();
-    std::string ffprobe = exeDir + "ffprobe.exe";
-    { DWORD attr = GetFileAttributesA(ffprobe.c_str()); if (attr == INVALID_FILE_ATTRIBUTES) ffprobe = "ffprobe.exe"; }
+// Downsample to the provider's budget and re-encode as JPEG. The original file is sent
+// untouched when it already fits and is smaller than the re-encode.
+bool PrepareImagePayload(const std::wstring& path, ProviderType prov, ImagePayload& out) {
+    using namespace Gdiplus;
+    VisionProfile vp = VisionProfileFor(prov);
+    Bitmap src(path.c_str());
+    if (src.GetLastStatus() != Ok) return false;
+    bool rotated = ApplyExifOrientation(src);
 
-    std::string tmpOut = exeDir + "ffprobe_tmp.txt";
-    std::string pathA = WStringToString(path);
-    std::string fullCmd = "cmd.exe /d /c \"\"" + ffprobe + "\" -v quiet -print_format json -show_format -show_streams \""
-                        + pathA + "\" > \"" + tmpOut + "\" 2>&1\"";
+    UINT w = src.GetWidth(), h = src.GetHeight();
+    if (w == 0 || h == 0) return false;
+    double scale = std::min({ 1.0, (double)vp.maxLong / std::max(w, h), (double)vp.maxShort / std::min(w, h) });
+    UINT tw = std::max(1u, (UINT)(w * scale + 0.5));
+    UINT th = std::max(1u, (UINT)(h * scale + 0.5));
 
-    STARTUPINFOA si = { sizeof(si) }; si.dwFlags = STARTF_USESHOWWINDOW; si.wShowWindow = SW_HIDE;
-    PROCESS_INFORMATION pi = {};
-    std::vector<char> cmdBuf(fullCmd.begin(), fullCmd.end()); cmdBuf.push_back('\0');
+    std::string ext = ExtensionOf(path);
+    const char* origMime = (ext == "jpg" || ext == "jpeg") ? "image/jpeg"
+                         : ext == "png"  ? "image/png"
+                         : ext == "webp" ? "image/webp" : nullptr;
+    std::vector<BYTE> original;
+    if (scale >= 1.0 && origMime && !rotated) {
+        std::ifstream f(path, std::ios::binary);
+        if (f) original.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    }
 
-    if (CreateProcessA(nullptr, cmdBuf.data(), nullptr, nullptr, FALSE, CREATE_NO_WINDOW, nullptr, nullptr, &si, &pi)) {
-        DWORD waitResult = WaitForSingleObject(pi.hProcess, 15000);
-        if (waitResult == WAIT_TIMEOUT) TerminateProcess(pi.hProcess, 1);
-        CloseHandle(pi.hProcess); CloseHandle(pi.hThread);
-        std::ifstream tf(tmpOut);
-        if (tf) {
-            std::ostringstream ss; ss << tf.rdbuf();
-            std::string result = ss.str();
-            tf.close(); DeleteFileA(tmpOut.c_str());
-            if (result.find("codec_name") != std::string::npos) {
-                char buf[512];
-                sprintf_s(buf, "=== VIDEO: \"%s\" | %s | %.2f MB ===\nffprobe data:\n%s\nAnalyse this video.",
-                    nameA.c_str(), ext.c_str(), (double)fileSize / (1024.0*1024.0), result.c_str());
-                return buf;
-            }
+    // Flatten alpha onto white (JPEG has none) and resample in one pass
+    std::vector<BYTE> encoded;
+    Bitmap dst((INT)tw, (INT)th, PixelFormat24bppRGB);
+    {
+        Graphics g(&dst);
+        g.Clear(Color(255, 255, 255, 255));
+        g.SetInterpolationMode(InterpolationModeHighQualityBicubic);
+        g.SetPixelOffsetMode(PixelOffsetModeHighQuality);
+        ImageAttributes ia; ia.SetWrapMode(WrapModeTileFlipXY);  // no dark fringe along the edges
+        g.DrawImage(&src, Rect(0, 0, (INT)tw, (INT)th), 0, 0, (INT)w, (INT)h, UnitPixel, &ia);
+    }
+    CLSID jpegClsid;
+    IStream* stream = nullptr;
+    if (GetEncoderClsid(L"image/jpeg", &jpegClsid) && SUCCEEDED(CreateStreamOnHGlobal(nullptr, TRUE, &stream))) {
+        ULONG quality = vp.jpegQuality;
+        EncoderParameters ep = {};
+        ep.Count = 1;
+        ep.Parameter[0].Guid           = EncoderQuality;
+        ep.Parameter[0].Type           = EncoderParameterValueTypeLong;
+        ep.Parameter[0].NumberOfValues = 1;
+        ep.Parameter[0].Value          = &quality;
+        HGLOBAL hg = nullptr;
+        STATSTG st = {};
+        if (dst.Save(stream, &jpegClsid, &ep) == Ok && SUCCEEDED(GetHGlobalFromStream(stream, &hg))
+            && SUCCEEDED(stream->Stat(&st, STATFLAG_NONAME))) {
+            BYTE* p = (BYTE*)GlobalLock(hg);
+            if (p) { encoded.assign(p, p + (size_t)st.cbSize.QuadPart); GlobalUnlock(hg); }
         }
+        stream->Release();
     }
 
-    char buf[512];
-    sprintf_s(buf,
-        "=== VIDEO FILE ===\nFilename: \"%s\" | Format: %s | Size: %.2f MB\n"
-        "Note: ffprobe not found. Place ffprobe.exe next to nova.exe for full analysis.",
-        nameA.c_str(), ext.c_str(), (double)fileSize / (1024.0*1024.0));
-    return buf;
+    if (!original.empty() && (encoded.empty() || original.size() <= encoded.size())) {
+        out.mime = origMime; out.bytes = std::move(original); out.width = w; out.height = h;
+    } else if (!encoded.empty()) {
+        out.mime = "image/jpeg"; out.bytes = std::move(encoded); out.width = tw; out.height = th;
+    } else {
+        return false;
+    }
+    return true;
 }
 
-bool LoadAttachment(const std::wstring& path, Attachment& out) {
-    out = {};
-    size_t slash = path.find_last_of(L"\\/");
-    out.path = path;
-    out.displayName = (slash != std::wstring::npos) ? path.substr(slash + 1) : path;
-    std::string ext = ExtensionOf(path);
+// ── PCM sample statistics engine (shared by WAV/AIFF analysis) ──
+enum class SampleKind { U8, S16, S24, S32, F32, F64 };
 
-    static const std::vector<std::string> textExts = {
-        "txt","cpp","h","c","hpp","py","js","ts","json","xml","html",
-        "css","md","log","csv","ini","yaml","yml","bat","ps1","sh","rc","asm"
-    };
-    if (std::find(textExts.begin(), textExts.end(), ext) != textExts.end()) {
-        std::ifstream f(path, std::ios::binary);
-        if (!f) return false;
-        std::ostringstream ss; ss << f.rdbuf();
-        std::string raw = ss.str();
-        if (raw.size() > 12000) raw = raw.substr(0, 12000) + "\n... [truncated]";
-        out.textContent = "=== FILE: \"" + WStringToString(out.displayName) + "\" ===\n" + raw + "\n=== END ===\nAnalyse this file.";
-        out.isText = true;
-        DevLog("[Attach] Text: %zu chars\n", out.textContent.size());
-        return true;
+struct PcmLayout {
+    SampleKind kind        = SampleKind::S16;
+    int        channels    = 0;
+    int        bytesPerSample = 0;
+    int        blockAlign  = 0;
+    bool       bigEndian   = false;
+};
+
+struct ChannelStats {
+    double    sum = 0.0, sumSq = 0.0;
+    float     peak = 0.0f;
+    ULONGLONG clipped = 0, silent = 0, crossings = 0;
+};
+
+struct PcmStats {
+    std::vector<ChannelStats> ch;
+    std::vector<float>        first, last;  // edge samples, used to stitch zero crossings across segments
+    ULONGLONG                 frames = 0;
+};
+
+static const float kSilenceLevel = 0.01f;   // -40 dBFS
+static const float kClipLevel    = 0.999f;  // within 0.01 dB of full scale
+
+// Convert n interleaved samples to float in [-1, 1)
+static void DecodeSamples(const BYTE* src, size_t n, const PcmLayout& L, float* dst) {
+    size_t i = 0;
+    if (!L.bigEndian) {
+        switch (L.kind) {
+        case SampleKind::F32:
+            memcpy(dst, src, n * sizeof(float));
+            return;
+        case SampleKind::S16: {
+#if NOVA_SIMD_X86
+            const __m128 k = _mm_set1_ps(1.0f / 32768.0f);
+            for (; i + 8 <= n; i += 8) {
+                __m128i v  = _mm_loadu_si128((const __m128i*)(src + i * 2));
+                __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+                __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+                _mm_storeu_ps(dst + i,     _mm_mul_ps(_mm_cvtepi32_ps(lo), k));
+                _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), k));
+            }
+#endif
+            for (; i < n; i++) { int16_t s; memcpy(&s, src + i * 2, 2); dst[i] = s * (1.0f / 32768.0f); }
+            return;
+        }
+        case SampleKind::S32: {
+#if NOVA_SIMD_X86
+            const __m128 k = _mm_set1_ps(1.0f / 2147483648.0f);
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(src + i * 4))), k));
+#endif
+            for (; i < n; i++) { int32_t s; memcpy(&s, src + i * 4, 4); dst[i] = (float)s * (1.0f / 2147483648.0f); }
+            return;
+        }
+        case SampleKind::S24:
+            for (; i < n; i++) {
+                const BYTE* p = src + i * 3;
+                int32_t s = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8;
+                dst[i] = s * (1.0f / 8388608.0f);
+            }
+            return;
+        case SampleKind::U8:
+            for (; i < n; i++) dst[i] = ((int)src[i] - 128) * (1.0f / 128.0f);
+            return;
+        case SampleKind::F64:
+            for (; i < n; i++) { double d; memcpy(&d, src + i * 8, 8); dst[i] = (float)d; }
+            return;
+        }
+    }
+    // Big-endian (AIFF) — scalar byte-swapping path
+    for (; i < n; i++) {
+        const BYTE* p = src + i * L.bytesPerSample;
+        switch (L.kind) {
+        case SampleKind::S16: dst[i] = (int16_t)(p[0] << 8 | p[1]) * (1.0f / 32768.0f); break;
+        case SampleKind::S24: dst[i] = ((int32_t)((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8) >> 8) * (1.0f / 8388608.0f); break;
+        case SampleKind::S32: dst[i] = (float)(int32_t)((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]) * (1.0f / 2147483648.0f); break;
+        case SampleKind::F32: { uint32_t u = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]; float f; memcpy(&f, &u, 4); dst[i] = f; break; }
+        case SampleKind::F64: { uint64_t u = 0; for (int b = 0; b < 8; b++) u = u << 8 | p[b]; double d; memcpy(&d, &u, 8); dst[i] = (float)d; break; }
+        case SampleKind::U8:  dst[i] = (int8_t)p[0] * (1.0f / 128.0f); break;  // AIFF 8-bit is signed
+        }
     }
+}
 
-    static const std::vector<std::string> imgExts = { "jpg","jpeg","png","bmp","gif","webp","tif","tiff","ico" };
-    if (std::find(imgExts.begin(), imgExts.end(), ext) != imgExts.end()) {
-        out.textContent = AnalyzeImageGDIPlus(path);
-        out.isImage = true;
-        return true;
+// Accumulate level statistics over `frames` interleaved frames. prev[] holds the previous
+// sample of each channel on entry and the last one on return.
+static void AccumulateStats(const float* x, size_t frames, int C, float* prev, ChannelStats* cs) {
+    size_t n = frames * (size_t)C, i = 0;
+#if NOVA_SIMD_X86
+    if (C == 1 || C == 2 || C == 4) {
+        // Lane j always carries channel j % C, so per-lane accumulators fold straight into channels
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        const __m128 zero = _mm_setzero_ps(), clipLv = _mm_set1_ps(kClipLevel), silLv = _mm_set1_ps(kSilenceLevel);
+        __m128 sum = zero, sq = zero, peak = zero;
+        __m128i clip = _mm_setzero_si128(), sil = _mm_setzero_si128(), zc = _mm_setzero_si128();
+        __m128 last = _mm_setr_ps(prev[0 % C], prev[1 % C], prev[2 % C], prev[3 % C]);
+        for (; i + 4 <= n; i += 4) {
+            __m128 v = _mm_loadu_ps(x + i);
+            __m128 before = C == 4 ? last
+                          : C == 2 ? _mm_shuffle_ps(last, v, _MM_SHUFFLE(1, 0, 3, 2))
+                          : _mm_shuffle_ps(_mm_shuffle_ps(last, v, _MM_SHUFFLE(0, 0, 3, 3)), v, _MM_SHUFFLE(2, 1, 2, 0));
+            __m128 a = _mm_and_ps(v, absMask);
+            sum  = _mm_add_ps(sum, v);
+            sq   = _mm_add_ps(sq, _mm_mul_ps(v, v));
+            peak = _mm_max_ps(peak, a);
+            clip = _mm_sub_epi32(clip, _mm_castps_si128(_mm_cmpge_ps(a, clipLv)));
+            sil  = _mm_sub_epi32(sil,  _mm_castps_si128(_mm_cmplt_ps(a, silLv)));
+            zc   = _mm_sub_epi32(zc,   _mm_castps_si128(_mm_xor_ps(_mm_cmplt_ps(v, zero), _mm_cmplt_ps(before, zero))));
+            last = v;
+        }
+        alignas(16) float fs[4], fq[4], fp[4], fl[4];
+        alignas(16) int32_t ic[4], is[4], iz[4];
+        _mm_store_ps(fs, sum); _mm_store_ps(fq, sq); _mm_store_ps(fp, peak); _mm_store_ps(fl, last);
+        _mm_store_si128((__m128i*)ic, clip); _mm_store_si128((__m128i*)is, sil); _mm_store_si128((__m128i*)iz, zc);
+        for (int j = 0; j < 4; j++) {
+            ChannelStats& c = cs[j % C];
+            c.sum += fs[j]; c.sumSq += fq[j]; c.peak = std::max(c.peak, fp[j]);
+            c.clipped += (ULONGLONG)ic[j]; c.silent += (ULONGLONG)is[j]; c.crossings += (ULONGLONG)iz[j];
+        }
+        if (i > 0) for (int j = 4 - C; j < 4; j++) prev[j % C] = fl[j];
     }
+#endif
+    for (; i < n; i++) {
+        int c = (int)(i % (size_t)C);
+        float s = x[i], a = fabsf(s);
+        ChannelStats& st = cs[c];
+        st.sum += s; st.sumSq += (double)s * s;
+        if (a > st.peak) st.peak = a;
+        if (a >= kClipLevel)   st.clipped++;
+        if (a < kSilenceLevel) st.silent++;
+        if ((s < 0.0f) != (prev[c] < 0.0f)) st.crossings++;
+        prev[c] = s;
+    }
+}
 
-    static const std::vector<std::string> audioExts = { "wav","mp3","flac","ogg","aac","wma","m4a","aiff","aif" };
-    if (std::find(audioExts.begin(), audioExts.end(), ext) != audioExts.end()) {
-        if (ext == "wav") out.textContent = AnalyzeWavDetailed(path);
-        else {
-            WIN32_FILE_ATTRIBUTE_DATA fa2 = {};
-            GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &fa2);
-            char buf[256]; sprintf_s(buf, "=== AUDIO: \"%s\" | %s | %.2f MB ===",
-                WStringToString(out.displayName).c_str(), ext.c_str(),
-                (double)(((ULONGLONG)fa2.nFileSizeHigh << 32) | fa2.nFileSizeLow) / (1024.0*1024.0));
-            out.textContent = buf;
+static void ComputePcmStatsRange(const BYTE* data, ULONGLONG frameBegin, ULONGLONG frameEnd, const PcmLayout& L, PcmStats& out) {
+    const int C = L.channels;
+    out.ch.assign(C, ChannelStats());
+    out.first.assign(C, 0.0f); out.last.assign(C, 0.0f);
+    out.frames = frameEnd - frameBegin;
+    if (frameEnd <= frameBegin) return;
+
+    const size_t blockFrames = std::max<size_t>(1, 16384 / (size_t)C);  // keeps per-lane float sums exact enough
+    std::vector<float> buf(blockFrames * C);
+    DecodeSamples(data + frameBegin * L.blockAlign, C, L, out.first.data());
+    std::vector<float> prev = out.first;
+    for (ULONGLONG f = frameBegin; f < frameEnd; f += blockFrames) {
+        size_t nf = (size_t)std::min<ULONGLONG>(blockFrames, frameEnd - f);
+        const BYTE* src = data + f * L.blockAlign;
+        if (L.blockAlign == L.bytesPerSample * C) {
+            DecodeSamples(src, nf * C, L, buf.data());
+        } else {
+            for (size_t k = 0; k < nf; k++) DecodeSamples(src + k * L.blockAlign, C, L, buf.data() + k * C);
         }
-        out.isAudio = true;
-        return true;
+        AccumulateStats(buf.data(), nf, C, prev.data(), out.ch.data());
     }
+    out.last = prev;
+}
 
-    static const std::vector<std::string> videoExts = { "mp4","mov","avi","mkv","wmv","flv","webm","m4v","mpg","mpeg","ts","mts" };
-    if (std::find(videoExts.begin(), videoExts.end(), ext) != videoExts.end()) {
-        out.textContent = AnalyzeVideoFile(path, ext);
-        out.isVideo = true;
-        return true;
+// Whole-file statistics; long recordings are split across worker threads
+static PcmStats ComputePcmStats(const BYTE* data, ULONGLONG frames, const PcmLayout& L, int* threadsUsed = nullptr) {
+    const ULONGLONG bytes = frames * (ULONGLONG)L.blockAlign;
+    int nThreads = 1;
+    if (bytes > (16ull << 20)) nThreads = (int)std::min<ULONGLONG>(std::max(1u, std::thread::hardware_concurrency()), bytes >> 23);
+    nThreads = std::max(1, std::min(nThreads, 16));
+    if (threadsUsed) *threadsUsed = nThreads;
+
+    std::vector<PcmStats> parts(nThreads);
+    if (nThreads == 1) {
+        ComputePcmStatsRange(data, 0, frames, L, parts[0]);
+    } else {
+        std::vector<std::thread> workers;
+        for (int t = 0; t < nThreads; t++) {
+            ULONGLONG b = frames * t / nThreads, e = frames * (t + 1) / nThreads;
+            workers.emplace_back([&, b, e, t]() { ComputePcmStatsRange(data, b, e, L, parts[t]); });
+        }
+        for (auto& w : workers) w.join();
     }
 
-    DevLog("[Attach] Unsupported type: .%s\n", ext.c_str());
-    return false;
+    PcmStats total = std::move(parts[0]);
+    for (int t = 1; t < nThreads; t++) {
+        const PcmStats& p = parts[t];
+        if (p.frames == 0) continue;
+        for (int c = 0; c < L.channels; c++) {
+            ChannelStats& a = total.ch[c]; const ChannelStats& b = p.ch[c];
+            a.sum += b.sum; a.sumSq += b.sumSq; a.peak = std::max(a.peak, b.peak);
+            a.clipped += b.clipped; a.silent += b.silent; a.crossings += b.crossings;
+            if (total.frames > 0 && (total.last[c] < 0.0f) != (p.first[c] < 0.0f)) a.crossings++;
+        }
+        if (total.frames == 0) total.first = p.first;
+        total.last = p.last;
+        total.frames += p.frames;
+    }
+    return total;
 }
 
-void ClearAttachment() {
-    g_hasAttachment = false;
-    g_attachment = {};
-    if (hAttachLabel) SetWindowTextW(hAttachLabel, L"");
-}
+// ── WAV container ──
+struct WavInfo {
+    WORD        formatTag = 0, channels = 0, blockAlign = 0, bitsPerSample = 0, validBits = 0;
+    DWORD       sampleRate = 0, byteRate = 0;
+    bool        extensible = false;
+    const BYTE* data = nullptr;
+    ULONGLONG   dataSize = 0;
+};
 
-void OpenAttachDialog() {
-    wchar_t filePath[MAX_PATH] = {};
-    OPENFILENAMEW ofn = {};
-    ofn.lStructSize = sizeof(ofn);
-    ofn.hwndOwner   = hMainWnd;
-    ofn.lpstrFilter =
-        L"All Supported\0*.txt;*.cpp;*.h;*.c;*.hpp;*.py;*.js;*.ts;*.json;*.xml;*.html;*.css;*.md;*.log;*.csv;*.ini;*.yaml;*.yml;*.bat;*.ps1;*.rc;*.asm;"
-        L"*.jpg;*.jpeg;*.png;*.bmp;*.gif;*.webp;*.tif;*.tiff;*.ico;"
-        L"*.wav;*.mp3;*.flac;*.ogg;*.aac;*.wma;*.m4a;*.aiff;"
-        L"*.mp4;*.mov;*.avi;*.mkv;*.wmv;*.flv;*.webm;*.m4v;*.mpg;*.mpeg\0"
-        L"All Files\0*.*\0";
-    ofn.lpstrFile  = filePath;
-    ofn.nMaxFile   = MAX_PATH;
-    ofn.Flags      = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST;
-    ofn.lpstrTitle = L"Attach File for Nova to Analyse";
+// Walks RIFF/RF64 chunks in place. Handles WAVE_FORMAT_EXTENSIBLE, odd-size padding and
+// streaming writers that leave the data size at 0 or 0xFFFFFFFF.
+static const char* ParseWavHeader(const BYTE* p, ULONGLONG size, WavInfo& wi) {
+    if (size < 12) return "Not a valid RIFF/WAV file.";
+    bool rf64 = memcmp(p, "RF64", 4) == 0;
+    if (memcmp(p, "RIFF", 4) != 0 && !rf64) return "Not a valid RIFF/WAV file.";
+    if (memcmp(p + 8, "WAVE", 4) != 0) return "Not a WAVE file.";
 
-    if (!GetOpenFileNameW(&ofn)) return;
-    Attachment loaded;
-    if (LoadAttachment(filePath, loaded)) {
-        g_attachment = loaded;
-        g_hasAttachment = true;
-        SetWindowTextW(hAttachLabel, (L"\U0001F4CE  " + loaded.displayName).c_str());
-        DevLog("[Attach] Ready: %s\n", WStringToString(loaded.displayName).c_str());
+    ULONGLONG ds64DataSize = 0, pos = 12;
+    bool fmtFound = false;
+    while (pos + 8 <= size) {
+        const BYTE* ck = p + pos;
+        ULONGLONG sz = ReadLE32(ck + 4), body = pos + 8;
+        if (memcmp(ck, "ds64", 4) == 0 && sz >= 16 && body + 16 <= size) {
+            ds64DataSize = ReadLE64(ck + 16);
+        } else if (memcmp(ck, "fmt ", 4) == 0 && sz >= 16 && body + sz <= size) {
+            const BYTE* f = ck + 8;
+            wi.formatTag     = ReadLE16(f);
+            wi.channels      = ReadLE16(f + 2);
+            wi.sampleRate    = ReadLE32(f + 4);
+            wi.byteRate      = ReadLE32(f + 8);
+            wi.blockAlign    = ReadLE16(f + 12);
+            wi.bitsPerSample = ReadLE16(f + 14);
+            wi.validBits     = wi.bitsPerSample;
+            if (wi.formatTag == 0xFFFE && sz >= 40) {
+                wi.extensible = true;
+                wi.validBits  = ReadLE16(f + 18);
+                wi.formatTag  = ReadLE16(f + 24);  // first two bytes of the SubFormat GUID
+            }
+            fmtFound = true;
+        } else if (memcmp(ck, "data", 4) == 0) {
+            ULONGLONG avail = size - std::min(size, body);
+            if (rf64 && sz == 0xFFFFFFFF) sz = ds64DataSize;
+            if (sz == 0 || sz > avail) sz = avail;
+            wi.data = ck + 8; wi.dataSize = sz;
+            break;
+        }
+        pos = body + sz + (sz & 1);
+    }
+    if (!fmtFound) return "Could not find fmt chunk.";
+    return nullptr;
+}
+
+static bool WavSampleLayout(const WavInfo& wi, PcmLayout& L) {
+    if (wi.channels == 0 || wi.bitsPerSample == 0) return false;
+    int container = wi.blockAlign / wi.channels;  // bytes actually occupied by each sample
+    if (wi.formatTag == 1) {
+        if      (container == 1) L.kind = SampleKind::U8;
+        else if (container == 2) L.kind = SampleKind::S16;
+        else if (container == 3) L.kind = SampleKind::S24;
+        else if (container == 4) L.kind = SampleKind::S32;
+        else return false;
+    } else if (wi.formatTag == 3) {
+        if      (container == 4) L.kind = SampleKind::F32;
+        else if (container == 8) L.kind = SampleKind::F64;
+        else return false;
     } else {
-        MessageBoxW(hMainWnd, L"Unsupported file type.", L"Nova", MB_ICONWARNING);
+        return false;
     }
+    L.channels = wi.channels; L.bytesPerSample = container; L.blockAlign = wi.blockAlign;
+    return true;
 }
 
-// ════════════════════════════════════════════════════════════════
-// SYSTEM EXECUTION ENGINE
-// ════════════════════════════════════════════════════════════════
+static double ToDbfs(double v) { return (v > 1e-10) ? 20.0 * log10(v) : -999.0; }
+
+// Human-readable level report shared by the WAV and AIFF analysers
+static std::string FormatPcmStats(const PcmStats& st, DWORD sampleRate) {
+    const int C = (int)st.ch.size();
+    double sumSq = 0.0, peak = 0.0;
+    ULONGLONG clipped = 0, silent = 0;
+    for (const auto& c : st.ch) { sumSq += c.sumSq; peak = std::max(peak, (double)c.peak); clipped += c.clipped; silent += c.silent; }
+    double samples = (double)st.frames * C;
+    double rmsDb = ToDbfs(sqrt(sumSq / samples)), peakDb = ToDbfs(peak);
+    double seconds = sampleRate ? (double)st.frames / sampleRate : 0.0;
+
+    char line[256];
+    sprintf_s(line, "RMS: %.1f dBFS | Peak: %.1f dBFS | Dynamic range: %.1f dB | Silence: %.1f%% | Clipped samples: %llu\n",
+              rmsDb, peakDb, peakDb - rmsDb, silent / samples * 100.0, clipped);
+    std::string out = line;
+    for (int c = 0; c < std::min(C, 8); c++) {
+        const ChannelStats& cs = st.ch[c];
+        const char* name = (C == 2) ? (c == 0 ? " (L)" : " (R)") : "";
+        sprintf_s(line, "Ch%d%s: RMS %.1f dBFS | Peak %.1f dBFS | DC %+.5f | ZCR %.0f/s | Clipped %llu | Silence %.1f%%\n",
+                  c + 1, name, ToDbfs(sqrt(cs.sumSq / st.frames)), ToDbfs(cs.peak), cs.sum / st.frames,
+                  seconds > 0 ? cs.crossings / seconds : 0.0, cs.clipped, (double)cs.silent / st.frames * 100.0);
+        out += line;
+    }
+    if (C > 8) out += "(" + std::to_string(C - 8) + " more channels not listed)\n";
+    if (C == 2) {
+        double diff = ToDbfs(sqrt(st.ch[0].sumSq / st.frames)) - ToDbfs(sqrt(st.ch[1].sumSq / st.frames));
+        sprintf_s(line, "Stereo balance: %s %.1f dB louder\n", diff >= 0 ? "L" : "R", fabs(diff));
+        out += line;
+    }
+    return out;
+}
 
-// Define tracking globals somewhere at the top of your file if they aren't already:
-// std::string g_currentAgentDir = "";
+// ── Spectral features (streaming STFT) ──
+// Radix-2 complex FFT on split re/im arrays. Twiddles are stored per stage so every
+// butterfly pass walks contiguous memory (SSE handles four butterflies at a time).
+class SplitFFT {
+public:
+    explicit SplitFFT(size_t n) : m_n(n), m_rev(n) {
+        int bits = 0; while (((size_t)1 << bits) < n) bits++;
+        for (size_t i = 0; i < n; i++) {
+            size_t r = 0;
+            for (int b = 0; b < bits; b++) if (i & ((size_t)1 << b)) r |= (size_t)1 << (bits - 1 - b);
+            m_rev[i] = (uint32_t)r;
+        }
+        for (size_t half = 1; half < n; half <<= 1) {
+            for (size_t k = 0; k < half; k++) {
+                double a = -M_PI * (double)k / (double)half;
+                m_twRe.push_back((float)cos(a));
+                m_twIm.push_back((float)sin(a));
+            }
+        }
+    }
 
-void ExecuteNovaCommand(const std::string& command, bool needsVS_Param) {
-    std::string lower = command;
-    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)::tolower(c); });
-
-    // 1. CWD Tracking (Allows Nova to remember where she is between commands)
-    size_t cdPos = lower.find("cd /d ");
-    if (cdPos != std::string::npos) {
-        std::string newDir = command.substr(cdPos + 6);
-        size_t end = newDir.find_first_of("&\r\n");
-        if (end != std::string::npos) newDir = newDir.substr(0, end);
-        
-        // Remove quotes if present
-        newDir.erase(std::remove(newDir.begin(), newDir.end(), '\"'), newDir.end());
-        newDir.erase(std::remove(newDir.begin(), newDir.end(), '\''), newDir.end());
-        
-        g_currentAgentDir = newDir;
+    void Forward(float* re, float* im) const {
+        for (size_t i = 0; i < m_n; i++) {
+            size_t r = m_rev[i];
+            if (r > i) { std::swap(re[i], re[r]); std::swap(im[i], im[r]); }
+        }
+        size_t twOff = 0;
+        for (size_t half = 1; half < m_n; half <<= 1) {
+            const float* wr = &m_twRe[twOff];
+            const float* wi = &m_twIm[twOff];
+            for (size_t base = 0; base < m_n; base += half * 2) {
+                float* ar = re + base;        float* ai = im + base;
+                float* br = re + base + half; float* bi = im + base + half;
+                size_t k = 0;
+#if NOVA_SIMD_X86
+                for (; k + 4 <= half; k += 4) {
+                    __m128 xr = _mm_loadu_ps(br + k), xi = _mm_loadu_ps(bi + k);
+                    __m128 cr = _mm_loadu_ps(wr + k), ci = _mm_loadu_ps(wi + k);
+                    __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, cr), _mm_mul_ps(xi, ci));
+                    __m128 ti = _mm_add_ps(_mm_mul_ps(xr, ci), _mm_mul_ps(xi, cr));
+                    __m128 ur = _mm_loadu_ps(ar + k), ui = _mm_loadu_ps(ai + k);
+                    _mm_storeu_ps(ar + k, _mm_add_ps(ur, tr)); _mm_storeu_ps(ai + k, _mm_add_ps(ui, ti));
+                    _mm_storeu_ps(br + k, _mm_sub_ps(ur, tr)); _mm_storeu_ps(bi + k, _mm_sub_ps(ui, ti));
+                }
+#endif
+                for (; k < half; k++) {
+                    float tr = br[k] * wr[k] - bi[k] * wi[k];
+                    float ti = br[k] * wi[k] + bi[k] * wr[k];
+                    br[k] = ar[k] - tr; bi[k] = ai[k] - ti;
+                    ar[k] += tr;        ai[k] += ti;
+                }
+            }
+            twOff += half;
+        }
     }
 
-    // 2. Set-Content Interceptor for Native Speed Write
-    // Bypasses PowerShell entirely for writing files to avoid shell escaping nightmare
-    if (lower.find("set-content") != std::string::npos) {
-        size_t pathPos = lower.find("-path '");
-        size_t valPos = lower.find("-value '");
-        
-        // Handle double quotes as well
-        if (pathPos == std::string::npos) pathPos = lower.find("-path \"");
-        if (valPos == std::string::npos) valPos = lower.find("-value \"");
+    size_t Size() const { return m_n; }
 
-        if (pathPos != std::string::npos && valPos != std::string::npos) {
-            std::string path = command.substr(pathPos + 7);
-            path = path.substr(0, path.find_first_of("'\"")); // Find closing quote
-            
-            std::string val = command.substr(valPos + 8);
-            val = val.substr(0, val.find_last_of("'\"")); // Find closing quote
-            
-            // Replace PowerShell's newlines (`n) with actual C++ newlines
-            size_t nPos = 0;
-            while ((nPos = val.find("`n", nPos)) != std::string::npos) { 
-                val.replace(nPos, 2, "\n"); 
-                nPos += 1; 
+private:
+    size_t                m_n;
+    std::vector<uint32_t> m_rev;
+    std::vector<float>    m_twRe, m_twIm;
+};
+
+struct SpectralSummary {
+    double    centroidHz = 0, centroidStdHz = 0, rolloffHz = 0, flatness = 0;
+    double    bandShare[7] = {};       // sub-bass, bass, low-mid, mid, high-mid, presence, brilliance
+    double    onsetsPerSec = 0, tempoBpm = 0, tempoConfidence = 0;
+    double    lowEnergyRatio = 0, speechBandShare = 0, fluxVariation = 0, speechLikelihood = 0;
+    ULONGLONG frames = 0;
+    double    msDecode = 0, msFft = 0, msFeatures = 0;
+};
+
+static const double kBandEdgesHz[8] = { 0, 60, 250, 500, 2000, 4000, 6000, 1e9 };
+static const double kMinOnsetFlux   = 0.05;  // rise in magnitude, relative to the frame total
+
+// Consumes a mono stream in hops and accumulates frame features. All state is fixed-size
+// (one FFT frame, a ~12 s onset-envelope window and a ~1 s energy window), so memory stays
+// constant no matter how long the recording is.
+class SpectralAnalyzer {
+public:
+    explicit SpectralAnalyzer(double sampleRate)
+        : m_sr(sampleRate),
+          m_n(sampleRate > 48000 ? 4096 : 2048),
+          m_hop(m_n / 2),
+          m_fft(m_n),
+          m_window(m_n), m_buf(m_n), m_frameA(m_n), m_re(m_n), m_im(m_n),
+          m_prevMag(m_n / 2 + 1, 0.0f), m_power(m_n / 2 + 1) {
+        for (size_t i = 0; i < m_n; i++) m_window[i] = (float)(0.5 - 0.5 * cos(2.0 * M_PI * i / m_n));
+        m_fps       = m_sr / m_hop;
+        m_minLag    = std::max(1, (int)(m_fps * 60.0 / 200.0));          // 200 BPM
+        m_maxLag    = std::max(m_minLag + 1, (int)(m_fps * 60.0 / 50.0)); // 50 BPM
+        m_envWin    = std::max(m_maxLag * 4, (int)(m_fps * 12.0));
+        m_energyWin = std::max(1, (int)m_fps);
+        m_acf.assign(m_maxLag + 1, 0.0);
+    }
+
+    // Feed mono samples; complete frames are analysed as soon as they fill
+    void Push(const float* x, size_t n) {
+        while (n > 0) {
+            size_t take = std::min(n, m_n - m_fill);
+            memcpy(&m_buf[m_fill], x, take * sizeof(float));
+            m_fill += take; x += take; n -= take;
+            if (m_fill == m_n) {
+                Frame(m_buf.data());
+                memmove(m_buf.data(), m_buf.data() + m_hop, (m_n - m_hop) * sizeof(float));
+                m_fill = m_n - m_hop;
             }
+        }
+    }
 
-            std::ofstream f(path);
-            if (f) { 
-                f << val; 
-                f.close(); 
+    SpectralSummary Finish() {
+        // Zero-pad whatever arrived after the last full frame (or a clip shorter than one frame)
+        if (m_fill > 0 && (m_fill > m_n - m_hop || m_framed == 0)) {
+            std::fill(m_buf.begin() + m_fill, m_buf.end(), 0.0f);
+            Frame(m_buf.data());
+        }
+        if (m_havePendingA) Transform(false);
+        FlushEnvelope(true);
+        FlushEnergyWindow();
+
+        SpectralSummary s;
+        s.frames = m_frames;
+        s.msFft = m_fftMs; s.msFeatures = m_featureMs;
+        if (m_frames == 0) return s;
+        double totalE = 0;
+        for (double e : m_bandE) totalE += e;
+        if (totalE > 0) for (int b = 0; b < 7; b++) s.bandShare[b] = m_bandE[b] / totalE;
+        if (m_voiced > 0) {
+            s.centroidHz    = m_cSum / m_voiced;
+            s.centroidStdHz = sqrt(std::max(0.0, m_cSq / m_voiced - s.centroidHz * s.centroidHz));
+            s.rolloffHz     = m_rollSum / m_voiced;
+            s.flatness      = m_flatSum / m_voiced;
+        }
+        double secs       = (double)m_frames / m_fps;
+        s.onsetsPerSec    = secs > 0 ? m_onsets / secs : 0;
+        s.lowEnergyRatio  = m_energyFrames ? (double)m_lowEnergy / m_energyFrames : 0;
+        s.speechBandShare = totalE > 0 ? m_speechE / totalE : 0;
+        double fm = m_fluxN ? m_fluxSum / m_fluxN : 0;
+        s.fluxVariation   = m_fluxN ? sqrt(std::max(0.0, m_fluxSq / m_fluxN - fm * fm)) / std::max(fm, kMinOnsetFlux) : 0;
+
+        // Tempo: strongest lag of the accumulated onset autocorrelation, gently weighted toward 120 BPM
+        double best = 0, mean = 0;
+        int bestLag = 0;
+        for (int l = m_minLag; l <= m_maxLag; l++) mean += m_acf[l];
+        mean /= (m_maxLag - m_minLag + 1);
+        for (int l = m_minLag; l <= m_maxLag; l++) {
+            double oct = log2(60.0 * m_fps / l / 120.0);
+            double w = exp(-0.5 * oct * oct);
+            if (m_acf[l] * w > best) { best = m_acf[l] * w; bestLag = l; }
+        }
+        if (bestLag > 0 && m_acf[0] > mean && s.onsetsPerSec >= 0.25) {
+            // Parabolic interpolation around the peak for sub-frame lag resolution
+            double lag = bestLag;
+            if (bestLag > m_minLag && bestLag < m_maxLag) {
+                double a = m_acf[bestLag - 1], b = m_acf[bestLag], c = m_acf[bestLag + 1];
+                double den = a - 2 * b + c;
+                if (fabs(den) > 1e-12) lag += 0.5 * (a - c) / den;
             }
-            
-            // Signal UI that execution is done
-            PostMessageW(hMainWnd, WM_EXEC_DONE, 0, 0);
-            return; 
+            s.tempoBpm = 60.0 * m_fps / lag;
+            s.tempoConfidence = std::max(0.0, std::min(1.0, (m_acf[bestLag] - mean) / (m_acf[0] - mean)));
         }
+
+        // Speech vs music heuristic: speech alternates syllables and pauses (many low-energy
+        // frames, bursty flux, energy in the 300-3400 Hz band, weak beat periodicity)
+        double z = 10.0 * (s.lowEnergyRatio - 0.3)
+                 +  3.0 * (s.speechBandShare - 0.5)
+                 +  1.0 * (std::min(s.fluxVariation, 3.0) - 1.0)
+                 -  4.0 * (s.tempoConfidence - 0.3);
+        s.speechLikelihood = 1.0 / (1.0 + exp(-z));
+        return s;
     }
 
-    // 3. Execution Thread with Universal Compiler Detection
-    std::thread([command, lower, needsVS_Param]() {
-        std::string exeDir = GetExeDir();
-        std::string batPath = exeDir + "nova_run.bat";
-        std::string outPath = exeDir + "nova_exec_out.txt";
-        
-        std::ofstream bat(batPath);
-        if (bat) {
-            bat << "@echo off\n";
-            if (!g_currentAgentDir.empty()) {
-                bat << "cd /d \"" << g_currentAgentDir << "\"\n";
-            }
-
-            // Auto-detect Visual Studio environment if compiling C++
-            if (needsVS_Param || lower.find("cl ") != std::string::npos || lower.find("cl.exe") != std::string::npos) {
-                std::string vcvars = "";
-                const char* searchPaths[] = {
-                    "C:\\Program Files\\Microsoft Visual Studio\\2022\\Community\\VC\\Auxiliary\\Build\\vcvars64.bat",
-                    "C:\\Program Files\\Microsoft Visual Studio\\2022\\Professional\\VC\\Auxiliary\\Build\\vcvars64.bat",
-                    "C:\\Program Files\\Microsoft Visual Studio\\2022\\Enterprise\\VC\\Auxiliary\\Build\\vcvars64.bat",
-                    "C:\\Program Files\\Microsoft Visual Studio\\2022\\BuildTools\\VC\\Auxiliary\\Build\\vcvars64.bat",
-                    "C:\\Program Files (x86)\\Microsoft Visual Studio\\2019\\Community\\VC\\Auxiliary\\Build\\vcvars64.bat",
-                    "C:\\Program Files (x86)\\Microsoft Visual Studio\\2019\\Professional\\VC\\Auxiliary\\Build\\vcvars64.bat",
-                    "C:\\Program Files (x86)\\Microsoft Visual Studio\\2019\\Enterprise\\VC\\Auxiliary\\Build\\vcvars64.bat",
-                    "C:\\Program Files (x86)\\Microsoft Visual Studio\\2019\\BuildTools\\VC\\Auxiliary\\Build\\vcvars64.bat"
-                };
-                
-                for (const char* p : searchPaths) {
-                    if (GetFileAttributesA(p) != INVALID_FILE_ATTRIBUTES) {
-                        vcvars = p;
-                        break;
-                    }
-                }
-                
-                if (!vcvars.empty()) {
-                    bat << "call \"" << vcvars << "\" >nul 2>&1\n"; // Hide the massive VS splash output
-                }
+    double FramesPerSecond() const { return m_fps; }
+
+private:
+    // Frames are paired into one complex FFT (A in re, B in im) and separated afterwards
+    void Frame(const float* x) {
+        m_framed++;
+        if (!m_havePendingA) {
+            for (size_t i = 0; i < m_n; i++) m_frameA[i] = x[i] * m_window[i];
+            m_havePendingA = true;
+            return;
+        }
+        for (size_t i = 0; i < m_n; i++) m_im[i] = x[i] * m_window[i];
+        Transform(true);
+    }
+
+    void Transform(bool pair) {
+        auto t0 = std::chrono::steady_clock::now();
+        memcpy(m_re.data(), m_frameA.data(), m_n * sizeof(float));
+        if (!pair) std::fill(m_im.begin(), m_im.end(), 0.0f);
+        m_fft.Forward(m_re.data(), m_im.data());
+        m_havePendingA = false;
+        auto t1 = std::chrono::steady_clock::now();
+        // Z = A + iB  =>  A[k] = (Z[k] + conj Z[N-k]) / 2,  B[k] = (Z[k] - conj Z[N-k]) / 2i
+        for (int which = 0; which < (pair ? 2 : 1); which++) {
+            for (size_t k = 0; k <= m_n / 2; k++) {
+                size_t nk = (m_n - k) & (m_n - 1);
+                float zr = m_re[k], zi = m_im[k], cr = m_re[nk], ci = -m_im[nk];
+                float r = which == 0 ? 0.5f * (zr + cr) : 0.5f * (zi - ci);
+                float i = which == 0 ? 0.5f * (zi + ci) : -0.5f * (zr - cr);
+                m_power[k] = r * r + i * i;
             }
+            FrameFeatures();
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        m_fftMs     += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        m_featureMs += std::chrono::duration<double, std::milli>(t2 - t1).count();
+    }
 
-            bat << command << "\n";
-            bat.close();
+    void FrameFeatures() {
+        const size_t bins = m_n / 2 + 1;
+        const double binHz = m_sr / m_n;
+        double total = 0, weighted = 0, logSum = 0, flux = 0, magSum = 0, speech = 0;
+        double band[7] = {};
+        int b = 0;
+        for (size_t k = 1; k < bins; k++) {
+            double p = m_power[k], f = k * binHz;
+            total += p; weighted += p * f;
+            logSum += log(p + 1e-12);
+            while (f >= kBandEdgesHz[b + 1]) b++;
+            band[b] += p;
+            if (f >= 300 && f <= 3400) speech += p;
+            float mag = sqrtf(m_power[k]);
+            magSum += mag;
+            float d = mag - m_prevMag[k];
+            if (d > 0) flux += d;
+            m_prevMag[k] = mag;
+        }
+        if (m_frames++ == 0) flux = 0;  // no previous spectrum to compare against
+        for (int j = 0; j < 7; j++) m_bandE[j] += band[j];
+        m_speechE += speech;
+        if (total > 1e-9) {
+            double c = weighted / total;
+            m_cSum += c; m_cSq += c * c;
+            double target = total * 0.85, acc = 0;
+            size_t k = 1;
+            while (k < bins && acc < target) acc += m_power[k++];
+            m_rollSum += (k - 1) * binHz;
+            double arith = total / (bins - 1);
+            m_flatSum += exp(logSum / (bins - 1)) / arith;
+            m_voiced++;
+        }
+        double rel = flux / (magSum + 1e-9);  // level-independent onset strength
+        m_fluxSum += rel; m_fluxSq += rel * rel; m_fluxN++;
+        m_env.push_back((float)rel);
+        if ((int)m_env.size() >= m_envWin) FlushEnvelope(false);
+        m_energy.push_back((float)total);
+        if ((int)m_energy.size() >= m_energyWin) FlushEnergyWindow();
+    }
 
-            // Execute the bat file and pipe output
-            std::string fullCmd = "cmd.exe /c \"\"" + batPath + "\" > \"" + outPath + "\" 2>&1\"";
-            system(fullCmd.c_str());
-            
-            // Cleanup
-            DeleteFileA(batPath.c_str());
+    // Onset picking + autocorrelation over one envelope window. The last maxLag frames are
+    // carried over so beats spanning the window boundary still correlate.
+    void FlushEnvelope(bool final) {
+        const int n = (int)m_env.size();
+        if (n - m_envCarry < 3) { if (final) m_env.clear(); return; }
+        double mean = 0, sq = 0;
+        for (float v : m_env) { mean += v; sq += (double)v * v; }
+        mean /= n;
+        double sd = sqrt(std::max(0.0, sq / n - mean * mean));
+        const int begin = m_envCarry;
+        for (int i = std::max(1, begin); i < n - 1; i++) {
+            if (m_env[i] > std::max(mean + 0.5 * sd, kMinOnsetFlux) && m_env[i] >= m_env[i - 1] && m_env[i] > m_env[i + 1]) m_onsets++;
         }
-        
-        PostMessageW(hMainWnd, WM_EXEC_DONE, 0, 0);
-    }).detach();
-}
+        m_dev.resize(n);
+        for (int i = 0; i < n; i++) m_dev[i] = (float)std::max(0.0, m_env[i] - mean);
+        for (int l = 0; l <= m_maxLag && l < n; l++) {
+            double acc = 0;
+            for (int i = std::max(begin, l); i < n; i++) acc += (double)m_dev[i] * m_dev[i - l];
+            m_acf[l] += acc;
+        }
+        if (final || n <= m_maxLag) { m_env.clear(); m_envCarry = 0; return; }
+        m_env.erase(m_env.begin(), m_env.end() - m_maxLag);
+        m_envCarry = (int)m_env.size();
+    }
 
-// ════════════════════════════════════════════════════════════════
-// HISTORY & PERSONALITY
-// ════════════════════════════════════════════════════════════════
-void TrimHistory() {
-    if (conversationHistory.size() <= MAX_HISTORY_CHARS) return;
-    size_t cut = conversationHistory.size() - MAX_HISTORY_CHARS;
-    size_t nl = conversationHistory.find(L'\n', cut);
-    conversationHistory = (nl != std::wstring::npos) ? conversationHistory.substr(nl + 1) : conversationHistory.substr(cut);
+    void FlushEnergyWindow() {
+        if (m_energy.empty()) return;
+        double mean = 0;
+        for (float e : m_energy) mean += e;
+        mean /= m_energy.size();
+        for (float e : m_energy) if (e < 0.5 * mean) m_lowEnergy++;
+        m_energyFrames += m_energy.size();
+        m_energy.clear();
+    }
+
+    double   m_sr;
+    size_t   m_n, m_hop, m_fill = 0;
+    SplitFFT m_fft;
+    std::vector<float>  m_window, m_buf, m_frameA, m_re, m_im, m_prevMag, m_power;
+    std::vector<float>  m_env, m_dev, m_energy;
+    std::vector<double> m_acf;
+    bool      m_havePendingA = false;
+    double    m_fps = 0;
+    int       m_minLag = 1, m_maxLag = 2, m_envWin = 0, m_envCarry = 0, m_energyWin = 1;
+    double    m_bandE[7] = {}, m_speechE = 0, m_cSum = 0, m_cSq = 0, m_rollSum = 0, m_flatSum = 0;
+    double    m_fluxSum = 0, m_fluxSq = 0, m_fftMs = 0, m_featureMs = 0;
+    ULONGLONG m_fluxN = 0, m_frames = 0, m_framed = 0, m_voiced = 0, m_onsets = 0, m_lowEnergy = 0, m_energyFrames = 0;
+};
+
+// Decode, downmix to mono and run the STFT over a PCM region in fixed-size blocks
+static SpectralSummary ComputeSpectralSummary(const BYTE* data, ULONGLONG frames, const PcmLayout& L, double sampleRate) {
+    const int C = L.channels;
+    const size_t blockFrames = 8192;
+    std::vector<float> buf(blockFrames * C), mono(blockFrames);
+    SpectralAnalyzer an(sampleRate);
+    double decodeMs = 0;
+    for (ULONGLONG f = 0; f < frames; f += blockFrames) {
+        auto t0 = std::chrono::steady_clock::now();
+        size_t nf = (size_t)std::min<ULONGLONG>(blockFrames, frames - f);
+        const BYTE* src = data + f * L.blockAlign;
+        if (L.blockAlign == L.bytesPerSample * C) {
+            DecodeSamples(src, nf * C, L, buf.data());
+        } else {
+            for (size_t k = 0; k < nf; k++) DecodeSamples(src + k * L.blockAlign, C, L, buf.data() + k * C);
+        }
+        if (C == 1) {
+            memcpy(mono.data(), buf.data(), nf * sizeof(float));
+        } else {
+            const float g = 1.0f / C;
+            for (size_t k = 0; k < nf; k++) {
+                float acc = 0;
+                for (int c = 0; c < C; c++) acc += buf[k * C + c];
+                mono[k] = acc * g;
+            }
+        }
+        decodeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        an.Push(mono.data(), nf);
+    }
+    SpectralSummary s = an.Finish();
+    s.msDecode = decodeMs;
+    return s;
 }
 
-void SaveHistory() {
-    std::ofstream f(GetExeDir() + g_historyFile);
-    if (f) f << WStringToString(conversationHistory);
+static std::string FormatSpectralSummary(const SpectralSummary& s) {
+    if (s.frames == 0) return "";
+    static const char* kBandNames[7] = { "sub", "bass", "low-mid", "mid", "high-mid", "presence", "air" };
+    char line[256];
+    sprintf_s(line, "Spectrum: centroid %.0f Hz (sd %.0f) | Rolloff(85%%) %.0f Hz | Flatness %.3f\n",
+              s.centroidHz, s.centroidStdHz, s.rolloffHz, s.flatness);
+    std::string out = line;
+    out += "Bands:";
+    for (int b = 0; b < 7; b++) {
+        sprintf_s(line, " %s %.0f%%%s", kBandNames[b], s.bandShare[b] * 100.0, b < 6 ? " |" : "\n");
+        out += line;
+    }
+    if (s.tempoBpm > 0 && s.tempoConfidence >= 0.1)
+        sprintf_s(line, "Rhythm: %.1f onsets/s | Tempo ~%.0f BPM (confidence %.2f)\n", s.onsetsPerSec, s.tempoBpm, s.tempoConfidence);
+    else
+        sprintf_s(line, "Rhythm: %.1f onsets/s | No steady beat detected\n", s.onsetsPerSec);
+    out += line;
+    sprintf_s(line, "Content: %s (speech likelihood %.0f%%, low-energy frames %.0f%%, 300-3400 Hz share %.0f%%)\n",
+              s.speechLikelihood >= 0.6 ? "likely speech" : s.speechLikelihood <= 0.4 ? "likely music/other" : "mixed/uncertain",
+              s.speechLikelihood * 100.0, s.lowEnergyRatio * 100.0, s.speechBandShare * 100.0);
+    out += line;
+    return out;
 }
 
-void LoadHistory() {
-    std::ifstream f(GetExeDir() + g_historyFile);
-    if (!f) return;
-    std::stringstream ss; ss << f.rdbuf();
-    std::wstring raw = StringToWString(ss.str());
-    std::wstring clean;
-    std::wstringstream wss(raw);
-    std::wstring line;
-    while (std::getline(wss, line)) {
-        if (!line.empty() && line.back() == L'\r') line.pop_back();
-        bool isRefusal = (line.find(L"Nova: I cannot") == 0 || line.find(L"Nova: I am unable") == 0 ||
-                          line.find(L"Nova: I can't") == 0 || line.find(L"Nova: Sorry, I") == 0);
-        if (isRefusal) continue;
-        clean += line + L"\n";
+// Level statistics plus spectral summary for a decodable PCM region (WAV, AIFF). The spectral
+// pass streams the same mapped data on its own thread while the level stats run.
+static std::string AnalyzePcmRegion(const BYTE* data, ULONGLONG frames, const PcmLayout& L, DWORD sampleRate, const char* label,
+                                    std::vector<float>* features = nullptr) {
+    auto t0 = std::chrono::steady_clock::now();
+    SpectralSummary spec;
+    double specMs = 0;
+    std::thread specThread([&]() {
+        auto s0 = std::chrono::steady_clock::now();
+        spec = ComputeSpectralSummary(data, frames, L, sampleRate);
+        specMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - s0).count();
+    });
+    int threads = 1;
+    PcmStats st = ComputePcmStats(data, frames, L, &threads);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    specThread.join();
+    DevLog("[Attach] %s stats: %llu frames, %.1f MB in %.1f ms (%d threads)\n",
+           label, frames, frames * L.blockAlign / (1024.0 * 1024.0), ms, threads);
+    DevLog("[Attach] %s spectral: %llu frames in %.1f ms (decode %.1f | fft %.1f | features %.1f)\n",
+           label, spec.frames, specMs, spec.msDecode, spec.msFft, spec.msFeatures);
+    if (features) {
+        // centroid, centroid spread, rolloff, flatness, 7 band shares, onset rate, tempo, tempo confidence,
+        // low-energy ratio, speech-band share, flux variation, speech likelihood
+        *features = { (float)spec.centroidHz, (float)spec.centroidStdHz, (float)spec.rolloffHz, (float)spec.flatness };
+        for (double b : spec.bandShare) features->push_back((float)b);
+        for (double v : { spec.onsetsPerSec, spec.tempoBpm, spec.tempoConfidence, spec.lowEnergyRatio,
+                          spec.speechBandShare, spec.fluxVariation, spec.speechLikelihood })
+            features->push_back((float)v);
     }
-    conversationHistory = clean;
-    TrimHistory();
+    return FormatPcmStats(st, sampleRate) + FormatSpectralSummary(spec);
+}
+
+std::string AnalyzeWavDetailed(const std::wstring& path, std::vector<float>* features) {
+    MappedFile mf(path);
+    if (!mf.IsOpen()) return "ERROR: Could not open WAV file.";
+
+    WavInfo wi;
+    if (const char* err = ParseWavHeader(mf.Data(), mf.Size(), wi)) return std::string("ERROR: ") + err;
+
+    PcmLayout L;
+    bool decodable = WavSampleLayout(wi, L) && wi.data && wi.blockAlign > 0;
+    ULONGLONG frames = decodable ? wi.dataSize / wi.blockAlign : 0;
+    double duration = decodable && wi.sampleRate ? (double)frames / wi.sampleRate
+                    : (wi.byteRate > 0 ? (double)wi.dataSize / wi.byteRate : 0.0);
+    int mins = (int)duration / 60;
+    double secs = duration - mins * 60;
+
+    char fmtName[48];
+    if      (wi.formatTag == 1) strcpy_s(fmtName, "PCM");
+    else if (wi.formatTag == 3) strcpy_s(fmtName, "IEEE Float");
+    else sprintf_s(fmtName, "compressed (0x%04X)", (unsigned)wi.formatTag);
+    if (wi.extensible) strcat_s(fmtName, " extensible");
+
+    char head[256];
+    sprintf_s(head, "Format: %s | %d-bit | %lu Hz | %d ch | %d:%04.1f\n",
+              fmtName, (int)wi.validBits, wi.sampleRate, (int)wi.channels, mins, secs);
+
+    if (frames == 0)
+        return std::string("=== WAV FILE ===\n") + head + "Note: Sample-level analysis not available for format " + fmtName + ".";
+
+    return "=== WAV ANALYSIS ===\n" + std::string(head) + AnalyzePcmRegion(wi.data, frames, L, wi.sampleRate, "WAV", features)
+         + "Analyse this audio and give detailed feedback.";
+}
+
+// ── Compressed / non-WAV audio containers ──
+// Header-level parsers over a mapped file. Each touches a few KB at the front (Ogg also reads
+// the last page), so multi-hour files return in milliseconds.
+struct AudioInfo {
+    std::string container, codec;
+    DWORD       sampleRate = 0;
+    int         channels = 0, bitsPerSample = 0;
+    double      seconds = 0.0, bitrateKbps = 0.0;
+    bool        vbr = false, estimated = false;
+    std::vector<std::pair<std::string, std::string>> tags;
+    std::string notes;
+    const BYTE* pcm = nullptr;   // uncompressed payload (AIFF) for the sample-statistics engine
+    ULONGLONG   pcmFrames = 0;
+    PcmLayout   layout;
+};
+
+static void AddAudioTag(AudioInfo& ai, const char* name, std::string value) {
+    while (!value.empty() && (unsigned char)value.back() <= ' ') value.pop_back();
+    size_t a = value.find_first_not_of(" \t\r\n");
+    if (a == std::string::npos) return;
+    value.erase(0, a);
+    if (value.size() > 120) value = value.substr(0, 117) + "...";
+    for (const auto& t : ai.tags) if (t.first == name) return;
+    ai.tags.emplace_back(name, value);
+}
+
+static std::string Latin1ToUtf8(const BYTE* p, size_t n) {
+    std::string out;
+    for (size_t i = 0; i < n && p[i]; i++) {
+        if (p[i] < 0x80) out += (char)p[i];
+        else { out += (char)(0xC0 | p[i] >> 6); out += (char)(0x80 | (p[i] & 0x3F)); }
+    }
+    return out;
+}
+
+static std::string Utf16ToUtf8(const BYTE* p, size_t n, bool bigEndian) {
+    std::wstring w;
+    for (size_t i = 0; i + 1 < n; i += 2) {
+        wchar_t c = bigEndian ? (wchar_t)(p[i] << 8 | p[i + 1]) : (wchar_t)(p[i] | p[i + 1] << 8);
+        if (!c) break;
+        w += c;
+    }
+    return WStringToString(w);
+}
+
+// Canonical tag name for Vorbis-comment style keys (FLAC, Ogg, Opus)
+static const char* CanonicalTagName(std::string key) {
+    for (auto& c : key) c = (char)toupper((unsigned char)c);
+    static const struct { const char* key; const char* name; } kMap[] = {
+        { "TITLE", "Title" }, { "ARTIST", "Artist" }, { "ALBUM", "Album" }, { "ALBUMARTIST", "Album artist" },
+        { "DATE", "Year" }, { "YEAR", "Year" }, { "GENRE", "Genre" }, { "TRACKNUMBER", "Track" },
+        { "COMPOSER", "Composer" }, { "COMMENT", "Comment" }, { "DESCRIPTION", "Comment" }, { "ENCODER", "Encoder" },
+    };
+    for (const auto& m : kMap) if (key == m.key) return m.name;
+    return nullptr;
+}
+
+static void ParseVorbisComment(const BYTE* p, size_t n, AudioInfo& ai) {
+    if (n < 8) return;
+    size_t vendorLen = ReadLE32(p);
+    if (vendorLen > n - 8) return;
+    AddAudioTag(ai, "Encoder", std::string((const char*)p + 4, vendorLen));
+    size_t pos = 4 + vendorLen;
+    DWORD count = ReadLE32(p + pos); pos += 4;
+    for (DWORD i = 0; i < count && pos + 4 <= n; i++) {
+        size_t len = ReadLE32(p + pos); pos += 4;
+        if (len > n - pos) break;
+        std::string kv((const char*)p + pos, len);
+        pos += len;
+        size_t eq = kv.find('=');
+        if (eq == std::string::npos) continue;
+        if (const char* name = CanonicalTagName(kv.substr(0, eq))) AddAudioTag(ai, name, kv.substr(eq + 1));
+    }
+}
+
+// ID3v2 text payload: encoding byte already split off
+static std::string DecodeId3Text(BYTE enc, const BYTE* p, size_t n) {
+    switch (enc) {
+    case 0: return Latin1ToUtf8(p, n);
+    case 1:
+        if (n >= 2 && p[0] == 0xFE && p[1] == 0xFF) return Utf16ToUtf8(p + 2, n - 2, true);
+        if (n >= 2 && p[0] == 0xFF && p[1] == 0xFE) return Utf16ToUtf8(p + 2, n - 2, false);
+        return Utf16ToUtf8(p, n, false);
+    case 2: return Utf16ToUtf8(p, n, true);
+    default: return std::string((const char*)p, strnlen((const char*)p, n));
+    }
+}
+
+static size_t SyncSafe32(const BYTE* p) { return (size_t)(p[0] & 0x7F) << 21 | (p[1] & 0x7F) << 14 | (p[2] & 0x7F) << 7 | (p[3] & 0x7F); }
+
+// Returns the size of a leading ID3v2 tag (0 if none) and collects common text frames into ai
+static size_t ParseId3v2(const BYTE* p, ULONGLONG size, AudioInfo* ai) {
+    if (size < 10 || memcmp(p, "ID3", 3) != 0 || p[3] < 2 || p[3] > 4) return 0;
+    const int ver = p[3];
+    const BYTE flags = p[5];
+    size_t end = 10 + SyncSafe32(p + 6);
+    size_t total = end + ((flags & 0x10) ? 10 : 0);
+    if (total > size) return (size_t)size;
+    if (!ai || (flags & 0x80)) return total;  // unsynchronised tags are rare; skip their frames
+
+    static const struct { const char* v3; const char* v2; const char* name; } kFrames[] = {
+        { "TIT2", "TT2", "Title" }, { "TPE1", "TP1", "Artist" }, { "TALB", "TAL", "Album" },
+        { "TPE2", "TP2", "Album artist" }, { "TYER", "TYE", "Year" }, { "TDRC", "TDA", "Year" },
+        { "TCON", "TCO", "Genre" }, { "TRCK", "TRK", "Track" }, { "TCOM", "TCM", "Composer" },
+        { "TSSE", "TSS", "Encoder" }, { "COMM", "COM", "Comment" },
+    };
+    const size_t idLen = ver == 2 ? 3 : 4, hdrLen = ver == 2 ? 6 : 10;
+    size_t pos = 10;
+    if ((flags & 0x40) && ver >= 3) pos += ver == 4 ? SyncSafe32(p + 10) : 4 + ReadBE32(p + 10);
+    while (pos + hdrLen <= end) {
+        const BYTE* f = p + pos;
+        if (f[0] == 0) break;  // padding
+        size_t fsz = ver == 2 ? (size_t)(f[3] << 16 | f[4] << 8 | f[5]) : ver == 4 ? SyncSafe32(f + 4) : ReadBE32(f + 4);
+        if (fsz > end - pos - hdrLen) break;
+        const BYTE* body = f + hdrLen;
+        for (const auto& k : kFrames) {
+            if (memcmp(f, ver == 2 ? k.v2 : k.v3, idLen) != 0 || fsz < 2) continue;
+            BYTE enc = body[0];
+            const BYTE* text = body + 1;
+            size_t len = fsz - 1;
+            if (k.name[0] == 'C') {
+                // COMM: language, then a terminated short description before the text
+                if (len < 4) break;
+                text += 3; len -= 3;
+                size_t i = 0, step = (enc == 1 || enc == 2) ? 2 : 1;
+                while (i + step <= len && (text[i] || (step == 2 && text[i + 1]))) i += step;
+                if (i + step > len) break;
+                text += i + step; len -= i + step;
+            }
+            AddAudioTag(*ai, k.name, DecodeId3Text(enc, text, len));
+            break;
+        }
+        pos += hdrLen + fsz;
+    }
+    return total;
+}
+
+// ── FLAC ──
+static void ParseFlacStreamInfo(const BYTE* b, AudioInfo& ai) {
+    ai.sampleRate    = (DWORD)b[10] << 12 | (DWORD)b[11] << 4 | b[12] >> 4;
+    ai.channels      = ((b[12] >> 1) & 7) + 1;
+    ai.bitsPerSample = (((b[12] & 1) << 4) | b[13] >> 4) + 1;
+    ULONGLONG total  = (ULONGLONG)(b[13] & 0x0F) << 32 | ReadBE32(b + 14);
+    if (ai.sampleRate && total) ai.seconds = (double)total / ai.sampleRate;
+    else ai.estimated = true;
+}
+
+static bool ParseFlac(const BYTE* p, ULONGLONG size, AudioInfo& ai) {
+    size_t pos = ParseId3v2(p, size, &ai);
+    if (pos + 8 > size || memcmp(p + pos, "fLaC", 4) != 0) return false;
+    ai.container = "FLAC"; ai.codec = "FLAC (lossless)";
+    pos += 4;
+    bool last = false, haveInfo = false;
+    while (!last && pos + 4 <= size) {
+        BYTE type = p[pos] & 0x7F;
+        last = (p[pos] & 0x80) != 0;
+        size_t len = (size_t)p[pos + 1] << 16 | p[pos + 2] << 8 | p[pos + 3];
+        const BYTE* body = p + pos + 4;
+        if (len > size - pos - 4) break;
+        if (type == 0 && len >= 34) { ParseFlacStreamInfo(body, ai); haveInfo = true; }
+        else if (type == 4) ParseVorbisComment(body, len, ai);
+        else if (type == 6) ai.notes += "Embedded cover art. ";
+        pos += 4 + len;
+    }
+    if (ai.seconds > 0) ai.bitrateKbps = (size - pos) * 8.0 / ai.seconds / 1000.0;
+    return haveInfo;
+}
+
+// ── MPEG audio (MP3/MP2) ──
+struct MpegFrame {
+    int    version = 1, layer = 3, bitrateKbps = 0, channels = 2, samples = 1152, sideInfo = 32;
+    DWORD  sampleRate = 0;
+    size_t length = 0;
+};
+
+static bool ParseMpegHeader(const BYTE* h, MpegFrame& f) {
+    if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0) return false;
+    int verBits = (h[1] >> 3) & 3, layerBits = (h[1] >> 1) & 3, brIdx = h[2] >> 4, srIdx = (h[2] >> 2) & 3;
+    if (verBits == 1 || layerBits == 0 || brIdx == 0 || brIdx == 15 || srIdx == 3) return false;
+    static const short kBitrate[5][15] = {
+        { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },  // V1 L1
+        { 0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384 },  // V1 L2
+        { 0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320 },  // V1 L3
+        { 0, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256 },  // V2 L1
+        { 0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 },  // V2 L2/L3
+    };
+    static const DWORD kRate[3] = { 44100, 48000, 32000 };
+    f.version = verBits == 3 ? 1 : verBits == 2 ? 2 : 25;
+    f.layer   = 4 - layerBits;
+    f.bitrateKbps = kBitrate[f.version == 1 ? f.layer - 1 : (f.layer == 1 ? 3 : 4)][brIdx];
+    f.sampleRate  = kRate[srIdx] >> (f.version == 1 ? 0 : f.version == 2 ? 1 : 2);
+    f.channels    = (h[3] >> 6) == 3 ? 1 : 2;
+    int pad = (h[2] >> 1) & 1;
+    if (f.layer == 1) {
+        f.samples = 384;
+        f.length  = (size_t)(12 * f.bitrateKbps * 1000 / f.sampleRate + pad) * 4;
+    } else {
+        f.samples = (f.layer == 3 && f.version != 1) ? 576 : 1152;
+        f.length  = (size_t)(f.samples / 8 * f.bitrateKbps * 1000 / f.sampleRate + pad);
+    }
+    f.sideInfo = f.version == 1 ? (f.channels == 1 ? 17 : 32) : (f.channels == 1 ? 9 : 17);
+    return f.length >= 4;
+}
+
+static bool ParseMp3(const BYTE* p, ULONGLONG size, AudioInfo& ai) {
+    size_t start = ParseId3v2(p, size, &ai);
+    ULONGLONG end = size;
+    if (end >= 128 && memcmp(p + end - 128, "TAG", 3) == 0) {
+        // ID3v1 fallback tags (fixed-width Latin-1 fields)
+        AddAudioTag(ai, "Title",  Latin1ToUtf8(p + end - 125, 30));
+        AddAudioTag(ai, "Artist", Latin1ToUtf8(p + end - 95, 30));
+        AddAudioTag(ai, "Album",  Latin1ToUtf8(p + end - 65, 30));
+        AddAudioTag(ai, "Year",   Latin1ToUtf8(p + end - 35, 4));
+        end -= 128;
+    }
+
+    // First frame whose successor also syncs (avoids false syncs in leading junk)
+    MpegFrame f;
+    size_t first = 0;
+    bool found = false;
+    for (size_t i = start; i + 4 <= end && i < start + 256 * 1024; i++) {
+        if (p[i] != 0xFF || !ParseMpegHeader(p + i, f)) continue;
+        MpegFrame g;
+        if (i + f.length == end || (i + f.length + 4 <= end && ParseMpegHeader(p + i + f.length, g) && g.sampleRate == f.sampleRate)) {
+            first = i; found = true; break;
+        }
+    }
+    if (!found) return false;
+
+    static const char* kLayer[4] = { "", "I", "II", "III" };
+    char codec[64];
+    sprintf_s(codec, "%s (MPEG-%s Layer %s)", f.layer == 3 ? "MP3" : f.layer == 2 ? "MP2" : "MP1",
+              f.version == 1 ? "1" : f.version == 2 ? "2" : "2.5", kLayer[f.layer]);
+    ai.container = f.layer == 3 ? "MP3" : "MPEG audio";
+    ai.codec = codec;
+    ai.sampleRate = f.sampleRate;
+    ai.channels = f.channels;
+
+    // Xing/Info (LAME) or VBRI header in the first frame gives exact frame and byte counts
+    const BYTE* x = p + first + 4 + f.sideInfo;
+    const BYTE* v = p + first + 36;
+    ULONGLONG frames = 0, bytes = 0;
+    if (first + 4 + f.sideInfo + 120 <= end && (memcmp(x, "Xing", 4) == 0 || memcmp(x, "Info", 4) == 0)) {
+        ai.vbr = memcmp(x, "Xing", 4) == 0;
+        DWORD flags = ReadBE32(x + 4);
+        size_t off = 8;
+        if (flags & 1) { frames = ReadBE32(x + off); off += 4; }
+        if (flags & 2) { bytes  = ReadBE32(x + off); off += 4; }
+        if (flags & 4) off += 100;
+        if (flags & 8) off += 4;
+        if (frames && first + 4 + f.sideInfo + off + 24 <= end && memcmp(x + off, "LAME", 4) == 0) {
+            // LAME extension: encoder version plus encoder delay/padding for a sample-exact length
+            AddAudioTag(ai, "Encoder", std::string((const char*)x + off, strnlen((const char*)x + off, 9)));
+            int delay = x[off + 21] << 4 | x[off + 22] >> 4, padding = (x[off + 22] & 0x0F) << 8 | x[off + 23];
+            ULONGLONG samples = frames * f.samples;
+            if (samples > (ULONGLONG)(delay + padding)) ai.seconds = (double)(samples - delay - padding) / f.sampleRate;
+        }
+    } else if (first + 36 + 18 <= end && memcmp(v, "VBRI", 4) == 0) {
+        ai.vbr = true;
+        bytes = ReadBE32(v + 10);
+        frames = ReadBE32(v + 14);
+    }
+    if (frames) {
+        if (ai.seconds <= 0) ai.seconds = (double)frames * f.samples / f.sampleRate;
+        if (!bytes) bytes = end - first;
+        ai.bitrateKbps = bytes * 8.0 / ai.seconds / 1000.0;
+        return true;
+    }
+
+    // No index frame: sample the first few hundred frames to tell CBR from VBR
+    ULONGLONG sampled = 0, sampledBytes = 0;
+    size_t pos = first;
+    bool varies = false;
+    MpegFrame g;
+    while (sampled < 400 && pos + 4 <= end && ParseMpegHeader(p + pos, g)) {
+        varies |= g.bitrateKbps != f.bitrateKbps;
+        sampledBytes += g.length; sampled++;
+        pos += g.length;
+    }
+    ULONGLONG audioBytes = end - first;
+    if (pos >= end) {
+        ai.seconds = (double)sampled * f.samples / f.sampleRate;  // whole file scanned: exact
+    } else if (!varies) {
+        ai.seconds = audioBytes * 8.0 / (f.bitrateKbps * 1000.0);
+    } else {
+        ai.vbr = ai.estimated = true;
+        ai.seconds = (double)audioBytes / sampledBytes * sampled * f.samples / f.sampleRate;
+    }
+    ai.bitrateKbps = ai.seconds > 0 ? audioBytes * 8.0 / ai.seconds / 1000.0 : f.bitrateKbps;
+    return true;
+}
+
+// ── ADTS AAC ──
+static bool ParseAdts(const BYTE* p, ULONGLONG size, AudioInfo& ai) {
+    size_t pos = ParseId3v2(p, size, &ai);
+    if (pos + 7 > size || p[pos] != 0xFF || (p[pos + 1] & 0xF6) != 0xF0) return false;
+    static const DWORD kRates[13] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+    const BYTE* h = p + pos;
+    int profile = h[2] >> 6, srIdx = (h[2] >> 2) & 0x0F;
+    if (srIdx > 12) return false;
+    static const char* kProfiles[4] = { "AAC Main", "AAC LC", "AAC SSR", "AAC LTP" };
+    ai.container = "ADTS"; ai.codec = kProfiles[profile];
+    ai.sampleRate = kRates[srIdx];
+    ai.channels = (h[2] & 1) << 2 | h[3] >> 6;
+    ULONGLONG frames = 0, bytes = 0;
+    const size_t first = pos;
+    while (frames < 2000 && pos + 7 <= size && p[pos] == 0xFF && (p[pos + 1] & 0xF6) == 0xF0) {
+        size_t len = (size_t)(p[pos + 3] & 3) << 11 | p[pos + 4] << 3 | p[pos + 5] >> 5;
+        if (len < 7) break;
+        frames += (p[pos + 6] & 3) + 1;
+        bytes += len; pos += len;
+    }
+    if (!frames) return false;
+    ai.seconds = (double)(size - first) / bytes * frames * 1024.0 / ai.sampleRate;
+    ai.estimated = pos < size;
+    ai.bitrateKbps = (size - first) * 8.0 / ai.seconds / 1000.0;
+    return true;
+}
+
+// ── Ogg (Vorbis, Opus, FLAC, Speex) ──
+static bool ParseOgg(const BYTE* p, ULONGLONG size, AudioInfo& ai) {
+    if (size < 28 || memcmp(p, "OggS", 4) != 0) return false;
+    const DWORD serial = ReadLE32(p + 14);
+
+    // Reassemble the identification and comment packets of the first logical stream
+    std::vector<std::string> packets(1);
+    size_t pos = 0;
+    while (packets.size() < 3 && pos + 27 <= size && memcmp(p + pos, "OggS", 4) == 0 && pos < (4u << 20)) {
+        int segs = p[pos + 26];
+        if (pos + 27 + segs > size) break;
+        const BYTE* lace = p + pos + 27;
+        size_t body = pos + 27 + segs;
+        bool ours = ReadLE32(p + pos + 14) == serial;
+        for (int i = 0; i < segs && packets.size() < 3; i++) {
+            if (body + lace[i] > size) break;
+            if (ours && packets.back().size() < (256u << 10)) packets.back().append((const char*)p + body, lace[i]);
+            body += lace[i];
+            if (ours && lace[i] < 255) packets.emplace_back();
+        }
+        pos = body;
+    }
+    const std::string& id = packets[0];
+    const BYTE* ip = (const BYTE*)id.data();
+    ULONGLONG preSkip = 0;
+    double granuleRate = 0;
+    ai.container = "Ogg";
+    if (id.size() >= 30 && memcmp(ip, "\x01vorbis", 7) == 0) {
+        ai.codec = "Vorbis";
+        ai.channels = ip[11];
+        ai.sampleRate = ReadLE32(ip + 12);
+        int nominal = (int)ReadLE32(ip + 20);
+        if (nominal > 0) ai.notes += "Nominal bitrate " + std::to_string(nominal / 1000) + " kbps. ";
+        granuleRate = ai.sampleRate;
+        if (packets.size() > 1 && packets[1].size() > 7) ParseVorbisComment((const BYTE*)packets[1].data() + 7, packets[1].size() - 7, ai);
+    } else if (id.size() >= 19 && memcmp(ip, "OpusHead", 8) == 0) {
+        ai.codec = "Opus";
+        ai.channels = ip[9];
+        preSkip = ReadLE16(ip + 10);
+        ai.sampleRate = ReadLE32(ip + 12);  // original input rate; Opus always decodes at 48 kHz
+        granuleRate = 48000;
+        if (packets.size() > 1 && packets[1].size() > 8) ParseVorbisComment((const BYTE*)packets[1].data() + 8, packets[1].size() - 8, ai);
+    } else if (id.size() >= 51 && memcmp(ip, "\x7F" "FLAC", 5) == 0 && memcmp(ip + 9, "fLaC", 4) == 0) {
+        ai.codec = "FLAC (lossless)";
+        ParseFlacStreamInfo(ip + 17, ai);
+        granuleRate = ai.sampleRate;
+        if (packets.size() > 1 && packets[1].size() > 4 && (packets[1][0] & 0x7F) == 4)
+            ParseVorbisComment((const BYTE*)packets[1].data() + 4, packets[1].size() - 4, ai);
+    } else if (id.size() >= 52 && memcmp(ip, "Speex   ", 8) == 0) {
+        ai.codec = "Speex";
+        ai.sampleRate = ReadLE32(ip + 36);
+        ai.channels = (int)ReadLE32(ip + 48);
+        granuleRate = ai.sampleRate;
+    } else {
+        ai.codec = "unknown";
+        return true;
+    }
+
+    // Duration from the granule position of the stream's last page, searched backwards from EOF
+    for (ULONGLONG window = 64 * 1024; granuleRate > 0; window *= 8) {
+        ULONGLONG from = size > window ? size - window : 0;
+        for (ULONGLONG i = size - 27 + 1; i-- > from; ) {
+            if (p[i] != 'O' || memcmp(p + i, "OggS", 4) != 0 || ReadLE32(p + i + 14) != serial) continue;
+            ULONGLONG granule = ReadLE64(p + i + 6);
+            if (granule == ~0ull) continue;
+            ai.seconds = granule > preSkip ? (granule - preSkip) / granuleRate : 0.0;
+            break;
+        }
+        if (ai.seconds > 0 || from == 0 || window > (16ull << 20)) break;
+    }
+    if (ai.seconds > 0) ai.bitrateKbps = size * 8.0 / ai.seconds / 1000.0;
+    ai.vbr = ai.codec != "FLAC (lossless)";
+    return true;
+}
+
+// ── ISO base media (MP4/M4A/MOV) ──
+// Calls fn(type, body, bodySize) for each box in [p, end); fn returns false to stop early
+template <class Fn>
+static void ForEachBox(const BYTE* p, const BYTE* end, Fn fn) {
+    while (end - p >= 8) {
+        ULONGLONG sz = ReadBE32(p);
+        size_t hdr = 8;
+        if (sz == 1) {
+            if (end - p < 16) return;
+            sz = ReadBE64(p + 8); hdr = 16;
+        } else if (sz == 0) {
+            sz = (ULONGLONG)(end - p);
+        }
+        if (sz < hdr || sz > (ULONGLONG)(end - p)) return;
+        if (!fn(p + 4, p + hdr, (size_t)(sz - hdr))) return;
+        p += sz;
+    }
+}
+
+static bool BoxIs(const BYTE* type, const char* name) { return memcmp(type, name, 4) == 0; }
+
+// Duration (in seconds) from an mdhd/mvhd full box
+static double Mp4Duration(const BYTE* b, size_t n) {
+    if (n < 20) return 0;
+    if (b[0] == 1 && n >= 32) { DWORD ts = ReadBE32(b + 20); return ts ? (double)ReadBE64(b + 24) / ts : 0; }
+    DWORD ts = ReadBE32(b + 12), dur = ReadBE32(b + 16);
+    return ts && dur != 0xFFFFFFFF ? (double)dur / ts : 0;
+}
+
+// MPEG-4 descriptor length: up to four 7-bit groups
+static size_t Mp4DescriptorLength(const BYTE*& q, const BYTE* end) {
+    size_t len = 0;
+    for (int i = 0; i < 4 && q < end; i++) { BYTE b = *q++; len = len << 7 | (b & 0x7F); if (!(b & 0x80)) break; }
+    return len;
+}
+
+// esds → average bitrate and AudioSpecificConfig (object type, rate, channels)
+static void ParseEsds(const BYTE* b, size_t n, AudioInfo& ai) {
+    if (n < 5) return;
+    const BYTE* q = b + 4, *end = b + n;
+    // Every read and skip is checked against `end`: the lengths come from the file
+    auto skip = [&](size_t k) { if ((size_t)(end - q) < k) return false; q += k; return true; };
+    if (*q++ != 0x03) return;
+    Mp4DescriptorLength(q, end);
+    if (end - q < 3) return;
+    BYTE fl = q[2]; q += 3;
+    if ((fl & 0x80) && !skip(2)) return;
+    if ((fl & 0x40) && (q >= end || !skip(1 + (size_t)*q))) return;
+    if ((fl & 0x20) && !skip(2)) return;
+    if (q >= end || *q++ != 0x04) return;
+    Mp4DescriptorLength(q, end);
+    if (end - q < 13) return;
+    BYTE oti = q[0];
+    DWORD avg = ReadBE32(q + 9);
+    if (avg) ai.bitrateKbps = avg / 1000.0;
+    q += 13;
+    if (oti == 0x69 || oti == 0x6B) { ai.codec = "MP3"; return; }
+    if (end - q < 4 || *q++ != 0x05) return;
+    size_t len = Mp4DescriptorLength(q, end);
+    if (len < 2 || end - q < 2) return;
+    int aot = q[0] >> 3;
+    static const struct { int aot; const char* name; } kAot[] = {
+        { 1, "AAC Main" }, { 2, "AAC LC" }, { 3, "AAC SSR" }, { 4, "AAC LTP" }, { 5, "HE-AAC (SBR)" },
+        { 23, "AAC-LD" }, { 29, "HE-AAC v2 (SBR+PS)" }, { 39, "AAC-ELD" }, { 42, "xHE-AAC (USAC)" },
+    };
+    for (const auto& a : kAot) if (a.aot == aot) ai.codec = a.name;
+    int chCfg = (q[1] >> 3) & 0x0F;
+    if (chCfg && !ai.channels) ai.channels = chCfg == 7 ? 8 : chCfg;
+}
+
+static void ParseMp4SoundEntry(const BYTE* e, size_t n, AudioInfo& ai) {
+    if (n < 36) return;
+    const BYTE* fmt = e + 4;
+    static const struct { const char* fourcc; const char* name; } kCodecs[] = {
+        { "mp4a", "AAC" }, { "alac", "ALAC (lossless)" }, { "Opus", "Opus" }, { "fLaC", "FLAC (lossless)" },
+        { "ac-3", "AC-3" }, { "ec-3", "E-AC-3" }, { "samr", "AMR-NB" }, { "sawb", "AMR-WB" },
+        { "lpcm", "PCM" }, { "sowt", "PCM" }, { "twos", "PCM" }, { ".mp3", "MP3" },
+    };
+    ai.codec = std::string((const char*)fmt, 4);
+    for (const auto& c : kCodecs) if (BoxIs(fmt, c.fourcc)) ai.codec = c.name;
+    int ver = ReadBE16(e + 16);
+    ai.channels = ReadBE16(e + 24);
+    ai.bitsPerSample = ReadBE16(e + 26);
+    ai.sampleRate = ReadBE32(e + 32) >> 16;
+    size_t child = 36;
+    if (ver == 1) child = 52;
+    else if (ver == 2 && n >= 72) {
+        ULONGLONG bits = ReadBE64(e + 40); double rate; memcpy(&rate, &bits, 8);
+        ai.sampleRate = (DWORD)rate; ai.channels = (int)ReadBE32(e + 48); child = 72;
+    }
+    if (child > n) return;
+    ForEachBox(e + child, e + n, [&](const BYTE* t, const BYTE* b, size_t len) {
+        if (BoxIs(t, "esds")) ParseEsds(b, len, ai);
+        else if (BoxIs(t, "alac") && len >= 28) { ai.bitsPerSample = b[9]; ai.channels = b[13]; ai.sampleRate = ReadBE32(b + 24); }
+        return true;
+    });
+    if (ai.codec != "PCM" && ai.codec != "ALAC (lossless)" && ai.codec != "FLAC (lossless)") ai.bitsPerSample = 0;
+}
+
+static void ParseIlst(const BYTE* b, size_t n, AudioInfo& ai) {
+    static const struct { const char* fourcc; const char* name; } kItems[] = {
+        { "\xA9nam", "Title" }, { "\xA9" "ART", "Artist" }, { "\xA9" "alb", "Album" }, { "aART", "Album artist" },
+        { "\xA9" "day", "Year" }, { "\xA9gen", "Genre" }, { "\xA9wrt", "Composer" }, { "\xA9too", "Encoder" },
+        { "\xA9" "cmt", "Comment" }, { "trkn", "Track" },
+    };
+    ForEachBox(b, b + n, [&](const BYTE* t, const BYTE* item, size_t len) {
+        for (const auto& k : kItems) {
+            if (!BoxIs(t, k.fourcc)) continue;
+            ForEachBox(item, item + len, [&](const BYTE* dt, const BYTE* d, size_t dlen) {
+                if (!BoxIs(dt, "data") || dlen < 8) return true;
+                if (BoxIs(t, "trkn")) {
+                    if (dlen >= 14) {
+                        int track = ReadBE16(d + 10), count = ReadBE16(d + 12);
+                        AddAudioTag(ai, k.name, count ? std::to_string(track) + "/" + std::to_string(count) : std::to_string(track));
+                    }
+                } else {
+                    AddAudioTag(ai, k.name, std::string((const char*)d + 8, dlen - 8));
+                }
+                return false;
+            });
+        }
+        return true;
+    });
+}
+
+// meta is a full box in ISO files but a plain container in QuickTime ones
+static void ParseMp4Meta(const BYTE* b, size_t n, AudioInfo& ai) {
+    if (n >= 8 && !BoxIs(b + 4, "hdlr")) { b += 4; n -= 4; }
+    ForEachBox(b, b + n, [&](const BYTE* t, const BYTE* c, size_t len) {
+        if (BoxIs(t, "ilst")) ParseIlst(c, len, ai);
+        return true;
+    });
+}
+
+static bool ParseMp4Audio(const BYTE* p, ULONGLONG size, AudioInfo& ai) {
+    if (size < 16 || !BoxIs(p + 4, "ftyp")) return false;
+    std::string brand((const char*)p + 8, 4);
+    ai.container = "MP4 (" + brand + ")";
+    double movieSeconds = 0;
+    ULONGLONG mdatBytes = 0;
+    bool fragmented = false, haveTrack = false;
+    ForEachBox(p, p + size, [&](const BYTE* t, const BYTE* b, size_t n) {
+        if (BoxIs(t, "mdat")) mdatBytes += n;
+        else if (BoxIs(t, "moof")) fragmented = true;
+        else if (BoxIs(t, "moov")) {
+            ForEachBox(b, b + n, [&](const BYTE* t2, const BYTE* b2, size_t n2) {
+                if (BoxIs(t2, "mvhd")) movieSeconds = Mp4Duration(b2, n2);
+                else if (BoxIs(t2, "mvex")) fragmented = true;
+                else if (BoxIs(t2, "meta")) ParseMp4Meta(b2, n2, ai);
+                else if (BoxIs(t2, "udta")) {
+                    ForEachBox(b2, b2 + n2, [&](const BYTE* t3, const BYTE* b3, size_t n3) {
+                        if (BoxIs(t3, "meta")) ParseMp4Meta(b3, n3, ai);
+                        return true;
+                    });
+                } else if (BoxIs(t2, "trak") && !haveTrack) {
+                    // First sound track: trak/mdia/{mdhd, hdlr, minf/stbl/stsd}
+                    ForEachBox(b2, b2 + n2, [&](const BYTE* t3, const BYTE* b3, size_t n3) {
+                        if (!BoxIs(t3, "mdia")) return true;
+                        double trackSeconds = 0;
+                        bool sound = false;
+                        const BYTE* stsd = nullptr; size_t stsdLen = 0;
+                        ForEachBox(b3, b3 + n3, [&](const BYTE* t4, const BYTE* b4, size_t n4) {
+                            if (BoxIs(t4, "mdhd")) trackSeconds = Mp4Duration(b4, n4);
+                            else if (BoxIs(t4, "hdlr") && n4 >= 12) sound = BoxIs(b4 + 8, "soun");
+                            else if (BoxIs(t4, "minf")) {
+                                ForEachBox(b4, b4 + n4, [&](const BYTE* t5, const BYTE* b5, size_t n5) {
+                                    if (!BoxIs(t5, "stbl")) return true;
+                                    ForEachBox(b5, b5 + n5, [&](const BYTE* t6, const BYTE* b6, size_t n6) {
+                                        if (BoxIs(t6, "stsd")) { stsd = b6; stsdLen = n6; }
+                                        return true;
+                                    });
+                                    return false;
+                                });
+                            }
+                            return true;
+                        });
+                        if (sound && stsd && stsdLen >= 16) {
+                            haveTrack = true;
+                            ai.seconds = trackSeconds;
+                            ParseMp4SoundEntry(stsd + 8, std::min<size_t>(ReadBE32(stsd + 8), stsdLen - 8), ai);
+                        }
+                        return false;
+                    });
+                }
+                return true;
+            });
+        }
+        return true;
+    });
+    if (!haveTrack) return false;
+    if (ai.seconds <= 0) ai.seconds = movieSeconds;
+    if (fragmented && ai.seconds <= 0) ai.notes += "Fragmented MP4: duration not indexed in the header. ";
+    if (ai.bitrateKbps <= 0 && ai.seconds > 0 && mdatBytes) ai.bitrateKbps = mdatBytes * 8.0 / ai.seconds / 1000.0;
+    return true;
+}
+
+// ── ASF (WMA) ──
+static const BYTE kAsfHeader[16]      = { 0x30,0x26,0xB2,0x75,0x8E,0x66,0xCF,0x11,0xA6,0xD9,0x00,0xAA,0x00,0x62,0xCE,0x6C };
+static const BYTE kAsfFileProps[16]   = { 0xA1,0xDC,0xAB,0x8C,0x47,0xA9,0xCF,0x11,0x8E,0xE4,0x00,0xC0,0x0C,0x20,0x53,0x65 };
+static const BYTE kAsfStreamProps[16] = { 0x91,0x07,0xDC,0xB7,0xB7,0xA9,0xCF,0x11,0x8E,0xE6,0x00,0xC0,0x0C,0x20,0x53,0x65 };
+static const BYTE kAsfAudioMedia[16]  = { 0x40,0x9E,0x69,0xF8,0x4D,0x5B,0xCF,0x11,0xA8,0xFD,0x00,0x80,0x5F,0x5C,0x44,0x2B };
+static const BYTE kAsfContentDesc[16] = { 0x33,0x26,0xB2,0x75,0x8E,0x66,0xCF,0x11,0xA6,0xD9,0x00,0xAA,0x00,0x62,0xCE,0x6C };
+
+static bool ParseAsf(const BYTE* p, ULONGLONG size, AudioInfo& ai) {
+    if (size < 30 || memcmp(p, kAsfHeader, 16) != 0) return false;
+    ULONGLONG headerEnd = std::min<ULONGLONG>(ReadLE64(p + 16), size);
+    ai.container = "ASF";
+    bool haveAudio = false;
+    for (ULONGLONG pos = 30; pos + 24 <= headerEnd; ) {
+        const BYTE* o = p + pos;
+        ULONGLONG len = ReadLE64(o + 16);
+        if (len < 24 || len > headerEnd - pos) break;
+        if (memcmp(o, kAsfFileProps, 16) == 0 && len >= 104) {
+            double play = ReadLE64(o + 64) / 1e7, preroll = ReadLE64(o + 80) / 1000.0;
+            ai.seconds = std::max(0.0, play - preroll);
+        } else if (memcmp(o, kAsfStreamProps, 16) == 0 && len >= 96 && !haveAudio && memcmp(o + 24, kAsfAudioMedia, 16) == 0) {
+            const BYTE* wf = o + 78;
+            WORD tag = ReadLE16(wf);
+            ai.codec = tag == 0x160 ? "WMA v1" : tag == 0x161 ? "WMA v2" : tag == 0x162 ? "WMA Pro"
+                     : tag == 0x163 ? "WMA Lossless" : tag == 0x0A ? "WMA Voice" : "ASF audio";
+            ai.channels = ReadLE16(wf + 2);
+            ai.sampleRate = ReadLE32(wf + 4);
+            ai.bitrateKbps = ReadLE32(wf + 8) * 8.0 / 1000.0;
+            ai.bitsPerSample = tag == 0x163 ? ReadLE16(wf + 14) : 0;
+            haveAudio = true;
+        } else if (memcmp(o, kAsfContentDesc, 16) == 0 && len >= 34) {
+            WORD titleLen = ReadLE16(o + 24), authorLen = ReadLE16(o + 26);
+            if (34ull + titleLen + authorLen <= len) {
+                AddAudioTag(ai, "Title",  Utf16ToUtf8(o + 34, titleLen, false));
+                AddAudioTag(ai, "Artist", Utf16ToUtf8(o + 34 + titleLen, authorLen, false));
+            }
+        }
+        pos += len;
+    }
+    return haveAudio;
+}
+
+// ── AIFF / AIFF-C ──
+static double ReadExtended80(const BYTE* b) {
+    int exponent = (b[0] & 0x7F) << 8 | b[1];
+    ULONGLONG mantissa = ReadBE64(b + 2);
+    if (!exponent && !mantissa) return 0.0;
+    double v = ldexp((double)mantissa, exponent - 16383 - 63);
+    return (b[0] & 0x80) ? -v : v;
+}
+
+static bool ParseAiff(const BYTE* p, ULONGLONG size, AudioInfo& ai) {
+    if (size < 12 || memcmp(p, "FORM", 4) != 0) return false;
+    bool aifc = memcmp(p + 8, "AIFC", 4) == 0;
+    if (!aifc && memcmp(p + 8, "AIFF", 4) != 0) return false;
+    ai.container = aifc ? "AIFF-C" : "AIFF";
+    char comp[5] = "NONE";
+    ULONGLONG frames = 0;
+    const BYTE* ssnd = nullptr;
+    ULONGLONG ssndLen = 0;
+    bool comm = false;
+    for (ULONGLONG pos = 12; pos + 8 <= size; ) {
+        const BYTE* ck = p + pos;
+        ULONGLONG len = ReadBE32(ck + 4), body = pos + 8;
+        ULONGLONG avail = std::min<ULONGLONG>(len, size - body);
+        if (memcmp(ck, "COMM", 4) == 0 && avail >= 18) {
+            ai.channels = ReadBE16(ck + 8);
+            frames = ReadBE32(ck + 10);
+            ai.bitsPerSample = ReadBE16(ck + 14);
+            ai.sampleRate = (DWORD)ReadExtended80(ck + 16);
+            if (aifc && avail >= 22) memcpy(comp, ck + 26, 4);
+            comm = true;
+        } else if (memcmp(ck, "SSND", 4) == 0 && avail >= 8) {
+            DWORD offset = ReadBE32(ck + 8);
+            if (8ull + offset <= avail) { ssnd = ck + 16 + offset; ssndLen = avail - 8 - offset; }
+        } else if (memcmp(ck, "NAME", 4) == 0) AddAudioTag(ai, "Title", std::string((const char*)ck + 8, (size_t)avail));
+        else if (memcmp(ck, "AUTH", 4) == 0)   AddAudioTag(ai, "Artist", std::string((const char*)ck + 8, (size_t)avail));
+        else if (memcmp(ck, "ANNO", 4) == 0)   AddAudioTag(ai, "Comment", std::string((const char*)ck + 8, (size_t)avail));
+        else if (memcmp(ck, "ID3 ", 4) == 0)   ParseId3v2(ck + 8, avail, &ai);
+        pos = body + len + (len & 1);
+    }
+    if (!comm) return false;
+    if (ai.sampleRate) ai.seconds = (double)frames / ai.sampleRate;
+
+    // Uncompressed variants are handed to the same statistics engine as WAV
+    PcmLayout& L = ai.layout;
+    int bytes = (ai.bitsPerSample + 7) / 8;
+    std::string c(comp, 4);
+    L.bigEndian = true;
+    if (c == "NONE" || c == "twos" || c == "sowt" || c == "raw ") {
+        L.kind = bytes == 1 ? SampleKind::U8 : bytes == 2 ? SampleKind::S16 : bytes == 3 ? SampleKind::S24 : SampleKind::S32;
+        L.bigEndian = c != "sowt" && c != "raw ";
+        ai.codec = "PCM";
+        if (bytes < 1 || bytes > 4) ai.codec.clear();
+    } else if (c == "fl32" || c == "FL32") { L.kind = SampleKind::F32; bytes = 4; ai.codec = "IEEE Float"; }
+    else if (c == "fl64" || c == "FL64")   { L.kind = SampleKind::F64; bytes = 8; ai.codec = "IEEE Float"; }
+    else ai.codec = "compressed (" + c + ")";
+    if (!ai.codec.empty() && ai.codec.compare(0, 10, "compressed") != 0 && ssnd && ai.channels > 0) {
+        L.channels = ai.channels; L.bytesPerSample = bytes; L.blockAlign = bytes * ai.channels;
+        ai.pcm = ssnd;
+        ai.pcmFrames = std::min<ULONGLONG>(frames, ssndLen / L.blockAlign);
+    }
+    if (ai.codec.empty()) ai.codec = "PCM (unsupported width)";
+    if (ai.seconds > 0) ai.bitrateKbps = (double)ai.sampleRate * ai.channels * ai.bitsPerSample / 1000.0;
+    return true;
+}
+
+std::string AnalyzeCompressedAudio(const std::wstring& path, const std::string& ext, std::vector<float>* features) {
+    std::string nameA = WStringToString(path.substr(path.find_last_of(L"\\/") + 1));
+    MappedFile mf(path);
+    if (!mf.IsOpen()) return "ERROR: Could not open audio file.";
+    const BYTE* p = mf.Data();
+    const ULONGLONG size = mf.Size();
+
+    // Sniff the content rather than trusting the extension (e.g. .ogg that is really Opus, .m4a vs .aac)
+    auto t0 = std::chrono::steady_clock::now();
+    AudioInfo ai;
+    size_t id3 = ParseId3v2(p, size, nullptr);
+    bool ok = ParseFlac(p, size, ai);
+    if (!ok) { ai = AudioInfo(); ok = ParseOgg(p, size, ai); }
+    if (!ok) { ai = AudioInfo(); ok = ParseMp4Audio(p, size, ai); }
+    if (!ok) { ai = AudioInfo(); ok = ParseAiff(p, size, ai); }
+    if (!ok) { ai = AudioInfo(); ok = ParseAsf(p, size, ai); }
+    if (!ok && id3 + 2 <= size && p[id3] == 0xFF && (p[id3 + 1] & 0xF6) == 0xF0) { ai = AudioInfo(); ok = ParseAdts(p, size, ai); }
+    if (!ok) { ai = AudioInfo(); ok = ParseMp3(p, size, ai); }
+    double parseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    DevLog("[Attach] Audio header parse (%s): %s in %.2f ms\n", ext.c_str(), ok ? ai.container.c_str() : "unrecognised", parseMs);
+
+    char line[512];
+    if (!ok) {
+        sprintf_s(line, "=== AUDIO: \"%s\" | %s | %.2f MB ===\nNote: Could not parse the %s stream headers.",
+                  nameA.c_str(), ext.c_str(), size / (1024.0 * 1024.0), ext.c_str());
+        return line;
+    }
+
+    int mins = (int)ai.seconds / 60;
+    double secs = ai.seconds - mins * 60;
+    std::string out = "=== AUDIO ANALYSIS ===\n";
+    sprintf_s(line, "File: \"%s\" | %.2f MB\nFormat: %s in %s", nameA.c_str(), size / (1024.0 * 1024.0), ai.codec.c_str(), ai.container.c_str());
+    out += line;
+    if (ai.sampleRate)    { sprintf_s(line, " | %lu Hz", ai.sampleRate); out += line; }
+    if (ai.channels)      { sprintf_s(line, " | %d ch", ai.channels); out += line; }
+    if (ai.bitsPerSample) { sprintf_s(line, " | %d-bit", ai.bitsPerSample); out += line; }
+    out += "\n";
+    if (ai.seconds > 0) {
+        sprintf_s(line, "Duration: %s%d:%06.3f | Bitrate: %.0f kbps%s\n", ai.estimated ? "~" : "", mins, secs,
+                  ai.bitrateKbps, ai.vbr ? " (VBR average)" : "");
+        out += line;
+    }
+    if (!ai.tags.empty()) {
+        out += "Tags:";
+        for (size_t i = 0; i < ai.tags.size(); i++) out += (i ? " | " : " ") + ai.tags[i].first + ": " + ai.tags[i].second;
+        out += "\n";
+    }
+    if (!ai.notes.empty()) out += "Notes: " + ai.notes + "\n";
+    if (ai.pcm && ai.pcmFrames) out += AnalyzePcmRegion(ai.pcm, ai.pcmFrames, ai.layout, ai.sampleRate, ai.container.c_str(), features);
+    return out + "Analyse this audio and give detailed feedback.";
+}
+
+// ── Video containers (MP4/MOV, Matroska/WebM, AVI) ──
+// Seeks only through header structures (moov, Segment Info/Tracks, hdrl), so even very large
+// files are described without reading their media payload.
+struct VideoTrack {
+    char        kind = 'v';          // 'v' video, 'a' audio, 's' subtitle
+    std::string codec, language, name;
+    int         width = 0, height = 0, channels = 0, rotation = 0;
+    DWORD       sampleRate = 0;
+    double      fps = 0.0, bitrateKbps = 0.0;
+};
+
+struct VideoInfo {
+    std::string container, title, notes;
+    double      seconds = 0.0;
+    std::vector<VideoTrack> tracks;
+};
+
+static const char* VideoCodecName(const char* fourcc) {
+    static const struct { const char* fourcc; const char* name; } kCodecs[] = {
+        { "avc1", "H.264" }, { "avc3", "H.264" }, { "hvc1", "HEVC" }, { "hev1", "HEVC" }, { "av01", "AV1" },
+        { "vp08", "VP8" }, { "vp09", "VP9" }, { "mp4v", "MPEG-4 Visual" }, { "s263", "H.263" },
+        { "apch", "ProRes 422 HQ" }, { "apcn", "ProRes 422" }, { "apcs", "ProRes 422 LT" }, { "apco", "ProRes 422 Proxy" },
+        { "ap4h", "ProRes 4444" }, { "jpeg", "Motion JPEG" }, { "mjpa", "Motion JPEG" }, { "dvh1", "Dolby Vision HEVC" },
+        { "H264", "H.264" }, { "h264", "H.264" }, { "X264", "H.264" }, { "x264", "H.264" }, { "XVID", "MPEG-4 ASP (Xvid)" },
+        { "xvid", "MPEG-4 ASP (Xvid)" }, { "DIVX", "MPEG-4 ASP (DivX)" }, { "DX50", "MPEG-4 ASP (DivX 5)" }, { "MJPG", "Motion JPEG" },
+        { "HFYU", "Huffyuv" }, { "FFV1", "FFV1" }, { "MPG2", "MPEG-2" }, { "WMV3", "WMV9" }, { "HEVC", "HEVC" },
+    };
+    for (const auto& c : kCodecs) if (memcmp(fourcc, c.fourcc, 4) == 0) return c.name;
+    return nullptr;
+}
+
+// ── MP4 / MOV ──
+// Codec detail from the avcC/hvcC configuration records (profile@level)
+static void ParseMp4VideoEntry(const BYTE* e, size_t n, VideoTrack& t) {
+    if (n < 86) return;
+    const char* fourcc = (const char*)e + 4;
+    const char* known = VideoCodecName(fourcc);
+    t.codec = known ? known : std::string(fourcc, 4);
+    t.width = ReadBE16(e + 32);
+    t.height = ReadBE16(e + 34);
+    ForEachBox(e + 86, e + n, [&](const BYTE* type, const BYTE* b, size_t len) {
+        char detail[48] = {};
+        if (BoxIs(type, "avcC") && len >= 4) {
+            int prof = b[1];
+            const char* pn = prof == 66 ? "Baseline" : prof == 77 ? "Main" : prof == 88 ? "Extended" : prof == 100 ? "High"
+                           : prof == 110 ? "High 10" : prof == 122 ? "High 4:2:2" : prof == 244 ? "High 4:4:4" : "profile";
+            sprintf_s(detail, " %s@L%d.%d", pn, b[3] / 10, b[3] % 10);
+        } else if (BoxIs(type, "hvcC") && len >= 13) {
+            int prof = b[1] & 0x1F;
+            sprintf_s(detail, " %s@L%.1f", prof == 1 ? "Main" : prof == 2 ? "Main 10" : prof == 4 ? "RExt" : "profile", b[12] / 30.0);
+        } else if (BoxIs(type, "btrt") && len >= 12) {
+            t.bitrateKbps = ReadBE32(b + 8) / 1000.0;
+        }
+        t.codec += detail;
+        return true;
+    });
+}
+
+// Display rotation from the tkhd transformation matrix
+static int Mp4Rotation(const BYTE* m) {
+    int a = (int)ReadBE32(m), b = (int)ReadBE32(m + 4);
+    int deg = (int)lround(atan2((double)b, (double)a) * 180.0 / M_PI);
+    return (deg % 360 + 360) % 360;
+}
+
+static bool ParseMp4Video(const BYTE* p, ULONGLONG size, VideoInfo& vi) {
+    if (size < 16 || !BoxIs(p + 4, "ftyp")) {
+        // Older QuickTime files may start straight with moov/mdat/wide/free
+        if (size < 8 || !(BoxIs(p + 4, "moov") || BoxIs(p + 4, "mdat") || BoxIs(p + 4, "wide") || BoxIs(p + 4, "free"))) return false;
+        vi.container = "QuickTime";
+    } else {
+        std::string brand((const char*)p + 8, 4);
+        vi.container = (brand == "qt  " ? "QuickTime (" : "MP4 (") + brand + ")";
+    }
+    bool haveMoov = false, fragmented = false;
+    ForEachBox(p, p + size, [&](const BYTE* t, const BYTE* b, size_t n) {
+        if (BoxIs(t, "moof")) fragmented = true;
+        if (!BoxIs(t, "moov")) return true;
+        haveMoov = true;
+        ForEachBox(b, b + n, [&](const BYTE* t2, const BYTE* b2, size_t n2) {
+            if (BoxIs(t2, "mvhd")) vi.seconds = Mp4Duration(b2, n2);
+            else if (BoxIs(t2, "mvex")) fragmented = true;
+            if (!BoxIs(t2, "trak")) return true;
+
+            VideoTrack tr;
+            int rotation = 0, tkW = 0, tkH = 0;
+            double trackSeconds = 0;
+            ULONGLONG samples = 0;
+            std::string handler;
+            const BYTE* stsd = nullptr; size_t stsdLen = 0;
+            ForEachBox(b2, b2 + n2, [&](const BYTE* t3, const BYTE* b3, size_t n3) {
+                if (BoxIs(t3, "tkhd") && n3 >= 84) {
+                    size_t m = b3[0] == 1 ? 52 : 40;
+                    if (m + 44 <= n3) { rotation = Mp4Rotation(b3 + m); tkW = ReadBE32(b3 + m + 36) >> 16; tkH = ReadBE32(b3 + m + 40) >> 16; }
+                }
+                if (!BoxIs(t3, "mdia")) return true;
+                ForEachBox(b3, b3 + n3, [&](const BYTE* t4, const BYTE* b4, size_t n4) {
+                    if (BoxIs(t4, "mdhd")) {
+                        trackSeconds = Mp4Duration(b4, n4);
+                        size_t lo = b4[0] == 1 ? 32 : 20;
+                        if (lo + 2 <= n4) {
+                            // ISO-639-2 code packed as three 5-bit letters
+                            WORD l = ReadBE16(b4 + lo);
+                            char lang[4] = { (char)(((l >> 10) & 31) + 0x60), (char)(((l >> 5) & 31) + 0x60), (char)((l & 31) + 0x60), 0 };
+                            if (l && strcmp(lang, "und") != 0 && lang[0] >= 'a') tr.language = lang;
+                        }
+                    } else if (BoxIs(t4, "hdlr") && n4 >= 12) {
+                        handler.assign((const char*)b4 + 8, 4);
+                    } else if (BoxIs(t4, "minf")) {
+                        ForEachBox(b4, b4 + n4, [&](const BYTE* t5, const BYTE* b5, size_t n5) {
+                            if (!BoxIs(t5, "stbl")) return true;
+                            ForEachBox(b5, b5 + n5, [&](const BYTE* t6, const BYTE* b6, size_t n6) {
+                                if (BoxIs(t6, "stsd") && n6 >= 16) { stsd = b6; stsdLen = n6; }
+                                else if (BoxIs(t6, "stsz") && n6 >= 12) samples = ReadBE32(b6 + 8);
+                                else if (BoxIs(t6, "stz2") && n6 >= 12) samples = ReadBE32(b6 + 8);
+                                return true;
+                            });
+                            return false;
+                        });
+                    }
+                    return true;
+                });
+                return true;
+            });
+            if (!stsd) return true;
+            const BYTE* entry = stsd + 8;
+            size_t entryLen = std::min<size_t>(ReadBE32(entry), stsdLen - 8);
+            if (handler == "vide") {
+                tr.kind = 'v';
+                ParseMp4VideoEntry(entry, entryLen, tr);
+                if (tkW && tkH) { tr.width = tkW; tr.height = tkH; }  // display size after pixel aspect
+                tr.rotation = rotation;
+                if (trackSeconds > 0 && samples) tr.fps = samples / trackSeconds;
+            } else if (handler == "soun") {
+                tr.kind = 'a';
+                AudioInfo ai;
+                ParseMp4SoundEntry(entry, entryLen, ai);
+                tr.codec = ai.codec; tr.channels = ai.channels; tr.sampleRate = ai.sampleRate; tr.bitrateKbps = ai.bitrateKbps;
+            } else if (handler == "text" || handler == "sbtl" || handler == "subt" || handler == "clcp") {
+                tr.kind = 's';
+                tr.codec = std::string((const char*)entry + 4, 4);
+            } else {
+                return true;  // hint, timecode and metadata tracks
+            }
+            if (vi.seconds <= 0) vi.seconds = trackSeconds;
+            vi.tracks.push_back(tr);
+            return true;
+        });
+        return true;
+    });
+    if (fragmented) vi.notes += "Fragmented MP4. ";
+    return haveMoov;
+}
+
+// ── Matroska / WebM (EBML) ──
+// Variable-length integers: IDs keep their length marker, sizes drop it
+static bool EbmlReadId(const BYTE*& q, const BYTE* end, DWORD& id) {
+    if (q >= end || !*q) return false;
+    int len = 1; while (!(*q & (0x80 >> (len - 1)))) len++;
+    if (len > 4 || end - q < len) return false;
+    id = 0;
+    for (int i = 0; i < len; i++) id = id << 8 | q[i];
+    q += len;
+    return true;
+}
+
+static bool EbmlReadSize(const BYTE*& q, const BYTE* end, ULONGLONG& size, bool& unknown) {
+    if (q >= end || !*q) return false;
+    int len = 1; while (!(*q & (0x80 >> (len - 1)))) len++;
+    if (end - q < len) return false;
+    size = *q & (0xFF >> len);
+    bool allOnes = size == (ULONGLONG)(0xFF >> len);
+    for (int i = 1; i < len; i++) { size = size << 8 | q[i]; allOnes &= q[i] == 0xFF; }
+    q += len;
+    unknown = allOnes;
+    return true;
+}
+
+static ULONGLONG EbmlUInt(const BYTE* b, size_t n) { ULONGLONG v = 0; for (size_t i = 0; i < n && i < 8; i++) v = v << 8 | b[i]; return v; }
+
+static double EbmlFloat(const BYTE* b, size_t n) {
+    if (n == 4) { DWORD u = ReadBE32(b); float f; memcpy(&f, &u, 4); return f; }
+    if (n == 8) { ULONGLONG u = ReadBE64(b); double d; memcpy(&d, &u, 8); return d; }
+    return 0.0;
+}
+
+// Calls fn(id, body, size) for each element in [p, end). Unknown-size elements run to end.
+template <class Fn>
+static void ForEachEbml(const BYTE* p, const BYTE* end, Fn fn) {
+    while (p < end) {
+        DWORD id; ULONGLONG sz; bool unknown;
+        if (!EbmlReadId(p, end, id) || !EbmlReadSize(p, end, sz, unknown)) return;
+        if (unknown || sz > (ULONGLONG)(end - p)) sz = (ULONGLONG)(end - p);
+        if (!fn(id, p, (size_t)sz)) return;
+        p += sz;
+    }
+}
+
+static const char* MatroskaCodecName(const std::string& id) {
+    static const struct { const char* prefix; const char* name; } kCodecs[] = {
+        { "V_MPEG4/ISO/AVC", "H.264" }, { "V_MPEGH/ISO/HEVC", "HEVC" }, { "V_AV1", "AV1" }, { "V_VP9", "VP9" },
+        { "V_VP8", "VP8" }, { "V_MPEG4/ISO", "MPEG-4 Visual" }, { "V_MPEG2", "MPEG-2" }, { "V_MS/VFW", "VfW" },
+        { "V_THEORA", "Theora" }, { "V_PRORES", "ProRes" }, { "V_FFV1", "FFV1" },
+        { "A_AAC", "AAC" }, { "A_OPUS", "Opus" }, { "A_VORBIS", "Vorbis" }, { "A_FLAC", "FLAC" }, { "A_AC3", "AC-3" },
+        { "A_EAC3", "E-AC-3" }, { "A_DTS", "DTS" }, { "A_TRUEHD", "TrueHD" }, { "A_MPEG/L3", "MP3" }, { "A_PCM", "PCM" },
+        { "S_TEXT/UTF8", "SRT" }, { "S_TEXT/ASS", "ASS" }, { "S_TEXT/SSA", "SSA" }, { "S_TEXT/WEBVTT", "WebVTT" },
+        { "S_HDMV/PGS", "PGS" }, { "S_VOBSUB", "VobSub" },
+    };
+    for (const auto& c : kCodecs) if (id.compare(0, strlen(c.prefix), c.prefix) == 0) return c.name;
+    return nullptr;
+}
+
+static void ParseMatroskaTrack(const BYTE* b, size_t n, VideoInfo& vi) {
+    VideoTrack t;
+    int type = 0;
+    ULONGLONG defaultDuration = 0;
+    ForEachEbml(b, b + n, [&](DWORD id, const BYTE* d, size_t len) {
+        switch (id) {
+        case 0x83:     type = (int)EbmlUInt(d, len); break;
+        case 0x86:     { std::string c((const char*)d, strnlen((const char*)d, len)); const char* k = MatroskaCodecName(c); t.codec = k ? k : c; break; }
+        case 0x22B59C: t.language.assign((const char*)d, strnlen((const char*)d, len)); break;
+        case 0x536E:   t.name.assign((const char*)d, strnlen((const char*)d, len)); break;
+        case 0x23E383: defaultDuration = EbmlUInt(d, len); break;
+        case 0xE0:     // Video
+            ForEachEbml(d, d + len, [&](DWORD vid, const BYTE* v, size_t vl) {
+                if (vid == 0xB0) t.width = (int)EbmlUInt(v, vl);
+                else if (vid == 0xBA) t.height = (int)EbmlUInt(v, vl);
+                return true;
+            });
+            break;
+        case 0xE1:     // Audio
+            ForEachEbml(d, d + len, [&](DWORD aid, const BYTE* a, size_t al) {
+                if (aid == 0xB5) t.sampleRate = (DWORD)EbmlFloat(a, al);
+                else if (aid == 0x9F) t.channels = (int)EbmlUInt(a, al);
+                return true;
+            });
+            break;
+        }
+        return true;
+    });
+    if (type == 1) t.kind = 'v';
+    else if (type == 2) t.kind = 'a';
+    else if (type == 17) t.kind = 's';
+    else return;
+    if (t.language == "und") t.language.clear();
+    if (t.kind == 'v' && defaultDuration) t.fps = 1e9 / defaultDuration;
+    vi.tracks.push_back(t);
+}
+
+static bool ParseMatroska(const BYTE* p, ULONGLONG size, VideoInfo& vi) {
+    if (size < 16 || ReadBE32(p) != 0x1A45DFA3) return false;
+    const BYTE* end = p + size;
+    std::string docType = "matroska";
+    bool ok = false;
+    ForEachEbml(p, end, [&](DWORD id, const BYTE* b, size_t n) {
+        if (id == 0x1A45DFA3) {
+            ForEachEbml(b, b + n, [&](DWORD hid, const BYTE* h, size_t hl) {
+                if (hid == 0x4282) docType.assign((const char*)h, strnlen((const char*)h, hl));
+                return true;
+            });
+            return true;
+        }
+        if (id != 0x18538067) return true;  // Segment
+        ok = true;
+        const BYTE* seg = b;
+        ULONGLONG scale = 1000000;
+        double duration = 0;
+        bool haveInfo = false, haveTracks = false;
+        std::vector<ULONGLONG> seeks;  // Info/Tracks positions from the SeekHead
+        auto parseInfo = [&](const BYTE* d, size_t len) {
+            haveInfo = true;
+            ForEachEbml(d, d + len, [&](DWORD iid, const BYTE* v, size_t vl) {
+                if (iid == 0x2AD7B1) scale = EbmlUInt(v, vl);
+                else if (iid == 0x4489) duration = EbmlFloat(v, vl);
+                else if (iid == 0x7BA9) vi.title.assign((const char*)v, strnlen((const char*)v, vl));
+                return true;
+            });
+        };
+        auto parseTracks = [&](const BYTE* d, size_t len) {
+            haveTracks = true;
+            ForEachEbml(d, d + len, [&](DWORD tid, const BYTE* v, size_t vl) {
+                if (tid == 0xAE) ParseMatroskaTrack(v, vl, vi);
+                return true;
+            });
+        };
+        ForEachEbml(seg, seg + n, [&](DWORD sid, const BYTE* d, size_t len) {
+            if (sid == 0x1549A966) parseInfo(d, len);
+            else if (sid == 0x1654AE6B) parseTracks(d, len);
+            else if (sid == 0x114D9B74) {
+                ForEachEbml(d, d + len, [&](DWORD eid, const BYTE* e, size_t el) {
+                    if (eid != 0x4DBB) return true;
+                    DWORD target = 0; ULONGLONG pos = ~0ull;
+                    ForEachEbml(e, e + el, [&](DWORD kid, const BYTE* k, size_t kl) {
+                        if (kid == 0x53AB) target = (DWORD)EbmlUInt(k, kl);
+                        else if (kid == 0x53AC) pos = EbmlUInt(k, kl);
+                        return true;
+                    });
+                    if ((target == 0x1549A966 || target == 0x1654AE6B) && pos < n) seeks.push_back(pos);
+                    return true;
+                });
+            } else if (sid == 0x1F43B675) {
+                return !(haveInfo && haveTracks) && seeks.empty();  // stop at the first Cluster
+            }
+            return true;
+        });
+        // Header elements written after the media (live muxers): follow the SeekHead
+        for (ULONGLONG pos : seeks) {
+            ForEachEbml(seg + pos, seg + n, [&](DWORD sid, const BYTE* d, size_t len) {
+                if (sid == 0x1549A966 && !haveInfo) parseInfo(d, len);
+                else if (sid == 0x1654AE6B && !haveTracks) parseTracks(d, len);
+                return false;
+            });
+        }
+        vi.seconds = duration * scale / 1e9;
+        return false;
+    });
+    vi.container = docType == "webm" ? "WebM" : "Matroska";
+    return ok;
+}
+
+// ── AVI (RIFF) ──
+static bool ParseAvi(const BYTE* p, ULONGLONG size, VideoInfo& vi) {
+    if (size < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "AVI ", 4) != 0) return false;
+    vi.container = "AVI";
+    DWORD usPerFrame = 0, totalFrames = 0;
+    ULONGLONG grandFrames = 0;
+    const BYTE* end = p + std::min<ULONGLONG>(size, 12ull + ReadLE32(p + 4));
+    // RIFF chunk walker: LIST chunks recurse, everything else goes to fn(id, body, len)
+    std::function<void(const BYTE*, const BYTE*)> walk = [&](const BYTE* q, const BYTE* stop) {
+        VideoTrack* cur = nullptr;
+        char curType[5] = {};
+        DWORD scale = 0, rate = 0, length = 0;
+        while (stop - q >= 8) {
+            size_t len = ReadLE32(q + 4);
+            const BYTE* body = q + 8;
+            if (len > (size_t)(stop - body)) len = (size_t)(stop - body);
+            if (memcmp(q, "LIST", 4) == 0 && len >= 4) {
+                if (memcmp(body, "movi", 4) != 0) walk(body + 4, body + len);  // never descend into media data
+            } else if (memcmp(q, "avih", 4) == 0 && len >= 40) {
+                usPerFrame = ReadLE32(body);
+                totalFrames = ReadLE32(body + 16);
+            } else if (memcmp(q, "dmlh", 4) == 0 && len >= 4) {
+                grandFrames = ReadLE32(body);
+            } else if (memcmp(q, "strh", 4) == 0 && len >= 36) {
+                memcpy(curType, body, 4);
+                scale = ReadLE32(body + 20); rate = ReadLE32(body + 24); length = ReadLE32(body + 32);
+                cur = nullptr;
+                if (!memcmp(curType, "vids", 4) || !memcmp(curType, "auds", 4) || !memcmp(curType, "txts", 4)) {
+                    vi.tracks.emplace_back();
+                    cur = &vi.tracks.back();
+                    cur->kind = curType[0] == 'v' ? 'v' : curType[0] == 'a' ? 'a' : 's';
+                    if (cur->kind == 'v' && scale) cur->fps = (double)rate / scale;
+                    if (scale && rate && length) vi.seconds = std::max(vi.seconds, (double)length * scale / rate);
+                }
+            } else if (memcmp(q, "strf", 4) == 0 && cur) {
+                if (cur->kind == 'v' && len >= 20) {
+                    cur->width = (int)ReadLE32(body + 4);
+                    cur->height = abs((int)ReadLE32(body + 8));
+                    const char* k = VideoCodecName((const char*)body + 16);
+                    cur->codec = k ? k : std::string((const char*)body + 16, 4);
+                } else if (cur->kind == 'a' && len >= 16) {
+                    WORD tag = ReadLE16(body);
+                    cur->codec = tag == 1 ? "PCM" : tag == 0x55 ? "MP3" : tag == 0x50 ? "MP2" : tag == 0xFF || tag == 0x1610 ? "AAC"
+                               : tag == 0x2000 ? "AC-3" : tag == 0x2001 ? "DTS" : tag == 0x161 ? "WMA v2" : "audio 0x" + std::to_string(tag);
+                    cur->channels = ReadLE16(body + 2);
+                    cur->sampleRate = ReadLE32(body + 4);
+                    cur->bitrateKbps = ReadLE32(body + 8) * 8.0 / 1000.0;
+                }
+            } else if (memcmp(q, "INAM", 4) == 0) {
+                vi.title.assign((const char*)body, strnlen((const char*)body, len));
+            }
+            q = body + len + (len & 1);
+        }
+    };
+    walk(p + 12, end);
+    ULONGLONG frames = std::max<ULONGLONG>(grandFrames, totalFrames);
+    if (usPerFrame && frames) vi.seconds = std::max(vi.seconds, frames * (double)usPerFrame / 1e6);
+    if (size > (ULONGLONG)(end - p)) vi.notes += "OpenDML (AVI 2.0) extended file. ";
+    return true;
+}
+
+static std::string FormatClock(double seconds) {
+    char buf[32];
+    int total = (int)seconds, h = total / 3600, m = (total / 60) % 60;
+    double s = seconds - h * 3600 - m * 60;
+    if (h) sprintf_s(buf, "%d:%02d:%04.1f", h, m, s);
+    else   sprintf_s(buf, "%d:%04.1f", m, s);
+    return buf;
+}
+
+std::string AnalyzeVideoFile(const std::wstring& path, const std::string& ext) {
+    std::string nameA = WStringToString(path.substr(path.find_last_of(L"\\/") + 1));
+    MappedFile mf(path);
+    if (!mf.IsOpen()) return "ERROR: Could not open video file.";
+    const BYTE* p = mf.Data();
+    const ULONGLONG size = mf.Size();
+
+    auto t0 = std::chrono::steady_clock::now();
+    VideoInfo vi;
+    bool ok = ParseMatroska(p, size, vi);
+    if (!ok) { vi = VideoInfo(); ok = ParseAvi(p, size, vi); }
+    if (!ok) { vi = VideoInfo(); ok = ParseMp4Video(p, size, vi); }
+    double parseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    DevLog("[Attach] Video header parse (%s): %s, %zu tracks in %.2f ms\n",
+           ext.c_str(), ok ? vi.container.c_str() : "unrecognised", vi.tracks.size(), parseMs);
+
+    char line[256];
+    double mb = size / (1024.0 * 1024.0);
+    if (!ok) {
+        sprintf_s(line, "=== VIDEO FILE ===\nFilename: \"%s\" | Format: %s | Size: %.2f MB\n"
+                        "Note: Container not recognised (MP4/MOV, MKV/WebM and AVI are parsed natively).", nameA.c_str(), ext.c_str(), mb);
+        return line;
+    }
+
+    std::string out = "=== VIDEO ANALYSIS ===\n";
+    out += "File: \"" + nameA + "\"";
+    sprintf_s(line, " | %.2f %s | %s\n", mb >= 1024 ? mb / 1024.0 : mb, mb >= 1024 ? "GB" : "MB", vi.container.c_str());
+    out += line;
+    if (!vi.title.empty()) out += "Title: " + vi.title + "\n";
+    if (vi.seconds > 0) {
+        sprintf_s(line, "Duration: %s | Overall bitrate: %.0f kbps\n", FormatClock(vi.seconds).c_str(), size * 8.0 / vi.seconds / 1000.0);
+        out += line;
+    }
+    int index = 1;
+    for (const auto& t : vi.tracks) {
+        static const char* kKinds[] = { "Video", "Audio", "Subtitle" };
+        std::string desc = std::string(kKinds[t.kind == 'v' ? 0 : t.kind == 'a' ? 1 : 2]) + " #" + std::to_string(index++) + ": "
+                         + (t.codec.empty() ? "unknown codec" : t.codec);
+        if (t.kind == 'v') {
+            if (t.width && t.height) { sprintf_s(line, " | %dx%d", t.width, t.height); desc += line; }
+            if (t.fps > 0)           { sprintf_s(line, " | %.3g fps", t.fps); desc += line; }
+            if (t.rotation)          { sprintf_s(line, " | rotated %d\xC2\xB0", t.rotation); desc += line; }
+        } else if (t.kind == 'a') {
+            if (t.sampleRate) { sprintf_s(line, " | %lu Hz", t.sampleRate); desc += line; }
+            if (t.channels)   { sprintf_s(line, " | %d ch", t.channels); desc += line; }
+        }
+        if (t.bitrateKbps > 0) { sprintf_s(line, " | %.0f kbps", t.bitrateKbps); desc += line; }
+        if (!t.language.empty()) desc += " | " + t.language;
+        if (!t.name.empty()) desc += " | \"" + t.name + "\"";
+        out += desc + "\n";
+    }
+    if (!vi.notes.empty()) out += "Notes: " + vi.notes + "\n";
+    return out + "Analyse this video.";
+}
+
+// ── Documents (PDF, DOCX, XLSX, PPTX) ──
+// PDF, DOCX, XLSX and PPTX without external libraries: a DEFLATE decoder, a ZIP central
+// directory reader, a streaming XML tokenizer and a PDF object/content-stream reader.
+// Extractors push text through a sink one page (sheet, slide) at a time, so the map-reduce
+// summarizer starts on page 1 while later pages are still being decoded. The sink returns
+// false to stop early. Output is plain text with [Page n] / [Sheet: x] / [Slide n] markers,
+// '#' headings and '|' table rows.
+
+typedef std::function<bool(const std::string&)>        TextSink;
+typedef std::function<bool(const char*, size_t)>       ByteSink;
+
+static void AppendUtf8(std::string& out, DWORD cp) {
+    if      (cp < 0x80)    out += (char)cp;
+    else if (cp < 0x800)   { out += (char)(0xC0 | cp >> 6);  out += (char)(0x80 | (cp & 0x3F)); }
+    else if (cp < 0x10000) { out += (char)(0xE0 | cp >> 12); out += (char)(0x80 | (cp >> 6 & 0x3F)); out += (char)(0x80 | (cp & 0x3F)); }
+    else                   { out += (char)(0xF0 | cp >> 18); out += (char)(0x80 | (cp >> 12 & 0x3F)); out += (char)(0x80 | (cp >> 6 & 0x3F)); out += (char)(0x80 | (cp & 0x3F)); }
+}
+
+// ── DEFLATE (RFC 1951) ──
+// Table-driven decoder. Output reaches the sink in blocks while the last 32 KB stay behind
+// for back-references, so memory is flat whatever the uncompressed size.
+class Inflater {
+public:
+    // zlibWrapped: input starts with the 2-byte RFC 1950 header (PDF FlateDecode). Returns false
+    // on corrupt input; everything decoded before the error has already been delivered.
+    static bool Run(const BYTE* in, size_t n, bool zlibWrapped, const ByteSink& sink) {
+        Inflater z(in, n, sink);
+        if (zlibWrapped) {
+            if (n < 2 || (in[0] & 0x0F) != 8 || ((in[0] << 8) | in[1]) % 31 != 0) return false;
+            z.m_p += 2;
+        }
+        return z.Decode();
+    }
+
+private:
+    static const size_t kWindow = 32768;
+
+    struct Huffman {
+        std::vector<WORD> table;   // indexed by the next `bits` input bits: symbol << 4 | code length
+        int               bits = 0;
+    };
+
+    Inflater(const BYTE* in, size_t n, const ByteSink& sink) : m_p(in), m_end(in + n), m_sink(sink), m_out(kWindow * 3) {}
+
+    void Refill() {
+        while (m_count <= 56) {
+            if (m_p < m_end) m_bits |= (ULONGLONG)*m_p++ << m_count;
+            else m_overrun++;   // zeros past the end; only an error if they get consumed
+            m_count += 8;
+        }
+    }
+    DWORD Bits(int n) {
+        if (m_count < n) Refill();
+        DWORD v = (DWORD)(m_bits & ((1ull << n) - 1));
+        m_bits >>= n; m_count -= n;
+        return v;
+    }
+    bool Overrun() const { return m_overrun * 8 > (size_t)m_count; }
+
+    static bool Build(const BYTE* lens, int n, Huffman& h) {
+        int count[16] = {}, next[16] = {};
+        int maxLen = 0;
+        for (int i = 0; i < n; i++) { count[lens[i]]++; maxLen = (std::max)(maxLen, (int)lens[i]); }
+        count[0] = 0;
+        h.bits = (std::max)(maxLen, 1);
+        h.table.assign((size_t)1 << h.bits, 0);
+        int code = 0, left = 1;
+        for (int len = 1; len <= 15; len++) {
+            left = (left << 1) - count[len];
+            if (left < 0) return false;   // over-subscribed
+            next[len] = code;
+            code = (code + count[len]) << 1;
+        }
+        for (int sym = 0; sym < n; sym++) {
+            int len = lens[sym];
+            if (!len) continue;
+            int c = next[len]++, rev = 0;
+            for (int i = 0; i < len; i++) rev |= ((c >> i) & 1) << (len - 1 - i);
+            for (int k = rev; k < (1 << h.bits); k += 1 << len) h.table[k] = (WORD)(sym << 4 | len);
+        }
+        return true;
+    }
+
+    int Symbol(const Huffman& h) {
+        if (m_count < h.bits) Refill();
+        WORD e = h.table[m_bits & ((1ull << h.bits) - 1)];
+        int len = e & 15;
+        if (!len) return -1;
+        m_bits >>= len; m_count -= len;
+        return e >> 4;
+    }
+
+    bool Flush(bool final) {
+        if (m_pos > m_flushed && !m_stopped && !m_sink((const char*)m_out.data() + m_flushed, m_pos - m_flushed)) m_stopped = true;
+        m_flushed = m_pos;
+        if (!final && m_pos > kWindow) {
+            memmove(m_out.data(), m_out.data() + m_pos - kWindow, kWindow);
+            m_pos = m_flushed = kWindow;
+        }
+        return !m_stopped;
+    }
+
+    bool Decode() {
+        static const WORD kLenBase[29]  = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+        static const BYTE kLenExtra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+        static const WORD kDistBase[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+        static const BYTE kDistExtra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+        static const BYTE kOrder[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+
+        Huffman lit, dist;
+        for (bool last = false; !last;) {
+            last = Bits(1) != 0;
+            DWORD type = Bits(2);
+            if (type == 0) {
+                Bits(m_count & 7);   // to a byte boundary
+                DWORD len = Bits(16), nlen = Bits(16);
+                if ((len ^ 0xFFFF) != nlen) return false;
+                for (DWORD i = 0; i < len; i++) {
+                    if (m_pos >= m_out.size() && !Flush(false)) return true;
+                    m_out[m_pos++] = (BYTE)Bits(8);
+                }
+                if (Overrun()) return false;
+                continue;
+            }
+            if (type == 3) return false;
+            if (type == 1) {
+                BYTE l[288], d[30];
+                memset(l, 8, 144); memset(l + 144, 9, 112); memset(l + 256, 7, 24); memset(l + 280, 8, 8);
+                memset(d, 5, 30);
+                Build(l, 288, lit); Build(d, 30, dist);
+            } else {
+                int hlit = Bits(5) + 257, hdist = Bits(5) + 1, hclen = Bits(4) + 4;
+                BYTE cl[19] = {};
+                for (int i = 0; i < hclen; i++) cl[kOrder[i]] = (BYTE)Bits(3);
+                Huffman ch;
+                if (!Build(cl, 19, ch)) return false;
+                BYTE lens[320] = {};
+                for (int i = 0; i < hlit + hdist;) {
+                    int sym = Symbol(ch);
+                    if (sym < 0) return false;
+                    if (sym < 16) { lens[i++] = (BYTE)sym; continue; }
+                    int rep = 0; BYTE val = 0;
+                    if      (sym == 16) { if (!i) return false; val = lens[i - 1]; rep = 3 + Bits(2); }
+                    else if (sym == 17) rep = 3 + Bits(3);
+                    else                rep = 11 + Bits(7);
+                    if (i + rep > hlit + hdist) return false;
+                    while (rep--) lens[i++] = val;
+                }
+                if (!Build(lens, hlit, lit) || !Build(lens + hlit, hdist, dist)) return false;
+            }
+            for (;;) {
+                if (m_pos + 258 > m_out.size() && !Flush(false)) return true;
+                int sym = Symbol(lit);
+                if (sym < 0 || Overrun()) return false;
+                if (sym < 256) { m_out[m_pos++] = (BYTE)sym; continue; }
+                if (sym == 256) break;
+                sym -= 257;
+                if (sym >= 29) return false;
+                int len = kLenBase[sym] + (int)Bits(kLenExtra[sym]);
+                int ds = Symbol(dist);
+                if (ds < 0 || ds >= 30) return false;
+                size_t d = kDistBase[ds] + Bits(kDistExtra[ds]);
+                if (d > m_pos) return false;
+                BYTE* o = m_out.data() + m_pos;
+                const BYTE* s = o - d;
+                for (int i = 0; i < len; i++) o[i] = s[i];   // may overlap: byte by byte
+                m_pos += len;
+            }
+        }
+        Flush(true);
+        return true;
+    }
+
+    const BYTE*       m_p;
+    const BYTE*       m_end;
+    const ByteSink&   m_sink;
+    ULONGLONG         m_bits = 0;
+    int               m_count = 0;
+    size_t            m_overrun = 0;
+    std::vector<BYTE> m_out;
+    size_t            m_pos = 0, m_flushed = 0;
+    bool              m_stopped = false;
+};
+
+// ── ZIP ──
+struct ZipEntry {
+    std::string name;
+    WORD        method = 0;
+    DWORD       compSize = 0, size = 0, localOffset = 0;
+};
+
+class ZipArchive {
+public:
+    // Reads the central directory (end record within the last 64 KB). ZIP64 is not supported.
+    bool Open(const BYTE* p, size_t n) {
+        m_p = p; m_n = n;
+        if (n < 22) return false;
+        size_t lo = n > 65557 ? n - 65557 : 0;
+        size_t eocd = std::string::npos;
+        for (size_t i = n - 22 + 1; i-- > lo;) if (ReadLE32(p + i) == 0x06054b50) { eocd = i; break; }
+        if (eocd == std::string::npos) return false;
+        WORD  count = ReadLE16(p + eocd + 10);
+        DWORD cdOff = ReadLE32(p + eocd + 16);
+        size_t q = cdOff;
+        for (WORD i = 0; i < count; i++) {
+            if (q + 46 > n || ReadLE32(p + q) != 0x02014b50) return false;
+            ZipEntry e;
+            e.method      = ReadLE16(p + q + 10);
+            e.compSize    = ReadLE32(p + q + 20);
+            e.size        = ReadLE32(p + q + 24);
+            WORD nameLen  = ReadLE16(p + q + 28), extraLen = ReadLE16(p + q + 30), commentLen = ReadLE16(p + q + 32);
+            e.localOffset = ReadLE32(p + q + 42);
+            if (q + 46 + nameLen > n) return false;
+            e.name.assign((const char*)p + q + 46, nameLen);
+            m_entries.push_back(std::move(e));
+            q += 46 + nameLen + extraLen + commentLen;
+        }
+        return true;
+    }
+
+    const ZipEntry* Find(const std::string& name) const {
+        for (const auto& e : m_entries) if (e.name == name) return &e;
+        for (const auto& e : m_entries) if (_stricmp(e.name.c_str(), name.c_str()) == 0) return &e;
+        return nullptr;
+    }
+
+    // Decompresses one entry into the sink as it is inflated
+    bool Stream(const ZipEntry& e, const ByteSink& sink) const {
+        size_t h = e.localOffset;
+        if (h + 30 > m_n || ReadLE32(m_p + h) != 0x04034b50) return false;
+        size_t data = h + 30 + ReadLE16(m_p + h + 26) + ReadLE16(m_p + h + 28);
+        if (data + e.compSize > m_n) return false;
+        if (e.method == 0) {
+            for (size_t off = 0; off < e.compSize; off += 65536)
+                if (!sink((const char*)m_p + data + off, (std::min)((size_t)65536, e.compSize - off))) break;
+            return true;
+        }
+        if (e.method != 8) return false;
+        return Inflater::Run(m_p + data, e.compSize, false, sink);
+    }
+
+    bool ReadAll(const std::string& name, std::string& out, size_t cap = 64u << 20) const {
+        const ZipEntry* e = Find(name);
+        if (!e) return false;
+        out.clear();
+        return Stream(*e, [&](const char* p, size_t n) { out.append(p, (std::min)(n, cap - out.size())); return out.size() < cap; });
+    }
+
+private:
+    const BYTE*           m_p = nullptr;
+    size_t                m_n = 0;
+    std::vector<ZipEntry> m_entries;
+};
+
+// ── Streaming XML ──
+// Just enough XML for Office parts: element starts and ends (local names, raw attribute text)
+// and character data with entities decoded. Feed() accepts arbitrary slices of the document.
+class XmlSax {
+public:
+    std::function<void(const std::string& name, const std::string& attrs)> onStart;
+    std::function<void(const std::string& name)>                           onEnd;
+    std::function<void(const std::string& text)>                           onText;
+
+    void Feed(const char* p, size_t n) {
+        const char* end = p + n;
+        while (p < end) {
+            if (!m_inTag) {
+                const char* lt = (const char*)memchr(p, '<', end - p);
+                m_text.append(p, lt ? lt : end);
+                if (!lt) return;
+                FlushText();
+                m_inTag = true;
+                m_tag.clear();
+                m_quote = 0;
+                p = lt + 1;
+                continue;
+            }
+            char c = *p++;
+            if (IsSpecial()) {
+                m_tag += c;
+                if (c == '>' && EndsSpecial()) EndTag();
+                continue;
+            }
+            if (m_quote) { if (c == m_quote) m_quote = 0; m_tag += c; continue; }
+            if (c == '"' || c == '\'') { m_quote = c; m_tag += c; continue; }
+            if (c == '>') { EndTag(); continue; }
+            m_tag += c;
+        }
+    }
+
+    // Value of attribute `key` in a start tag's attribute text. A key without a prefix also
+    // matches prefixed names ("val" finds w:val); "r:id" must match exactly.
+    static std::string Attr(const std::string& attrs, const char* key) {
+        size_t klen = strlen(key);
+        bool local = strchr(key, ':') == nullptr;
+        for (size_t pos = attrs.find(key); pos != std::string::npos; pos = attrs.find(key, pos + 1)) {
+            char before = pos ? attrs[pos - 1] : ' ';
+            if (before != ' ' && before != '\t' && before != '\n' && before != '\r' && !(local && before == ':')) continue;
+            size_t q = pos + klen;
+            if (q + 1 >= attrs.size() || attrs[q] != '=' || (attrs[q + 1] != '"' && attrs[q + 1] != '\'')) continue;
+            size_t close = attrs.find(attrs[q + 1], q + 2);
+            if (close == std::string::npos) return "";
+            return Decode(attrs.substr(q + 2, close - q - 2));
+        }
+        return "";
+    }
+
+    static std::string Decode(const std::string& s) {
+        if (s.find('&') == std::string::npos) return s;
+        std::string out;
+        for (size_t i = 0; i < s.size(); i++) {
+            if (s[i] != '&') { out += s[i]; continue; }
+            size_t semi = s.find(';', i);
+            if (semi == std::string::npos || semi - i > 10) { out += '&'; continue; }
+            std::string ent = s.substr(i + 1, semi - i - 1);
+            if      (ent == "amp")  out += '&';
+            else if (ent == "lt")   out += '<';
+            else if (ent == "gt")   out += '>';
+            else if (ent == "quot") out += '"';
+            else if (ent == "apos") out += '\'';
+            else if (ent.size() > 1 && ent[0] == '#') AppendUtf8(out, (DWORD)strtoul(ent.c_str() + (ent[1] == 'x' ? 2 : 1), nullptr, ent[1] == 'x' ? 16 : 10));
+            else { out += '&'; continue; }
+            i = semi;
+        }
+        return out;
+    }
+
+private:
+    bool IsSpecial() const {
+        return m_tag.compare(0, 3, "!--") == 0 || m_tag.compare(0, 8, "![CDATA[") == 0;
+    }
+    bool EndsSpecial() const {
+        size_t n = m_tag.size();
+        if (m_tag[0] == '!' && m_tag[1] == '-') return n >= 6 && m_tag.compare(n - 3, 3, "-->") == 0;
+        return n >= 11 && m_tag.compare(n - 3, 3, "]]>") == 0;
+    }
+
+    void FlushText() {
+        if (!m_text.empty() && onText) onText(Decode(m_text));
+        m_text.clear();
+    }
+
+    void EndTag() {
+        m_inTag = false;
+        if (m_tag.empty()) return;
+        if (m_tag.compare(0, 8, "![CDATA[") == 0) { if (onText) onText(m_tag.substr(8, m_tag.size() - 11)); return; }
+        if (m_tag[0] == '!' || m_tag[0] == '?') return;
+        bool closing = m_tag[0] == '/';
+        bool selfClose = !closing && m_tag.back() == '/';
+        size_t s = closing ? 1 : 0;
+        size_t e = m_tag.find_first_of(" \t\r\n/", s);
+        if (e == std::string::npos) e = m_tag.size();
+        std::string name = m_tag.substr(s, e - s);
+        size_t colon = name.find(':');
+        if (colon != std::string::npos) name.erase(0, colon + 1);
+        if (closing) { if (onEnd) onEnd(name); return; }
+        if (onStart) onStart(name, e < m_tag.size() ? m_tag.substr(e, m_tag.size() - e - (selfClose ? 1 : 0)) : "");
+        if (selfClose && onEnd) onEnd(name);
+    }
+
+    std::string m_text, m_tag;
+    bool        m_inTag = false;
+    char        m_quote = 0;
+};
+
+// ── Office Open XML ──
+static const size_t kDocEmitBytes = 8192;   // text handed to the sink in pieces of about this size
+
+struct OoxmlRel { std::string id, type, target; };
+
+// Relationships of a part, with targets resolved to archive paths
+static std::vector<OoxmlRel> ReadOoxmlRels(const ZipArchive& zip, const std::string& part) {
+    std::vector<OoxmlRel> rels;
+    size_t slash = part.rfind('/');
+    std::string dir = slash == std::string::npos ? "" : part.substr(0, slash + 1);
+    std::string xml;
+    if (!zip.ReadAll(dir + "_rels/" + part.substr(slash + 1) + ".rels", xml)) return rels;
+    XmlSax sax;
+    sax.onStart = [&](const std::string& name, const std::string& attrs) {
+        if (name != "Relationship") return;
+        std::string target = XmlSax::Attr(attrs, "Target");
+        std::string path = target[0] == '/' ? target.substr(1) : dir + target;
+        // Collapse "dir/../" segments
+        for (size_t up; (up = path.find("/../")) != std::string::npos;) {
+            size_t prev = up ? path.rfind('/', up - 1) : std::string::npos;
+            path.erase(prev == std::string::npos ? 0 : prev + 1, up + 4 - (prev == std::string::npos ? 0 : prev + 1));
+        }
+        rels.push_back({ XmlSax::Attr(attrs, "Id"), XmlSax::Attr(attrs, "Type"), path });
+    };
+    sax.Feed(xml.data(), xml.size());
+    return rels;
+}
+
+static std::string RelTarget(const std::vector<OoxmlRel>& rels, const std::string& id) {
+    for (const auto& r : rels) if (r.id == id) return r.target;
+    return "";
+}
+
+// Paragraph/run/table state shared by the Word and PowerPoint walkers
+struct OoxmlText {
+    std::string out, para, cell;
+    std::vector<std::string> row;
+    int  heading = 0, tableDepth = 0;
+    bool inText = false, inRun = false, listItem = false;
+
+    void EndParagraph() {
+        while (!para.empty() && (para.back() == ' ' || para.back() == '\t')) para.pop_back();
+        if (tableDepth > 0) { if (!para.empty()) cell += (cell.empty() ? "" : " ") + para; }
+        else if (!para.empty()) out += (heading ? std::string(heading, '#') + " " : listItem ? "- " : "") + para + "\n";
+        para.clear();
+        heading = 0;
+        listItem = false;
+    }
+    void EndRow() {
+        bool any = std::any_of(row.begin(), row.end(), [](const std::string& c) { return !c.empty(); });
+        if (any) {
+            out += "|";
+            for (const auto& c : row) out += " " + c + " |";
+            out += "\n";
+        }
+        row.clear();
+    }
+};
+
+static bool ExtractDocx(const ZipArchive& zip, const TextSink& sink, std::string& err) {
+    const ZipEntry* doc = zip.Find("word/document.xml");
+    if (!doc) { err = "word/document.xml missing"; return false; }
+    OoxmlText t;
+    int page = 1;
+    bool stop = false;
+    auto emit = [&](bool force) {
+        if (stop || t.out.empty() || (!force && t.out.size() < kDocEmitBytes)) return;
+        if (!sink(t.out)) stop = true;
+        t.out.clear();
+    };
+    auto pageBreak = [&] {
+        t.EndParagraph();
+        emit(true);
+        t.out += "\n[Page " + std::to_string(++page) + "]\n";
+    };
+    XmlSax sax;
+    sax.onStart = [&](const std::string& n, const std::string& a) {
+        if      (n == "t")      t.inText = true;
+        else if (n == "r")      t.inRun = true;
+        else if (n == "tab")    { if (t.inRun) t.para += '\t'; }   // w:tab also appears in paragraph tab stops
+        else if (n == "br")     { if (XmlSax::Attr(a, "type") == "page") pageBreak(); else if (t.inRun) t.para += '\n'; }
+        else if (n == "lastRenderedPageBreak") { if (t.tableDepth == 0) pageBreak(); }
+        else if (n == "numPr")  t.listItem = true;
+        else if (n == "tbl")    { t.EndParagraph(); t.tableDepth++; }
+        else if (n == "tc")     t.cell.clear();
+        else if (n == "pStyle") {
+            std::string v = XmlSax::Attr(a, "val");
+            if (v.compare(0, 7, "Heading") == 0 && v.size() > 7 && isdigit((unsigned char)v[7])) t.heading = (std::min)(v[7] - '0', 6);
+            else if (v == "Title") t.heading = 1;
+        }
+    };
+    sax.onEnd = [&](const std::string& n) {
+        if      (n == "t")   t.inText = false;
+        else if (n == "r")   t.inRun = false;
+        else if (n == "p")   { t.EndParagraph(); emit(false); }
+        else if (n == "tc")  t.row.push_back(t.cell);
+        else if (n == "tr")  { t.EndRow(); emit(false); }
+        else if (n == "tbl") { t.tableDepth = (std::max)(0, t.tableDepth - 1); if (!t.tableDepth) t.out += "\n"; }
+    };
+    sax.onText = [&](const std::string& s) { if (t.inText) t.para += s; };
+    t.out = "[Page 1]\n";
+    zip.Stream(*doc, [&](const char* p, size_t n) { sax.Feed(p, n); return !stop; });
+    t.EndParagraph();
+    emit(true);
+    return true;
+}
+
+// Column index from a cell reference ("AB12" -> 27)
+static int XlsxColumn(const std::string& ref) {
+    int col = 0;
+    for (char c : ref) { if (!isalpha((unsigned char)c)) break; col = col * 26 + (toupper((unsigned char)c) - 'A' + 1); }
+    return col - 1;
+}
+
+static std::string XlsxColumnName(int col) {
+    std::string s;
+    for (col++; col > 0; col = (col - 1) / 26) s.insert(s.begin(), (char)('A' + (col - 1) % 26));
+    return s;
+}
+
+static bool ExtractXlsx(const ZipArchive& zip, const TextSink& sink, std::string& err, int* units) {
+    // Shared strings, capped so a pathological workbook can't exhaust memory
+    std::vector<std::string> shared;
+    if (const ZipEntry* ss = zip.Find("xl/sharedStrings.xml")) {
+        std::string cur;
+        size_t bytes = 0;
+        bool inSi = false, inT = false, inPhonetic = false;
+        XmlSax sax;
+        sax.onStart = [&](const std::string& n, const std::string&) {
+            if (n == "si") { inSi = true; cur.clear(); }
+            else if (n == "t") inT = true;
+            else if (n == "rPh") inPhonetic = true;
+        };
+        sax.onEnd = [&](const std::string& n) {
+            if (n == "si") { inSi = false; bytes += cur.size(); shared.push_back(bytes < (32u << 20) ? cur : ""); }
+            else if (n == "t") inT = false;
+            else if (n == "rPh") inPhonetic = false;
+        };
+        sax.onText = [&](const std::string& s) { if (inSi && inT && !inPhonetic) cur += s; };
+        zip.Stream(*ss, [&](const char* p, size_t n) { sax.Feed(p, n); return true; });
+    }
+
+    std::vector<std::pair<std::string, std::string>> sheets;   // name, part
+    std::vector<OoxmlRel> rels = ReadOoxmlRels(zip, "xl/workbook.xml");
+    std::string wb;
+    if (!zip.ReadAll("xl/workbook.xml", wb)) { err = "xl/workbook.xml missing"; return false; }
+    XmlSax wsax;
+    wsax.onStart = [&](const std::string& n, const std::string& a) {
+        if (n == "sheet") sheets.push_back({ XmlSax::Attr(a, "name"), RelTarget(rels, XmlSax::Attr(a, "r:id")) });
+    };
+    wsax.Feed(wb.data(), wb.size());
+    if (units) *units = (int)sheets.size();
+
+    bool stop = false;
+    for (const auto& sh : sheets) {
+        const ZipEntry* e = zip.Find(sh.second);
+        if (!e || stop) continue;
+        std::string out = "\n[Sheet: " + sh.first + "]\n", line, value, type;
+        int col = -1, prevCol = -1;
+        bool inValue = false;
+        XmlSax sax;
+        sax.onStart = [&](const std::string& n, const std::string& a) {
+            if (n == "row") { line = "R" + XmlSax::Attr(a, "r") + ":"; prevCol = -1; }
+            else if (n == "c") { type = XmlSax::Attr(a, "t"); std::string r = XmlSax::Attr(a, "r"); col = r.empty() ? prevCol + 1 : XlsxColumn(r); value.clear(); }
+            else if (n == "v" || n == "t") inValue = true;
+        };
+        sax.onText = [&](const std::string& s) { if (inValue) value += s; };
+        sax.onEnd = [&](const std::string& n) {
+            if (n == "v" || n == "t") inValue = false;
+            else if (n == "c") {
+                if (value.empty()) return;
+                if (type == "s") { size_t i = (size_t)atoi(value.c_str()); value = i < shared.size() ? shared[i] : ""; }
+                else if (type == "b") value = value == "1" ? "TRUE" : "FALSE";
+                if (value.empty()) return;
+                for (auto& ch : value) if (ch == '\n' || ch == '\r' || ch == '\t') ch = ' ';
+                line += (col == prevCol + 1 ? " " : " " + XlsxColumnName(col) + "=") + value + " |";
+                prevCol = col;
+            } else if (n == "row") {
+                if (prevCol >= 0) out += line + "\n";
+                if (out.size() >= kDocEmitBytes) { if (!sink(out)) stop = true; out.clear(); }
+            }
+        };
+        zip.Stream(*e, [&](const char* p, size_t n) { sax.Feed(p, n); return !stop; });
+        if (!stop && !out.empty() && !sink(out)) stop = true;
+    }
+    return true;
+}
+
+// Text of one slide (or notes) part; titles become '#' headings and table rows '|' lines
+static std::string PptxPartText(const ZipArchive& zip, const ZipEntry& e, bool notes) {
+    OoxmlText t;
+    bool title = false, skipShape = false;
+    XmlSax sax;
+    sax.onStart = [&](const std::string& n, const std::string& a) {
+        if      (n == "sp" || n == "graphicFrame") { title = false; skipShape = false; }
+        else if (n == "ph")  {
+            std::string type = XmlSax::Attr(a, "type");
+            title = type == "title" || type == "ctrTitle";
+            skipShape = notes ? type != "body" : (type == "sldNum" || type == "dt" || type == "ftr");
+        }
+        else if (n == "t")   t.inText = true;
+        else if (n == "br")  t.para += '\n';
+        else if (n == "tbl") { t.EndParagraph(); t.tableDepth++; }
+        else if (n == "tc")  t.cell.clear();
+    };
+    sax.onEnd = [&](const std::string& n) {
+        if      (n == "t")   t.inText = false;
+        else if (n == "p")   { if (skipShape) t.para.clear(); else { t.heading = title ? 1 : 0; t.EndParagraph(); } }
+        else if (n == "tc")  t.row.push_back(t.cell);
+        else if (n == "tr")  t.EndRow();
+        else if (n == "tbl") t.tableDepth = (std::max)(0, t.tableDepth - 1);
+    };
+    sax.onText = [&](const std::string& s) { if (t.inText) t.para += s; };
+    zip.Stream(e, [&](const char* p, size_t n) { sax.Feed(p, n); return true; });
+    return t.out;
+}
+
+static bool ExtractPptx(const ZipArchive& zip, const TextSink& sink, std::string& err, int* units) {
+    std::vector<OoxmlRel> rels = ReadOoxmlRels(zip, "ppt/presentation.xml");
+    std::string pres;
+    if (!zip.ReadAll("ppt/presentation.xml", pres)) { err = "ppt/presentation.xml missing"; return false; }
+    std::vector<std::string> slides;
+    XmlSax psax;
+    psax.onStart = [&](const std::string& n, const std::string& a) {
+        if (n == "sldId") slides.push_back(RelTarget(rels, XmlSax::Attr(a, "r:id")));
+    };
+    psax.Feed(pres.data(), pres.size());
+    if (units) *units = (int)slides.size();
+
+    for (size_t i = 0; i < slides.size(); i++) {
+        const ZipEntry* e = zip.Find(slides[i]);
+        if (!e) continue;
+        std::string text = "\n[Slide " + std::to_string(i + 1) + "]\n" + PptxPartText(zip, *e, false);
+        for (const auto& r : ReadOoxmlRels(zip, slides[i])) {
+            if (r.type.size() < 11 || r.type.compare(r.type.size() - 11, 11, "/notesSlide") != 0) continue;
+            if (const ZipEntry* ne = zip.Find(r.target)) {
+                std::string notes = PptxPartText(zip, *ne, true);
+                if (!notes.empty()) text += "[Notes]\n" + notes;
+            }
+        }
+        if (!sink(text)) break;
+    }
+    return true;
+}
+
+// ── PDF ──
+// Objects are located by scanning for "n g obj" (robust to damaged or missing xref tables)
+// plus the contents of object streams. Pages come from the catalog's page tree; their content
+// streams run through a small interpreter that tracks text-showing and positioning operators
+// and maps glyph codes through each font's ToUnicode CMap when there is one.
+struct PdfObj {
+    enum Type : BYTE { Null, Bool, Num, Name, Str, Array, Dict, Ref, Op };
+    Type                                         type = Null;
+    double                                       num  = 0;   // Num, Bool, Ref object number
+    std::string                                  str;        // Name (without '/'), Str bytes, Op keyword
+    std::vector<PdfObj>                          items;
+    std::vector<std::pair<std::string, PdfObj>>  dict;
+    const BYTE*                                  stream = nullptr;   // stream data of a stream object
+    size_t                                       streamLen = 0;
+
+    const PdfObj* Get(const char* key) const {
+        for (const auto& kv : dict) if (kv.first == key) return &kv.second;
+        return nullptr;
+    }
+    bool Is(Type t, const char* s) const { return type == t && str == s; }
+};
+
+static inline bool PdfSpace(BYTE c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == 0; }
+static inline bool PdfDelim(BYTE c) { return c == '(' || c == ')' || c == '<' || c == '>' || c == '[' || c == ']' || c == '{' || c == '}' || c == '/' || c == '%'; }
+
+class PdfLexer {
+public:
+    PdfLexer(const BYTE* p, const BYTE* end) : m_p(p), m_end(end) {}
+
+    const BYTE* Pos() const { return m_p; }
+    void        Seek(const BYTE* p) { m_p = p; }
+
+    // Next object or operator; false at the end of input
+    bool Next(PdfObj& o, int depth = 0) {
+        o = PdfObj();
+        SkipSpace();
+        if (m_p >= m_end || depth > 64) return false;
+        BYTE c = *m_p;
+        if (c == '/') {
+            m_p++;
+            o.type = PdfObj::Name;
+            while (m_p < m_end && !PdfSpace(*m_p) && !PdfDelim(*m_p)) {
+                if (*m_p == '#' && m_p + 2 < m_end && isxdigit(m_p[1]) && isxdigit(m_p[2])) {
+                    o.str += (char)strtol(std::string((const char*)m_p + 1, 2).c_str(), nullptr, 16);
+                    m_p += 3;
+                } else {
+                    o.str += (char)*m_p++;
+                }
+            }
+            return true;
+        }
+        if (c == '(') { o.type = PdfObj::Str; LiteralString(o.str); return true; }
+        if (c == '<' && m_p + 1 < m_end && m_p[1] == '<') {
+            m_p += 2;
+            o.type = PdfObj::Dict;
+            for (;;) {
+                SkipSpace();
+                if (m_p >= m_end) return true;
+                if (*m_p == '>' && m_p + 1 < m_end && m_p[1] == '>') { m_p += 2; return true; }
+                PdfObj key, val;
+                if (!Next(key, depth + 1) || key.Is(PdfObj::Op, "endobj")) return true;
+                if (key.type != PdfObj::Name) continue;
+                if (!Next(val, depth + 1)) return true;
+                if (val.type == PdfObj::Op && (val.str == ">>" || val.str == "endobj")) return true;
+                o.dict.emplace_back(std::move(key.str), std::move(val));
+            }
+        }
+        if (c == '<') {
+            m_p++;
+            o.type = PdfObj::Str;
+            int hi = -1;
+            while (m_p < m_end && *m_p != '>') {
+                BYTE h = *m_p++;
+                if (!isxdigit(h)) continue;
+                int v = isdigit(h) ? h - '0' : (tolower(h) - 'a' + 10);
+                if (hi < 0) hi = v; else { o.str += (char)(hi << 4 | v); hi = -1; }
+            }
+            if (hi >= 0) o.str += (char)(hi << 4);
+            if (m_p < m_end) m_p++;
+            return true;
+        }
+        if (c == '[') {
+            m_p++;
+            o.type = PdfObj::Array;
+            for (;;) {
+                SkipSpace();
+                if (m_p >= m_end) return true;
+                if (*m_p == ']') { m_p++; return true; }
+                PdfObj item;
+                if (!Next(item, depth + 1)) return true;
+                if (item.type == PdfObj::Op && item.str == "endobj") return true;
+                o.items.push_back(std::move(item));
+            }
+        }
+        if (isdigit(c) || c == '-' || c == '+' || c == '.') {
+            const BYTE* s = m_p;
+            while (m_p < m_end && (isdigit(*m_p) || *m_p == '-' || *m_p == '+' || *m_p == '.')) m_p++;
+            o.type = PdfObj::Num;
+            o.num = atof(std::string((const char*)s, m_p - s).c_str());
+            // "n g R" is a reference
+            bool integer = std::find(s, m_p, (BYTE)'.') == m_p;
+            if (integer && m_allowRefs) {
+                const BYTE* save = m_p;
+                SkipSpace();
+                const BYTE* g = m_p;
+                while (m_p < m_end && isdigit(*m_p)) m_p++;
+                if (m_p > g && m_p < m_end && PdfSpace(*m_p)) {
+                    SkipSpace();
+                    if (m_p < m_end && *m_p == 'R' && (m_p + 1 >= m_end || PdfSpace(m_p[1]) || PdfDelim(m_p[1]))) {
+                        m_p++;
+                        o.type = PdfObj::Ref;
+                        return true;
+                    }
+                }
+                m_p = save;
+            }
+            return true;
+        }
+        // Keyword / operator (also stray delimiters, so the caller always makes progress)
+        const BYTE* s = m_p;
+        if (PdfDelim(c)) m_p += (c == '>' && m_p + 1 < m_end && m_p[1] == '>') ? 2 : 1;
+        else while (m_p < m_end && !PdfSpace(*m_p) && !PdfDelim(*m_p)) m_p++;
+        o.str.assign((const char*)s, m_p - s);
+        if      (o.str == "true")  { o.type = PdfObj::Bool; o.num = 1; }
+        else if (o.str == "false") { o.type = PdfObj::Bool; }
+        else if (o.str == "null")  { o.type = PdfObj::Null; }
+        else                         o.type = PdfObj::Op;
+        return true;
+    }
+
+    // Content streams have no references; "0 0 1 RG" must not look like one
+    void AllowRefs(bool on) { m_allowRefs = on; }
+
+    // After the BI operator: skips inline image parameters and data up to EI
+    void SkipInlineImage() {
+        for (; m_p + 2 < m_end; m_p++) {
+            if (m_p[0] == 'I' && m_p[1] == 'D' && PdfSpace(m_p[2])) { m_p += 3; break; }
+        }
+        for (; m_p + 2 <= m_end; m_p++) {
+            if (m_p[0] == 'E' && m_p[1] == 'I' && PdfSpace(m_p[-1]) && (m_p + 2 == m_end || PdfSpace(m_p[2]) || PdfDelim(m_p[2]))) {
+                m_p += 2;
+                return;
+            }
+        }
+    }
+
+    void SkipSpace() {
+        while (m_p < m_end) {
+            if (PdfSpace(*m_p)) m_p++;
+            else if (*m_p == '%') { while (m_p < m_end && *m_p != '\n' && *m_p != '\r') m_p++; }
+            else break;
+        }
+    }
+
+private:
+    void LiteralString(std::string& out) {
+        m_p++;
+        int nest = 1;
+        while (m_p < m_end) {
+            BYTE c = *m_p++;
+            if (c == '(') nest++;
+            else if (c == ')' && --nest == 0) return;
+            else if (c == '\\' && m_p < m_end) {
+                BYTE e = *m_p++;
+                switch (e) {
+                case 'n': out += '\n'; continue;
+                case 'r': out += '\r'; continue;
+                case 't': out += '\t'; continue;
+                case 'b': out += '\b'; continue;
+                case 'f': out += '\f'; continue;
+                case '\r': if (m_p < m_end && *m_p == '\n') m_p++; continue;
+                case '\n': continue;
+                }
+                if (e >= '0' && e <= '7') {
+                    int v = e - '0';
+                    for (int k = 0; k < 2 && m_p < m_end && *m_p >= '0' && *m_p <= '7'; k++) v = v * 8 + (*m_p++ - '0');
+                    out += (char)v;
+                    continue;
+                }
+                out += (char)e;
+                continue;
+            }
+            out += (char)c;
+        }
+    }
+
+    const BYTE* m_p;
+    const BYTE* m_end;
+    bool        m_allowRefs = true;
+};
+
+// Windows-1252 for bytes 0x80-0x9F of simple fonts without a ToUnicode map
+static const WORD kCp1252High[32] = {
+    0x20AC,0x0081,0x201A,0x0192,0x201E,0x2026,0x2020,0x2021,0x02C6,0x2030,0x0160,0x2039,0x0152,0x008D,0x017D,0x008F,
+    0x0090,0x2018,0x2019,0x201C,0x201D,0x2022,0x2013,0x2014,0x02DC,0x2122,0x0161,0x203A,0x0153,0x009D,0x017E,0x0178
+};
+
+struct PdfFont {
+    std::unordered_map<DWORD, std::string> toUnicode;
+    int                                    codeBytes = 1;
+};
+
+class PdfDocument {
+public:
+    bool Open(const BYTE* p, size_t n, std::string& err) {
+        m_p = p; m_n = n;
+        if (n < 8 || memcmp(p, "%PDF", 4) != 0) { err = "not a PDF file"; return false; }
+        ScanObjects();
+        if (m_encrypted) { err = "the PDF is encrypted"; return false; }
+        if (const PdfObj* root = m_root ? Load(m_root) : nullptr) {
+            std::vector<int> seen;
+            const PdfObj* pages = Resolve(root->Get("Pages"));
+            if (pages && pages->type == PdfObj::Dict) CollectPages(*pages, nullptr, seen, 0);
+        }
+        if (m_pages.empty()) {
+            // No usable catalog: fall back to every page object in file order
+            for (int num : m_pageObjects) if (const PdfObj* pg = Load(num)) m_pages.push_back({ pg, Resolve(pg->Get("Resources")) });
+        }
+        if (m_pages.empty()) { err = "no pages found"; return false; }
+        return true;
+    }
+
+    int PageCount() const { return (int)m_pages.size(); }
+
+    std::string PageText(int i) {
+        std::string out;
+        const Page& pg = m_pages[i];
+        const PdfObj* contents = Resolve(pg.page->Get("Contents"));
+        std::string data;
+        if (contents && contents->type == PdfObj::Array) {
+            for (const auto& item : contents->items)
+                if (const PdfObj* s = Resolve(&item)) { DecodeStream(*s, data); data += '\n'; }
+        } else if (contents) {
+            DecodeStream(*contents, data);
+        }
+        RunContent(data, pg.resources, out, 0);
+        // Collapse runs of blank lines
+        std::string clean;
+        for (size_t k = 0; k < out.size(); k++) {
+            if (out[k] == '\n' && clean.size() >= 2 && clean[clean.size() - 1] == '\n' && clean[clean.size() - 2] == '\n') continue;
+            clean += out[k];
+        }
+        while (!clean.empty() && (clean.back() == '\n' || clean.back() == ' ')) clean.pop_back();
+        return clean;
+    }
+
+private:
+    struct Loc  { size_t offset = 0; int stream = -1, index = 0; };
+    struct Page { const PdfObj* page; const PdfObj* resources; };
+
+    // Registers every "n g obj"; stream bodies with a direct /Length are skipped so their
+    // bytes can't produce false matches
+    void ScanObjects() {
+        std::vector<int> objStreams;
+        size_t i = 0;
+        while (i + 3 <= m_n) {
+            const BYTE* hit = (const BYTE*)memchr(m_p + i, 'o', m_n - i);
+            if (!hit) break;
+            i = hit - m_p + 1;
+            if (i + 2 > m_n || hit[1] != 'b' || hit[2] != 'j' || (i + 2 < m_n && !PdfSpace(hit[3]) && !PdfDelim(hit[3]))) continue;
+            // Walk back over "num gen "
+            size_t k = hit - m_p;
+            auto backDigits = [&](size_t& pos, DWORD& value) {
+                while (pos > 0 && PdfSpace(m_p[pos - 1])) pos--;
+                size_t e = pos;
+                while (pos > 0 && isdigit(m_p[pos - 1])) pos--;
+                if (pos == e || e - pos > 10) return false;
+                value = (DWORD)strtoul(std::string((const char*)m_p + pos, e - pos).c_str(), nullptr, 10);
+                return true;
+            };
+            DWORD gen = 0, num = 0;
+            size_t pos = k;
+            if (!backDigits(pos, gen) || !backDigits(pos, num) || (pos > 0 && !PdfSpace(m_p[pos - 1]) && !PdfDelim(m_p[pos - 1]))) continue;
+
+            size_t body = k + 3;
+            m_locs[(int)num] = { body, -1, 0 };
+            PdfLexer lx(m_p + body, m_p + m_n);
+            PdfObj o;
+            if (!lx.Next(o)) continue;
+            if (o.type == PdfObj::Dict) {
+                const PdfObj* type = o.Get("Type");
+                if (type && type->Is(PdfObj::Name, "ObjStm")) objStreams.push_back((int)num);
+                else if (type && type->Is(PdfObj::Name, "Catalog")) m_root = (int)num;
+                else if (type && type->Is(PdfObj::Name, "Page")) m_pageObjects.push_back((int)num);
+                else if (type && type->Is(PdfObj::Name, "XRef")) TrailerInfo(o);
+                PdfObj kw;
+                const PdfObj* len = o.Get("Length");
+                if (lx.Next(kw) && kw.Is(PdfObj::Op, "stream") && len && len->type == PdfObj::Num) {
+                    size_t data = StreamStart(lx.Pos());
+                    if (data + (size_t)len->num <= m_n) { i = data + (size_t)len->num; continue; }
+                }
+            }
+            i = lx.Pos() - m_p;
+        }
+        // Classic trailers
+        for (size_t t = 0; t + 7 < m_n;) {
+            const BYTE* hit = (const BYTE*)memchr(m_p + t, 't', m_n - t);
+            if (!hit) break;
+            t = hit - m_p + 1;
+            if ((size_t)(m_p + m_n - hit) < 7 || memcmp(hit, "trailer", 7) != 0) continue;
+            PdfLexer lx(hit + 7, m_p + m_n);
+            PdfObj o;
+            if (lx.Next(o) && o.type == PdfObj::Dict) TrailerInfo(o);
+        }
+        // Objects packed in object streams (only where no direct definition exists)
+        for (int s : objStreams) {
+            const PdfObj* stm = Load(s);
+            if (!stm) continue;
+            std::string& data = m_objStmData[s];
+            if (!DecodeStream(*stm, data)) continue;
+            const PdfObj* nObj = stm->Get("N");
+            int count = nObj ? (int)nObj->num : 0;
+            PdfLexer lx((const BYTE*)data.data(), (const BYTE*)data.data() + data.size());
+            lx.AllowRefs(false);
+            for (int k = 0; k < count; k++) {
+                PdfObj num, off;
+                if (!lx.Next(num) || !lx.Next(off)) break;
+                int id = (int)num.num;
+                if (!m_locs.count(id)) m_locs[id] = { (size_t)off.num, s, k };
+            }
+        }
+        if (!m_root) {
+            // The catalog may live in an object stream
+            for (const auto& kv : m_locs) {
+                if (kv.second.stream < 0) continue;
+                const PdfObj* o = Load(kv.first);
+                const PdfObj* type = o ? o->Get("Type") : nullptr;
+                if (type && type->Is(PdfObj::Name, "Catalog")) { m_root = kv.first; break; }
+            }
+        }
+    }
+
+    void TrailerInfo(const PdfObj& t) {
+        if (t.Get("Encrypt")) m_encrypted = true;
+        const PdfObj* root = t.Get("Root");
+        if (root && root->type == PdfObj::Ref) m_root = (int)root->num;
+    }
+
+    size_t StreamStart(const BYTE* afterKeyword) const {
+        size_t d = afterKeyword - m_p;
+        if (d < m_n && m_p[d] == '\r') d++;
+        if (d < m_n && m_p[d] == '\n') d++;
+        return d;
+    }
+
+    const PdfObj* Load(int num) {
+        auto cached = m_cache.find(num);
+        if (cached != m_cache.end()) return &cached->second;
+        auto it = m_locs.find(num);
+        if (it == m_locs.end() || m_loading.count(num)) return nullptr;
+        m_loading.insert(num);
+        PdfObj o;
+        const Loc loc = it->second;
+        if (loc.stream < 0) {
+            PdfLexer lx(m_p + loc.offset, m_p + m_n);
+            lx.Next(o);
+            PdfObj kw;
+            if (o.type == PdfObj::Dict && lx.Next(kw) && kw.Is(PdfObj::Op, "stream")) {
+                size_t data = StreamStart(lx.Pos());
+                const PdfObj* len = Resolve(o.Get("Length"));
+                size_t n = len && len->type == PdfObj::Num && len->num >= 0 ? (size_t)len->num : 0;
+                if (!n || data + n > m_n || !EndstreamNear(data + n)) {
+                    // Missing or wrong /Length: search for the keyword instead
+                    const char* key = "endstream";
+                    const BYTE* e = std::search(m_p + data, m_p + m_n, key, key + 9);
+                    n = e - (m_p + data);
+                    while (n && (m_p[data + n - 1] == '\n' || m_p[data + n - 1] == '\r')) n--;
+                }
+                o.stream = m_p + data;
+                o.streamLen = n;
+            }
+        } else {
+            const PdfObj* stm = Load(loc.stream);
+            auto sd = m_objStmData.find(loc.stream);
+            if (stm && sd != m_objStmData.end()) {
+                const PdfObj* first = stm->Get("First");
+                size_t at = (first ? (size_t)first->num : 0) + loc.offset;
+                if (at < sd->second.size()) {
+                    PdfLexer lx((const BYTE*)sd->second.data() + at, (const BYTE*)sd->second.data() + sd->second.size());
+                    lx.Next(o);
+                }
+            }
+        }
+        m_loading.erase(num);
+        return &(m_cache[num] = std::move(o));
+    }
+
+    bool EndstreamNear(size_t pos) const {
+        for (size_t k = pos; k < m_n && k < pos + 32; k++) if (m_p[k] == 'e') return k + 9 <= m_n && memcmp(m_p + k, "endstream", 9) == 0;
+        return false;
+    }
+
+    const PdfObj* Resolve(const PdfObj* o) {
+        for (int hops = 0; o && o->type == PdfObj::Ref && hops < 16; hops++) o = Load((int)o->num);
+        return o;
+    }
+
+    void CollectPages(const PdfObj& node, const PdfObj* inherited, std::vector<int>& seen, int depth) {
+        if (depth > 64 || m_pages.size() > 100000) return;
+        const PdfObj* res = Resolve(node.Get("Resources"));
+        if (!res) res = inherited;
+        const PdfObj* kids = Resolve(node.Get("Kids"));
+        if (!kids || kids->type != PdfObj::Array) {
+            m_pages.push_back({ &node, res });
+            return;
+        }
+        for (const auto& k : kids->items) {
+            if (k.type == PdfObj::Ref) {
+                if (std::find(seen.begin(), seen.end(), (int)k.num) != seen.end()) continue;
+                seen.push_back((int)k.num);
+            }
+            if (const PdfObj* child = Resolve(&k)) if (child->type == PdfObj::Dict) CollectPages(*child, res, seen, depth + 1);
+        }
+    }
+
+    // Applies the stream's filters. Image codecs and LZW are not decoded (no text in them).
+    bool DecodeStream(const PdfObj& s, std::string& out) {
+        if (!s.stream) return false;
+        std::string cur((const char*)s.stream, s.streamLen);
+        const PdfObj* filter = Resolve(s.Get("Filter"));
+        const PdfObj* parms  = Resolve(s.Get("DecodeParms"));
+        std::vector<const PdfObj*> filters, params;
+        if (filter && filter->type == PdfObj::Name) { filters.push_back(filter); params.push_back(parms); }
+        if (filter && filter->type == PdfObj::Array)
+            for (size_t i = 0; i < filter->items.size(); i++) {
+                filters.push_back(&filter->items[i]);
+                params.push_back(parms && parms->type == PdfObj::Array && i < parms->items.size() ? Resolve(&parms->items[i]) : nullptr);
+            }
+        for (size_t i = 0; i < filters.size(); i++) {
+            const std::string& f = filters[i]->str;
+            std::string next;
+            if (f == "FlateDecode" || f == "Fl") {
+                const BYTE* b = (const BYTE*)cur.data();
+                bool zlib = cur.size() >= 2 && (b[0] & 0x0F) == 8 && ((b[0] << 8) | b[1]) % 31 == 0;
+                Inflater::Run(b, cur.size(), zlib, [&](const char* p, size_t n) { next.append(p, n); return next.size() < (256u << 20); });
+                if (next.empty()) return false;
+                if (params[i] && params[i]->type == PdfObj::Dict) UndoPredictor(*params[i], next);
+            } else if (f == "ASCIIHexDecode" || f == "AHx") {
+                int hi = -1;
+                for (char c : cur) {
+                    if (c == '>') break;
+                    if (!isxdigit((unsigned char)c)) continue;
+                    int v = isdigit((unsigned char)c) ? c - '0' : tolower(c) - 'a' + 10;
+                    if (hi < 0) hi = v; else { next += (char)(hi << 4 | v); hi = -1; }
+                }
+            } else if (f == "ASCII85Decode" || f == "A85") {
+                DWORD v = 0;
+                int cnt = 0;
+                for (size_t k = 0; k < cur.size(); k++) {
+                    char c = cur[k];
+                    if (c == '~') break;
+                    if (c == 'z' && cnt == 0) { next.append(4, '\0'); continue; }
+                    if (c < '!' || c > 'u') continue;
+                    v = v * 85 + (c - '!');
+                    if (++cnt == 5) { for (int b = 3; b >= 0; b--) next += (char)(v >> (b * 8)); v = 0; cnt = 0; }
+                }
+                if (cnt > 1) {
+                    for (int k = cnt; k < 5; k++) v = v * 85 + 84;
+                    for (int b = 3; b > 3 - (cnt - 1); b--) next += (char)(v >> (b * 8));
+                }
+            } else {
+                return false;
+            }
+            cur.swap(next);
+        }
+        out += cur;
+        return true;
+    }
+
+    // PNG predictors (10-15) as used by object and xref streams
+    static void UndoPredictor(const PdfObj& parms, std::string& data) {
+        const PdfObj* pred = parms.Get("Predictor");
+        if (!pred || pred->num < 10) return;
+        const PdfObj* colsObj = parms.Get("Columns");
+        const PdfObj* colorsObj = parms.Get("Colors");
+        const PdfObj* bpcObj = parms.Get("BitsPerComponent");
+        int cols = colsObj ? (int)colsObj->num : 1, colors = colorsObj ? (int)colorsObj->num : 1, bpc = bpcObj ? (int)bpcObj->num : 8;
+        size_t bpp = (std::max)(1, colors * bpc / 8), row = (size_t)(cols * colors * bpc + 7) / 8;
+        if (!row) return;
+        std::string out;
+        std::vector<BYTE> prev(row, 0), cur(row);
+        for (size_t pos = 0; pos + row + 1 <= data.size(); pos += row + 1) {
+            BYTE type = (BYTE)data[pos];
+            for (size_t k = 0; k < row; k++) {
+                BYTE x = (BYTE)data[pos + 1 + k], a = k >= bpp ? cur[k - bpp] : 0, b = prev[k], c = k >= bpp ? prev[k - bpp] : 0;
+                switch (type) {
+                case 1: x += a; break;
+                case 2: x += b; break;
+                case 3: x += (BYTE)((a + b) / 2); break;
+                case 4: { int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c); x += (pa <= pb && pa <= pc) ? a : pb <= pc ? b : c; break; }
+                }
+                cur[k] = x;
+            }
+            out.append((const char*)cur.data(), row);
+            prev = cur;
+        }
+        data.swap(out);
+    }
+
+    const PdfFont* Font(const PdfObj* resources, const std::string& name) {
+        const PdfObj* fonts = resources ? Resolve(resources->Get("Font")) : nullptr;
+        const PdfObj* ref = fonts ? fonts->Get(name.c_str()) : nullptr;
+        if (!ref) return nullptr;
+        const PdfObj* font = Resolve(ref);
+        if (!font) return nullptr;
+        auto it = m_fonts.find(font);
+        if (it != m_fonts.end()) return &it->second;
+        PdfFont& f = m_fonts[font];
+        const PdfObj* sub = font->Get("Subtype");
+        if (sub && sub->Is(PdfObj::Name, "Type0")) f.codeBytes = 2;
+        const PdfObj* tu = Resolve(font->Get("ToUnicode"));
+        std::string cmap;
+        if (tu && DecodeStream(*tu, cmap)) ParseToUnicode(cmap, f);
+        return &f;
+    }
+
+    static void ParseToUnicode(const std::string& cmap, PdfFont& f) {
+        PdfLexer lx((const BYTE*)cmap.data(), (const BYTE*)cmap.data() + cmap.size());
+        lx.AllowRefs(false);
+        auto code = [](const std::string& s) { DWORD v = 0; for (unsigned char c : s) v = v << 8 | c; return v; };
+        auto utf16 = [](const std::string& s) {
+            std::string out;
+            for (size_t i = 0; i + 1 < s.size(); i += 2) {
+                DWORD u = (BYTE)s[i] << 8 | (BYTE)s[i + 1];
+                if (u >= 0xD800 && u < 0xDC00 && i + 3 < s.size()) {
+                    DWORD lo = (BYTE)s[i + 2] << 8 | (BYTE)s[i + 3];
+                    u = 0x10000 + ((u - 0xD800) << 10) + (lo - 0xDC00);
+                    i += 2;
+                }
+                if (u) AppendUtf8(out, u);
+            }
+            return out;
+        };
+        PdfObj o;
+        while (lx.Next(o)) {
+            if (o.Is(PdfObj::Op, "begincodespacerange")) {
+                PdfObj lo;
+                if (lx.Next(lo) && lo.type == PdfObj::Str && !lo.str.empty()) f.codeBytes = (int)(std::min)(lo.str.size(), (size_t)4);
+            } else if (o.Is(PdfObj::Op, "beginbfchar")) {
+                PdfObj src, dst;
+                while (lx.Next(src) && src.type == PdfObj::Str && lx.Next(dst))
+                    if (dst.type == PdfObj::Str) f.toUnicode[code(src.str)] = utf16(dst.str);
+            } else if (o.Is(PdfObj::Op, "beginbfrange")) {
+                PdfObj lo, hi, dst;
+                while (lx.Next(lo) && lo.type == PdfObj::Str && lx.Next(hi) && lx.Next(dst)) {
+                    DWORD a = code(lo.str), b = code(hi.str);
+                    if (b < a || b - a > 65535) continue;
+                    for (DWORD c = a; c <= b; c++) {
+                        if (dst.type == PdfObj::Array) {
+                            if (c - a < dst.items.size()) f.toUnicode[c] = utf16(dst.items[c - a].str);
+                        } else if (dst.type == PdfObj::Str && !dst.str.empty()) {
+                            std::string d = dst.str;
+                            d.back() = (char)((BYTE)d.back() + (c - a));
+                            f.toUnicode[c] = utf16(d);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    static void ShowString(const std::string& s, const PdfFont* f, std::string& out) {
+        if (f && !f->toUnicode.empty()) {
+            for (size_t i = 0; i + f->codeBytes <= s.size(); i += f->codeBytes) {
+                DWORD c = 0;
+                for (int k = 0; k < f->codeBytes; k++) c = c << 8 | (BYTE)s[i + k];
+                auto it = f->toUnicode.find(c);
+                if (it != f->toUnicode.end()) out += it->second;
+                else if (f->codeBytes == 1) AppendUtf8(out, c >= 0x80 && c < 0xA0 ? kCp1252High[c - 0x80] : c);
+            }
+            return;
+        }
+        if (f && f->codeBytes == 2) return;   // CID font without a map: glyph ids, not text
+        for (unsigned char c : s) {
+            if (c < 0x20 && c != '\t') continue;
+            AppendUtf8(out, c >= 0x80 && c < 0xA0 ? kCp1252High[c - 0x80] : c);
+        }
+    }
+
+    void RunContent(const std::string& data, const PdfObj* resources, std::string& out, int depth) {
+        PdfLexer lx((const BYTE*)data.data(), (const BYTE*)data.data() + data.size());
+        lx.AllowRefs(false);
+        std::vector<PdfObj> args;
+        const PdfFont* font = nullptr;
+        double lineY = 0, lastX = 0;
+        bool haveY = false;
+        auto newline = [&] { if (!out.empty() && out.back() != '\n') out += '\n'; };
+        auto space   = [&] { if (!out.empty() && out.back() != ' ' && out.back() != '\n') out += ' '; };
+        auto num = [&](size_t i) { return i < args.size() && args[i].type == PdfObj::Num ? args[i].num : 0.0; };
+        PdfObj o;
+        while (lx.Next(o)) {
+            if (o.type != PdfObj::Op) {
+                if (args.size() < 64) args.push_back(std::move(o));
+                continue;
+            }
+            const std::string& op = o.str;
+            if (op == "Tj" && !args.empty()) ShowString(args.back().str, font, out);
+            else if (op == "TJ" && !args.empty()) {
+                for (const auto& it : args.back().items) {
+                    if (it.type == PdfObj::Str) ShowString(it.str, font, out);
+                    else if (it.type == PdfObj::Num && it.num < -180) space();
+                }
+            }
+            else if (op == "'" && !args.empty()) { newline(); ShowString(args.back().str, font, out); }
+            else if (op == "\"" && !args.empty()) { newline(); ShowString(args.back().str, font, out); }
+            else if (op == "Td" || op == "TD") {
+                double tx = num(0), ty = num(1);
+                if (fabs(ty) > 0.5) newline(); else if (tx > 1) space();
+                lastX = tx;
+            }
+            else if (op == "T*") newline();
+            else if (op == "Tm") {
+                double y = num(5), x = num(4);
+                if (haveY && fabs(y - lineY) > 0.5) newline();
+                else if (haveY && x > lastX + 1) space();
+                lineY = y; lastX = x; haveY = true;
+            }
+            else if (op == "Tf" && !args.empty() && args[0].type == PdfObj::Name) font = Font(resources, args[0].str);
+            else if (op == "BT") { if (!out.empty() && out.back() != '\n') space(); }
+            else if (op == "BI") lx.SkipInlineImage();
+            else if (op == "Do" && !args.empty() && depth < 4) {
+                // Form XObjects carry text of their own
+                const PdfObj* xobjs = resources ? Resolve(resources->Get("XObject")) : nullptr;
+                const PdfObj* xo = xobjs ? Resolve(xobjs->Get(args[0].str.c_str())) : nullptr;
+                const PdfObj* st = xo ? xo->Get("Subtype") : nullptr;
+                if (st && st->Is(PdfObj::Name, "Form")) {
+                    std::string form;
+                    if (DecodeStream(*xo, form)) {
+                        const PdfObj* res = Resolve(xo->Get("Resources"));
+                        RunContent(form, res ? res : resources, out, depth + 1);
+                        newline();
+                    }
+                }
+            }
+            args.clear();
+        }
+    }
+
+    const BYTE*                                   m_p = nullptr;
+    size_t                                        m_n = 0;
+    int                                           m_root = 0;
+    bool                                          m_encrypted = false;
+    std::unordered_map<int, Loc>                  m_locs;
+    std::unordered_map<int, PdfObj>               m_cache;       // node-based: pointers stay valid
+    std::unordered_set<int>                       m_loading;     // guards reference cycles
+    std::unordered_map<int, std::string>          m_objStmData;
+    std::unordered_map<const PdfObj*, PdfFont>    m_fonts;
+    std::vector<int>                              m_pageObjects;
+    std::vector<Page>                             m_pages;
+};
+
+static bool ExtractPdf(const BYTE* p, size_t n, const TextSink& sink, std::string& err, int* units) {
+    PdfDocument doc;
+    if (!doc.Open(p, n, err)) return false;
+    if (units) *units = doc.PageCount();
+    size_t chars = 0;
+    for (int i = 0; i < doc.PageCount(); i++) {
+        std::string text = doc.PageText(i);
+        chars += text.size();
+        if (!sink("\n[Page " + std::to_string(i + 1) + "]\n" + text + "\n")) return true;
+    }
+    if (chars == 0) { err = "no extractable text (scanned pages or image-only PDF)"; return false; }
+    return true;
+}
+
+// Streams the text of a PDF or Office file through `sink`, page by page. `units` receives
+// the page/sheet/slide count as soon as it is known (0 for Word, which has no fixed pages).
+static bool ExtractDocumentText(const std::wstring& path, const std::string& ext, const TextSink& sink, std::string& err, int* units = nullptr) {
+    if (units) *units = 0;
+    MappedFile mf(path);
+    if (!mf.IsOpen()) { err = "cannot open file"; return false; }
+    const BYTE* p = mf.Data();
+    size_t n = (size_t)mf.Size();
+    if (ext == "pdf") return ExtractPdf(p, n, sink, err, units);
+
+    ZipArchive zip;
+    if (!zip.Open(p, n)) { err = "not a valid Office (ZIP) file"; return false; }
+    if (ext == "docx") return ExtractDocx(zip, sink, err);
+    if (ext == "xlsx") return ExtractXlsx(zip, sink, err, units);
+    if (ext == "pptx") return ExtractPptx(zip, sink, err, units);
+    err = "unsupported document type";
+    return false;
+}
+
+// Text up to kInlineTextLimit goes into the prompt verbatim; larger files are map-reduced
+// (see LARGE TEXT MAP-REDUCE), reading at most kMaxCondenseBytes of them
+static const size_t kInlineTextLimit  = 12000;
+static const size_t kMaxCondenseBytes = 2 * 1024 * 1024;
+
+static const std::vector<std::string> kTextExts = {
+    "txt","cpp","h","c","hpp","py","js","ts","json","xml","html",
+    "css","md","log","csv","ini","yaml","yml","bat","ps1","sh","rc","asm"
+};
+static const std::vector<std::string> kImageExts = { "jpg","jpeg","png","bmp","gif","webp","tif","tiff","ico" };
+static const std::vector<std::string> kAudioExts = { "wav","mp3","flac","ogg","opus","aac","wma","m4a","aiff","aif","aifc" };
+static const std::vector<std::string> kVideoExts = { "mp4","mov","avi","mkv","wmv","flv","webm","m4v","mpg","mpeg","ts","mts" };
+static const std::vector<std::string> kDocumentExts = { "pdf","docx","xlsx","pptx" };
+
+static bool HasExt(const std::vector<std::string>& list, const std::string& ext) {
+    return std::find(list.begin(), list.end(), ext) != list.end();
+}
+
+static bool IsSupportedAttachment(const std::string& ext) {
+    return HasExt(kTextExts, ext) || HasExt(kImageExts, ext) || HasExt(kAudioExts, ext) || HasExt(kVideoExts, ext) ||
+           HasExt(kDocumentExts, ext);
+}
+
+// ── Persistent analysis cache (nova_analysis_cache.bin) ──
+// Media analysis results are keyed by path, size, mtime and an XXH64 over sampled blocks, so
+// re-attaching an unchanged image, recording or video skips the analyser entirely. The file is
+// mapped at first use and entries point straight into the view until they are replaced;
+// Flush() rewrites it (least recently used entries dropped past kAnalysisCacheCap).
+//
+// Layout: "NVAC" u32 version, u32 count, u64 clock, then per entry
+//         u64 key, u64 lastUse, u32 kind, u32 textLen, u32 featureCount, text, float features[]
+
+static const DWORD     kAnalysisCacheVersion = 1;          // bump when an analyser's output changes
+static const size_t    kAnalysisCacheCap     = 32u << 20;  // bytes of text + features kept
+static const ULONGLONG kSampleBlock          = 64 * 1024;
+
+enum : DWORD { kCacheImage = 1, kCacheAudio = 2, kCacheVideo = 4 };
+
+class AnalysisCache {
+public:
+    static AnalysisCache& Instance() { static AnalysisCache c; return c; }
+
+    bool Lookup(ULONGLONG key, Attachment& out) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        EnsureLoaded();
+        auto it = m_entries.find(key);
+        if (it == m_entries.end()) { m_misses++; return false; }
+        Entry& e = it->second;
+        e.lastUse = ++m_clock;   // in memory only: written with the next add/evict, or at exit
+        m_touched = true;
+        out.textContent.assign(e.text, e.textLen);
+        out.features.resize(e.featureCount);
+        if (e.featureCount) memcpy(out.features.data(), e.features, e.featureCount * sizeof(float));
+        out.isImage = (e.kind & kCacheImage) != 0;
+        out.isAudio = (e.kind & kCacheAudio) != 0;
+        out.isVideo = (e.kind & kCacheVideo) != 0;
+        m_hits++;
+        return true;
+    }
+
+    void Store(ULONGLONG key, const Attachment& a) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        EnsureLoaded();
+        auto owned = std::make_shared<std::string>(a.textContent);
+        owned->append((const char*)a.features.data(), a.features.size() * sizeof(float));
+        Entry e;
+        e.lastUse      = ++m_clock;
+        e.kind         = (a.isImage ? kCacheImage : 0) | (a.isAudio ? kCacheAudio : 0) | (a.isVideo ? kCacheVideo : 0);
+        e.text         = owned->data();
+        e.textLen      = (DWORD)a.textContent.size();
+        e.features     = owned->data() + e.textLen;
+        e.featureCount = (DWORD)a.features.size();
+        e.owned        = std::move(owned);
+        auto it = m_entries.find(key);
+        if (it != m_entries.end()) m_bytes -= it->second.Bytes();
+        m_bytes += e.Bytes();
+        m_entries[key] = std::move(e);
+        m_dirty = true;
+        EvictToCap();
+    }
+
+    // Rewrites the cache file if entries were added or evicted since the last flush. Hits only move
+    // lastUse, which is worth a rewrite of the whole file just once, at exit (`atExit`).
+    void Flush(bool atExit = false) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (!m_loaded || !(m_dirty || (atExit && m_touched))) return;
+        std::string out;
+        out.reserve(m_bytes + m_entries.size() * 32 + 20);
+        auto put32 = [&](DWORD v)     { out.append((const char*)&v, 4); };
+        auto put64 = [&](ULONGLONG v) { out.append((const char*)&v, 8); };
+        out += "NVAC";
+        put32(kAnalysisCacheVersion);
+        put32((DWORD)m_entries.size());
+        put64(m_clock);
+        for (const auto& kv : m_entries) {
+            const Entry& e = kv.second;
+            put64(kv.first); put64(e.lastUse); put32(e.kind); put32(e.textLen); put32(e.featureCount);
+            out.append(e.text, e.textLen);
+            out.append(e.features, e.featureCount * sizeof(float));
+        }
+
+        std::string path = GetExeDir() + "nova_analysis_cache.bin";
+        std::string tmp  = path + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+            if (!f.write(out.data(), (std::streamsize)out.size())) { DevLog("[Cache] ERROR: could not write %s\n", tmp.c_str()); return; }
+        }
+        // A mapped file cannot be replaced: the view goes first
+        auto written = std::make_shared<std::string>(std::move(out));
+        m_view.reset();
+        if (!MoveFileExW(StringToWString(tmp).c_str(), StringToWString(path).c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            DevLog("[Cache] ERROR: could not replace %s GLE=%lu — entries kept in memory, retried at the next flush\n", path.c_str(), GetLastError());
+            DeleteFileW(StringToWString(tmp).c_str());
+            // Re-point every entry at the image just written (same order as the loop above)
+            size_t at = 20;
+            for (auto& kv : m_entries) {
+                Entry& e = kv.second;
+                at += 28;
+                e.text     = written->data() + at;
+                e.features = e.text + e.textLen;
+                e.owned    = written;
+                at += e.Bytes();
+            }
+            return;   // m_dirty and m_touched stay set
+        }
+        // Entries pointed into the old view: reload them from the new file
+        m_entries.clear();
+        m_loaded = false;
+        m_bytes  = 0;
+        EnsureLoaded();
+        m_dirty = m_touched = false;
+    }
+
+    ULONGLONG Hits()    const { return m_hits.load(); }
+    ULONGLONG Misses()  const { return m_misses.load(); }
+    size_t    Entries() { std::lock_guard<std::mutex> lk(m_mutex); return m_entries.size(); }
+    size_t    Bytes()   { std::lock_guard<std::mutex> lk(m_mutex); return m_bytes; }
+
+private:
+    struct Entry {
+        ULONGLONG    lastUse = 0;
+        DWORD        kind = 0, textLen = 0, featureCount = 0;
+        const char*  text = nullptr;
+        const char*  features = nullptr;   // packed floats, not necessarily aligned
+        std::shared_ptr<std::string> owned;   // null while the entry lives in the mapped view
+        size_t Bytes() const { return textLen + featureCount * sizeof(float); }
+    };
+
+    void EnsureLoaded() {
+        if (m_loaded) return;
+        m_loaded = true;
+        m_view = std::make_unique<MappedFile>(StringToWString(GetExeDir() + "nova_analysis_cache.bin"));
+        if (!m_view->IsOpen()) return;
+        const BYTE* p = m_view->Data();
+        const BYTE* end = p + m_view->Size();
+        if (end - p < 20 || memcmp(p, "NVAC", 4) != 0 || ReadLE32(p + 4) != kAnalysisCacheVersion) {
+            DevLog("[Cache] Ignoring stale or foreign analysis cache\n");
+            return;
+        }
+        DWORD count = ReadLE32(p + 8);
+        m_clock = ReadLE64(p + 12);
+        p += 20;
+        for (DWORD i = 0; i < count && end - p >= 28; i++) {
+            Entry e;
+            ULONGLONG key = ReadLE64(p);
+            e.lastUse      = ReadLE64(p + 8);
+            e.kind         = ReadLE32(p + 16);
+            e.textLen      = ReadLE32(p + 20);
+            e.featureCount = ReadLE32(p + 24);
+            p += 28;
+            if ((ULONGLONG)(end - p) < (ULONGLONG)e.textLen + (ULONGLONG)e.featureCount * sizeof(float)) break;
+            e.text     = (const char*)p;
+            e.features = (const char*)p + e.textLen;
+            p += e.Bytes();
+            m_bytes += e.Bytes();
+            m_entries[key] = std::move(e);
+        }
+        DevLog("[Cache] Loaded %zu analysis entries (%.1f KB)\n", m_entries.size(), m_bytes / 1024.0);
+    }
+
+    void EvictToCap() {
+        if (m_bytes <= kAnalysisCacheCap) return;
+        std::vector<std::pair<ULONGLONG, ULONGLONG>> byAge;   // (lastUse, key)
+        for (const auto& kv : m_entries) byAge.push_back({ kv.second.lastUse, kv.first });
+        std::sort(byAge.begin(), byAge.end());
+        for (size_t i = 0; i < byAge.size() && m_bytes > kAnalysisCacheCap * 3 / 4; i++) {
+            auto it = m_entries.find(byAge[i].second);
+            m_bytes -= it->second.Bytes();
+            m_entries.erase(it);
+        }
+    }
+
+    std::mutex                          m_mutex;
+    std::unordered_map<ULONGLONG, Entry> m_entries;
+    std::unique_ptr<MappedFile>         m_view;
+    size_t                              m_bytes  = 0;
+    ULONGLONG                           m_clock  = 0;
+    bool                                m_loaded = false, m_dirty = false;
+    bool                                m_touched = false;   // lastUse moved by hits since the last flush
+    std::atomic<ULONGLONG>              m_hits{0}, m_misses{0};
+};
+
+// Key from the lower-cased path, size, mtime and XXH64 over the first, middle and last 64 KB.
+// Returns 0 (uncacheable) if the file can't be opened.
+static ULONGLONG AnalysisCacheKey(const std::wstring& path) {
+    WIN32_FILE_ATTRIBUTE_DATA fa = {};
+    if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &fa)) return 0;
+    MappedFile mf(path);
+    if (!mf.IsOpen()) return 0;
+
+    std::wstring lower = path;
+    CharLowerBuffW(lower.data(), (DWORD)lower.size());
+    ULONGLONG h = XXH64(lower.data(), lower.size() * sizeof(wchar_t), kAnalysisCacheVersion);
+    ULONGLONG stamp[2] = { mf.Size(), (ULONGLONG)fa.ftLastWriteTime.dwHighDateTime << 32 | fa.ftLastWriteTime.dwLowDateTime };
+    h = XXH64(stamp, sizeof(stamp), h);
+
+    const BYTE* d = mf.Data();
+    ULONGLONG n = mf.Size();
+    if (n <= 3 * kSampleBlock) return XXH64(d, (size_t)n, h) | 1;
+    h = XXH64(d, (size_t)kSampleBlock, h);
+    h = XXH64(d + (n / 2 - kSampleBlock / 2), (size_t)kSampleBlock, h);
+    return XXH64(d + (n - kSampleBlock), (size_t)kSampleBlock, h) | 1;
+}
+
+// Runs the type-specific analyser for image, audio and video files
+static bool AnalyzeMediaAttachment(const std::wstring& path, const std::string& ext, Attachment& out) {
+    if (HasExt(kImageExts, ext)) {
+        out.textContent = AnalyzeImageGDIPlus(path, &out.features);
+        out.isImage = true;
+        return true;
+    }
+
+    if (HasExt(kAudioExts, ext)) {
+        if (ext == "wav") out.textContent = AnalyzeWavDetailed(path, &out.features);
+        else              out.textContent = AnalyzeCompressedAudio(path, ext, &out.features);
+        out.isAudio = true;
+        return true;
+    }
+
+    if (HasExt(kVideoExts, ext)) {
+        out.textContent = AnalyzeVideoFile(path, ext);
+        out.isVideo = true;
+        return true;
+    }
+    return false;
+}
+
+bool LoadAttachment(const std::wstring& path, Attachment& out) {
+    out = {};
+    size_t slash = path.find_last_of(L"\\/");
+    out.path = path;
+    out.displayName = (slash != std::wstring::npos) ? path.substr(slash + 1) : path;
+    std::string ext = ExtensionOf(path);
+
+    if (HasExt(kTextExts, ext)) {
+        std::ifstream f(path, std::ios::binary | std::ios::ate);
+        if (!f) return false;
+        size_t total = (size_t)f.tellg();
+        f.seekg(0);
+        std::string raw((std::min)(total, kMaxCondenseBytes), '\0');
+        f.read(raw.data(), (std::streamsize)raw.size());
+        raw.resize((size_t)f.gcount());
+        out.isText = true;
+        if (total > kInlineTextLimit) {
+            // Too big to inline — keep it whole and condense it section by section at send time
+            out.fullText = std::move(raw);
+            out.textContent = "=== FILE: \"" + WStringToString(out.displayName) + "\" (" + std::to_string(total) +
+                              " bytes, condensed before sending) ===";
+            DevLog("[Attach] Text: %zu bytes — queued for map-reduce (%zu kept)\n", total, out.fullText.size());
+            return true;
+        }
+        out.textContent = "=== FILE: \"" + WStringToString(out.displayName) + "\" ===\n" + raw + "\n=== END ===\nAnalyse this file.";
+        DevLog("[Attach] Text: %zu chars\n", out.textContent.size());
+        return true;
+    }
+
+    if (HasExt(kDocumentExts, ext)) {
+        // Extract just far enough to know whether the document fits inline; larger ones are
+        // extracted again at send time, straight into the summarizer
+        auto t0 = std::chrono::steady_clock::now();
+        std::string text, err;
+        int units = 0;
+        bool more = false;
+        bool ok = ExtractDocumentText(path, ext, [&](const std::string& s) {
+            if (text.size() + s.size() > kInlineTextLimit) { more = true; return false; }
+            text += s;
+            return true;
+        }, err, &units);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+        std::string name = WStringToString(out.displayName);
+        std::string info = ext == "pdf" ? "PDF" : ext == "docx" ? "Word" : ext == "xlsx" ? "Excel" : "PowerPoint";
+        if (units) info += ", " + std::to_string(units) + (ext == "pdf" ? " pages" : ext == "xlsx" ? " sheets" : " slides");
+        out.isText = true;
+        if (!ok) {
+            out.textContent = "ERROR: could not extract text from \"" + name + "\" (" + err + ").";
+            DevLog("[Attach] Document (%s): %s\n", info.c_str(), err.c_str());
+            return true;
+        }
+        if (more) {
+            out.streamExtract = true;
+            out.textContent = "=== DOCUMENT: \"" + name + "\" (" + info + ", condensed before sending) ===";
+        } else {
+            out.textContent = "=== DOCUMENT: \"" + name + "\" (" + info + ") ===\n" + text + "\n=== END ===\nAnalyse this document.";
+        }
+        DevLog("[Attach] Document (%s): %s in %.1f ms\n", info.c_str(),
+               more ? "too large to inline — queued for streaming map-reduce" : (std::to_string(text.size()) + " chars inline").c_str(), ms);
+        return true;
+    }
+
+    if (!IsSupportedAttachment(ext)) {
+        DevLog("[Attach] Unsupported type: .%s\n", ext.c_str());
+        return false;
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    ULONGLONG key = AnalysisCacheKey(path);
+    if (key && AnalysisCache::Instance().Lookup(key, out)) {
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+        DevLog("[Cache] Hit: %s in %.0f us\n", WStringToString(out.displayName).c_str(), us);
+        return true;
+    }
+    AnalyzeMediaAttachment(path, ext, out);
+    if (key && out.textContent.compare(0, 6, "ERROR:") != 0) AnalysisCache::Instance().Store(key, out);
+    return true;
+}
+
+// ── Multi-file attachment loading ──
+// Files and dropped folders are expanded on a background thread and analysed on a pool.
+// Each job reserves its share of kAttachMemoryBudget while it runs, so a folder of large
+// media can't map and decode everything at once. Results land in g_attachments in
+// priority order when the whole batch is done.
+
+static const size_t    kMaxAttachFiles     = 500;
+static const ULONGLONG kAttachMemoryBudget = 512ull * 1024 * 1024;
+
+static int g_attachLoads = 0;   // batches still analysing (UI thread only)
+
+struct AttachCandidate {
+    std::wstring path;
+    ULONGLONG    size       = 0;
+    bool         fromFolder = false;
+};
+
+// Counting semaphore over bytes
+class ByteBudget {
+public:
+    explicit ByteBudget(ULONGLONG total) : m_free(total), m_total(total) {}
+    ULONGLONG Acquire(ULONGLONG n) {
+        n = (std::min)(n, m_total);
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_cv.wait(lk, [&] { return m_free >= n; });
+        m_free -= n;
+        return n;
+    }
+    void Release(ULONGLONG n) {
+        { std::lock_guard<std::mutex> lk(m_mutex); m_free += n; }
+        m_cv.notify_all();
+    }
+private:
+    std::mutex              m_mutex;
+    std::condition_variable m_cv;
+    ULONGLONG               m_free, m_total;
+};
+
+// Explicit picks first, then by type (text, image, audio, video), smaller files first so more fit
+static int AttachmentRank(const Attachment& a) {
+    return (a.fromFolder ? 4 : 0) + (a.isText ? 0 : a.isImage ? 1 : a.isAudio ? 2 : 3);
+}
+
+static void SortAttachments(std::vector<Attachment>& v) {
+    std::stable_sort(v.begin(), v.end(), [](const Attachment& a, const Attachment& b) {
+        int ra = AttachmentRank(a), rb = AttachmentRank(b);
+        if (ra != rb) return ra < rb;
+        return a.fileSize < b.fileSize;
+    });
+}
+
+// Folders are walked recursively for supported types, skipping hidden and dependency/build dirs
+static void ExpandAttachPaths(const std::vector<std::wstring>& paths, std::vector<AttachCandidate>& out) {
+    namespace fs = std::filesystem;
+    static const std::vector<std::wstring> skipDirs = { L"node_modules", L"__pycache__", L"bin", L"obj", L"build", L"out" };
+    std::error_code ec;
+    auto sizeOf = [](const fs::path& f) { std::error_code e; auto n = fs::file_size(f, e); return e ? 0ull : (ULONGLONG)n; };
+    for (const auto& p : paths) {
+        if (out.size() >= kMaxAttachFiles) break;
+        if (!fs::is_directory(p, ec)) {
+            out.push_back({ p, sizeOf(p), false });
+            continue;
+        }
+        fs::recursive_directory_iterator it(p, fs::directory_options::skip_permission_denied, ec), end;
+        for (; !ec && it != end && out.size() < kMaxAttachFiles; it.increment(ec)) {
+            std::wstring name = it->path().filename().wstring();
+            std::error_code fe;   // per-entry errors skip the entry, not the walk
+            if (it->is_directory(fe)) {
+                if ((!name.empty() && name[0] == L'.') || std::find(skipDirs.begin(), skipDirs.end(), name) != skipDirs.end())
+                    it.disable_recursion_pending();
+                continue;
+            }
+            if (!it->is_regular_file(fe) || !IsSupportedAttachment(ExtensionOf(it->path().wstring()))) continue;
+            out.push_back({ it->path().wstring(), sizeOf(it->path()), true });
+        }
+    }
+}
+
+// Posts WM_ATTACH_PROGRESS per file and WM_ATTACH_DONE with a heap vector of the results
+// Analysis threads in flight: WM_DESTROY cancels them and waits before the analysis cache is flushed
+static struct {
+    std::mutex              mutex;
+    std::condition_variable idle;
+    int                     running = 0;
+    std::atomic<bool>       cancel{false};
+} g_attachWorkers;
+
+static void StopAttachmentLoads() {
+    g_attachWorkers.cancel = true;
+    std::unique_lock<std::mutex> lk(g_attachWorkers.mutex);
+    g_attachWorkers.idle.wait(lk, [] { return g_attachWorkers.running == 0; });   // each stops after its current file
+}
+
+static void LoadAttachmentsAsync(std::vector<std::wstring> paths) {
+    g_attachLoads++;
+    EnableWindow(hButtonSend, FALSE);
+    {
+        std::lock_guard<std::mutex> lk(g_attachWorkers.mutex);
+        g_attachWorkers.running++;
+    }
+    std::thread([paths]() {
+        auto finished = [] {
+            std::lock_guard<std::mutex> lk(g_attachWorkers.mutex);
+            g_attachWorkers.running--;
+            g_attachWorkers.idle.notify_all();
+        };
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<AttachCandidate> files;
+        ExpandAttachPaths(paths, files);
+
+        std::vector<Attachment> loaded(files.size());
+        std::vector<char>       ok(files.size(), 0);
+        std::atomic<int>        done{0};
+        ByteBudget              budget(kAttachMemoryBudget);
+        {
+            int threads = (int)(std::min)((size_t)(std::max)(std::thread::hardware_concurrency(), 2u), (std::max)(files.size(), (size_t)1));
+            WorkerPool pool((std::min)(threads, 16));
+            for (size_t i = 0; i < files.size(); i++) {
+                pool.Submit([&, i] {
+                    if (g_attachWorkers.cancel) return;
+                    ULONGLONG held = budget.Acquire((std::max)(files[i].size, (ULONGLONG)64 * 1024));
+                    ok[i] = LoadAttachment(files[i].path, loaded[i]);
+                    budget.Release(held);
+                    loaded[i].fileSize   = files[i].size;
+                    loaded[i].fromFolder = files[i].fromFolder;
+                    PostMessageW(hMainWnd, WM_ATTACH_PROGRESS, (WPARAM)++done, (LPARAM)files.size());
+                });
+            }
+        }
+
+        if (g_attachWorkers.cancel) { finished(); return; }   // closing: nothing left to show them in
+
+        auto* result = new std::vector<Attachment>;
+        for (size_t i = 0; i < files.size(); i++) {
+            if (ok[i]) result->push_back(std::move(loaded[i]));
+            else       DevLog("[Attach] Skipped: %s\n", WStringToString(files[i].path).c_str());
+        }
+        SortAttachments(*result);
+        AnalysisCache& cache = AnalysisCache::Instance();
+        cache.Flush();
+        DevLog("[Cache] hits=%llu misses=%llu entries=%zu (%.1f KB)\n",
+               cache.Hits(), cache.Misses(), cache.Entries(), cache.Bytes() / 1024.0);
+        long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+        DevLog("[Attach] %zu of %zu files analysed in %lld ms\n", result->size(), files.size(), ms);
+        if (!PostMessageW(hMainWnd, WM_ATTACH_DONE, 0, (LPARAM)result)) delete result;
+        finished();
+    }).detach();
+}
+
+static void UpdateAttachLabel() {
+    if (!hAttachLabel) return;
+    if (g_attachments.empty()) { SetWindowTextW(hAttachLabel, L""); return; }
+    std::wstring text = L"\U0001F4CE  " + g_attachments[0].displayName;
+    if (g_attachments.size() > 1) text += L"  + " + std::to_wstring(g_attachments.size() - 1) + L" more";
+    SetWindowTextW(hAttachLabel, text.c_str());
+}
+
+// Called on WM_ATTACH_DONE: merge a finished batch, skipping files that are already attached
+static void OnAttachmentsLoaded(std::vector<Attachment>* batch) {
+    bool   none  = batch->empty();
+    size_t added = 0;
+    for (auto& a : *batch) {
+        bool dup = std::any_of(g_attachments.begin(), g_attachments.end(),
+                               [&](const Attachment& e) { return _wcsicmp(e.path.c_str(), a.path.c_str()) == 0; });
+        if (!dup) { g_attachments.push_back(std::move(a)); added++; }
+    }
+    delete batch;
+    SortAttachments(g_attachments);
+    if (--g_attachLoads == 0 && !AppStateManager::Instance().aiRunning.load()) EnableWindow(hButtonSend, TRUE);
+    UpdateAttachLabel();
+    if (!added && none) MessageBoxW(hMainWnd, L"No supported files found.", L"Nova", MB_ICONWARNING);
+    DevLog("[Attach] Ready: %zu attachment(s)\n", g_attachments.size());
+}
+
+void ClearAttachment() {
+    g_attachments.clear();
+    if (hAttachLabel) SetWindowTextW(hAttachLabel, L"");
+}
+
+void OpenAttachDialog() {
+    std::vector<wchar_t> buf(64 * 1024, L'\0');   // multi-select returns dir\0name\0name\0\0
+    OPENFILENAMEW ofn = {};
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner   = hMainWnd;
+    ofn.lpstrFilter =
+        L"All Supported\0*.txt;*.cpp;*.h;*.c;*.hpp;*.py;*.js;*.ts;*.json;*.xml;*.html;*.css;*.md;*.log;*.csv;*.ini;*.yaml;*.yml;*.bat;*.ps1;*.rc;*.asm;"
+        L"*.jpg;*.jpeg;*.png;*.bmp;*.gif;*.webp;*.tif;*.tiff;*.ico;"
+        L"*.wav;*.mp3;*.flac;*.ogg;*.opus;*.aac;*.wma;*.m4a;*.aiff;*.aif;*.aifc;"
+        L"*.mp4;*.mov;*.avi;*.mkv;*.wmv;*.flv;*.webm;*.m4v;*.mpg;*.mpeg;"
+        L"*.pdf;*.docx;*.xlsx;*.pptx\0"
+        L"All Files\0*.*\0";
+    ofn.lpstrFile  = buf.data();
+    ofn.nMaxFile   = (DWORD)buf.size();
+    ofn.Flags      = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST | OFN_ALLOWMULTISELECT | OFN_EXPLORER;
+    ofn.lpstrTitle = L"Attach Files for Nova to Analyse (or drop files/folders on the window)";
+
+    if (!GetOpenFileNameW(&ofn)) return;
+    std::vector<std::wstring> paths;
+    std::wstring first = buf.data();
+    const wchar_t* p = buf.data() + first.size() + 1;
+    if (!*p) {
+        paths.push_back(first);                  // single selection is a full path
+    } else {
+        for (; *p; p += wcslen(p) + 1) paths.push_back(first + L"\\" + p);
+    }
+    LoadAttachmentsAsync(std::move(paths));
+}
+
+void OnDropFiles(HDROP drop) {
+    std::vector<std::wstring> paths;
+    UINT n = DragQueryFileW(drop, 0xFFFFFFFF, nullptr, 0);
+    for (UINT i = 0; i < n; i++) {
+        std::wstring path(DragQueryFileW(drop, i, nullptr, 0) + 1, L'\0');
+        path.resize(DragQueryFileW(drop, i, path.data(), (UINT)path.size()));
+        paths.push_back(path);
+    }
+    DragFinish(drop);
+    if (!paths.empty()) LoadAttachmentsAsync(std::move(paths));
+}
+
+// ════════════════════════════════════════════════════════════════
+// WORKSPACE INDEX
+// ════════════════════════════════════════════════════════════════
+// Per-file records (size, mtime, extracted symbols) for the workspace folder (workspace_dir,
+// default the Desktop). The first scan walks the tree in parallel and parses every code file;
+// later scans only re-parse files whose size or mtime changed, and a ReadDirectoryChangesW
+// watcher feeds single-file updates so an edit costs one parse. The index persists in
+// nova_workspace_index.bin and prompts get a ranked summary cut to a character budget.
+
+struct CodeSymbol {
+    char        kind = 'f';   // 'f' function, 't' type (class/struct/enum/namespace...), 'i' include/import
+    int         line = 0;
+    std::string name;
+};
+
+struct IndexedFile {
+    ULONGLONG               size = 0, mtime = 0;
+    std::vector<CodeSymbol> symbols;
+};
+
+static const std::vector<std::string> kIndexExts = {
+    "c","cc","cpp","cxx","h","hh","hpp","hxx","inl","ipp","cs","java","kt","go","rs","swift","m","mm",
+    "py","js","jsx","ts","tsx","mjs","rb","php","lua","sh","ps1","bat","cmd",
+    "cmake","txt","md","json","xml","yaml","yml","toml","ini","html","css","rc","asm","sql"
+};
+static const size_t kMaxIndexFiles      = 200000;
+static const size_t kMaxSymbolFileBytes = 1 << 20;   // larger files are listed but not parsed
+static const size_t kMaxSymbolsPerFile  = 256;
+
+static std::string ToLowerAscii(std::string s) {
+    for (auto& c : s) c = (char)tolower((unsigned char)c);
+    return s;
+}
+
+static std::string LowerExtOf(const std::string& nameLower) {
+    size_t dot = nameLower.rfind('.');
+    return dot == std::string::npos ? "" : nameLower.substr(dot + 1);
+}
+
+static bool IsIndexedName(const std::string& nameLower) {
+    return HasExt(kIndexExts, LowerExtOf(nameLower)) || nameLower == "makefile" || nameLower == "dockerfile";
+}
+
+// ── Ignore rules ──
+// '*' and '?' match within one path segment, '**' across segments
+static bool GlobMatch(const char* p, const char* s) {
+    while (*p) {
+        if (*p == '*') {
+            bool deep = p[1] == '*';
+            while (*p == '*') p++;
+            if (deep && *p == '/' && GlobMatch(p + 1, s)) return true;
+            for (const char* t = s; ; t++) {
+                if (GlobMatch(p, t)) return true;
+                if (!*t || (!deep && *t == '/')) return false;
+            }
+        }
+        if (!*s || (*p == '?' && *s == '/') || (*p != '?' && *p != *s)) return false;
+        p++; s++;
+    }
+    return !*s;
+}
+
+// Built-in VCS/dependency/build directories plus the root .gitignore and .novaignore.
+// Supports the common gitignore forms (name globs, trailing '/', anchored paths); '!' negation
+// and nested ignore files are not applied. Matching is case-insensitive, like the file system.
+class IgnoreRules {
+public:
+    IgnoreRules() {
+        for (const char* d : { ".git/", ".svn/", ".hg/", ".vs/", ".vscode/", ".idea/", ".cache/", "node_modules/",
+                               "__pycache__/", ".venv/", "venv/", "bin/", "obj/", "build/", "out/", "dist/",
+                               "target/", "x64/", "debug/", "release/", "*.min.js" })
+            Add(d);
+    }
+
+    void Add(std::string line) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) line.pop_back();
+        if (line.empty() || line[0] == '#' || line[0] == '!') return;
+        std::replace(line.begin(), line.end(), '\\', '/');
+        Rule r;
+        if (line.back() == '/') { r.dirOnly = true; line.pop_back(); }
+        if (!line.empty() && line[0] == '/') { r.anchored = true; line.erase(0, 1); }
+        else if (line.find('/') != std::string::npos) r.anchored = true;
+        if (line.empty()) return;
+        r.glob = ToLowerAscii(line);
+        m_rules.push_back(std::move(r));
+    }
+
+    void AddFile(const std::wstring& path) {
+        std::ifstream f(path);
+        std::string line;
+        while (std::getline(f, line)) Add(line);
+    }
+
+    // relLower is '/'-separated and relative to the root; nameLower is its last segment
+    bool Ignored(const std::string& relLower, const std::string& nameLower, bool isDir) const {
+        for (const auto& r : m_rules) {
+            if (r.dirOnly && !isDir) continue;
+            if (GlobMatch(r.glob.c_str(), (r.anchored ? relLower : nameLower).c_str())) return true;
+        }
+        return false;
+    }
+
+    // Checks every ancestor directory too (for paths reported by the watcher)
+    bool IgnoredPath(const std::string& relLower, bool isDir) const {
+        size_t start = 0;
+        for (size_t slash = relLower.find('/'); slash != std::string::npos; slash = relLower.find('/', start)) {
+            if (Ignored(relLower.substr(0, slash), relLower.substr(start, slash - start), true)) return true;
+            start = slash + 1;
+        }
+        return Ignored(relLower, relLower.substr(start), isDir);
+    }
+
+private:
+    struct Rule { std::string glob; bool dirOnly = false, anchored = false; };
+    std::vector<Rule> m_rules;
+};
+
+// ── Symbol extraction ──
+// Line-based heuristics, not a parser: enough to tell the model where things are defined.
+enum class SrcLang { None, CLike, Python, Script, Go, Rust };
+
+static SrcLang SourceLanguage(const std::string& ext) {
+    static const std::vector<std::string> clike = { "c","cc","cpp","cxx","h","hh","hpp","hxx","inl","ipp","cs","java","kt","swift","m","mm" };
+    if (HasExt(clike, ext)) return SrcLang::CLike;
+    if (ext == "py") return SrcLang::Python;
+    if (ext == "js" || ext == "jsx" || ext == "ts" || ext == "tsx" || ext == "mjs") return SrcLang::Script;
+    if (ext == "go") return SrcLang::Go;
+    if (ext == "rs") return SrcLang::Rust;
+    return SrcLang::None;
+}
+
+static inline bool IsIdentChar(char c) { return isalnum((unsigned char)c) || c == '_' || c == '$'; }
+
+// True if t starts with keyword w followed by a non-identifier character
+static bool StartsWithWord(const std::string& t, const char* w) {
+    size_t n = strlen(w);
+    return t.compare(0, n, w) == 0 && (t.size() == n || !IsIdentChar(t[n]));
+}
+
+static std::string IdentAt(const std::string& t, size_t pos) {
+    while (pos < t.size() && (t[pos] == ' ' || t[pos] == '\t' || t[pos] == '*' || t[pos] == '&')) pos++;
+    size_t end = pos;
+    while (end < t.size() && (IsIdentChar(t[end]) || (t[end] == ':' && end + 1 < t.size() && t[end + 1] == ':'))) end += (t[end] == ':') ? 2 : 1;
+    return t.substr(pos, end - pos);
+}
+
+// Drops access/storage modifiers so "pub async fn" and "public static void" start at the payload
+static std::string StripModifiers(std::string t) {
+    static const char* mods[] = { "export", "default", "pub", "public", "private", "protected", "internal", "static",
+                                  "inline", "virtual", "async", "abstract", "final", "sealed", "partial", "override",
+                                  "unsafe", "extern", "constexpr", "friend", "declare", "open", "data" };
+    for (bool again = true; again; ) {
+        again = false;
+        if (t.compare(0, 4, "pub(") == 0) {
+            size_t close = t.find(')');
+            if (close != std::string::npos) { t.erase(0, close + 1); again = true; }
+        }
+        for (const char* m : mods) {
+            if (StartsWithWord(t, m)) { t.erase(0, strlen(m)); again = true; }
+        }
+        size_t a = t.find_first_not_of(" \t");
+        t.erase(0, a == std::string::npos ? t.size() : a);
+    }
+    return t;
+}
+
+// Next whitespace/punctuation-delimited token from pos ("java.util.List", "os.path", "a::b")
+static std::string TokenAfter(const std::string& t, size_t pos) {
+    size_t a = t.find_first_not_of(" \t", pos);
+    if (a == std::string::npos) return "";
+    size_t b = t.find_first_of(" \t;,({", a);
+    return t.substr(a, (b == std::string::npos ? t.size() : b) - a);
+}
+
+// First quoted string on the line ('...', "..." or <...>)
+static std::string QuotedAt(const std::string& t) {
+    size_t a = t.find_first_of("\"'<");
+    if (a == std::string::npos) return "";
+    char close = t[a] == '<' ? '>' : t[a];
+    size_t b = t.find(close, a + 1);
+    return b == std::string::npos ? "" : t.substr(a + 1, b - a - 1);
+}
+
+static void ExtractSymbols(const char* data, size_t size, SrcLang lang, std::vector<CodeSymbol>& out) {
+    static const char* typeWords[] = { "class", "struct", "enum", "union", "interface", "namespace", "trait", "impl", "mod", "record", "object" };
+    static const char* stmtWords[] = { "if", "for", "while", "switch", "return", "else", "do", "case", "catch", "sizeof",
+                                       "new", "delete", "throw", "goto", "using", "typedef", "co_return", "static_assert", "elif", "with" };
+
+    // Split into (start, length) line spans first so definitions can peek at the next line
+    std::vector<std::pair<size_t, size_t>> lines;
+    for (size_t i = 0, start = 0; i <= size; i++) {
+        if (i == size || data[i] == '\n') {
+            size_t len = i - start;
+            if (len && data[start + len - 1] == '\r') len--;
+            lines.push_back({ start, len });
+            start = i + 1;
+        }
+    }
+    auto trimmed = [&](size_t li, int* indent) {
+        size_t a = lines[li].first, e = a + lines[li].second;
+        int ind = 0;
+        while (a < e && (data[a] == ' ' || data[a] == '\t')) { ind += data[a] == '\t' ? 4 : 1; a++; }
+        while (e > a && (data[e - 1] == ' ' || data[e - 1] == '\t')) e--;
+        if (indent) *indent = ind;
+        return std::string(data + a, e - a);
+    };
+    auto add = [&](char kind, int line, std::string name) {
+        if (!name.empty() && out.size() < kMaxSymbolsPerFile) out.push_back({ kind, line, std::move(name) });
+    };
+
+    bool goImportBlock = false, inBlockComment = false;
+    for (size_t li = 0; li < lines.size() && out.size() < kMaxSymbolsPerFile; li++) {
+        int indent = 0;
+        std::string t = trimmed(li, &indent);
+        if (t.empty()) continue;
+        int line = (int)li + 1;
+
+        if (lang == SrcLang::CLike || lang == SrcLang::Script || lang == SrcLang::Go || lang == SrcLang::Rust) {
+            if (inBlockComment) { if (t.find("*/") != std::string::npos) inBlockComment = false; continue; }
+            if (t.compare(0, 2, "/*") == 0) { inBlockComment = t.find("*/", 2) == std::string::npos; continue; }
+            if (t.compare(0, 2, "//") == 0 || t[0] == '*') continue;
+        } else if (t[0] == '#' && lang != SrcLang::CLike) {
+            continue;
+        }
+
+        // Includes / imports
+        if (lang == SrcLang::CLike) {
+            if (t[0] == '#') {
+                if (t.find("include") != std::string::npos || t.find("import") != std::string::npos) add('i', line, QuotedAt(t));
+                continue;
+            }
+            if (indent == 0 && StartsWithWord(t, "import") && t.back() == ';') { add('i', line, TokenAfter(t, 6)); continue; }
+        } else if (lang == SrcLang::Python) {
+            if (indent == 0 && (StartsWithWord(t, "import") || StartsWithWord(t, "from"))) { add('i', line, TokenAfter(t, t[0] == 'i' ? 6 : 4)); continue; }
+        } else if (lang == SrcLang::Script) {
+            if (StartsWithWord(t, "import") || (t.find("require(") != std::string::npos && indent == 0)) {
+                std::string q = QuotedAt(t.substr(t.rfind("from") != std::string::npos ? t.rfind("from") : 0));
+                if (!q.empty()) { add('i', line, q); continue; }
+            }
+        } else if (lang == SrcLang::Go) {
+            if (goImportBlock) { if (t[0] == ')') goImportBlock = false; else add('i', line, QuotedAt(t)); continue; }
+            if (StartsWithWord(t, "import")) { if (t.find('(') != std::string::npos) goImportBlock = true; else add('i', line, QuotedAt(t)); continue; }
+        } else if (lang == SrcLang::Rust) {
+            std::string u = StripModifiers(t);
+            if (StartsWithWord(u, "use")) { add('i', line, TokenAfter(u, 3)); continue; }
+        }
+
+        std::string body = StripModifiers(t);
+        if (StartsWithWord(body, "template")) {
+            int depth = 0; size_t k = 8;
+            for (; k < body.size(); k++) { if (body[k] == '<') depth++; else if (body[k] == '>' && --depth == 0) { k++; break; } }
+            body = StripModifiers(body.substr((std::min)(k, body.size())));
+            if (body.empty()) continue;
+        }
+
+        // Types
+        bool typed = false;
+        for (const char* w : typeWords) {
+            if (!StartsWithWord(body, w)) continue;
+            std::string rest = body.substr(strlen(w));
+            rest.erase(0, rest.find_first_not_of(' '));
+            std::string name;
+            if (!strcmp(w, "enum") && StartsWithWord(rest, "class"))       name = IdentAt(rest, 5);   // enum class / enum struct
+            else if (!strcmp(w, "enum") && StartsWithWord(rest, "struct")) name = IdentAt(rest, 6);
+            else                                                           name = IdentAt(rest, 0);
+            if (name == "__declspec" || name == "alignas") break;
+            bool forward = lang == SrcLang::CLike && body.back() == ';' && body.find('{') == std::string::npos;
+            if (!forward && !name.empty()) { add('t', line, name); typed = true; }
+            break;
+        }
+        if (typed) continue;
+        if (lang == SrcLang::Go && StartsWithWord(body, "type")) { add('t', line, IdentAt(body, 4)); continue; }
+
+        // Functions
+        switch (lang) {
+        case SrcLang::Python:
+            if (StartsWithWord(body, "def")) add('f', line, IdentAt(body, 3));
+            break;
+        case SrcLang::Go:
+            if (StartsWithWord(body, "func")) {
+                size_t pos = 4;
+                if (body.find_first_not_of(' ', 4) != std::string::npos && body[body.find_first_not_of(' ', 4)] == '(')
+                    pos = body.find(')', 4) + 1;   // method receiver
+                add('f', line, IdentAt(body, pos));
+            }
+            break;
+        case SrcLang::Rust:
+            if (StartsWithWord(body, "fn")) add('f', line, IdentAt(body, 2));
+            break;
+        case SrcLang::Script:
+            if (StartsWithWord(body, "function")) {
+                add('f', line, IdentAt(body, body[8] == '*' ? 9 : 8));
+            } else if ((StartsWithWord(body, "const") || StartsWithWord(body, "let") || StartsWithWord(body, "var")) && indent == 0) {
+                size_t eq = body.find('=');
+                if (eq != std::string::npos && (body.find("=>", eq) != std::string::npos || body.find("function", eq) != std::string::npos))
+                    add('f', line, IdentAt(body, body.find(' ')));
+            }
+            break;
+        case SrcLang::CLike: {
+            // A definition: "<type> name(...)" at shallow indent (class members, C#/Java methods) whose
+            // body opens on this line or after a wrapped parameter list
+            const int maxIndent = 8;
+            size_t paren = body.find('(');
+            if (indent > maxIndent || paren == std::string::npos || paren == 0 || body[0] == '}') break;
+            bool isStmt = false;
+            for (const char* w : stmtWords) if (StartsWithWord(body, w)) { isStmt = true; break; }
+            if (isStmt || body.find('=') < paren || body.back() == ';') break;
+            size_t e = paren;
+            while (e > 0 && body[e - 1] == ' ') e--;
+            size_t b = e;
+            while (b > 0 && (IsIdentChar(body[b - 1]) || body[b - 1] == ':' || body[b - 1] == '~')) b--;
+            std::string name = body.substr(b, e - b);
+            if (name.empty() || isdigit((unsigned char)name[0]) || (b == 0 && name.find("::") == std::string::npos)) break;
+            for (const char* w : stmtWords) if (name == w) { isStmt = true; break; }
+            if (isStmt) break;
+            bool opens = body.back() == '{';
+            for (size_t nx = li + 1; !opens && nx < lines.size() && nx <= li + 3; nx++) {
+                std::string n = trimmed(nx, nullptr);
+                if (n.empty()) continue;
+                opens = n[0] == '{' || n[0] == ':';
+                if (!opens && n.back() != ')' && n.back() != ',' && n.find("const") != 0 && n.find("noexcept") != 0) break;
+            }
+            if (opens) add('f', line, name);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+// Reads (mapped) and parses one file; size and mtime come from the directory walk
+static void ParseIndexedFile(const std::wstring& fullPath, const std::string& nameLower, IndexedFile& rec) {
+    rec.symbols.clear();
+    SrcLang lang = SourceLanguage(LowerExtOf(nameLower));
+    if (lang == SrcLang::None || rec.size == 0 || rec.size > kMaxSymbolFileBytes) return;
+    MappedFile mf(fullPath);
+    if (!mf.IsOpen()) return;
+    ExtractSymbols((const char*)mf.Data(), (size_t)mf.Size(), lang, rec.symbols);
+}
+
+// ── Parallel walk ──
+struct WalkEntry {
+    std::string rel;            // '/'-separated, relative to the root
+    ULONGLONG   size = 0, mtime = 0;
+};
+
+static inline ULONGLONG FileTimeU64(const FILETIME& ft) { return (ULONGLONG)ft.dwHighDateTime << 32 | ft.dwLowDateTime; }
+
+static std::wstring WorkspacePath(const std::wstring& root, const std::string& rel) {
+    std::wstring w = StringToWString(rel);
+    std::replace(w.begin(), w.end(), L'/', L'\\');
+    return rel.empty() ? root : root + L"\\" + w;
+}
+
+// Threads share a queue of directories; each lists one directory with FindFirstFileEx (which
+// returns size and mtime without a separate stat) and queues the subdirectories it finds.
+// Reparse points (junctions, symlinks) are not followed.
+static void WalkWorkspace(const std::wstring& root, const IgnoreRules& ignore, const std::string& startRel,
+                          std::vector<WalkEntry>& out) {
+    std::mutex                          qMutex;
+    std::condition_variable             qCv;
+    std::deque<std::string>             dirs = { startRel };
+    int                                 busy = 0;
+    std::atomic<size_t>                 total{0};
+    int                                 nThreads = (int)(std::min)((std::max)(std::thread::hardware_concurrency(), 2u), 8u);
+    std::vector<std::vector<WalkEntry>> found(nThreads);
+
+    auto worker = [&](int id) {
+        for (;;) {
+            std::string dir;
+            {
+                std::unique_lock<std::mutex> lk(qMutex);
+                qCv.wait(lk, [&] { return !dirs.empty() || busy == 0; });
+                if (dirs.empty()) return;
+                dir = std::move(dirs.front());
+                dirs.pop_front();
+                busy++;
+            }
+            std::vector<std::string> sub;
+            WIN32_FIND_DATAW fd;
+            HANDLE h = FindFirstFileExW((WorkspacePath(root, dir) + L"\\*").c_str(), FindExInfoBasic, &fd,
+                                        FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+            if (h != INVALID_HANDLE_VALUE) {
+                do {
+                    const wchar_t* n = fd.cFileName;
+                    if (n[0] == L'.' && (!n[1] || (n[1] == L'.' && !n[2]))) continue;
+                    bool isDir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+                    if (isDir && (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) continue;
+                    std::string name = WStringToString(n);
+                    std::string rel  = dir.empty() ? name : dir + "/" + name;
+                    std::string nameLower = ToLowerAscii(name);
+                    if (ignore.Ignored(ToLowerAscii(rel), nameLower, isDir)) continue;
+                    if (isDir) { sub.push_back(std::move(rel)); continue; }
+                    if (!IsIndexedName(nameLower) || total.fetch_add(1) >= kMaxIndexFiles) continue;
+                    found[id].push_back({ std::move(rel), (ULONGLONG)fd.nFileSizeHigh << 32 | fd.nFileSizeLow,
+                                          FileTimeU64(fd.ftLastWriteTime) });
+                } while (FindNextFileW(h, &fd));
+                FindClose(h);
+            }
+            {
+                std::lock_guard<std::mutex> lk(qMutex);
+                for (auto& s : sub) dirs.push_back(std::move(s));
+                busy--;
+            }
+            qCv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nThreads; i++) threads.emplace_back(worker, i);
+    for (auto& t : threads) t.join();
+    for (auto& v : found) for (auto& e : v) out.push_back(std::move(e));
+}
+
+// ── Index ──
+class WorkspaceIndex {
+public:
+    ~WorkspaceIndex() { Close(); }
+
+    // Loads the saved index (when indexFile is set), brings it up to date and optionally starts
+    // the watcher. Blocks for the initial scan; call from a worker thread.
+    void Open(const std::wstring& root, const std::string& indexFile, bool watch) {
+        Close();
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_root = root;
+            while (!m_root.empty() && (m_root.back() == L'\\' || m_root.back() == L'/')) m_root.pop_back();
+            m_indexFile = indexFile;
+            m_files.clear();
+            m_ignore = IgnoreRules();
+            m_ignore.AddFile(m_root + L"\\.gitignore");
+            m_ignore.AddFile(m_root + L"\\.novaignore");
+
+            // Nova's own runtime files (log, history, caches) must not feed the watcher when the exe lives in the workspace
+            std::wstring exeDir = StringToWString(GetExeDir());
+            if (exeDir.size() > m_root.size() && _wcsnicmp(exeDir.c_str(), m_root.c_str(), m_root.size()) == 0 && exeDir[m_root.size()] == L'\\') {
+                std::string relExe = WStringToString(exeDir.substr(m_root.size() + 1));
+                std::replace(relExe.begin(), relExe.end(), '\\', '/');
+                m_ignore.Add("/" + relExe + "nova_*");
+            } else if (_wcsicmp(exeDir.c_str(), (m_root + L"\\").c_str()) == 0) {
+                m_ignore.Add("/nova_*");
+            }
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        bool loaded = Load();
+        double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        size_t parsed = Rescan();
+        if (m_cancel) return;
+        if (parsed || !loaded) Save();
+        DevLog("[Workspace] %s: %zu files, %zu symbols (index load %.1f ms, %zu re-parsed)\n",
+               WStringToString(m_root).c_str(), Files(), Symbols(), loadMs, parsed);
+        if (watch) {
+            m_stopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+            m_watcher = std::thread([this] { WatchLoop(); });
+        }
+    }
+
+    // At exit: a running Open stops after the file it is parsing, keeps the saved index as it was
+    // and starts no watcher
+    void Cancel() { m_cancel = true; }
+    bool Cancelled() const { return m_cancel; }
+
+    void Close() {
+        if (m_watcher.joinable()) {
+            SetEvent(m_stopEvent);
+            m_watcher.join();
+        }
+        if (m_stopEvent) { CloseHandle(m_stopEvent); m_stopEvent = nullptr; }
+        if (m_dirty) Save();
+    }
+
+    // Full walk; only new or changed files are parsed. Returns the number parsed.
+    size_t Rescan() {
+        auto t0 = std::chrono::steady_clock::now();
+        std::wstring root;
+        IgnoreRules ignore;
+        { std::lock_guard<std::mutex> lk(m_mutex); root = m_root; ignore = m_ignore; }
+        std::vector<WalkEntry> walked;
+        WalkWorkspace(root, ignore, "", walked);
+        double walkMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+        std::unordered_map<std::string, IndexedFile> next;
+        std::vector<std::string> changed;
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            next.reserve(walked.size());
+            for (auto& w : walked) {
+                auto it = m_files.find(w.rel);
+                if (it != m_files.end() && it->second.size == w.size && it->second.mtime == w.mtime) {
+                    next[w.rel] = std::move(it->second);
+                } else {
+                    IndexedFile& rec = next[w.rel];
+                    rec.size = w.size; rec.mtime = w.mtime;
+                    changed.push_back(w.rel);
+                }
+            }
+        }
+        ParseAll(root, changed, next);
+        if (m_cancel) return 0;   // half-parsed: the records would claim files are up to date
+        size_t removed = 0;
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            for (const auto& kv : m_files) if (!next.count(kv.first)) removed++;
+            m_files = std::move(next);
+            if (!changed.empty() || removed) { m_dirty = true; m_generation++; }
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        DevLog("[Workspace] Rescan: %zu files walked in %.1f ms, %zu parsed, %zu removed, %.1f ms total\n",
+               walked.size(), walkMs, changed.size(), removed, ms);
+        return changed.size();
+    }
+
+    // Targeted refresh for paths reported by the watcher (files or directories, '/'-separated)
+    size_t Update(const std::vector<std::string>& rels) {
+        std::wstring root;
+        IgnoreRules ignore;
+        { std::lock_guard<std::mutex> lk(m_mutex); root = m_root; ignore = m_ignore; }
+
+        std::unordered_map<std::string, IndexedFile> fresh;
+        std::vector<std::string> gone, toParse;
+        for (const auto& rel : rels) {
+            WIN32_FILE_ATTRIBUTE_DATA fa = {};
+            std::string relLower = ToLowerAscii(rel);
+            if (!GetFileAttributesExW(WorkspacePath(root, rel).c_str(), GetFileExInfoStandard, &fa)) { gone.push_back(rel); continue; }
+            bool isDir = (fa.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+            if (ignore.IgnoredPath(relLower, isDir)) continue;
+            if (isDir) {
+                // New or renamed directory: index its contents
+                std::vector<WalkEntry> walked;
+                WalkWorkspace(root, ignore, rel, walked);
+                for (auto& w : walked) { IndexedFile& f = fresh[w.rel]; f.size = w.size; f.mtime = w.mtime; }
+                continue;
+            }
+            size_t slash = relLower.rfind('/');
+            if (!IsIndexedName(slash == std::string::npos ? relLower : relLower.substr(slash + 1))) continue;
+            IndexedFile& f = fresh[rel];
+            f.size  = (ULONGLONG)fa.nFileSizeHigh << 32 | fa.nFileSizeLow;
+            f.mtime = FileTimeU64(fa.ftLastWriteTime);
+        }
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            for (auto it = fresh.begin(); it != fresh.end(); ) {
+                auto old = m_files.find(it->first);
+                if (old != m_files.end() && old->second.size == it->second.size && old->second.mtime == it->second.mtime) it = fresh.erase(it);
+                else { toParse.push_back(it->first); ++it; }
+            }
+        }
+        ParseAll(root, toParse, fresh);
+
+        std::lock_guard<std::mutex> lk(m_mutex);
+        size_t removed = 0;
+        for (const auto& rel : gone) {
+            removed += m_files.erase(rel);
+            std::string prefix = rel + "/";   // a deleted or renamed-away directory
+            for (auto it = m_files.begin(); it != m_files.end(); ) {
+                if (it->first.compare(0, prefix.size(), prefix) == 0) { it = m_files.erase(it); removed++; }
+                else ++it;
+            }
+        }
+        for (auto& kv : fresh) m_files[kv.first] = std::move(kv.second);
+        if (!toParse.empty() || removed) { m_dirty = true; m_generation++; }
+        return toParse.size() + removed;
+    }
+
+    // Whether a request is about the workspace: it says so, or names one of its files (by name or
+    // stem) or a defined symbol of 5+ characters. Requests that are not get no summary.
+    bool Relevant(const std::string& query) {
+        std::vector<std::string> terms;
+        std::string cur, lower;
+        for (char c : query + " ") {
+            lower += (char)tolower((unsigned char)c);
+            if (IsIdentChar(c) || c == '.') cur += (char)tolower((unsigned char)c);
+            else { if (cur.size() >= 3) terms.push_back(cur); cur.clear(); }
+        }
+        for (const char* w : { "workspace", "project", "codebase", "repo", "repository", "source code", "my code", "this code" })
+            if (lower.find(w) != std::string::npos) return true;
+        if (terms.empty()) return false;
+        std::unordered_set<std::string> wanted(terms.begin(), terms.end());
+        for (const std::string& t : terms) {   // "parser.cpp" also asks about "parser"
+            size_t dot = t.rfind('.');
+            if (dot != std::string::npos && dot >= 3) wanted.insert(t.substr(0, dot));
+        }
+        std::lock_guard<std::mutex> lk(m_mutex);
+        for (const auto& kv : m_files) {
+            size_t slash = kv.first.rfind('/');
+            std::string name = ToLowerAscii(slash == std::string::npos ? kv.first : kv.first.substr(slash + 1));
+            size_t dot = name.rfind('.');
+            if (wanted.count(name) || (dot != std::string::npos && wanted.count(name.substr(0, dot)))) return true;
+            for (const auto& sym : kv.second.symbols)
+                if (sym.kind != 'i' && sym.name.size() >= 5 && wanted.count(ToLowerAscii(sym.name))) return true;
+        }
+        return false;
+    }
+
+    // Ranked listing cut to `budget` chars: recently edited files, files and symbols matching the
+    // query, and shallow paths float to the top. Each line carries the file's key symbols.
+    std::string Summary(const std::string& query, size_t budget) {
+        std::vector<std::string> terms;
+        {
+            std::string cur;
+            for (char c : query + " ") {
+                if (IsIdentChar(c)) cur += (char)tolower((unsigned char)c);
+                else { if (cur.size() >= 3) terms.push_back(cur); cur.clear(); }
+            }
+        }
+        FILETIME nowFt;
+        GetSystemTimeAsFileTime(&nowFt);
+        ULONGLONG now = FileTimeU64(nowFt);
+
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_files.empty()) return "";
+
+        struct Ranked { double score; const std::string* rel; const IndexedFile* file; };
+        std::vector<Ranked> ranked;
+        ranked.reserve(m_files.size());
+        size_t symbolTotal = 0;
+        for (const auto& kv : m_files) {
+            const IndexedFile& f = kv.second;
+            symbolTotal += f.symbols.size();
+            double ageDays = now > f.mtime ? (now - f.mtime) / 864e9 : 0.0;
+            double score = 2.0 / (1.0 + ageDays) - 0.1 * std::count(kv.first.begin(), kv.first.end(), '/');
+            if (!f.symbols.empty()) score += 0.5;
+            for (const auto& t : terms) {
+                if (ContainsNoCase(kv.first, t)) score += 4.0;
+                int hits = 0;
+                for (const auto& s : f.symbols) if (s.kind != 'i' && ContainsNoCase(s.name, t) && ++hits >= 3) break;
+                score += 2.0 * hits;
+            }
+            ranked.push_back({ score, &kv.first, &f });
+        }
+        size_t keep = (std::min)(ranked.size(), (size_t)400);
+        std::partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(),
+                          [](const Ranked& a, const Ranked& b) { return a.score > b.score; });
+
+        char head[512];
+        sprintf_s(head, "Root: %s | %zu files, %zu symbols indexed\n", WStringToString(m_root).c_str(), m_files.size(), symbolTotal);
+        std::string out = head;
+        size_t shown = 0;
+        for (size_t i = 0; i < keep; i++) {
+            std::string line = FormatEntry(*ranked[i].rel, *ranked[i].file, terms, now);
+            if (out.size() + line.size() > budget) break;
+            out += line;
+            shown++;
+        }
+        if (shown < m_files.size()) out += "(+" + std::to_string(m_files.size() - shown) + " more files not listed)\n";
+        return out;
+    }
+
+    bool Save() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_indexFile.empty()) return false;
+        // "NVWI" u32 version, u32 rootLen, root, u32 count, then per file:
+        //   u16 pathLen, path, u64 size, u64 mtime, u16 symbols, per symbol: u8 kind, u32 line, u8 nameLen, name
+        std::string out = "NVWI";
+        auto put = [&](const void* p, size_t n) { out.append((const char*)p, n); };
+        DWORD version = kIndexVersion;
+        std::string root = WStringToString(m_root);
+        DWORD rootLen = (DWORD)root.size(), count = (DWORD)m_files.size();
+        put(&version, 4); put(&rootLen, 4); out += root; put(&count, 4);
+        for (const auto& kv : m_files) {
+            WORD pathLen = (WORD)(std::min)(kv.first.size(), (size_t)0xFFFF);
+            put(&pathLen, 2); out.append(kv.first, 0, pathLen);
+            put(&kv.second.size, 8); put(&kv.second.mtime, 8);
+            WORD n = (WORD)kv.second.symbols.size();
+            put(&n, 2);
+            for (const auto& s : kv.second.symbols) {
+                BYTE len = (BYTE)(std::min)(s.name.size(), (size_t)255);
+                DWORD line = (DWORD)s.line;
+                put(&s.kind, 1); put(&line, 4); put(&len, 1); out.append(s.name, 0, len);
+            }
+        }
+        std::string tmp = m_indexFile + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+            if (!f.write(out.data(), (std::streamsize)out.size())) { DevLog("[Workspace] ERROR: could not write %s\n", tmp.c_str()); return false; }
+        }
+        if (!MoveFileExW(StringToWString(tmp).c_str(), StringToWString(m_indexFile).c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            DevLog("[Workspace] ERROR: could not replace %s GLE=%lu\n", m_indexFile.c_str(), GetLastError());
+            return false;
+        }
+        m_dirty = false;
+        return true;
+    }
+
+    size_t Files()   { std::lock_guard<std::mutex> lk(m_mutex); return m_files.size(); }
+    size_t Symbols() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        size_t n = 0;
+        for (const auto& kv : m_files) n += kv.second.symbols.size();
+        return n;
+    }
+
+    // Marks one file stale so the next Update() re-parses it (benchmarks)
+    void Invalidate(const std::string& rel) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        auto it = m_files.find(rel);
+        if (it != m_files.end()) it->second.mtime = 0;
+    }
+
+    std::vector<std::string> Paths() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        std::vector<std::string> v;
+        for (const auto& kv : m_files) v.push_back(kv.first);
+        return v;
+    }
+
+    // Bumped whenever the file set changes, so consumers can skip re-syncing an unchanged index
+    ULONGLONG    Generation() const { return m_generation; }
+    std::wstring Root()             { std::lock_guard<std::mutex> lk(m_mutex); return m_root; }
+
+    // Path, size and mtime of every indexed file
+    std::vector<WalkEntry> Stamps() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        std::vector<WalkEntry> v;
+        v.reserve(m_files.size());
+        for (const auto& kv : m_files) v.push_back({ kv.first, kv.second.size, kv.second.mtime });
+        return v;
+    }
+
+private:
+    static const DWORD kIndexVersion = 1;
+
+    static bool ContainsNoCase(const std::string& hay, const std::string& needleLower) {
+        if (needleLower.size() > hay.size()) return false;
+        auto it = std::search(hay.begin(), hay.end(), needleLower.begin(), needleLower.end(),
+                              [](char a, char b) { return tolower((unsigned char)a) == b; });
+        return it != hay.end();
+    }
+
+    static std::string FormatEntry(const std::string& rel, const IndexedFile& f, const std::vector<std::string>& terms, ULONGLONG now) {
+        double ageH = now > f.mtime ? (now - f.mtime) / 36e9 : 0.0;
+        char age[32];
+        if      (ageH < 1.0 / 60) strcpy_s(age, "just now");
+        else if (ageH < 1)        sprintf_s(age, "%.0fm ago", ageH * 60);
+        else if (ageH < 48)       sprintf_s(age, "%.0fh ago", ageH);
+        else                      sprintf_s(age, "%.0fd ago", ageH / 24);
+        char head[64];
+        sprintf_s(head, " (%.1f KB, %s)", f.size / 1024.0, age);
+        std::string line = "- " + rel + head;
+
+        // Query matches first, then definition order; includes last
+        const char* labels[] = { "fn", "types", "inc" };
+        const char  kinds[]  = { 'f', 't', 'i' };
+        for (int k = 0; k < 3; k++) {
+            std::vector<const CodeSymbol*> pick;
+            for (const auto& s : f.symbols)
+                if (s.kind == kinds[k] && std::any_of(terms.begin(), terms.end(), [&](const std::string& t) { return ContainsNoCase(s.name, t); }))
+                    pick.push_back(&s);
+            for (const auto& s : f.symbols)
+                if (s.kind == kinds[k] && std::find(pick.begin(), pick.end(), &s) == pick.end()) pick.push_back(&s);
+            if (pick.empty()) continue;
+            line += std::string(k == 0 || line.back() == ')' ? " — " : " | ") + labels[k] + ": ";
+            size_t limit = k == 2 ? 4 : 8;
+            for (size_t i = 0; i < pick.size() && i < limit; i++) line += (i ? ", " : "") + pick[i]->name;
+            if (pick.size() > limit) line += ", +" + std::to_string(pick.size() - limit);
+        }
+        return line + "\n";
+    }
+
+    // Parses `rels` (already present in `into` with size/mtime set) on a pool
+    void ParseAll(const std::wstring& root, const std::vector<std::string>& rels, std::unordered_map<std::string, IndexedFile>& into) {
+        if (rels.empty()) return;
+        std::vector<IndexedFile*> slots;
+        for (const auto& r : rels) slots.push_back(&into[r]);
+        WorkerPool pool((int)(std::min)((size_t)(std::max)(std::thread::hardware_concurrency(), 2u), rels.size()));
+        const size_t batch = 64;
+        for (size_t i = 0; i < rels.size(); i += batch) {
+            pool.Submit([&, i] {
+                for (size_t k = i; k < rels.size() && k < i + batch && !m_cancel; k++) {
+                    size_t slash = rels[k].rfind('/');
+                    ParseIndexedFile(WorkspacePath(root, rels[k]),
+                                     ToLowerAscii(slash == std::string::npos ? rels[k] : rels[k].substr(slash + 1)), *slots[k]);
+                }
+            });
+        }
+        pool.Wait();
+    }
+
+    bool Load() {
+        if (m_indexFile.empty()) return false;
+        MappedFile mf(StringToWString(m_indexFile));
+        if (!mf.IsOpen()) return false;
+        const BYTE* p = mf.Data();
+        const BYTE* end = p + mf.Size();
+        if (end - p < 16 || memcmp(p, "NVWI", 4) != 0 || ReadLE32(p + 4) != kIndexVersion) return false;
+        DWORD rootLen = ReadLE32(p + 8);
+        p += 12;
+        if ((ULONGLONG)(end - p) < (ULONGLONG)rootLen + 4) return false;
+        std::string root((const char*)p, rootLen);
+        p += rootLen;
+        if (_stricmp(root.c_str(), WStringToString(m_root).c_str()) != 0) return false;   // index of another folder
+        DWORD count = ReadLE32(p);
+        p += 4;
+
+        std::unordered_map<std::string, IndexedFile> files;
+        files.reserve(count);
+        for (DWORD i = 0; i < count; i++) {
+            if (end - p < 2) return false;
+            WORD pathLen = ReadLE16(p); p += 2;
+            if (end - p < (ptrdiff_t)pathLen + 18) return false;
+            IndexedFile& f = files[std::string((const char*)p, pathLen)];
+            p += pathLen;
+            f.size  = ReadLE64(p);
+            f.mtime = ReadLE64(p + 8);
+            WORD n  = ReadLE16(p + 16);
+            p += 18;
+            f.symbols.resize(n);
+            for (WORD k = 0; k < n; k++) {
+                if (end - p < 6) return false;
+                f.symbols[k].kind = (char)p[0];
+                f.symbols[k].line = (int)ReadLE32(p + 1);
+                BYTE len = p[5];
+                p += 6;
+                if (end - p < len) return false;
+                f.symbols[k].name.assign((const char*)p, len);
+                p += len;
+            }
+        }
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_files = std::move(files);
+        m_generation++;
+        return true;
+    }
+
+    // Overlapped ReadDirectoryChangesW on the root. Changes are coalesced for 150 ms, applied with
+    // Update(), and the index is saved after 2 s without further changes. A buffer overflow
+    // (too many changes at once) falls back to a full mtime rescan.
+    void WatchLoop() {
+        HANDLE dir = CreateFileW(m_root.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                 nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+        if (dir == INVALID_HANDLE_VALUE) { DevLog("[Workspace] Watcher: cannot open root GLE=%lu\n", GetLastError()); return; }
+        std::vector<DWORD> buf(16 * 1024);   // DWORD-aligned, as ReadDirectoryChangesW requires
+        OVERLAPPED ov = {};
+        ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        HANDLE waits[2] = { ov.hEvent, m_stopEvent };
+        std::vector<std::string> pending;
+        bool armed = false;
+
+        for (;;) {
+            if (!armed) {
+                ResetEvent(ov.hEvent);
+                if (!ReadDirectoryChangesW(dir, buf.data(), (DWORD)(buf.size() * sizeof(DWORD)), TRUE,
+                                           FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                                           FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE, nullptr, &ov, nullptr)) {
+                    DevLog("[Workspace] Watcher: ReadDirectoryChangesW failed GLE=%lu\n", GetLastError());
+                    break;
+                }
+                armed = true;
+            }
+            DWORD timeout = !pending.empty() ? 150 : m_dirty ? 2000 : INFINITE;
+            DWORD wr = WaitForMultipleObjects(2, waits, FALSE, timeout);
+            if (wr == WAIT_OBJECT_0 + 1) break;
+            if (wr == WAIT_TIMEOUT) {
+                if (!pending.empty()) {
+                    auto t0 = std::chrono::steady_clock::now();
+                    std::sort(pending.begin(), pending.end());
+                    pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+                    size_t n = Update(pending);
+                    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+                    if (n) DevLog("[Workspace] %zu change(s) applied from %zu event path(s) in %.2f ms\n", n, pending.size(), ms);
+                    pending.clear();
+                } else if (m_dirty) {
+                    Save();
+                }
+                continue;
+            }
+
+            armed = false;
+            DWORD got = 0;
+            if (!GetOverlappedResult(dir, &ov, &got, FALSE)) break;
+            if (got == 0) {
+                DevLog("[Workspace] Watcher overflow — rescanning\n");
+                pending.clear();
+                Rescan();
+                continue;
+            }
+            const BYTE* p = (const BYTE*)buf.data();
+            for (;;) {
+                const FILE_NOTIFY_INFORMATION* fni = (const FILE_NOTIFY_INFORMATION*)p;
+                std::string rel = WStringToString(std::wstring(fni->FileName, fni->FileNameLength / sizeof(WCHAR)));
+                std::replace(rel.begin(), rel.end(), '\\', '/');
+                pending.push_back(std::move(rel));
+                if (!fni->NextEntryOffset) break;
+                p += fni->NextEntryOffset;
+            }
+        }
+
+        if (armed) {
+            DWORD got = 0;
+            CancelIoEx(dir, &ov);
+            GetOverlappedResult(dir, &ov, &got, TRUE);
+        }
+        CloseHandle(ov.hEvent);
+        CloseHandle(dir);
+    }
+
+    std::mutex                                   m_mutex;
+    std::wstring                                 m_root;
+    std::string                                  m_indexFile;
+    IgnoreRules                                  m_ignore;
+    std::unordered_map<std::string, IndexedFile> m_files;
+    std::atomic<bool>                            m_dirty{false};
+    std::atomic<bool>                            m_cancel{false};
+    std::atomic<ULONGLONG>                       m_generation{0};
+    std::thread                                  m_watcher;
+    HANDLE                                       m_stopEvent = nullptr;
+};
+
+static WorkspaceIndex g_workspace;
+
+// workspace_dir from the config; empty (the default) means no workspace is indexed
+static std::wstring WorkspaceRoot() {
+    return StringToWString(g_config.workspaceDir);
+}
+
+// Characters of workspace summary per prompt: small local contexts get less
+static size_t WorkspaceBudget() {
+    if (g_providerPresets[g_config.provider].needsApiKey) return 4000;
+    return (std::min)((size_t)4000, (size_t)(std::max)(g_config.contextSize, 2048) / 2);
+}
+
+// One-shot index of an arbitrary folder (no persistence, no watcher); returns the ranked summary
+std::string IndexProjectDirectory(const std::string& targetPath) {
+    WorkspaceIndex index;
+    index.Open(StringToWString(targetPath), "", false);
+    return "PROJECT DIRECTORY MAP:\n" + index.Summary("", 4000);
+}
+
+// ════════════════════════════════════════════════════════════════
+// CODE RETRIEVAL
+// ════════════════════════════════════════════════════════════════
+// BM25 over function/class-sized chunks of the workspace files, so "how does X work in my
+// project" reaches the code that implements X without a manual attachment. Chunk boundaries
+// come from the workspace symbols; identifiers are split on camelCase and snake_case so
+// "frame header" finds parseFrameHeader. The index follows the workspace generation: only
+// files whose size or mtime changed are re-chunked, replaced chunks are tombstoned and the
+// postings are compacted once half of them are dead.
+
+static const int    kChunkMaxLines      = 80;    // longer definitions are split into windows
+static const int    kChunkWindowLines   = 60;
+static const int    kChunkMinLines      = 6;     // shorter spans merge into the next one
+static const size_t kMaxMinifiedLineAvg = 400;   // average bytes per line above which a file is skipped
+static const double kMinRetrievalScore  = 8.0;   // below this the best chunk is noise, inject nothing
+static const double kRetrievalKeepRatio = 0.5;   // later chunks must score at least half the best one
+
+struct CodeChunk {
+    DWORD       file = 0;              // index into the retriever's path table
+    DWORD       line0 = 0, line1 = 0;  // 1-based, inclusive
+    DWORD       offset = 0, length = 0;
+    DWORD       tokens = 0;            // BM25 document length
+    bool        dead = false;
+    std::string title;                 // symbol the chunk starts with, if any
+};
+
+struct ChunkedFile {
+    std::vector<CodeChunk>                                 chunks;
+    std::vector<std::vector<std::pair<std::string, WORD>>> terms;   // per chunk: term, frequency
+};
+
+// Keywords and question words that would otherwise dominate every query
+static bool IsRetrievalStopword(const std::string& t) {
+    static const std::unordered_set<std::string> stop = [] {
+        std::unordered_set<std::string> s;
+        for (const char* w : { "the","and","for","if","else","return","int","void","const","static","std","string","auto",
+                               "true","false","this","self","def","function","var","let","new","nullptr","null","none",
+                               "include","in","is","of","to","an","or","not","with","from","import","public","private",
+                               "protected","struct","class","char","bool","size_t","unsigned","while","break","continue",
+                               "how","does","do","what","where","which","why","when","who","my","me","it","its","work",
+                               "works","project","code","can","you","please","explain","show","that","there","be","are" })
+            s.insert(w);
+        return s;
+    }();
+    return stop.count(t) != 0;
+}
+
+// Calls emit(term) for each identifier and each of its camelCase/snake_case parts, lowercased:
+// "parseFrameHeader" -> parse, frame, header, parseframeheader; "HTTPServer" -> http, server, httpserver.
+// Stopwords are not filtered here; callers drop them once per distinct term.
+template <class Fn>
+static void ForEachCodeToken(const char* p, size_t n, Fn emit) {
+    std::string whole, part;
+    size_t i = 0;
+    while (i < n) {
+        unsigned char c = (unsigned char)p[i];
+        if (!isalnum(c) && c != '_') { i++; continue; }
+        size_t s = i;
+        while (i < n && (isalnum((unsigned char)p[i]) || p[i] == '_')) i++;
+        if (isdigit((unsigned char)p[s]) || i - s > 64) continue;
+
+        whole.clear();
+        for (size_t k = s; k < i; k++) whole += (char)tolower((unsigned char)p[k]);
+        size_t ps = s;
+        auto flush = [&](size_t pe) {
+            part.clear();
+            bool digits = true;
+            for (size_t k = ps; k < pe; k++) { if (p[k] == '_') continue; part += (char)tolower((unsigned char)p[k]); digits &= isdigit((unsigned char)p[k]) != 0; }
+            if (part.size() >= 2 && part.size() < whole.size() && !digits) emit(part);
+            ps = pe;
+        };
+        for (size_t k = s + 1; k < i; k++) {
+            char a = p[k - 1], b = p[k];
+            bool boundary = b == '_' ||
+                            (a == '_' && b != '_') ||
+                            (isupper((unsigned char)b) && (islower((unsigned char)a) || isdigit((unsigned char)a))) ||
+                            (isupper((unsigned char)a) && isupper((unsigned char)b) && k + 1 < i && islower((unsigned char)p[k + 1]));
+            if (boundary) flush(k);
+        }
+        flush(i);
+        if (whole.size() >= 2) emit(whole);
+    }
+}
+
+// Comment and decorator lines directly above a definition belong to its chunk
+static bool IsLeadInLine(const char* p, size_t n, SrcLang lang) {
+    size_t i = 0;
+    while (i < n && (p[i] == ' ' || p[i] == '\t')) i++;
+    if (i >= n) return false;
+    if (p[i] == '@' || (p[i] == '*' && lang != SrcLang::Python)) return true;
+    if (i + 1 < n && p[i] == '/' && (p[i + 1] == '/' || p[i + 1] == '*')) return true;
+    return p[i] == '#' && (lang == SrcLang::Python || lang == SrcLang::None);
+}
+
+// Splits one file into chunks and counts each chunk's terms. The symbol name is counted three
+// times and the file name's parts once, a light field weighting on top of the body text.
+static void ChunkSourceFile(const char* data, size_t size, SrcLang lang, const std::string& rel, ChunkedFile& out) {
+    std::vector<size_t> starts;   // byte offset of each line, plus a final sentinel
+    starts.push_back(0);
+    for (size_t i = 0; i < size; i++) if (data[i] == '\n' && i + 1 < size) starts.push_back(i + 1);
+    int lineCount = (int)starts.size();
+    starts.push_back(size);
+    if (size / lineCount > kMaxMinifiedLineAvg) return;
+
+    struct Span { int l0, l1; std::string title; };
+    std::vector<Span> spans;
+    std::vector<CodeSymbol> symbols;
+    if (lang != SrcLang::None) ExtractSymbols(data, size, lang, symbols);
+    std::vector<std::pair<int, std::string>> bounds;
+    for (const auto& s : symbols) {
+        if (s.kind == 'i' || s.line < 1 || s.line > lineCount) continue;
+        int l = s.line;
+        int lowest = bounds.empty() ? 1 : bounds.back().first + 1;
+        while (l - 1 >= lowest && IsLeadInLine(data + starts[l - 2], starts[l - 1] - starts[l - 2], lang)) l--;
+        if (bounds.empty() || l > bounds.back().first) bounds.push_back({ l, s.name });
+    }
+    if (bounds.empty() || bounds[0].first > 1) bounds.insert(bounds.begin(), { 1, "" });
+    for (size_t i = 0; i < bounds.size(); i++)
+        spans.push_back({ bounds[i].first, i + 1 < bounds.size() ? bounds[i + 1].first - 1 : lineCount, bounds[i].second });
+
+    // Merge runs of tiny spans (prototypes, one-line helpers), then window the long ones
+    std::vector<Span> merged;
+    for (auto& s : spans) {
+        if (!merged.empty() && merged.back().l1 - merged.back().l0 + 1 < kChunkMinLines) {
+            merged.back().l1 = s.l1;
+            if (merged.back().title.empty()) merged.back().title = s.title;
+        } else {
+            merged.push_back(s);
+        }
+    }
+    std::vector<Span> windows;
+    for (auto& s : merged) {
+        if (s.l1 - s.l0 + 1 <= kChunkMaxLines) { windows.push_back(s); continue; }
+        for (int l = s.l0; l <= s.l1; l += kChunkWindowLines)
+            windows.push_back({ l, (std::min)(s.l1, l + kChunkWindowLines - 1), s.title });
+    }
+
+    std::vector<std::string> nameTerms;
+    size_t slash = rel.rfind('/');
+    std::string base = slash == std::string::npos ? rel : rel.substr(slash + 1);
+    ForEachCodeToken(base.data(), base.size(), [&](const std::string& t) { nameTerms.push_back(t); });
+
+    std::unordered_map<std::string, WORD> tf;
+    for (const auto& s : windows) {
+        tf.clear();
+        auto add = [&](const std::string& t, int w) { WORD& v = tf[t]; v = (WORD)(std::min)(0xFFFF, v + w); };
+        size_t a = starts[s.l0 - 1], e = starts[s.l1];
+        ForEachCodeToken(data + a, e - a, [&](const std::string& t) { add(t, 1); });
+        ForEachCodeToken(s.title.data(), s.title.size(), [&](const std::string& t) { add(t, 3); });
+        for (const auto& t : nameTerms) add(t, 1);
+
+        CodeChunk c;
+        std::vector<std::pair<std::string, WORD>> terms;
+        terms.reserve(tf.size());
+        for (const auto& t : tf) {
+            c.tokens += t.second;
+            if (!IsRetrievalStopword(t.first)) terms.push_back(t);
+        }
+        if (terms.empty()) continue;
+        c.line0 = s.l0; c.line1 = s.l1;
+        c.offset = (DWORD)a; c.length = (DWORD)(e - a);
+        c.title = s.title;
+        out.chunks.push_back(std::move(c));
+        out.terms.push_back(std::move(terms));
+    }
+}
+
+class CodeRetriever {
+public:
+    struct Hit {
+        std::string path, title, text;
+        DWORD       line0 = 0, line1 = 0;
+        double      score = 0;
+    };
+
+    // Brings the chunk index in line with the workspace index. Returns the number of files
+    // (re)chunked. With wait=false a sync already running elsewhere is not waited for.
+    size_t Sync(WorkspaceIndex& ws, bool wait = true) {
+        std::unique_lock<std::mutex> syncLock(m_syncMutex, std::defer_lock);
+        if (wait) syncLock.lock();
+        else if (!syncLock.try_lock()) return 0;
+
+        ULONGLONG gen = ws.Generation();
+        std::wstring root = ws.Root();
+        if (root.empty()) return 0;
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if (gen == m_generation && root == m_root) return 0;
+            if (root != m_root) Reset(root);
+        }
+        auto t0 = std::chrono::steady_clock::now();
+
+        // m_files is only modified here, under m_syncMutex, so reading it unlocked is safe
+        std::vector<WalkEntry> stamps = ws.Stamps();
+        std::unordered_set<std::string> present;
+        present.reserve(stamps.size());
+        std::vector<const WalkEntry*> changed;
+        for (const auto& w : stamps) {
+            present.insert(w.rel);
+            auto it = m_files.find(w.rel);
+            if (it == m_files.end() || it->second.size != w.size || it->second.mtime != w.mtime) changed.push_back(&w);
+        }
+        std::vector<std::string> removed;
+        for (const auto& kv : m_files) if (!present.count(kv.first)) removed.push_back(kv.first);
+
+        std::vector<ChunkedFile> parsed(changed.size());
+        if (!changed.empty()) {
+            WorkerPool pool((int)(std::min)((size_t)(std::max)(std::thread::hardware_concurrency(), 2u), changed.size()));
+            const size_t batch = 32;
+            for (size_t i = 0; i < changed.size(); i += batch) {
+                pool.Submit([&, i] {
+                    for (size_t k = i; k < changed.size() && k < i + batch; k++) {
+                        const WalkEntry& w = *changed[k];
+                        if (w.size == 0 || w.size > kMaxSymbolFileBytes) continue;
+                        MappedFile mf(WorkspacePath(root, w.rel));
+                        if (!mf.IsOpen()) continue;
+                        std::string nameLower = ToLowerAscii(w.rel.substr(w.rel.rfind('/') + 1));
+                        ChunkSourceFile((const char*)mf.Data(), (size_t)mf.Size(), SourceLanguage(LowerExtOf(nameLower)), w.rel, parsed[k]);
+                    }
+                });
+            }
+            pool.Wait();
+        }
+        double parseMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+        size_t added = 0, live = 0, terms = 0;
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            for (const auto& rel : removed) Retire(rel);
+            for (size_t k = 0; k < changed.size(); k++) {
+                Retire(changed[k]->rel);
+                added += Insert(*changed[k], parsed[k]);
+            }
+            if (m_dead > 4096 && m_dead > m_live) Compact();
+            m_generation = gen;
+            live = m_live;
+            terms = m_postings.size();
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        if (!changed.empty() || !removed.empty())
+            DevLog("[Retrieval] Sync: %zu file(s) chunked (%zu chunks) in %.1f ms, %zu removed, %zu live chunks, %zu terms, %.1f ms total\n",
+                   changed.size(), added, parseMs, removed.size(), live, terms, ms);
+        return changed.size();
+    }
+
+    // Top chunks for `query`, at most two per file, best first. Chunk text is read back from disk.
+    std::vector<Hit> Query(const std::string& query, size_t maxHits) {
+        std::vector<std::string> terms;
+        ForEachCodeToken(query.data(), query.size(), [&](const std::string& t) {
+            if (!IsRetrievalStopword(t) && std::find(terms.begin(), terms.end(), t) == terms.end()) terms.push_back(t);
+        });
+
+        std::vector<Hit> hits;
+        std::vector<DWORD> offsets, lengths;
+        std::wstring root;
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if (terms.empty() || m_live == 0) return hits;
+            root = m_root;
+            const double k1 = 1.2, b = 0.75;
+            double N = (double)m_live, avgdl = (double)m_liveTokens / m_live;
+            m_scores.resize(m_chunks.size(), 0.0f);
+            m_matched.resize(m_chunks.size(), 0);
+            m_touched.clear();
+            for (const auto& t : terms) {
+                auto it = m_termIds.find(t);
+                if (it == m_termIds.end()) continue;
+                const auto& list = m_postings[it->second];
+                double df = (double)(std::min)(list.size(), (size_t)m_live);   // tombstones inflate df slightly until compaction
+                double idf = log(1.0 + (N - df + 0.5) / (df + 0.5));
+                for (const auto& p : list) {
+                    const CodeChunk& c = m_chunks[p.chunk];
+                    if (c.dead) continue;
+                    double tf = p.tf;
+                    if (m_matched[p.chunk] == 0) m_touched.push_back(p.chunk);
+                    m_scores[p.chunk] += (float)(idf * tf * (k1 + 1) / (tf + k1 * (1 - b + b * c.tokens / avgdl)));
+                    if (m_matched[p.chunk] < 255) m_matched[p.chunk]++;
+                }
+            }
+
+            // Chunks matching several distinct query terms beat ones repeating a single term
+            std::vector<std::pair<float, DWORD>> ranked;
+            ranked.reserve(m_touched.size());
+            for (DWORD id : m_touched) {
+                ranked.push_back({ m_scores[id] * (1.0f + 0.25f * (m_matched[id] - 1)), id });
+                m_scores[id] = 0.0f;
+                m_matched[id] = 0;
+            }
+            size_t keep = (std::min)(ranked.size(), maxHits * 4);
+            std::partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(), std::greater<std::pair<float, DWORD>>());
+
+            std::unordered_map<DWORD, int> perFile;
+            for (size_t i = 0; i < keep && hits.size() < maxHits; i++) {
+                const CodeChunk& c = m_chunks[ranked[i].second];
+                if (++perFile[c.file] > 2) continue;
+                Hit h;
+                h.path = m_paths[c.file];
+                h.title = c.title;
+                h.line0 = c.line0; h.line1 = c.line1;
+                h.score = ranked[i].first;
+                hits.push_back(std::move(h));
+                offsets.push_back(c.offset);
+                lengths.push_back(c.length);
+            }
+        }
+        for (size_t i = 0; i < hits.size(); i++) {
+            MappedFile mf(WorkspacePath(root, hits[i].path));
+            if (mf.IsOpen() && (ULONGLONG)offsets[i] + lengths[i] <= mf.Size())
+                hits[i].text.assign((const char*)mf.Data() + offsets[i], lengths[i]);
+        }
+        return hits;
+    }
+
+    // The best chunks formatted for the system prompt, cut to `budget` chars. Empty when nothing
+    // scores above the noise floor; chunks well behind the best one are left out.
+    std::string Context(const std::string& query, size_t budget) {
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<Hit> hits = Query(query, 8);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        if (hits.empty() || hits[0].score < kMinRetrievalScore) return "";
+
+        std::string out;
+        size_t used = 0;
+        for (auto& h : hits) {
+            if (h.text.empty() || h.score < hits[0].score * kRetrievalKeepRatio) continue;
+            while (!h.text.empty() && (h.text.back() == '\n' || h.text.back() == '\r' || h.text.back() == ' ')) h.text.pop_back();
+            std::string head = "--- " + h.path + ":" + std::to_string(h.line0) + "-" + std::to_string(h.line1) +
+                               (h.title.empty() ? "" : " " + h.title) + " ---\n";
+            size_t need = head.size() + h.text.size() + 1;
+            if (out.size() + need > budget) {
+                if (!out.empty()) continue;   // a smaller chunk further down may still fit
+                size_t room = budget > head.size() + 40 ? budget - head.size() - 40 : 0;
+                if (room < 200) break;
+                h.text = h.text.substr(0, room) + "\n... (chunk truncated)";
+            }
+            out += head + h.text + "\n";
+            used++;
+        }
+        DevLog("[Retrieval] %zu chunk(s), %zu chars for the prompt (best score %.1f, query %.2f ms)\n",
+               used, out.size(), hits[0].score, ms);
+        return out;
+    }
+
+    size_t Chunks() { std::lock_guard<std::mutex> lk(m_mutex); return m_live; }
+    size_t Terms()  { std::lock_guard<std::mutex> lk(m_mutex); return m_postings.size(); }
+
+private:
+    struct Posting   { DWORD chunk; WORD tf; };
+    struct FileState { ULONGLONG size = 0, mtime = 0; std::vector<DWORD> chunks; };
+
+    void Reset(const std::wstring& root) {
+        m_root = root;
+        m_generation = ~0ull;
+        m_files.clear(); m_paths.clear(); m_chunks.clear();
+        m_termIds.clear(); m_postings.clear();
+        m_scores.clear(); m_matched.clear();
+        m_live = m_dead = 0;
+        m_liveTokens = 0;
+    }
+
+    void Retire(const std::string& rel) {
+        auto it = m_files.find(rel);
+        if (it == m_files.end()) return;
+        for (DWORD id : it->second.chunks) {
+            CodeChunk& c = m_chunks[id];
+            if (c.dead) continue;
+            c.dead = true;
+            m_live--; m_dead++;
+            m_liveTokens -= c.tokens;
+        }
+        m_files.erase(it);
+    }
+
+    size_t Insert(const WalkEntry& w, ChunkedFile& cf) {
+        FileState& fs = m_files[w.rel];
+        fs.size = w.size; fs.mtime = w.mtime;
+        if (cf.chunks.empty()) return 0;
+        DWORD fileId = (DWORD)m_paths.size();
+        m_paths.push_back(w.rel);
+        for (size_t i = 0; i < cf.chunks.size(); i++) {
+            DWORD id = (DWORD)m_chunks.size();
+            cf.chunks[i].file = fileId;
+            m_liveTokens += cf.chunks[i].tokens;
+            m_chunks.push_back(std::move(cf.chunks[i]));
+            fs.chunks.push_back(id);
+            for (const auto& t : cf.terms[i]) {
+                auto ins = m_termIds.emplace(t.first, (DWORD)m_postings.size());
+                if (ins.second) m_postings.emplace_back();
+                m_postings[ins.first->second].push_back({ id, t.second });
+            }
+        }
+        m_live += cf.chunks.size();
+        return cf.chunks.size();
+    }
+
+    // Drops tombstoned chunks and renumbers the rest; terms left without postings are removed
+    void Compact() {
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<DWORD> remap(m_chunks.size(), ~0u), fileRemap(m_paths.size(), ~0u);
+        std::vector<CodeChunk> chunks;
+        std::vector<std::string> paths;
+        chunks.reserve(m_live);
+        for (size_t i = 0; i < m_chunks.size(); i++) {
+            if (m_chunks[i].dead) continue;
+            CodeChunk& c = m_chunks[i];
+            if (fileRemap[c.file] == ~0u) { fileRemap[c.file] = (DWORD)paths.size(); paths.push_back(std::move(m_paths[c.file])); }
+            c.file = fileRemap[c.file];
+            remap[i] = (DWORD)chunks.size();
+            chunks.push_back(std::move(c));
+        }
+        for (auto& kv : m_files) for (auto& id : kv.second.chunks) id = remap[id];
+
+        std::unordered_map<std::string, DWORD> termIds;
+        std::vector<std::vector<Posting>> postings;
+        for (auto& kv : m_termIds) {
+            std::vector<Posting> list;
+            for (const auto& p : m_postings[kv.second]) if (remap[p.chunk] != ~0u) list.push_back({ remap[p.chunk], p.tf });
+            if (list.empty()) continue;
+            termIds.emplace(kv.first, (DWORD)postings.size());
+            postings.push_back(std::move(list));
+        }
+        size_t dropped = m_dead;
+        m_chunks = std::move(chunks); m_paths = std::move(paths);
+        m_termIds = std::move(termIds); m_postings = std::move(postings);
+        m_scores.clear(); m_matched.clear();
+        m_dead = 0;
+        DevLog("[Retrieval] Compacted %zu dead chunks in %.1f ms\n", dropped,
+               std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+    }
+
+    std::mutex                                 m_syncMutex;   // one Sync at a time
+    std::mutex                                 m_mutex;       // everything below
+    std::wstring                               m_root;
+    ULONGLONG                                  m_generation = ~0ull;
+    std::unordered_map<std::string, FileState> m_files;
+    std::vector<std::string>                   m_paths;
+    std::vector<CodeChunk>                     m_chunks;
+    std::unordered_map<std::string, DWORD>     m_termIds;
+    std::vector<std::vector<Posting>>          m_postings;
+    std::vector<float>                         m_scores;      // query scratch, kept zeroed between queries
+    std::vector<BYTE>                          m_matched;
+    std::vector<DWORD>                         m_touched;
+    size_t                                     m_live = 0, m_dead = 0;
+    ULONGLONG                                  m_liveTokens = 0;
+};
+
+static CodeRetriever g_retriever;
+
+// Characters of retrieved code per prompt: a quarter of a local context (at ~4 chars/token)
+static size_t RetrievalBudget() {
+    if (g_providerPresets[g_config.provider].needsApiKey) return 12000;
+    return (std::min)((size_t)12000, (size_t)(std::max)(g_config.contextSize, 2048));
+}
+
+// Index the workspace and build the chunk index in the background at startup, then keep the
+// workspace current with the watcher (the chunk index follows it lazily at query time)
+static std::thread g_workspaceThread;   // joined at exit, before g_workspace closes
+
+static void StartWorkspaceIndex() {
+    std::wstring root = WorkspaceRoot();
+    if (root.empty()) return;
+    g_workspaceThread = std::thread([root]() {
+        g_workspace.Open(root, GetExeDir() + "nova_workspace_index.bin", true);
+        if (!g_workspace.Cancelled()) g_retriever.Sync(g_workspace);
+    });
+}
+
+// ════════════════════════════════════════════════════════════════
+// SYSTEM EXECUTION ENGINE
+// ════════════════════════════════════════════════════════════════
+
+// ── Process runner ──
+// Commands run under cmd.exe with stdout and stderr on one pipe, drained by a reader as they
+// print. The process tree lives in a job object so Stop, the wall-clock limit and the output
+// limit can kill everything it spawned.
+
+// Bounded capture of a command's output: the first quarter of the capacity verbatim (where
+// compilers report the first error) and a ring of the most recent bytes (where the summary is)
+class OutputRing {
+public:
+    explicit OutputRing(size_t capacity) {
+        capacity = (std::max)(capacity, (size_t)1024);
+        m_headCap = capacity / 4;
+        m_ring.resize(capacity - m_headCap);
+    }
+
+    void Append(const char* p, size_t n) {
+        m_total += n;
+        size_t h = (std::min)(n, m_headCap - m_head.size());
+        m_head.append(p, h);
+        p += h; n -= h;
+        if (n > m_ring.size()) { p += n - m_ring.size(); n = m_ring.size(); }
+        while (n) {
+            size_t k = (std::min)(n, m_ring.size() - m_pos);
+            memcpy(&m_ring[m_pos], p, k);
+            m_pos = (m_pos + k) % m_ring.size();
+            m_filled = (std::min)(m_filled + k, m_ring.size());
+            p += k; n -= k;
+        }
+    }
+
+    std::string Text() const {
+        std::string out = m_head;
+        unsigned long long dropped = m_total - m_head.size() - m_filled;
+        if (dropped) out += "\n... [" + std::to_string(dropped) + " bytes omitted] ...\n";
+        if (m_filled < m_ring.size()) out.append(m_ring.data(), m_filled);
+        else { out.append(m_ring.data() + m_pos, m_ring.size() - m_pos); out.append(m_ring.data(), m_pos); }
+        return out;
+    }
+
+    unsigned long long Total() const { return m_total; }
+
+private:
+    std::string        m_head;
+    size_t             m_headCap = 0;
+    std::vector<char>  m_ring;
+    size_t             m_pos = 0, m_filled = 0;
+    unsigned long long m_total = 0;
+};
+
+struct ExecLimits {
+    unsigned           timeoutMs      = 300000;            // wall clock (0 = none)
+    unsigned long long maxOutputBytes = 16ull << 20;       // killed once it has printed this much (0 = none)
+    size_t             captureBytes   = 64 * 1024;         // kept in ExecResult::output
+};
+
+struct ExecResult {
+    bool        started     = false;
+    int         exitCode    = -1;
+    bool        timedOut    = false;
+    bool        outputLimit = false;
+    bool        aborted     = false;
+    unsigned long long totalBytes = 0;
+    double      seconds     = 0;
+    std::string output;     // stdout + stderr as interleaved by the child, head and tail only
+    std::string error;      // why the command could not be started
+    std::string cwd;        // working folder the command ended in; empty if unknown
+    std::string source;     // what ran, for the feedback: empty for EXEC commands, "EDIT" for file edits
+};
+
+typedef std::function<void(const char*, size_t)> ExecOutputFn;
+typedef std::vector<std::pair<std::string, std::string>> EnvOverrides;   // NAME=value set on top of Nova's own environment
+
+// Grace period for the pipe to close after the command itself exits; anything it started in the
+// background and that still holds the pipe is left running
+static const unsigned kExecDrainMs = 2000;
+
+// Nova's environment with `env` applied, as a CreateProcess block (sorted by name, case-insensitively)
+static std::wstring EnvironmentBlock(const EnvOverrides& env) {
+    auto nameOf = [](const std::wstring& v) { return v.substr(0, v.find(L'=', 1)); };
+    std::vector<std::wstring> vars;
+    if (wchar_t* block = GetEnvironmentStringsW()) {
+        for (const wchar_t* p = block; *p; p += wcslen(p) + 1) vars.push_back(p);
+        FreeEnvironmentStringsW(block);
+    }
+    for (const auto& kv : env) {
+        std::wstring name = StringToWString(kv.first);
+        vars.erase(std::remove_if(vars.begin(), vars.end(), [&](const std::wstring& v) { return _wcsicmp(nameOf(v).c_str(), name.c_str()) == 0; }), vars.end());
+        vars.push_back(name + L"=" + StringToWString(kv.second));
+    }
+    std::sort(vars.begin(), vars.end(), [&](const std::wstring& a, const std::wstring& b) { return _wcsicmp(nameOf(a).c_str(), nameOf(b).c_str()) < 0; });
+    std::wstring out;
+    for (const auto& v : vars) { out += v; out += L'\0'; }
+    out += L'\0';
+    return out;
+}
+
+static ExecResult RunCommand(const std::string& command, const std::string& cwd, const ExecLimits& limits,
+                             const ExecOutputFn& onOutput = nullptr, const std::atomic<bool>* abort = nullptr,
+                             const EnvOverrides* env = nullptr) {
+    ExecResult res;
+    auto t0 = std::chrono::steady_clock::now();
+    auto elapsedMs = [&] { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count(); };
+
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, TRUE };
+    HANDLE readPipe = nullptr, writePipe = nullptr;
+    if (!CreatePipe(&readPipe, &writePipe, &sa, 0)) {
+        res.error = "CreatePipe failed (GLE=" + std::to_string(GetLastError()) + ")";
+        return res;
+    }
+    SetHandleInformation(readPipe, HANDLE_FLAG_INHERIT, 0);
+    HANDLE nul = CreateFileW(L"NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, nullptr);
+
+    HANDLE job = CreateJobObjectW(nullptr, nullptr);
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION jl = {};
+    jl.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+    if (job) SetInformationJobObject(job, JobObjectExtendedLimitInformation, &jl, sizeof(jl));
+
+    // Inherit only this run's pipe and NUL, so concurrent runs never hold each other's pipes open
+    HANDLE inherit[2] = { writePipe, nul };
+    DWORD inheritCount = nul != INVALID_HANDLE_VALUE ? 2 : 1;
+    SIZE_T attrSize = 0;
+    InitializeProcThreadAttributeList(nullptr, 1, 0, &attrSize);
+    std::vector<BYTE> attrBuf(attrSize);
+    LPPROC_THREAD_ATTRIBUTE_LIST attrs = (LPPROC_THREAD_ATTRIBUTE_LIST)attrBuf.data();
+    bool haveList = attrSize && InitializeProcThreadAttributeList(attrs, 1, 0, &attrSize);
+    if (haveList && !UpdateProcThreadAttribute(attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inherit,
+                                               inheritCount * sizeof(HANDLE), nullptr, nullptr)) {
+        DeleteProcThreadAttributeList(attrs);
+        haveList = false;
+    }
+
+    STARTUPINFOEXW si = {};
+    si.StartupInfo.cb          = sizeof(si);
+    si.StartupInfo.dwFlags     = STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+    si.StartupInfo.wShowWindow = SW_HIDE;
+    si.StartupInfo.hStdInput   = nul != INVALID_HANDLE_VALUE ? nul : nullptr;
+    si.StartupInfo.hStdOutput  = writePipe;
+    si.StartupInfo.hStdError   = writePipe;
+    si.lpAttributeList         = haveList ? attrs : nullptr;
+
+    wchar_t comspec[MAX_PATH];
+    if (!GetEnvironmentVariableW(L"ComSpec", comspec, MAX_PATH)) wcscpy_s(comspec, L"cmd.exe");
+    std::wstring cmdLine = L"\"" + std::wstring(comspec) + L"\" /d /s /c \"" + StringToWString(command) + L"\"";
+    std::wstring wcwd = StringToWString(cwd);
+    DWORD flags = CREATE_NO_WINDOW | CREATE_SUSPENDED | CREATE_UNICODE_ENVIRONMENT | (haveList ? EXTENDED_STARTUPINFO_PRESENT : 0);
+
+    std::wstring envBlock = env && !env->empty() ? EnvironmentBlock(*env) : L"";
+
+    PROCESS_INFORMATION pi = {};
+    BOOL ok = CreateProcessW(nullptr, &cmdLine[0], nullptr, nullptr, TRUE, flags, envBlock.empty() ? nullptr : &envBlock[0],
+                             wcwd.empty() ? nullptr : wcwd.c_str(), &si.StartupInfo, &pi);
+    DWORD gle = GetLastError();
+    if (haveList) DeleteProcThreadAttributeList(attrs);
+    CloseHandle(writePipe);   // the child now holds the only write end: EOF means it is done with the pipe
+    if (nul != INVALID_HANDLE_VALUE) CloseHandle(nul);
+    if (!ok) {
+        CloseHandle(readPipe);
+        if (job) CloseHandle(job);
+        res.error = "CreateProcess failed (GLE=" + std::to_string(gle) + ")";
+        return res;
+    }
+    // Fails only when a job that forbids nesting already holds us (pre-Windows 8); the process alone is killed then
+    if (job && !AssignProcessToJobObject(job, pi.hProcess)) { CloseHandle(job); job = nullptr; }
+    ResumeThread(pi.hThread);
+    CloseHandle(pi.hThread);
+    res.started = true;
+
+    OutputRing ring(limits.captureBytes);
+    std::atomic<unsigned long long> total{ 0 };
+    std::atomic<bool> drained{ false };
+    std::thread reader([&] {
+        char buf[4096];
+        DWORD got = 0;
+        while (ReadFile(readPipe, buf, sizeof(buf), &got, nullptr) && got) {
+            ring.Append(buf, got);
+            total += got;
+            if (onOutput) onOutput(buf, got);
+        }
+        drained = true;
+    });
+
+    bool killed = false;
+    auto kill = [&] {
+        if (job) TerminateJobObject(job, 1); else TerminateProcess(pi.hProcess, 1);
+        killed = true;
+    };
+    while (WaitForSingleObject(pi.hProcess, 50) == WAIT_TIMEOUT) {
+        if (abort && abort->load())                                      { res.aborted = true;     kill(); break; }
+        if (limits.timeoutMs && elapsedMs() > limits.timeoutMs)          { res.timedOut = true;    kill(); break; }
+        if (limits.maxOutputBytes && total.load() > limits.maxOutputBytes) { res.outputLimit = true; kill(); break; }
+    }
+    WaitForSingleObject(pi.hProcess, 5000);
+    DWORD code = 1;
+    GetExitCodeProcess(pi.hProcess, &code);
+    res.exitCode = (int)code;
+
+    for (double exitAt = elapsedMs(); !drained && elapsedMs() - exitAt < kExecDrainMs; ) Sleep(10);
+    while (!drained) { CancelSynchronousIo((HANDLE)reader.native_handle()); Sleep(10); }
+    reader.join();
+    CloseHandle(readPipe);
+
+    if (job) {
+        // A clean exit leaves anything the command started in the background running
+        if (!killed) { jl.BasicLimitInformation.LimitFlags = 0; SetInformationJobObject(job, JobObjectExtendedLimitInformation, &jl, sizeof(jl)); }
+        CloseHandle(job);
+    }
+    CloseHandle(pi.hProcess);
+
+    res.totalBytes = ring.Total();
+    res.output     = ring.Text();
+    res.seconds    = elapsedMs() / 1000.0;
+    return res;
+}
+
+// Bytes at the end of `s` that start a UTF-8 sequence not yet complete (held back until the next read)
+static size_t IncompleteUtf8Tail(const std::string& s) {
+    for (size_t back = 1; back <= 3 && back <= s.size(); back++) {
+        unsigned char c = (unsigned char)s[s.size() - back];
+        if ((c & 0xC0) == 0x80) continue;
+        size_t len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        return len > back ? back : 0;
+    }
+    return 0;
+}
+
+// Live output stops being echoed to the transcript past this much; the capture still completes
+static const size_t kLiveOutputLimit = 64 * 1024;
+
+static const char* FindVcvars() {
+    static const char* searchPaths[] = {
+        "C:\\Program Files\\Microsoft Visual Studio\\2022\\Community\\VC\\Auxiliary\\Build\\vcvars64.bat",
+        "C:\\Program Files\\Microsoft Visual Studio\\2022\\Professional\\VC\\Auxiliary\\Build\\vcvars64.bat",
+        "C:\\Program Files\\Microsoft Visual Studio\\2022\\Enterprise\\VC\\Auxiliary\\Build\\vcvars64.bat",
+        "C:\\Program Files\\Microsoft Visual Studio\\2022\\BuildTools\\VC\\Auxiliary\\Build\\vcvars64.bat",
+        "C:\\Program Files (x86)\\Microsoft Visual Studio\\2019\\Community\\VC\\Auxiliary\\Build\\vcvars64.bat",
+        "C:\\Program Files (x86)\\Microsoft Visual Studio\\2019\\Professional\\VC\\Auxiliary\\Build\\vcvars64.bat",
+        "C:\\Program Files (x86)\\Microsoft Visual Studio\\2019\\Enterprise\\VC\\Auxiliary\\Build\\vcvars64.bat",
+        "C:\\Program Files (x86)\\Microsoft Visual Studio\\2019\\BuildTools\\VC\\Auxiliary\\Build\\vcvars64.bat"
+    };
+    for (const char* p : searchPaths)
+        if (GetFileAttributesA(p) != INVALID_FILE_ATTRIBUTES) return p;
+    return nullptr;
+}
+
+// ── Compiler environment ──
+// vcvars64.bat takes 1–3 s to run. What it does to the environment is captured once, saved next
+// to the exe under a key built from the toolchain's version files, and handed straight to compile
+// commands (the warm shell host applies it per command; RunCommand merges it into the child's
+// environment block). A Visual Studio or Windows SDK update changes the key and forces a recapture.
+// Only what vcvars itself changed is kept: for PATH, INCLUDE, LIB and the like just the entries it
+// put in front ("NAME+=..." in the saved file), applied on top of whatever they hold at the time.
+
+class ToolchainEnv {
+public:
+    // Captures (or reloads) the environment if it is missing or stale; false if there is no toolchain
+    bool Ensure() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_source.empty() || !FileExists(m_source)) {
+            m_source = CachedSource();
+            if (m_source.empty() || !FileExists(m_source)) m_source = Discover();
+            m_key.clear();
+            if (m_source.empty()) return false;
+        }
+        std::string key = Key(m_source);
+        if (key == m_key) return true;
+        auto t0 = std::chrono::steady_clock::now();
+        if (Load(key)) {
+            m_key = key;
+            DevLog("[Toolchain] Loaded %zu variables for %s\n", m_vars.size(), key.c_str());
+            return true;
+        }
+        if (!Capture(key)) return false;
+        m_key = key;
+        DevLog("[Toolchain] Captured %zu variables for %s in %.0f ms\n", m_vars.size(), key.c_str(),
+               std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+        return true;
+    }
+
+    EnvOverrides Vars() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_vars;
+    }
+
+    // The saved capture, for the shell host to apply ("" until Ensure has succeeded)
+    std::string File() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_key.empty() ? "" : CacheFile();
+    }
+
+    // Which toolchain and version the environment belongs to ("" until Ensure has succeeded)
+    std::string Identity() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_key;
+    }
+
+private:
+    static std::string CacheFile() { return GetExeDir() + "nova_toolchain_env.txt"; }
+
+    static bool FileExists(const std::string& path) {
+        std::error_code ec;
+        return std::filesystem::exists(std::filesystem::u8path(path), ec);
+    }
+
+    // Size and mtime of a file or folder, so an in-place update changes the key
+    static std::string Stamp(const std::string& path) {
+        std::error_code ec;
+        auto p = std::filesystem::u8path(path);
+        auto mtime = std::filesystem::last_write_time(p, ec);
+        if (ec) return "-";
+        unsigned long long size = std::filesystem::is_regular_file(p, ec) ? (unsigned long long)std::filesystem::file_size(p, ec) : 0;
+        return std::to_string(size) + "@" + std::to_string((long long)mtime.time_since_epoch().count());
+    }
+
+    // "# source: ..." line of the saved capture, so start-up does not have to rediscover
+    static std::string CachedSource() {
+        std::ifstream f(CacheFile());
+        std::string line;
+        while (std::getline(f, line) && line.rfind("# ", 0) == 0)
+            if (line.rfind("# source: ", 0) == 0) return line.substr(10);
+        return "";
+    }
+
+    static std::string CurrentValue(const std::string& name) {
+        std::vector<wchar_t> buf(32767);
+        DWORD n = GetEnvironmentVariableW(StringToWString(name).c_str(), buf.data(), (DWORD)buf.size());
+        return n && n < buf.size() ? WStringToString(std::wstring(buf.data(), n)) : "";
+    }
+
+    // Saved entries as full values against Nova's environment now ("NAME+" prepends to NAME)
+    static EnvOverrides Resolve(const EnvOverrides& saved) {
+        EnvOverrides vars;
+        for (const auto& kv : saved) {
+            if (kv.first.size() > 1 && kv.first.back() == '+') {
+                std::string name = kv.first.substr(0, kv.first.size() - 1);
+                vars.emplace_back(name, kv.second + CurrentValue(name));
+            } else {
+                vars.push_back(kv);
+            }
+        }
+        return vars;
+    }
+
+    bool Load(const std::string& key) {
+        std::ifstream f(CacheFile(), std::ios::binary);
+        if (!f) return false;
+        std::string line;
+        bool match = false, format = false;
+        EnvOverrides saved;
+        while (std::getline(f, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.rfind("# key: ", 0) == 0) { match = line.substr(7) == key; continue; }
+            if (line == "# format: 2") { format = true; continue; }   // older files hold whole PATHs: recapture
+            if (line.rfind("# ", 0) == 0) continue;
+            size_t eq = line.find('=', 1);
+            if (eq != std::string::npos) saved.emplace_back(line.substr(0, eq), line.substr(eq + 1));
+        }
+        if (!match || !format || saved.empty()) return false;
+        m_vars = Resolve(saved);
+        return true;
+    }
+
+    bool Save(const std::string& key, const EnvOverrides& saved) {
+        std::string out = "# Compiler environment captured by Nova — deleted or stale copies are recaptured\n"
+                          "# format: 2\n# source: " + m_source + "\n# key: " + key + "\n";
+        for (const auto& kv : saved) out += kv.first + "=" + kv.second + "\n";
+        std::string path = CacheFile(), tmp = path + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+            if (!f.write(out.data(), (std::streamsize)out.size())) { DevLog("[Toolchain] ERROR: could not write %s\n", tmp.c_str()); return false; }
+        }
+        std::error_code ec;
+        std::filesystem::rename(std::filesystem::u8path(tmp), std::filesystem::u8path(path), ec);
+        if (ec) DevLog("[Toolchain] ERROR: could not replace %s: %s\n", path.c_str(), ec.message().c_str());
+        return !ec;
+    }
+
+    // vcvars64.bat of the newest install with the C++ tools (vswhere), else the well-known paths
+    static std::string Discover() {
+        char pf[MAX_PATH];
+        if (GetEnvironmentVariableA("ProgramFiles(x86)", pf, MAX_PATH)) {
+            std::string vswhere = std::string(pf) + "\\Microsoft Visual Studio\\Installer\\vswhere.exe";
+            if (FileExists(vswhere)) {
+                ExecLimits limits;
+                limits.timeoutMs = 15000;
+                ExecResult r = RunCommand("\"" + vswhere + "\" -latest -products * -requires Microsoft.VisualStudio.Component.VC.Tools.x86.x64 "
+                                          "-property installationPath -utf8", "", limits);
+                std::string install = r.output.substr(0, r.output.find_first_of("\r\n"));
+                std::string vcvars = install + "\\VC\\Auxiliary\\Build\\vcvars64.bat";
+                if (r.exitCode == 0 && !install.empty() && FileExists(vcvars)) return vcvars;
+            }
+        }
+        const char* vcvars = FindVcvars();
+        return vcvars ? vcvars : "";
+    }
+
+    // MSVC tools version + vcvars itself + the Windows SDK include folder (new SDKs land there)
+    static std::string Key(const std::string& vcvars) {
+        std::string dir = vcvars.substr(0, vcvars.find_last_of('\\') + 1);
+        std::ifstream v(dir + "Microsoft.VCToolsVersion.default.txt");
+        std::string tools;
+        std::getline(v, tools);
+        while (!tools.empty() && isspace((unsigned char)tools.back())) tools.pop_back();
+        char pf[MAX_PATH] = "C:\\Program Files (x86)";
+        GetEnvironmentVariableA("ProgramFiles(x86)", pf, MAX_PATH);
+        return "msvc " + (tools.empty() ? std::string("?") : tools) + " vcvars " + Stamp(vcvars) +
+               " sdk " + Stamp(std::string(pf) + "\\Windows Kits\\10\\Include");
+    }
+
+    // Run vcvars once and keep what it added or changed, relative to Nova's own environment
+    bool Capture(const std::string& key) {
+        ExecLimits limits;
+        limits.timeoutMs = 60000;
+        ExecResult r = RunCommand("chcp 65001 >nul && call \"" + m_source + "\" >nul 2>&1 && set", "", limits);
+        if (r.exitCode != 0 || r.output.find("INCLUDE=") == std::string::npos) {
+            DevLog("[Toolchain] ERROR: %s failed (exit %d): %.200s\n", m_source.c_str(), r.exitCode, r.output.c_str());
+            return false;
+        }
+        EnvOverrides saved;
+        size_t pos = 0;
+        while (pos < r.output.size()) {
+            size_t eol = r.output.find('\n', pos);
+            if (eol == std::string::npos) eol = r.output.size();
+            std::string line = r.output.substr(pos, eol - pos);
+            pos = eol + 1;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            size_t eq = line.find('=', 1);
+            if (eq == std::string::npos) continue;
+            std::string name = line.substr(0, eq), value = line.substr(eq + 1);
+            std::string before = CurrentValue(name);
+            if (value == before) continue;
+            if (!before.empty() && value.size() > before.size() && value.compare(value.size() - before.size(), before.size(), before) == 0)
+                saved.emplace_back(name + "+", value.substr(0, value.size() - before.size()));   // entries put in front
+            else
+                saved.emplace_back(name, value);
+        }
+        m_vars = Resolve(saved);
+        Save(key, saved);
+        return true;
+    }
+
+    std::mutex   m_mutex;
+    std::string  m_source;   // vcvars64.bat
+    std::string  m_key;      // key of m_vars; empty until captured or loaded
+    EnvOverrides m_vars;
+};
+
+static ToolchainEnv g_toolchain;
+
+// ── Warm shell host ──
+// One long-lived shell (a PowerShell runspace) that EXEC commands are sent to, so they skip the shell's start-up: 300–800 ms for every `powershell -Command` line.
+// Each command goes over a private pipe as one frame (id, kind, working folder, text and an
+// optional file of NAME=value lines to set for that command only, see ToolchainEnv); the host
+// runs it with stdin on NUL and then prints a sentinel line on the shared output pipe:
+//     \n<nonce> END <id> <exit code> <working folder>\n
+// The nonce is random per host, so command output cannot fake it. A command that overruns its
+// limits or is stopped takes the host down together with the processes it started itself; the
+// next command starts a fresh host. Background processes left by earlier commands live in the
+// same job object but are recorded before each command and spared.
+
+enum class ShellKind { Shell, PowerShell };   // Shell = cmd.exe line
+
+// `powershell [-flags] -Command <script>` (or pwsh) → the script, run in the host's runspace.
+// Anything else, including PowerShell lines that cmd.exe itself would split with | & < >, stays
+// a Shell line so it behaves exactly as it did before.
+static ShellKind SplitShellCommand(const std::string& command, std::string& payload) {
+    payload = command;
+    size_t p = command.find_first_not_of(" \t");
+    if (p == std::string::npos) return ShellKind::Shell;
+    auto token = [&](size_t at, size_t& end) {
+        end = command.find_first_of(" \t", at);
+        if (end == std::string::npos) end = command.size();
+        std::string t = command.substr(at, end - at);
+        std::transform(t.begin(), t.end(), t.begin(), [](unsigned char c) { return (char)::tolower(c); });
+        t.erase(std::remove(t.begin(), t.end(), '"'), t.end());
+        return t;
+    };
+    size_t end;
+    std::string exe = token(p, end);
+    size_t slash = exe.find_last_of("\\/");
+    if (slash != std::string::npos) exe = exe.substr(slash + 1);
+    if (exe != "powershell" && exe != "powershell.exe" && exe != "pwsh" && exe != "pwsh.exe") return ShellKind::Shell;
+
+    static const char* valued[] = { "-executionpolicy", "-ep", "-windowstyle", "-outputformat", "-inputformat", "-version" };
+    for (p = command.find_first_not_of(" \t", end); p != std::string::npos; p = command.find_first_not_of(" \t", end)) {
+        std::string t = token(p, end);
+        if (t == "-command" || t == "-c") { p = command.find_first_not_of(" \t", end); break; }
+        if (t.empty() || (t[0] != '-' && t[0] != '/')) break;       // bare script text after the flags
+        if (t == "-file" || t == "-f" || t == "-encodedcommand" || t == "-enc" || t == "-e") return ShellKind::Shell;
+        for (const char* v : valued)
+            if (t == v) { token(command.find_first_not_of(" \t", end), end); break; }
+        if (end >= command.size()) return ShellKind::Shell;
+    }
+    if (p == std::string::npos) return ShellKind::Shell;
+
+    std::string script = command.substr(p);
+    while (!script.empty() && (script.back() == ' ' || script.back() == '\t')) script.pop_back();
+    if (script.size() >= 2 && script.front() == '"' && script.back() == '"') {
+        // One quoted argument: cmd.exe leaves it alone, PowerShell drops the quotes and unescapes \"
+        std::string inner = script.substr(1, script.size() - 2), out;
+        for (size_t i = 0; i < inner.size(); i++) {
+            if (inner[i] == '\\' && i + 1 < inner.size() && inner[i + 1] == '"') { out += '"'; i++; }
+            else if (inner[i] == '"') return ShellKind::Shell;        // several quoted pieces: let cmd.exe decide
+            else out += inner[i];
+        }
+        script = out;
+    } else if (script.find_first_of("|&<>\"") != std::string::npos) {
+        return ShellKind::Shell;
+    }
+    if (script.empty()) return ShellKind::Shell;
+    payload = script;
+    return ShellKind::PowerShell;
+}
+
+class ShellHost {
+public:
+    ~ShellHost() { Stop(); }
+
+    // Runs one command in the host, starting it first if needed. res.started is false (with
+    // res.error set) only if no host could be started; callers then fall back to RunCommand.
+    ExecResult Run(const std::string& text, ShellKind kind, const std::string& cwd, const ExecLimits& limits,
+                   const ExecOutputFn& onOutput = nullptr, const std::atomic<bool>* abort = nullptr,
+                   const std::string& envFile = "") {
+        std::lock_guard<std::mutex> run(m_runMutex);
+        ExecResult res;
+        auto t0 = std::chrono::steady_clock::now();
+        auto elapsedMs = [&] { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count(); };
+        if (!m_alive && m_stopped) { res.error = "the shell host is shut down"; return res; }
+        if (!m_alive && !Launch(res.error)) return res;
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_buf.clear();    // stray output from earlier background jobs
+        }
+        unsigned id = ++m_seq;
+        m_resident = JobProcesses();   // started by earlier commands: not this command's to kill
+        std::string frame = Frame(id, kind, cwd, text, envFile);
+        if (!Send(frame)) {
+            Kill();
+            if (!Launch(res.error) || !Send(frame)) { Kill(); res.error = "shell host is not accepting commands"; return res; }
+        }
+        res.started = true;
+
+        OutputRing ring(limits.captureBytes);
+        const std::string marker = "\n" + m_nonce + " END " + std::to_string(id) + " ";
+        std::string pending;
+        auto emit = [&](size_t n) {
+            if (!n) return;
+            ring.Append(pending.data(), n);
+            if (onOutput) onOutput(pending.data(), n);
+            pending.erase(0, n);
+        };
+        for (;;) {
+            bool eof;
+            {
+                std::unique_lock<std::mutex> lk(m_mutex);
+                m_cv.wait_for(lk, std::chrono::milliseconds(50), [&] { return !m_buf.empty() || m_eof; });
+                pending += m_buf;
+                m_buf.clear();
+                eof = m_eof;
+            }
+            size_t at = pending.find(marker);
+            if (at == std::string::npos) {
+                emit(pending.size() > marker.size() ? pending.size() - marker.size() : 0);   // keep a possible partial marker
+            } else {
+                emit(at);
+                size_t eol = pending.find('\n', marker.size());
+                if (eol != std::string::npos) {
+                    std::string tail = pending.substr(marker.size(), eol - marker.size());
+                    if (!tail.empty() && tail.back() == '\r') tail.pop_back();
+                    size_t sp = tail.find(' ');
+                    res.exitCode = atoi(tail.c_str());
+                    res.cwd = sp == std::string::npos ? "" : tail.substr(sp + 1);
+                    break;
+                }
+            }
+            if (eof) {
+                // The host itself exited (e.g. `exit 3` in a PowerShell script): that is the command's result
+                emit(pending.size());
+                res.exitCode = Reap();
+                break;
+            }
+            if      (abort && abort->load())                                     res.aborted = true;
+            else if (limits.timeoutMs && elapsedMs() > limits.timeoutMs)        res.timedOut = true;
+            else if (limits.maxOutputBytes && ring.Total() > limits.maxOutputBytes) res.outputLimit = true;
+            else continue;
+            emit(pending.size());
+            Kill();
+            res.exitCode = 1;
+            break;
+        }
+        res.totalBytes = ring.Total();
+        res.output     = ring.Text();
+        res.seconds    = elapsedMs() / 1000.0;
+        return res;
+    }
+
+    // Start the host ahead of the first command
+    void Prewarm() {
+        std::lock_guard<std::mutex> run(m_runMutex);
+        if (m_stopped) return;   // shutting down: no new host
+        std::string err;
+        if (!m_alive && !Launch(err)) DevLog("[Shell] Could not start the shell host: %s\n", err.c_str());
+    }
+
+    bool Warm() const { return m_alive; }
+
+    // Prewarm on a thread the host owns, then `then` (unless stopped by then); Stop joins it
+    void PrewarmAsync(std::function<void()> then = nullptr) {
+        std::lock_guard<std::mutex> lk(m_prewarmMutex);
+        if (m_stopped) return;
+        for (size_t i = 0; i < m_prewarms.size();) {   // reap the finished ones
+            if (!*m_prewarms[i].second) { i++; continue; }
+            m_prewarms[i].first.join();
+            m_prewarms.erase(m_prewarms.begin() + i);
+        }
+        auto done = std::make_shared<std::atomic<bool>>(false);
+        m_prewarms.emplace_back(std::thread([this, then, done] {
+            Prewarm();
+            if (then && !m_stopped) then();
+            *done = true;
+        }), done);
+    }
+
+    // Shut the host down for good, leaving anything it started in the background running
+    void Stop() {
+        m_stopped = true;
+        {
+            std::lock_guard<std::mutex> lk(m_prewarmMutex);
+            for (auto& p : m_prewarms) p.first.join();
+            m_prewarms.clear();
+        }
+        std::lock_guard<std::mutex> run(m_runMutex);
+        Close(false);
+    }
+
+private:
+    void Kill() { Close(true); }
+
+    void OnOutput(const char* p, size_t n) {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_buf.append(p, n);
+        }
+        m_cv.notify_one();
+    }
+
+    void OnEof() {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_eof = true;
+        }
+        m_cv.notify_one();
+    }
+
+    void ResetStream() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_buf.clear();
+        m_eof = false;
+    }
+
+    static std::string NewNonce() {
+        std::random_device rd;
+        char buf[40];
+        sprintf_s(buf, "NOVA%08x%08x%08x", rd(), rd(), rd());
+        return buf;
+    }
+
+    // Process ids currently in the host's job (the host itself included)
+    std::vector<DWORD> JobProcesses() {
+        std::vector<DWORD> pids;
+        if (!m_job) return pids;
+        std::vector<BYTE> buf(sizeof(JOBOBJECT_BASIC_PROCESS_ID_LIST) + 1024 * sizeof(ULONG_PTR));
+        auto* list = (JOBOBJECT_BASIC_PROCESS_ID_LIST*)buf.data();
+        list->NumberOfAssignedProcesses = 1024;
+        if (!QueryInformationJobObject(m_job, JobObjectBasicProcessIdList, list, (DWORD)buf.size(), nullptr) &&
+            GetLastError() != ERROR_MORE_DATA) return pids;
+        for (DWORD i = 0; i < list->NumberOfProcessIdsInList; i++) pids.push_back((DWORD)list->ProcessIdList[i]);
+        return pids;
+    }
+
+    // Kill what the current command started, leaving m_resident (earlier background processes) alone
+    void KillCommandProcesses() {
+        for (DWORD pid : JobProcesses()) {
+            if (std::find(m_resident.begin(), m_resident.end(), pid) != m_resident.end()) continue;
+            HANDLE h = OpenProcess(PROCESS_TERMINATE | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+            if (!h) continue;
+            BOOL inJob = FALSE;
+            if (IsProcessInJob(h, m_job, &inJob) && inJob) TerminateProcess(h, 1);   // not a reused id
+            CloseHandle(h);
+        }
+    }
+
+    bool Launch(std::string& err) {
+        Close(true);
+        ResetStream();
+        m_resident.clear();
+        m_nonce = NewNonce();
+        std::wstring pipeName = L"\\\\.\\pipe\\nova-shell-" + std::to_wstring(GetCurrentProcessId()) + L"-" + StringToWString(m_nonce);
+
+        // The host script: read frames from the command pipe, run each, print the sentinel
+        std::wstring script =
+            L"$ErrorActionPreference = 'Continue'; $ProgressPreference = 'SilentlyContinue'\n"
+            L"[Console]::OutputEncoding = New-Object Text.UTF8Encoding $false\n"
+            L"$utf8 = New-Object Text.UTF8Encoding $false\n"
+            L"$state = Join-Path $env:TEMP 'nova_shell_@N.txt'\n"
+            L"$pipe = New-Object IO.Pipes.NamedPipeServerStream('@P', [IO.Pipes.PipeDirection]::In, 1)\n"
+            L"$pipe.WaitForConnection()\n"
+            L"$in = New-Object IO.StreamReader($pipe, $utf8)\n"
+            L"while ($null -ne ($frame = $in.ReadLine())) {\n"
+            L"  $f = $frame.Split(' ')\n"
+            L"  $dir = $utf8.GetString([Convert]::FromBase64String($f[2]))\n"
+            L"  $text = $utf8.GetString([Convert]::FromBase64String($f[3]))\n"
+            L"  $envFile = $utf8.GetString([Convert]::FromBase64String($f[4]))\n"
+            L"  $code = 0; $saved = @{}\n"
+            L"  try {\n"
+            L"    if ($envFile) {\n"
+            L"      foreach ($line in [IO.File]::ReadAllLines($envFile, $utf8)) {\n"
+            L"        $eq = $line.IndexOf('=')\n"
+            L"        if ($line.StartsWith('#') -or $eq -lt 1) { continue }\n"
+            L"        $k = $line.Substring(0, $eq); $v = $line.Substring($eq + 1)\n"
+            L"        if ($k.EndsWith('+')) { $k = $k.TrimEnd('+'); $v += [Environment]::GetEnvironmentVariable($k) }\n"
+            L"        if (-not $saved.ContainsKey($k)) { $saved[$k] = [Environment]::GetEnvironmentVariable($k) }\n"
+            L"        [Environment]::SetEnvironmentVariable($k, $v)\n"
+            L"      }\n"
+            L"    }\n"
+            L"    if ($dir) { Set-Location -LiteralPath $dir }\n"
+            L"    if ($f[1] -eq 'cmd') {\n"
+            L"      $si = New-Object Diagnostics.ProcessStartInfo($env:ComSpec, ('/d /s /c \"' + $text + ' & >\"' + $state + '\" call echo %^ERRORLEVEL% %^CD%\"'))\n"
+            L"      $si.UseShellExecute = $false; $si.WorkingDirectory = (Get-Location).ProviderPath\n"
+            L"      Remove-Item -LiteralPath $state -ErrorAction SilentlyContinue\n"
+            L"      $p = [Diagnostics.Process]::Start($si); $p.WaitForExit(); $code = $p.ExitCode\n"
+            L"      if (Test-Path -LiteralPath $state) {\n"
+            L"        $s = ([IO.File]::ReadAllText($state)).Trim().Split(' ', 2)\n"
+            L"        $code = [int]$s[0]; Set-Location -LiteralPath $s[1]\n"
+            L"      }\n"
+            L"    } else {\n"
+            L"      $global:LASTEXITCODE = 0; $global:__novaOk = $true\n"
+            L"      & ([ScriptBlock]::Create($text + \"`n`$global:__novaOk = `$?\")) 2>&1 |\n"
+            L"        ForEach-Object { if ($_ -is [Management.Automation.ErrorRecord]) { \"$_\" } else { $_ } } |\n"
+            L"        Out-String -Stream -Width 4096 | ForEach-Object { [Console]::Out.WriteLine($_) }\n"
+            L"      if ($LASTEXITCODE) { $code = $LASTEXITCODE } elseif (-not $global:__novaOk) { $code = 1 }\n"
+            L"    }\n"
+            L"  } catch { [Console]::Out.WriteLine(\"$_\"); $code = 1 }\n"
+            L"  finally { foreach ($k in $saved.Keys) { [Environment]::SetEnvironmentVariable($k, $saved[$k]) } }\n"
+            L"  [Console]::Out.Write(\"`n@N END \" + $f[0] + ' ' + $code + ' ' + (Get-Location).ProviderPath + \"`n\")\n"
+            L"  [Console]::Out.Flush()\n"
+            L"}\n";
+        for (size_t at; (at = script.find(L"@N")) != std::wstring::npos; ) script.replace(at, 2, StringToWString(m_nonce));
+        for (size_t at; (at = script.find(L"@P")) != std::wstring::npos; ) script.replace(at, 2, pipeName.substr(9));
+        std::string encoded;
+        Base64EncodeInto(encoded, (const BYTE*)script.data(), script.size() * sizeof(wchar_t));   // -EncodedCommand is UTF-16LE
+
+        SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, TRUE };
+        HANDLE writePipe = nullptr;
+        if (!CreatePipe(&m_out, &writePipe, &sa, 0)) { err = "CreatePipe failed (GLE=" + std::to_string(GetLastError()) + ")"; return false; }
+        SetHandleInformation(m_out, HANDLE_FLAG_INHERIT, 0);
+        HANDLE nul = CreateFileW(L"NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, nullptr);
+
+        m_job = CreateJobObjectW(nullptr, nullptr);
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION jl = {};
+        jl.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+        if (m_job) SetInformationJobObject(m_job, JobObjectExtendedLimitInformation, &jl, sizeof(jl));
+
+        STARTUPINFOW si = { sizeof(si) };
+        si.dwFlags     = STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+        si.wShowWindow = SW_HIDE;
+        si.hStdInput   = nul != INVALID_HANDLE_VALUE ? nul : nullptr;
+        si.hStdOutput  = writePipe;
+        si.hStdError   = writePipe;
+        std::wstring cmdLine = L"powershell.exe -NoLogo -NoProfile -NonInteractive -ExecutionPolicy Bypass -EncodedCommand " + StringToWString(encoded);
+        PROCESS_INFORMATION pi = {};
+        BOOL ok = CreateProcessW(nullptr, &cmdLine[0], nullptr, nullptr, TRUE, CREATE_NO_WINDOW | CREATE_SUSPENDED,
+                                 nullptr, nullptr, &si, &pi);
+        DWORD gle = GetLastError();
+        CloseHandle(writePipe);
+        if (nul != INVALID_HANDLE_VALUE) CloseHandle(nul);
+        if (!ok) { err = "could not start powershell.exe (GLE=" + std::to_string(gle) + ")"; Close(true); return false; }
+        if (m_job && !AssignProcessToJobObject(m_job, pi.hProcess)) { CloseHandle(m_job); m_job = nullptr; }
+        ResumeThread(pi.hThread);
+        CloseHandle(pi.hThread);
+        m_process = pi.hProcess;
+
+        HANDLE out = m_out;
+        m_reader = std::thread([this, out] {
+            char buf[4096];
+            DWORD got = 0;
+            while (ReadFile(out, buf, sizeof(buf), &got, nullptr) && got) OnOutput(buf, got);
+            OnEof();
+        });
+
+        // The host creates the command pipe once it is up; connect as its only client
+        auto t0 = std::chrono::steady_clock::now();
+        while ((m_in = CreateFileW(pipeName.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr)) == INVALID_HANDLE_VALUE) {
+            m_in = nullptr;
+            if (WaitForSingleObject(m_process, 0) == WAIT_OBJECT_0 ||
+                std::chrono::steady_clock::now() - t0 > std::chrono::seconds(15)) {
+                err = "powershell.exe did not open its command pipe";
+                Close(true);
+                return false;
+            }
+            if (GetLastError() == ERROR_PIPE_BUSY) WaitNamedPipeW(pipeName.c_str(), 100);
+            else Sleep(10);
+        }
+        m_alive = true;
+        DevLog("[Shell] PowerShell host up (PID %lu) in %.0f ms\n", pi.dwProcessId,
+               std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+        return true;
+    }
+
+    static std::string Frame(unsigned id, ShellKind kind, const std::string& cwd, const std::string& text, const std::string& envFile) {
+        std::string f = std::to_string(id) + (kind == ShellKind::PowerShell ? " ps " : " cmd ");
+        Base64EncodeInto(f, (const BYTE*)cwd.data(), cwd.size());
+        f += ' ';
+        Base64EncodeInto(f, (const BYTE*)text.data(), text.size());
+        f += ' ';
+        Base64EncodeInto(f, (const BYTE*)envFile.data(), envFile.size());
+        f += '\n';
+        return f;
+    }
+
+    bool Send(const std::string& frame) {
+        DWORD wrote = 0;
+        return m_in && WriteFile(m_in, frame.data(), (DWORD)frame.size(), &wrote, nullptr) && wrote == frame.size();
+    }
+
+    int Reap() {
+        DWORD code = 1;
+        if (m_process) { WaitForSingleObject(m_process, 5000); GetExitCodeProcess(m_process, &code); }
+        Close(false);
+        return (int)code;
+    }
+
+    void Close(bool killTree) {
+        m_alive = false;
+        if (m_in) { CloseHandle(m_in); m_in = nullptr; }   // a live host sees EOF on its command pipe and exits
+        if (m_job) {
+            // Closing the job must not take background processes of earlier commands with it
+            JOBOBJECT_EXTENDED_LIMIT_INFORMATION jl = {};
+            SetInformationJobObject(m_job, JobObjectExtendedLimitInformation, &jl, sizeof(jl));
+        }
+        if (killTree) {
+            if (m_process) TerminateProcess(m_process, 1);   // first, so it cannot start anything more
+            if (m_job) KillCommandProcesses();
+        }
+        if (m_process) {
+            if (WaitForSingleObject(m_process, killTree ? 5000 : 2000) == WAIT_TIMEOUT) TerminateProcess(m_process, 1);
+            CloseHandle(m_process);
+            m_process = nullptr;
+        }
+        if (m_reader.joinable()) {
+            // Background children of a stopped host may still hold the output pipe
+            for (int i = 0; i < 200; i++) { { std::lock_guard<std::mutex> lk(m_mutex); if (m_eof) break; } Sleep(10); }
+            for (;;) {
+                { std::lock_guard<std::mutex> lk(m_mutex); if (m_eof) break; }
+                CancelSynchronousIo((HANDLE)m_reader.native_handle());
+                Sleep(10);
+            }
+            m_reader.join();
+        }
+        if (m_out) { CloseHandle(m_out); m_out = nullptr; }
+        if (m_job) { CloseHandle(m_job); m_job = nullptr; }
+    }
+
+    HANDLE m_process = nullptr, m_job = nullptr, m_in = nullptr, m_out = nullptr;
+    std::vector<DWORD> m_resident;   // job members when the current command was sent
+
+    std::mutex              m_runMutex;   // one command (or launch) at a time
+    std::mutex              m_mutex;      // m_buf, m_eof
+    std::condition_variable m_cv;
+    std::string             m_buf;
+    bool                    m_eof = false;
+    std::thread             m_reader;
+    std::atomic<bool>       m_alive{ false };
+    std::string             m_nonce;
+    unsigned                m_seq = 0;
+    std::atomic<bool>       m_stopped{ false };
+    std::mutex              m_prewarmMutex;   // m_prewarms
+    std::vector<std::pair<std::thread, std::shared_ptr<std::atomic<bool>>>> m_prewarms;   // thread, finished
+};
+
+static ShellHost g_shell;
+
+// ── Command classification ──
+// EXEC lines are split into simple commands the way the shell would (quotes, escapes, && || | ;
+// chains, redirections, and the strings handed to `powershell -Command`, `cmd /c` and `sh -c`),
+// then each command is classified by its program. The result decides how the line runs:
+// natively, in the warm shell, or in the warm shell with the compiler environment.
+
+enum class ShellDialect { Cmd, PowerShell, Posix };
+
+struct CommandSegment {
+    ShellDialect             dialect = ShellDialect::Cmd;
+    std::string              program;     // lower case, no folder, no .exe/.com/.bat/.cmd
+    std::string              typed;       // the program as written
+    std::vector<std::string> args;        // unquoted
+    std::vector<std::string> writes;      // > and >> targets (nul, $null and /dev/null left out)
+    bool                     dynamic = false;   // uses $variables or $(...) the shell has to expand
+};
+
+// File operations ExecuteNovaCommand can run in-process (see "Native built-ins")
+enum class NativeOp { None, MakeDir, NewItem, SetContent, AddContent, GetContent, Copy, Move, Rename, Delete, List, Find, Where };
+
+struct CommandInfo {
+    enum class Route { Native, WarmShell, Toolchain };
+    std::vector<CommandSegment> segments;
+    bool  compiles    = false;   // compiler, linker or build tool: needs the toolchain environment
+    bool  writesFiles = false;
+    bool  changesDir  = false;
+    bool  destructive = false;   // deletes files, kills processes, rewrites history...
+    bool  unbalanced  = false;   // an unterminated quote: classified from what could be read
+    bool  cmdlet      = false;   // starts with a bare PowerShell cmdlet, which cmd.exe cannot run
+    Route route = Route::WarmShell;
+    NativeOp native = NativeOp::None;   // set when route is Native
+
+    std::string Describe() const {
+        std::string s;
+        if (compiles)    s += "compile ";
+        if (writesFiles) s += "writes ";
+        if (changesDir)  s += "cd ";
+        if (destructive) s += "destructive ";
+        if (unbalanced)  s += "unbalanced-quotes ";
+        if (cmdlet)      s += "powershell ";
+        return s + (route == Route::Native ? "-> native" : route == Route::Toolchain ? "-> toolchain" : "-> warm shell");
+    }
+};
+
+static void TokenizeCommandLine(const std::string& line, ShellDialect dialect, std::vector<CommandSegment>& out, bool& unbalanced, int depth);
+
+// Lower-cased program name as a shell would look it up: no quotes, folder or executable extension
+static std::string ProgramName(std::string word) {
+    std::transform(word.begin(), word.end(), word.begin(), [](unsigned char c) { return (char)::tolower(c); });
+    if (!word.empty() && word[0] == '@') word.erase(0, 1);      // cmd's echo-off prefix
+    size_t slash = word.find_last_of("\\/");
+    if (slash != std::string::npos) word = word.substr(slash + 1);
+    for (const char* ext : { ".exe", ".com", ".bat", ".cmd" }) {
+        size_t n = strlen(ext);
+        if (word.size() > n && word.compare(word.size() - n, n, ext) == 0) { word.resize(word.size() - n); break; }
+    }
+    return word;
+}
+
+// Finish one simple command: unwrap call/start, recurse into nested shells, or keep it
+static void PushSegment(CommandSegment seg, std::vector<CommandSegment>& out, bool& unbalanced, int depth) {
+    while (!seg.args.empty() && seg.program.empty()) { seg.typed = seg.args[0]; seg.program = ProgramName(seg.typed); seg.args.erase(seg.args.begin()); }
+    if (seg.program.empty()) return;
+
+    // `call x`, `start "" /b x ...` (cmd) and `& x` (PowerShell) run x
+    if (seg.dialect == ShellDialect::Cmd && (seg.program == "call" || seg.program == "start")) {
+        bool start = seg.program == "start";
+        size_t i = 0;
+        if (start) while (i < seg.args.size() && (seg.args[i].empty() || seg.args[i][0] == '/' || (i == 0 && seg.args[i].find(' ') != std::string::npos))) i++;
+        if (i < seg.args.size()) {
+            seg.typed = seg.args[i];
+            seg.program = ProgramName(seg.typed);
+            seg.args.erase(seg.args.begin(), seg.args.begin() + i + 1);
+            PushSegment(std::move(seg), out, unbalanced, depth);
+        }
+        return;
+    }
+
+    if (depth < 4) {
+        // Nested shells: their command string is classified in their own dialect
+        ShellDialect inner = seg.dialect;
+        size_t from = std::string::npos;
+        const std::string& p = seg.program;
+        if (p == "powershell" || p == "pwsh") {
+            inner = ShellDialect::PowerShell;
+            for (size_t i = 0; i < seg.args.size(); i++) {
+                std::string a = seg.args[i];
+                std::transform(a.begin(), a.end(), a.begin(), [](unsigned char c) { return (char)::tolower(c); });
+                if (a == "-command" || a == "-c") { from = i + 1; break; }
+                if (a == "-file" || a == "-f" || a == "-encodedcommand" || a == "-enc" || a == "-e") break;
+                if (a == "-executionpolicy" || a == "-ep" || a == "-windowstyle" || a == "-outputformat" || a == "-inputformat" || a == "-version") { i++; continue; }
+                if (!a.empty() && a[0] != '-' && a[0] != '/') { from = i; break; }
+            }
+        } else if (p == "cmd") {
+            inner = ShellDialect::Cmd;
+            for (size_t i = 0; i < seg.args.size(); i++) {
+                std::string a = seg.args[i];
+                std::transform(a.begin(), a.end(), a.begin(), [](unsigned char c) { return (char)::tolower(c); });
+                if (a == "/c" || a == "/k") { from = i + 1; break; }
+            }
+        } else if (p == "sh" || p == "bash" || p == "zsh" || p == "dash") {
+            inner = ShellDialect::Posix;
+            for (size_t i = 0; i < seg.args.size(); i++)
+                if (seg.args[i] == "-c" || seg.args[i] == "-lc") { from = i + 1; break; }
+        }
+        if (from != std::string::npos && from < seg.args.size()) {
+            std::string script;
+            for (size_t i = from; i < seg.args.size(); i++) script += (i > from ? " " : "") + seg.args[i];
+            size_t before = out.size();
+            TokenizeCommandLine(script, inner, out, unbalanced, depth + 1);
+            if (!seg.writes.empty() && out.size() > before) {
+                out.back().writes.insert(out.back().writes.end(), seg.writes.begin(), seg.writes.end());
+            }
+            return;
+        }
+    }
+    out.push_back(std::move(seg));
+}
+
+static void TokenizeCommandLine(const std::string& line, ShellDialect dialect, std::vector<CommandSegment>& out, bool& unbalanced, int depth) {
+    const bool ps = dialect == ShellDialect::PowerShell, posix = dialect == ShellDialect::Posix;
+    const char escape = ps ? '`' : posix ? '\\' : '^';
+    CommandSegment seg;
+    seg.dialect = dialect;
+    std::string word;
+    bool haveWord = false, toRedirect = false, toInput = false;
+
+    auto endWord = [&] {
+        if (!haveWord) return;
+        if (toInput) toInput = false;
+        else if (toRedirect) {
+            std::string t = word;
+            std::transform(t.begin(), t.end(), t.begin(), [](unsigned char c) { return (char)::tolower(c); });
+            if (t != "nul" && t != "$null" && t != "/dev/null") seg.writes.push_back(word);
+            toRedirect = false;
+        } else {
+            seg.args.push_back(word);
+        }
+        word.clear();
+        haveWord = false;
+    };
+    auto endSegment = [&] {
+        endWord();
+        PushSegment(std::move(seg), out, unbalanced, depth);
+        seg = CommandSegment();
+        seg.dialect = dialect;
+        toRedirect = toInput = false;
+    };
+
+    // powershell.exe reads its command line with the C runtime's rules, where \" is a quote inside
+    // the argument; cmd built-ins and cmd's own parsing do not
+    auto argvRules = [&] {
+        if (ps || posix || seg.args.empty()) return false;
+        std::string p = ProgramName(seg.args[0]);
+        return p == "powershell" || p == "pwsh";
+    };
+    // Backslashes at i: n before a quote become n/2, and an odd one escapes the quote. Returns the
+    // index of the last character consumed.
+    auto backslashes = [&](size_t i) {
+        size_t k = i;
+        while (k < line.size() && line[k] == '\\') k++;
+        if (k >= line.size() || line[k] != '"') { word.append(k - i, '\\'); return k - 1; }
+        word.append((k - i) / 2, '\\');
+        if ((k - i) % 2) { word += '"'; return k; }
+        return k - 1;   // the quote itself opens or closes a string
+    };
+
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (c == '\\' && argvRules()) {
+            i = backslashes(i);
+            haveWord = true;
+            continue;
+        }
+        if (c == escape && i + 1 < line.size()) {
+            char n = line[++i];
+            if (ps) word += n == 'n' ? '\n' : n == 't' ? '\t' : n == 'r' ? '\r' : n == '0' ? '\0' : n;
+            else if (!(n == '\n' || (n == '\r' && i + 1 < line.size() && line[i + 1] == '\n'))) word += n;   // caret/backslash at end of line continues it
+            haveWord = true;
+            continue;
+        }
+        if (c == '"' || (c == '\'' && (ps || posix))) {
+            // Quoted text joins the current word; only PowerShell/POSIX double quotes expand anything inside
+            bool argv = c == '"' && argvRules();
+            size_t j = i + 1;
+            for (; j < line.size(); j++) {
+                char q = line[j];
+                if (argv && q == '\\') { j = backslashes(j); continue; }
+                if (q == c) {
+                    if (ps && c == '\'' && j + 1 < line.size() && line[j + 1] == '\'') { word += '\''; j++; continue; }
+                    break;
+                }
+                if (c == '"' && ps && q == '`' && j + 1 < line.size()) {
+                    char n = line[++j];
+                    word += n == 'n' ? '\n' : n == 't' ? '\t' : n == 'r' ? '\r' : n == '0' ? '\0' : n;
+                    continue;
+                }
+                if (c == '"' && posix && q == '\\' && j + 1 < line.size() && strchr("\"\\$`", line[j + 1])) { word += line[++j]; continue; }
+                if ((c == '"' && (ps || posix) && q == '$' && j + 1 < line.size() && (isalnum((unsigned char)line[j + 1]) || strchr("_({", line[j + 1]))) ||
+                    (q == '%' && !ps && !posix))
+                    seg.dynamic = true;
+                word += q;
+            }
+            if (j >= line.size()) unbalanced = true;
+            i = j;
+            haveWord = true;
+            continue;
+        }
+        if ((c == '$' && (ps || posix) && i + 1 < line.size() && (isalnum((unsigned char)line[i + 1]) || strchr("_({", line[i + 1]))) ||
+            (c == '%' && !ps && !posix))
+            seg.dynamic = true;
+        if (ps && (c == ',' || (c == '@' && !haveWord))) seg.dynamic = true;   // arrays, splats, here-strings
+        if (c == ' ' || c == '\t') { endWord(); continue; }
+        if (c == '\r' || c == '\n' || c == ';' || (c == '&' && !ps) || c == '|' || c == '(' || c == ')' ||
+            ((ps || posix) && (c == '{' || c == '}'))) {
+            // Separators. Groups and blocks are flattened: `if (x) { Remove-Item y }` yields "if", "x", "Remove-Item y"
+            if (c == ';' && !ps && !posix) { word += c; haveWord = true; continue; }   // cmd: ; is an argument separator, not a chain
+            if (c == '&' && i + 1 < line.size() && line[i + 1] == '&') i++;
+            if (c == '|' && i + 1 < line.size() && line[i + 1] == '|') i++;
+            endSegment();
+            continue;
+        }
+        if (c == '&' && ps) {
+            // && chains; a leading & is the call operator (the next word is the program); elsewhere it backgrounds
+            if (i + 1 < line.size() && line[i + 1] == '&') i++;
+            else if (!haveWord && seg.program.empty() && seg.args.empty()) continue;
+            endSegment();
+            continue;
+        }
+        if (c == '>' || c == '<') {
+            // Redirections; a lone handle number or * just before > belongs to it (2>, *>)
+            if (haveWord && (word == "1" || word == "2" || word == "3" || (ps && word == "*"))) { word.clear(); haveWord = false; }
+            else endWord();
+            if (c == '<') { toInput = true; continue; }
+            if (i + 1 < line.size() && line[i + 1] == '>') i++;
+            if (i + 1 < line.size() && line[i + 1] == '&') { i++; while (i + 1 < line.size() && isdigit((unsigned char)line[i + 1])) i++; continue; }
+            toRedirect = true;
+            continue;
+        }
+        word += c;
+        haveWord = true;
+    }
+    endSegment();
+}
+
+static bool IsOneOf(const std::string& s, std::initializer_list<const char*> names) {
+    for (const char* n : names) if (s == n) return true;
+    return false;
+}
+
+// Verb-Noun names with one of the common PowerShell verbs (Set-Content, Get-ChildItem...)
+static bool IsCmdletName(const std::string& p) {
+    size_t dash = p.find('-');
+    return dash != std::string::npos && dash > 0 && dash + 1 < p.size() &&
+           IsOneOf(p.substr(0, dash), { "get", "set", "new", "remove", "add", "copy", "move", "rename", "test", "write",
+                                        "out", "select", "where", "foreach", "start", "stop", "invoke", "clear", "import",
+                                        "export", "convertto", "convertfrom", "measure", "sort", "format", "expand",
+                                        "compress", "push", "pop", "resolve", "split", "join" });
+}
+
+// The native built-in for a command, by the meaning its program name has in that shell
+static NativeOp NativeOpFor(const CommandSegment& seg) {
+    const std::string& p = seg.program;
+    switch (seg.dialect) {
+    case ShellDialect::Cmd:
+        if (IsOneOf(p, { "mkdir", "md" }))                 return NativeOp::MakeDir;
+        if (p == "type")                                   return NativeOp::GetContent;
+        if (p == "copy")                                   return NativeOp::Copy;
+        if (p == "move")                                   return NativeOp::Move;
+        if (IsOneOf(p, { "ren", "rename" }))               return NativeOp::Rename;
+        if (IsOneOf(p, { "del", "erase", "rd", "rmdir" })) return NativeOp::Delete;
+        if (p == "dir")                                    return NativeOp::List;
+        if (p == "where")                                  return NativeOp::Where;
+        break;
+    case ShellDialect::PowerShell:
+        if (IsOneOf(p, { "mkdir", "md" }))                 return NativeOp::MakeDir;
+        if (IsOneOf(p, { "new-item", "ni" }))              return NativeOp::NewItem;
+        if (p == "set-content")                            return NativeOp::SetContent;
+        if (IsOneOf(p, { "add-content", "ac" }))           return NativeOp::AddContent;
+        if (IsOneOf(p, { "get-content", "gc", "type", "cat" })) return NativeOp::GetContent;
+        if (IsOneOf(p, { "copy-item", "cpi", "copy", "cp" }))   return NativeOp::Copy;
+        if (IsOneOf(p, { "move-item", "mi", "move", "mv" }))    return NativeOp::Move;
+        if (IsOneOf(p, { "rename-item", "rni", "ren" }))        return NativeOp::Rename;
+        if (IsOneOf(p, { "remove-item", "ri", "del", "erase", "rm", "rd", "rmdir" })) return NativeOp::Delete;
+        if (IsOneOf(p, { "get-childitem", "gci", "dir", "ls" }))                      return NativeOp::List;
+        break;
+    case ShellDialect::Posix:
+        if (p == "mkdir")                                  return NativeOp::MakeDir;
+        if (p == "cat")                                    return NativeOp::GetContent;
+        if (p == "cp")                                     return NativeOp::Copy;
+        if (p == "mv")                                     return NativeOp::Move;
+        if (IsOneOf(p, { "rm", "rmdir" }))                 return NativeOp::Delete;
+        if (p == "ls")                                     return NativeOp::List;
+        if (p == "find")                                   return NativeOp::Find;
+        break;
+    }
+    return NativeOp::None;
+}
+
+static CommandInfo ClassifyCommand(const std::string& command) {
+    CommandInfo info;
+    TokenizeCommandLine(command, ShellDialect::Cmd, info.segments, info.unbalanced, 0);
+    if (!info.segments.empty() && IsCmdletName(info.segments[0].program)) {
+        // A bare cmdlet is run by PowerShell (see ExecuteNovaCommand), so read it with PowerShell's quoting
+        info.cmdlet = true;
+        info.unbalanced = false;
+        info.segments.clear();
+        TokenizeCommandLine(command, ShellDialect::PowerShell, info.segments, info.unbalanced, 0);
+    }
+    for (const CommandSegment& s : info.segments) {
+        const std::string& p = s.program;
+        auto hasArg = [&](std::initializer_list<const char*> names) {
+            for (const std::string& a : s.args) {
+                std::string l = a;
+                std::transform(l.begin(), l.end(), l.begin(), [](unsigned char c) { return (char)::tolower(c); });
+                if (IsOneOf(l, names)) return true;
+            }
+            return false;
+        };
+        if (!s.writes.empty()) info.writesFiles = true;
+        if (IsOneOf(p, { "cl", "clang-cl", "link", "lld-link", "lib", "ml", "ml64", "rc", "mt", "cvtres", "nmake", "msbuild",
+                         "devenv", "dumpbin", "editbin", "cmake", "ninja", "make", "gcc", "g++", "cc", "c++", "clang", "clang++", "ld" }))
+            info.compiles = info.writesFiles = true;
+        if (IsOneOf(p, { "cd", "chdir", "pushd", "popd", "set-location", "sl", "push-location", "pop-location" }) ||
+            p.rfind("cd.", 0) == 0 || p.rfind("cd\\", 0) == 0)
+            info.changesDir = true;
+        if (IsOneOf(p, { "copy", "xcopy", "robocopy", "move", "ren", "rename", "mkdir", "md", "mklink", "set-content", "add-content",
+                         "ac", "out-file", "new-item", "ni", "copy-item", "cp", "cpi", "move-item", "mv", "mi", "rename-item", "rni",
+                         "tee", "tee-object", "touch", "install", "expand-archive", "compress-archive", "tar", "unzip" }))
+            info.writesFiles = true;
+        if (IsOneOf(p, { "del", "erase", "rd", "rmdir", "rm", "remove-item", "ri", "clear-content", "clc", "format", "format-volume",
+                         "diskpart", "shutdown", "restart-computer", "stop-computer", "taskkill", "stop-process", "spps", "kill",
+                         "pkill", "killall", "cipher", "dd", "mkfs" }) ||
+            (p == "git" && (hasArg({ "clean" }) || (hasArg({ "reset" }) && hasArg({ "--hard" })) || (hasArg({ "push" }) && hasArg({ "--force", "-f" })))) ||
+            (p == "reg" && hasArg({ "delete" })) ||
+            (p == "robocopy" && hasArg({ "/mir", "/purge" })))
+            info.destructive = info.writesFiles = true;
+    }
+
+    if (info.compiles) info.route = CommandInfo::Route::Toolchain;
+    else if (info.segments.size() == 1 && !info.unbalanced && !info.segments[0].dynamic && info.segments[0].writes.empty() &&
+             (info.native = NativeOpFor(info.segments[0])) != NativeOp::None)
+        info.route = CommandInfo::Route::Native;
+    return info;
+}
+
+// ── Native built-ins ──
+// The file operations the model emits most (make a folder, write, append or read a file, copy, move,
+// rename, delete, list and find) run in-process when the EXEC line is a single literal command: no
+// shell round trip, and no second parser to get the quoting wrong. A switch, wildcard or form that is
+// not handled here sends the command to the shell untouched.
+
+// File text as the prompt's writing form has it (rule 4): `n, `r and `t inside single quotes, where
+// PowerShell itself would keep them literally. The writers turn them into the characters they stand
+// for, as the Set-Content interceptor always did.
+static std::string PromptEscapes(std::string text) {
+    size_t out = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '`' && i + 1 < text.size() && strchr("nrt", text[i + 1])) {
+            char n = text[++i];
+            c = n == 'n' ? '\n' : n == 'r' ? '\r' : '\t';
+        }
+        text[out++] = c;
+    }
+    text.resize(out);
+    return text;
+}
+
+struct NativeArgs {
+    std::vector<std::string> operands;
+    std::unordered_map<std::string, std::string> values;   // PowerShell -Name value parameters, lower case
+    std::unordered_set<std::string> switches;              // lower case, without the - or /
+    bool Has(const char* s) const { return switches.count(s) != 0; }
+    std::string Value(const char* name) const { auto it = values.find(name); return it == values.end() ? "" : it->second; }
+    bool HasValue(const char* name) const { return values.count(name) != 0; }
+};
+
+static std::string LowerAscii(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return (char)::tolower(c); });
+    return s;
+}
+
+static std::string TrimAscii(const std::string& s) {
+    size_t a = s.find_first_not_of(" \t\r"), b = s.find_last_not_of(" \t\r");
+    return a == std::string::npos ? "" : s.substr(a, b - a + 1);
+}
+
+// Splits arguments into operands, switches and PowerShell named values. PowerShell parameters may be
+// abbreviated (-Rec), POSIX short flags clustered (-rf) and cmd switches chained (/s/b). False for
+// anything not listed, so the command is left to the shell.
+static bool ParseNativeArgs(const CommandSegment& seg, std::initializer_list<const char*> valueNames,
+                            std::initializer_list<const char*> switchNames, NativeArgs& out) {
+    auto lookup = [](const std::string& name, std::initializer_list<const char*> names, bool prefix) -> const char* {
+        const char* hit = nullptr;
+        for (const char* n : names) {
+            if (name == n) return n;
+            if (prefix && !name.empty() && strncmp(n, name.c_str(), name.size()) == 0) {
+                if (hit) return nullptr;   // ambiguous
+                hit = n;
+            }
+        }
+        return hit;
+    };
+    const std::vector<std::string>& args = seg.args;
+    bool optionsDone = false;
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (seg.dialect == ShellDialect::PowerShell && arg.size() > 1 && arg[0] == '-' && !isdigit((unsigned char)arg[1])) {
+            std::string name = LowerAscii(arg.substr(1)), inline_;
+            size_t colon = name.find(':');
+            bool hasInline = colon != std::string::npos;
+            if (hasInline) { inline_ = arg.substr(colon + 2); name.resize(colon); }
+            if (const char* v = lookup(name, valueNames, true)) {
+                if (!hasInline && i + 1 >= args.size()) return false;
+                out.values[v] = hasInline ? inline_ : args[++i];
+            } else if (const char* s = lookup(name, switchNames, true)) {
+                if (hasInline) return false;
+                out.switches.insert(s);
+            } else if (name == "erroraction" || name == "ea") {
+                if (!hasInline && i + 1 >= args.size()) return false;
+                out.values["erroraction"] = LowerAscii(hasInline ? inline_ : args[++i]);
+            } else {
+                return false;
+            }
+        } else if (seg.dialect == ShellDialect::Cmd && arg.size() > 1 && arg[0] == '/') {
+            size_t from = 1;
+            while (from < arg.size()) {
+                size_t to = arg.find('/', from);
+                std::string name = LowerAscii(arg.substr(from, to == std::string::npos ? std::string::npos : to - from));
+                if (!lookup(name, switchNames, false)) return false;
+                out.switches.insert(name);
+                if (to == std::string::npos) break;
+                from = to + 1;
+            }
+        } else if (seg.dialect == ShellDialect::Posix && !optionsDone && arg.size() > 1 && arg[0] == '-') {
+            if (arg == "--") { optionsDone = true; continue; }
+            if (arg[1] == '-') {
+                if (!lookup(arg.substr(2), switchNames, false)) return false;
+                out.switches.insert(arg.substr(2));
+            } else {
+                for (size_t k = 1; k < arg.size(); k++) {
+                    std::string flag(1, arg[k]);
+                    if (!lookup(flag, switchNames, false)) return false;
+                    out.switches.insert(flag);
+                }
+            }
+        } else {
+            out.operands.push_back(arg);
+        }
+    }
+    return true;
+}
+
+// An EXEC argument as a full path: relative to the agent's working folder, ~ for the home folder outside cmd
+static std::filesystem::path NativePath(const std::string& arg, const std::string& cwd, bool tilde) {
+    namespace fs = std::filesystem;
+    std::string s = arg;
+    if (tilde && (s == "~" || s.rfind("~/", 0) == 0 || s.rfind("~\\", 0) == 0)) {
+        char home[MAX_PATH] = "";
+        GetEnvironmentVariableA("USERPROFILE", home, MAX_PATH);
+        s = std::string(home) + s.substr(1);
+    }
+    fs::path p = fs::u8path(s);
+    if (p.is_relative()) {
+        std::error_code ec;
+        p = (cwd.empty() ? fs::current_path(ec) : fs::u8path(cwd)) / p;
+    }
+    return p.lexically_normal();
+}
+
+// * and ? wildcards, as the listing commands apply them to names
+static bool GlobMatch(const char* pat, const char* s, bool icase) {
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    auto same = [icase](char a, char b) { return icase ? ::tolower((unsigned char)a) == ::tolower((unsigned char)b) : a == b; };
+    while (*s) {
+        if (*pat == '*') { star = pat++; resume = s; }
+        else if (*pat == '?' || (*pat && same(*pat, *s))) { pat++; s++; }
+        else if (star) { pat = star + 1; s = ++resume; }
+        else return false;
+    }
+    while (*pat == '*') pat++;
+    return *pat == 0;
+}
+
+static std::string FormatFileTime(std::filesystem::file_time_type t) {
+    auto sys = std::chrono::system_clock::now() +
+               std::chrono::duration_cast<std::chrono::system_clock::duration>(t - std::filesystem::file_time_type::clock::now());
+    time_t tt = std::chrono::system_clock::to_time_t(sys);
+    struct tm local = {};
+    localtime_s(&local, &tt);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &local);
+    return buf;
+}
+
+static bool IsHiddenPath(const std::filesystem::path& p) {
+    DWORD attr = GetFileAttributesW(p.wstring().c_str());
+    return attr != INVALID_FILE_ATTRIBUTES && (attr & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM));
+}
+
+// Writes through a temporary file in the same folder that is then renamed over the target, so an
+// interrupted write never leaves half a file behind
+static bool WriteFileAtomic(const std::filesystem::path& path, const std::string& data, std::string& err) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    fs::path tmp = path;
+    tmp += ".nova-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f || !f.write(data.data(), (std::streamsize)data.size()) || !f.flush()) {
+            f.close();
+            fs::remove(tmp, ec);
+            err = "Could not write '" + path.u8string() + "'.";
+            return false;
+        }
+    }
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        std::error_code ignored;
+        fs::remove(tmp, ignored);
+        err = "Could not replace '" + path.u8string() + "': " + ec.message();
+        return false;
+    }
+    return true;
+}
+
+static bool CopyFileAtomic(const std::filesystem::path& from, const std::filesystem::path& to, std::string& err) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path tmp = to;
+    tmp += ".nova-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+    fs::copy_file(from, tmp, fs::copy_options::overwrite_existing, ec);
+    if (!ec) fs::rename(tmp, to, ec);
+    if (ec) {
+        std::error_code ignored;
+        fs::remove(tmp, ignored);
+        err = "Could not copy '" + from.u8string() + "' to '" + to.u8string() + "': " + ec.message();
+        return false;
+    }
+    return true;
+}
+
+// Deletes go to the Recycle Bin, so a wrong guess by the model can be undone
+static bool MoveToRecycleBin(const std::vector<std::filesystem::path>& items, std::string& err) {
+    std::wstring from;
+    for (const auto& p : items) { from += p.wstring(); from.push_back(L'\0'); }
+    from.push_back(L'\0');
+    HRESULT co = CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
+    SHFILEOPSTRUCTW op = {};
+    op.wFunc  = FO_DELETE;
+    op.pFrom  = from.c_str();
+    op.fFlags = FOF_ALLOWUNDO | FOF_NOCONFIRMATION | FOF_SILENT | FOF_NOERRORUI | FOF_WANTNUKEWARNING;   // asks before anything is deleted for good
+    int rc = SHFileOperationW(&op);
+    if (SUCCEEDED(co)) CoUninitialize();
+    if (rc != 0 || op.fAnyOperationsAborted) {
+        char buf[96];
+        sprintf_s(buf, "The Recycle Bin refused the delete (code 0x%X).", rc);
+        err = buf;
+        return false;
+    }
+    return true;
+}
+
+// Entries of a folder for dir / ls / Get-ChildItem / find / where /r
+struct NativeListing {
+    bool recursive = false, bare = false, fullPaths = false, hidden = false, filesOnly = false, dirsOnly = false;
+    bool findStyle = false;     // find: paths start with the folder as typed, the folder itself included
+    int  maxDepth  = -1;        // deepest level listed, 0 for the folder's own entries; -1 for no limit
+    std::string pattern;        // * and ? on the name
+    bool icase = true;
+};
+
+static const size_t kNativeListLimit = 20000;
+
+static bool ListNative(const std::string& typed, const std::filesystem::path& dir, const NativeListing& o,
+                       unsigned long long maxBytes, std::string& out, size_t& count, std::string& err) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    if (!fs::exists(dir, ec)) { err = "Cannot find path '" + dir.u8string() + "' because it does not exist."; return false; }
+
+    struct Entry { std::string rel; bool dir; unsigned long long size; fs::file_time_type mtime; };
+    std::vector<Entry> entries;
+    bool capped = false;
+    auto add = [&](const fs::directory_entry& e, const std::string& rel) {
+        std::error_code eec;
+        bool isDir = e.is_directory(eec);
+        if ((o.filesOnly && isDir) || (o.dirsOnly && !isDir)) return;
+        if (!o.pattern.empty() && !GlobMatch(o.pattern.c_str(), e.path().filename().u8string().c_str(), o.icase)) return;
+        if (entries.size() >= kNativeListLimit) { capped = true; return; }
+        entries.push_back({ rel, isDir, isDir ? 0 : (unsigned long long)e.file_size(eec), e.last_write_time(eec) });
+    };
+
+    if (!fs::is_directory(dir, ec)) {
+        add(fs::directory_entry(dir, ec), "");
+    } else if (o.recursive) {
+        if (o.findStyle) add(fs::directory_entry(dir, ec), "");
+        fs::recursive_directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end;
+        for (; !ec && it != end && !capped; it.increment(ec)) {
+            if (!o.hidden && IsHiddenPath(it->path())) { it.disable_recursion_pending(); continue; }
+            if (o.maxDepth >= 0 && it.depth() >= o.maxDepth) it.disable_recursion_pending();
+            add(*it, it->path().lexically_relative(dir).u8string());
+        }
+    } else {
+        for (fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+            if (!o.hidden && IsHiddenPath(it->path())) continue;
+            add(*it, it->path().filename().u8string());
+        }
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.rel < b.rel; });
+
+    unsigned long long files = 0, folders = 0, bytes = 0;
+    if (!o.bare) out += "Directory: " + dir.u8string() + "\n\n";
+    for (const Entry& e : entries) {
+        if (out.size() >= maxBytes) { capped = true; break; }
+        // An empty `rel` is the listed path itself (a file, or find's start folder)
+        std::string name = o.fullPaths ? (e.rel.empty() ? dir : dir / fs::u8path(e.rel)).u8string()
+                         : o.findStyle ? (e.rel.empty() ? typed : typed + "/" + e.rel)
+                         : e.rel.empty() ? dir.filename().u8string() : e.rel;
+        if (o.bare) {
+            out += name + "\n";
+        } else {
+            char size[32];
+            sprintf_s(size, "%-14s", e.dir ? "<DIR>" : std::to_string(e.size).c_str());
+            out += FormatFileTime(e.mtime) + "  " + size + "  " + name + "\n";
+        }
+        (e.dir ? folders : files)++;
+        bytes += e.size;
+    }
+    if (capped) out += "... listing stopped at " + std::to_string(entries.size()) + " entries\n";
+    count = entries.size();
+    if (!o.bare) out += "\n" + std::to_string(files) + " file(s), " + std::to_string(folders) + " folder(s), " + std::to_string(bytes) + " bytes\n";
+    return true;
+}
+
+// Reads at most `maxBytes` of a file for type / cat / Get-Content, from the end when `tail` is set
+static bool ReadFileNative(const std::filesystem::path& p, unsigned long long maxBytes, bool tail, std::string& text, std::string& err) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    if (!fs::exists(p, ec))     { err = "Cannot find path '" + p.u8string() + "' because it does not exist."; return false; }
+    if (fs::is_directory(p, ec)) { err = "'" + p.u8string() + "' is a folder, not a file."; return false; }
+    std::ifstream f(p, std::ios::binary);
+    if (!f) { err = "Could not open '" + p.u8string() + "'."; return false; }
+    unsigned long long size = (unsigned long long)fs::file_size(p, ec), n = (std::min)(size, maxBytes);
+    if (tail && size > n) f.seekg((std::streamoff)(size - n));
+    text.resize((size_t)n);
+    f.read(&text[0], (std::streamsize)n);
+    text.resize((size_t)f.gcount());
+    if (size > n) text = tail ? "[... " + std::to_string(size - n) + " earlier bytes not shown]\n" + text
+                              : text + "\n[... " + std::to_string(size - n) + " more bytes not shown]\n";
+    return true;
+}
+
+// Runs `seg` in-process and fills `res` like the shell would have. False when the command needs the
+// shell after all (an unsupported switch, a wildcard, a folder where cmd expects files...); nothing
+// has been touched in that case.
+static bool RunNativeCommand(const CommandSegment& seg, NativeOp op, const std::string& cwd, unsigned long long maxOutput, ExecResult& res) {
+    namespace fs = std::filesystem;
+    const bool ps = seg.dialect == ShellDialect::PowerShell, posix = seg.dialect == ShellDialect::Posix, cmd = !ps && !posix;
+    const std::string& prog = seg.program;
+    NativeArgs a;
+    std::string out, err;
+    std::error_code ec;
+    auto path = [&](const std::string& s) { return NativePath(s, cwd, !cmd); };
+    auto wild = [&](const std::string& s) { return s.find_first_of(ps && !a.HasValue("literalpath") ? "*?[" : "*?") != std::string::npos; };
+    auto missing = [&](const fs::path& p) { err = "Cannot find path '" + p.u8string() + "' because it does not exist."; };
+    // PowerShell's -Path / -LiteralPath, else the first operand
+    auto psPath = [&]() -> std::string {
+        if (a.HasValue("literalpath")) return a.Value("literalpath");
+        if (a.HasValue("path")) return a.Value("path");
+        if (a.operands.empty()) return "";
+        std::string p = a.operands[0];
+        a.operands.erase(a.operands.begin());
+        return p;
+    };
+    const char* newline = "\r\n";
+
+    switch (op) {
+    case NativeOp::MakeDir: {
+        if (!(ps ? ParseNativeArgs(seg, { "path" }, { "force" }, a) : posix ? ParseNativeArgs(seg, {}, { "p", "v", "parents" }, a)
+                 : ParseNativeArgs(seg, {}, {}, a)))
+            return false;
+        if (a.HasValue("path")) a.operands.insert(a.operands.begin(), a.Value("path"));
+        if (a.operands.empty()) return false;
+        for (const std::string& t : a.operands) if (wild(t)) return false;
+        bool existingOk = a.Has("force") || a.Has("p") || a.Has("parents");
+        for (const std::string& t : a.operands) {
+            fs::path p = path(t);
+            if (fs::exists(p, ec)) {
+                if (!existingOk || !fs::is_directory(p, ec)) { err += "'" + p.u8string() + "' already exists.\n"; }
+                continue;
+            }
+            if (!fs::create_directories(p, ec) && ec) err += "Could not create '" + p.u8string() + "': " + ec.message() + "\n";
+        }
+        break;
+    }
+
+    case NativeOp::NewItem: {
+        if (!ParseNativeArgs(seg, { "path", "name", "itemtype", "type", "value" }, { "force" }, a)) return false;
+        std::string type = LowerAscii(a.HasValue("itemtype") ? a.Value("itemtype") : a.Value("type"));
+        std::string target = psPath();
+        if (!a.operands.empty() || (target.empty() && !a.HasValue("name")) || wild(target)) return false;
+        fs::path p = a.HasValue("name") ? path(target.empty() ? a.Value("name") : target + "/" + a.Value("name")) : path(target);
+        if (type == "directory" || type == "d") {
+            if (fs::exists(p, ec) && !a.Has("force")) err = "An item with the specified name '" + p.u8string() + "' already exists.";
+            else if (!fs::create_directories(p, ec) && ec) err = "Could not create '" + p.u8string() + "': " + ec.message();
+        } else if (type.empty() || type == "file" || type == "f") {
+            if (fs::exists(p, ec) && !a.Has("force")) err = "The file '" + p.u8string() + "' already exists.";
+            else WriteFileAtomic(p, PromptEscapes(a.Value("value")), err);
+        } else {
+            return false;   // links and junctions
+        }
+        break;
+    }
+
+    case NativeOp::SetContent:
+    case NativeOp::AddContent: {
+        // Text is written as UTF-8 without a BOM; the encodings that mean something else go to PowerShell
+        if (!ParseNativeArgs(seg, { "path", "literalpath", "value", "encoding" }, { "nonewline", "force" }, a)) return false;
+        std::string target = psPath();
+        if (!a.HasValue("value")) {
+            if (a.operands.size() != 1) return false;   // no value: it would come down the pipeline
+            a.values["value"] = a.operands[0];
+            a.operands.clear();
+        }
+        std::string enc = LowerAscii(a.Value("encoding"));
+        if (target.empty() || !a.operands.empty() || wild(target) ||
+            !IsOneOf(enc, { "", "utf8", "utf8nobom", "ascii", "default", "oem", "string" }))
+            return false;
+        fs::path p = path(target);
+        std::string text = PromptEscapes(a.Value("value")) + (a.Has("nonewline") ? "" : newline);
+        if (fs::is_directory(p, ec)) {
+            err = "'" + p.u8string() + "' is a folder, not a file.";
+        } else if (op == NativeOp::SetContent) {
+            WriteFileAtomic(p, text, err);
+        } else {
+            // Appending in place already never loses what was there; only the new text can be cut short
+            fs::create_directories(p.parent_path(), ec);
+            std::ofstream f(p, std::ios::binary | std::ios::app);
+            if (!f || !f.write(text.data(), (std::streamsize)text.size())) err = "Could not append to '" + p.u8string() + "'.";
+        }
+        break;
+    }
+
+    case NativeOp::GetContent: {
+        if (!(ps ? ParseNativeArgs(seg, { "path", "literalpath", "encoding", "totalcount", "head", "first", "tail", "last" }, { "raw", "force" }, a)
+                 : ParseNativeArgs(seg, {}, {}, a)))
+            return false;
+        if (ps) {
+            std::string target = psPath();
+            if (!target.empty()) a.operands.insert(a.operands.begin(), target);
+        }
+        if (a.operands.empty()) return false;
+        for (const std::string& t : a.operands) if (wild(t)) return false;
+        std::string headArg = a.HasValue("totalcount") ? a.Value("totalcount") : a.HasValue("head") ? a.Value("head") : a.Value("first");
+        std::string tailArg = a.HasValue("tail") ? a.Value("tail") : a.Value("last");
+        long head = headArg.empty() ? -1 : atol(headArg.c_str()), tail = tailArg.empty() ? -1 : atol(tailArg.c_str());
+        for (const std::string& t : a.operands) {
+            std::string text;
+            if (!ReadFileNative(path(t), maxOutput, tail >= 0, text, err)) break;
+            if (head >= 0 || tail >= 0) {
+                std::vector<std::string> lines;
+                std::istringstream in(text);
+                for (std::string line; std::getline(in, line);) lines.push_back(line);
+                size_t from = tail >= 0 && (size_t)tail < lines.size() ? lines.size() - (size_t)tail : 0;
+                size_t to   = head >= 0 ? (std::min)(lines.size(), from + (size_t)head) : lines.size();
+                text.clear();
+                for (size_t i = from; i < to; i++) text += lines[i] + "\n";
+            }
+            out += text;
+        }
+        break;
+    }
+
+    case NativeOp::Copy:
+    case NativeOp::Move: {
+        bool copy = op == NativeOp::Copy;
+        bool ok = ps    ? ParseNativeArgs(seg, { "path", "literalpath", "destination" }, { "recurse", "force", "container" }, a)
+                : posix ? (copy ? ParseNativeArgs(seg, {}, { "r", "R", "f", "v", "recursive", "force" }, a)
+                                : ParseNativeArgs(seg, {}, { "f", "v", "force" }, a))
+                        : ParseNativeArgs(seg, {}, copy ? std::initializer_list<const char*>{ "y", "b", "v" } : std::initializer_list<const char*>{ "y" }, a);
+        if (!ok) return false;
+        std::vector<std::string> sources;
+        std::string dest;
+        if (ps) {
+            std::string src = psPath();
+            if (!src.empty()) sources.push_back(src);
+            if (a.HasValue("destination")) dest = a.Value("destination");
+            else if (!a.operands.empty()) { dest = a.operands[0]; a.operands.erase(a.operands.begin()); }
+            if (!a.operands.empty()) return false;
+        } else {
+            sources = a.operands;
+            if (sources.size() >= 2) { dest = sources.back(); sources.pop_back(); }
+            else if (cmd && sources.size() == 1) dest = ".";   // copy x: into the current folder
+        }
+        if (sources.empty() || dest.empty() || wild(dest)) return false;
+        for (const std::string& s : sources) if (wild(s) || (cmd && s.find('+') != std::string::npos)) return false;
+        bool recurse = a.Has("recurse") || a.Has("r") || a.Has("R") || a.Has("recursive");
+        fs::path to = path(dest);
+        bool intoFolder = fs::is_directory(to, ec) || sources.size() > 1;
+        for (const std::string& s : sources) {
+            fs::path from = path(s);
+            if (!fs::exists(from, ec)) { missing(from); break; }
+            bool folder = fs::is_directory(from, ec);
+            if (copy && folder && !recurse) {
+                if (!posix) return false;   // cmd copies the files inside, PowerShell just the folder
+                err = "cp: -r not specified; omitting directory '" + s + "'";
+                break;
+            }
+            fs::path target = intoFolder ? to / from.filename() : to;
+            if (fs::equivalent(from, target, ec)) { err = "'" + from.u8string() + "' cannot be " + (copy ? "copied" : "moved") + " onto itself."; break; }
+            if (!copy && ps && !a.Has("force") && fs::exists(target, ec)) { err = "Cannot create '" + target.u8string() + "' because it already exists."; break; }
+            if (copy) {
+                if (folder) {
+                    fs::copy(from, target, fs::copy_options::recursive | fs::copy_options::overwrite_existing, ec);
+                    if (ec) { err = "Could not copy '" + from.u8string() + "': " + ec.message(); break; }
+                } else if (!CopyFileAtomic(from, target, err)) {
+                    break;
+                }
+            } else {
+                fs::rename(from, target, ec);
+                if (ec == std::errc::cross_device_link) {
+                    ec.clear();
+                    if (folder) fs::copy(from, target, fs::copy_options::recursive, ec);
+                    else        fs::copy_file(from, target, fs::copy_options::overwrite_existing, ec);
+                    if (!ec) fs::remove_all(from, ec);
+                }
+                if (ec) { err = "Could not move '" + from.u8string() + "': " + ec.message(); break; }
+            }
+        }
+        break;
+    }
+
+    case NativeOp::Rename: {
+        if (!(ps ? ParseNativeArgs(seg, { "path", "literalpath", "newname" }, { "force" }, a) : ParseNativeArgs(seg, {}, {}, a))) return false;
+        std::string src = ps ? psPath() : a.operands.empty() ? "" : a.operands[0];
+        if (!ps && !a.operands.empty()) a.operands.erase(a.operands.begin());
+        std::string name = a.HasValue("newname") ? a.Value("newname") : a.operands.empty() ? "" : a.operands[0];
+        if (a.operands.size() > (a.HasValue("newname") ? 0u : 1u)) return false;
+        if (src.empty() || name.empty() || wild(src) || wild(name) || name.find_first_of("\\/") != std::string::npos) return false;
+        fs::path from = path(src), to = from.parent_path() / fs::u8path(name);
+        if (!fs::exists(from, ec))    missing(from);
+        else if (fs::exists(to, ec))  err = "Cannot rename to '" + name + "' because it already exists.";
+        else {
+            fs::rename(from, to, ec);
+            if (ec) err = "Could not rename '" + from.u8string() + "': " + ec.message();
+        }
+        break;
+    }
+
+    case NativeOp::Delete: {
+        // The shells' rules for folders are kept: cmd's del only deletes files, rd and rm need /s or -r
+        // for anything not empty, Remove-Item needs -Recurse
+        bool rd = prog == "rd" || prog == "rmdir";
+        bool ok = ps    ? ParseNativeArgs(seg, { "path", "literalpath" }, { "recurse", "force" }, a)
+                : posix ? (rd ? ParseNativeArgs(seg, {}, {}, a) : ParseNativeArgs(seg, {}, { "r", "R", "f", "d", "v", "recursive", "force", "dir" }, a))
+                        : ParseNativeArgs(seg, {}, rd ? std::initializer_list<const char*>{ "s", "q" } : std::initializer_list<const char*>{ "q", "f" }, a);
+        if (!ok) return false;
+        if (ps) {
+            std::string target = psPath();
+            if (!target.empty()) a.operands.insert(a.operands.begin(), target);
+        }
+        if (a.operands.empty()) return false;
+        for (const std::string& t : a.operands) if (wild(t)) return false;
+        bool recurse = a.Has("recurse") || a.Has("r") || a.Has("R") || a.Has("recursive") || a.Has("s");
+        bool force   = posix && (a.Has("f") || a.Has("force"));
+        std::vector<fs::path> items;
+        for (const std::string& t : a.operands) {
+            fs::path p = path(t);
+            if (!fs::exists(p, ec)) {
+                if (!force) { missing(p); break; }
+                continue;
+            }
+            bool folder = fs::is_directory(p, ec), empty = folder && fs::is_empty(p, ec);
+            if (cmd && !rd && folder) return false;   // del <folder> deletes the files in it, after a prompt
+            if (rd && !folder)                         { err = "'" + p.u8string() + "' is not a folder."; break; }
+            if (folder && !empty && !recurse)          { err = "'" + p.u8string() + "' is not empty" + (ps ? " and -Recurse was not specified." : "."); break; }
+            if (posix && !rd && folder && !recurse && !a.Has("d") && !a.Has("dir")) { err = "rm: cannot remove '" + t + "': Is a directory"; break; }
+            items.push_back(p);
+        }
+        if (err.empty() && !items.empty() && MoveToRecycleBin(items, err)) {
+            out = "Moved to the Recycle Bin (can be restored from there):\n";
+            for (const auto& p : items) out += "  " + p.u8string() + "\n";
+        }
+        break;
+    }
+
+    case NativeOp::List: {
+        NativeListing o;
+        o.icase = !posix;
+        std::string target;
+        if (ps) {
+            if (!ParseNativeArgs(seg, { "path", "literalpath", "filter", "depth" }, { "recurse", "file", "directory", "name", "force" }, a)) return false;
+            target = psPath();
+            if (!a.operands.empty() && !a.HasValue("filter")) { a.values["filter"] = a.operands[0]; a.operands.erase(a.operands.begin()); }
+            if (!a.operands.empty()) return false;
+            o.recursive = a.Has("recurse") || a.HasValue("depth");
+            o.maxDepth  = a.HasValue("depth") ? atoi(a.Value("depth").c_str()) : -1;
+            o.filesOnly = a.Has("file");
+            o.dirsOnly  = a.Has("directory");
+            o.bare      = a.Has("name");
+            o.hidden    = a.Has("force");
+            o.pattern   = a.Value("filter");
+        } else if (posix) {
+            if (!ParseNativeArgs(seg, {}, { "l", "a", "A", "1", "all", "almost-all" }, a) || a.operands.size() > 1) return false;
+            target = a.operands.empty() ? "" : a.operands[0];
+            o.bare   = !a.Has("l");
+            o.hidden = a.Has("a") || a.Has("A") || a.Has("all") || a.Has("almost-all");
+        } else {
+            if (!ParseNativeArgs(seg, {}, { "b", "s", "a", "ad", "a:d", "a-d", "a:-d", "o", "on", "o:n" }, a) || a.operands.size() > 1) return false;
+            target = a.operands.empty() ? "" : a.operands[0];
+            o.bare      = a.Has("b");
+            o.recursive = a.Has("s");
+            o.fullPaths = o.bare && o.recursive;
+            o.hidden    = a.Has("a");
+            o.dirsOnly  = a.Has("ad") || a.Has("a:d");
+            o.filesOnly = a.Has("a-d") || a.Has("a:-d");
+        }
+        // A wildcard in the last part is a name pattern: dir src\*.cpp, Get-ChildItem *.txt
+        size_t slash = target.find_last_of(cmd || ps ? "\\/" : "/");
+        std::string last = slash == std::string::npos ? target : target.substr(slash + 1);
+        if (wild(last) && !last.empty()) {
+            if (!o.pattern.empty() || wild(target.substr(0, target.size() - last.size()))) return false;
+            o.pattern = last;
+            target.resize(target.size() - last.size());
+        }
+        if (wild(target) || (!o.pattern.empty() && o.pattern.find('[') != std::string::npos)) return false;
+        size_t count = 0;
+        if (ListNative(target, path(target.empty() ? "." : target), o, maxOutput, out, count, err) && cmd && count == 0 && !o.pattern.empty()) {
+            out.clear();
+            err = "File Not Found";
+        }
+        break;
+    }
+
+    case NativeOp::Find: {
+        // find [folder...] with -name / -iname / -type f|d / -maxdepth / -mindepth 1 / -print
+        NativeListing o;
+        o.recursive = o.bare = o.findStyle = o.hidden = true;
+        o.icase = false;
+        std::vector<std::string> roots;
+        const std::vector<std::string>& args = seg.args;
+        size_t i = 0;
+        for (; i < args.size() && !args[i].empty() && args[i][0] != '-'; i++) roots.push_back(args[i]);
+        bool noStart = false;
+        for (; i < args.size(); i++) {
+            const std::string& k = args[i];
+            if (k == "-print") continue;
+            if (i + 1 >= args.size()) return false;
+            const std::string& v = args[++i];
+            if ((k == "-name" || k == "-iname") && o.pattern.empty()) { o.pattern = v; o.icase = k == "-iname"; }
+            else if (k == "-type" && (v == "f" || v == "d"))          { o.filesOnly = v == "f"; o.dirsOnly = v == "d"; }
+            else if (k == "-maxdepth" && v != "0" && isdigit((unsigned char)v[0])) o.maxDepth = atoi(v.c_str()) - 1;
+            else if (k == "-mindepth" && v == "1")                     noStart = true;
+            else return false;
+        }
+        if (o.pattern.find('[') != std::string::npos) return false;
+        if (roots.empty()) roots.push_back(".");
+        for (const std::string& r : roots) {
+            std::string listed;
+            size_t count = 0;
+            if (!ListNative(r, path(r), o, maxOutput, listed, count, err)) break;
+            if (noStart && listed.compare(0, r.size() + 1, r + "\n") == 0) listed.erase(0, r.size() + 1);   // the start folder sorts first
+            out += listed;
+        }
+        break;
+    }
+
+    case NativeOp::Where: {
+        // Only the recursive search, where /r <folder> <pattern>; a bare `where x` searches PATH
+        if (seg.args.size() != 3 || LowerAscii(seg.args[0]) != "/r" || wild(seg.args[1])) return false;
+        NativeListing o;
+        o.recursive = o.bare = o.fullPaths = o.filesOnly = o.hidden = true;
+        o.pattern = seg.args[2];
+        size_t count = 0;
+        if (ListNative(seg.args[1], path(seg.args[1]), o, maxOutput, out, count, err) && count == 0)
+            err = "INFO: Could not find files for the given pattern(s).";
+        break;
+    }
+
+    case NativeOp::None:
+        return false;
+    }
+
+    if (!err.empty() && ps && IsOneOf(a.Value("erroraction"), { "silentlycontinue", "ignore" })) err.clear();
+    res.started  = true;
+    res.exitCode = err.empty() ? 0 : 1;
+    res.output   = out + err;
+    if (!err.empty() && res.output.back() != '\n') res.output += "\n";
+    res.totalBytes = res.output.size();
+    return true;
+}
+
+// EXEC fast-path accounting for the dev log. What the shell would have cost is estimated from the
+// short commands it ran this session.
+struct ExecFastPathStats {
+    std::mutex mutex;
+    unsigned execs = 0, native = 0, shellShort = 0;
+    double   nativeMs = 0, shellShortMs = 0;
+};
+static ExecFastPathStats g_execStats;
+
+// ── Compile cache ──
+// ccache-style: a compiler call whose preprocessed sources, flags and compiler are unchanged gets its
+// outputs (executable or objects) and diagnostics back from the cache instead of being compiled
+// again, so a retry or a rebuild after an edit that only touched comments costs one preprocessor
+// run. Compile errors are cached too; link and file-access failures are not. Entries live in
+// nova_compile_cache next to the exe, capped at compile_cache_mb (least recently used go first).
+
+struct CompileJob {
+    std::string program;                  // cl, clang-cl, gcc, g++, clang, clang++, cc, c++
+    bool msvc        = false;
+    bool compileOnly = false;             // /c or -c: objects only
+    bool changesDir  = false;             // the line cd's before compiling
+    std::string dir;                      // folder the compiler runs in
+    std::vector<std::string> sources;     // as typed, wildcards expanded
+    std::vector<std::string> inputs;      // objects and libraries on the command line, hashed by content
+    std::vector<std::string> flags;       // everything else, output names left out
+    std::vector<std::string> outputs;     // full paths the compiler writes, in a fixed order
+};
+
+// Quoted for the shell RunCommand uses (cmd.exe / sh)
+static std::string QuoteArg(const std::string& a) {
+    if (!a.empty() && a.find_first_of(" \t&|<>^()\"") == std::string::npos) return a;
+    return "\"" + a + "\"";
+}
+
+// `*.cpp`, `src/*.c`: the shell (or cl itself) would expand these, in name order
+static bool ExpandSourceWildcard(const std::string& arg, const std::string& dir, std::vector<std::string>& sources) {
+    namespace fs = std::filesystem;
+    size_t slash = arg.find_last_of("\\/");
+    std::string parent = slash == std::string::npos ? "" : arg.substr(0, slash + 1), pattern = arg.substr(parent.size());
+    if (parent.find_first_of("*?") != std::string::npos) return false;
+    const bool icase = true;
+    std::vector<std::string> names;
+    std::error_code ec;
+    for (fs::directory_iterator it(NativePath(parent.empty() ? "." : parent, dir, !icase), ec), end; !ec && it != end; it.increment(ec)) {
+        std::string name = it->path().filename().u8string();
+        if (it->is_regular_file(ec) && GlobMatch(pattern.c_str(), name.c_str(), icase)) names.push_back(name);
+    }
+    if (names.empty()) return false;
+    std::sort(names.begin(), names.end());
+    for (const std::string& n : names) sources.push_back(parent + n);
+    return true;
+}
+
+// A single compiler call, optionally after cd's. False for anything the cache cannot reproduce
+// exactly: debug info and listing files, precompiled headers, response files, /link sections...
+static bool ParseCompileJob(const CommandInfo& info, const std::string& cwd, CompileJob& job) {
+    namespace fs = std::filesystem;
+    if (info.unbalanced || info.segments.empty()) return false;
+    std::error_code ec;
+    fs::path dir = cwd.empty() ? fs::current_path(ec) : fs::u8path(cwd);
+    for (size_t i = 0; i + 1 < info.segments.size(); i++) {
+        const CommandSegment& cd = info.segments[i];
+        if (!IsOneOf(cd.program, { "cd", "chdir" }) || cd.dynamic || !cd.writes.empty()) return false;
+        std::vector<std::string> operands;
+        for (const std::string& a : cd.args) if (LowerAscii(a) != "/d") operands.push_back(a);
+        if (operands.size() != 1) return false;
+        dir = NativePath(operands[0], dir.u8string(), cd.dialect != ShellDialect::Cmd);
+        job.changesDir = true;
+    }
+    const CommandSegment& seg = info.segments.back();
+    if (seg.dynamic || !seg.writes.empty() ||
+        !IsOneOf(seg.program, { "cl", "clang-cl", "gcc", "g++", "clang", "clang++", "cc", "c++" }))
+        return false;
+    job.program = seg.program;
+    job.msvc = seg.program == "cl" || seg.program == "clang-cl";
+    job.dir = dir.u8string();
+
+    std::string exe, obj;
+    const std::vector<std::string>& args = seg.args;
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string& a = args[i];
+        if (a.empty() || a[0] == '@') return false;
+        bool option = a.size() > 1 && (a[0] == '-' || (job.msvc && a[0] == '/'));
+        if (option && job.msvc) {
+            std::string o = a.substr(1);
+            auto value = [&](size_t skip, std::string& into) {
+                into = o.substr(skip);
+                if (!into.empty() && into[0] == ':') into.erase(0, 1);
+                if (into.empty() && i + 1 < args.size()) into = args[++i];
+                return !into.empty();
+            };
+            if (o == "c") job.compileOnly = true;
+            else if (o == "nologo") continue;
+            else if (o.compare(0, 2, "Fe") == 0) { if (!value(2, exe)) return false; }
+            else if (o.compare(0, 2, "Fo") == 0) { if (!value(2, obj)) return false; }
+            else if (o == "link" || o == "P" || o == "E" || o == "EP" || o.compare(0, 2, "Zi") == 0 || o.compare(0, 2, "ZI") == 0 ||
+                     o.compare(0, 2, "LD") == 0 || o.compare(0, 2, "Yc") == 0 || o.compare(0, 2, "Yu") == 0 || o.compare(0, 2, "Tc") == 0 ||
+                     o.compare(0, 2, "Tp") == 0 || o.compare(0, 7, "analyze") == 0 || o.compare(0, 3, "doc") == 0 ||
+                     o.compare(0, 20, "sourceDependencies") == 0 ||
+                     (o.size() >= 2 && o[0] == 'F' && strchr("daAmpiRrx", o[1])))
+                return false;
+            else {
+                job.flags.push_back(a);
+                if ((o == "I" || o == "D" || o == "U" || o == "FI") && i + 1 < args.size()) job.flags.push_back(args[++i]);
+            }
+        } else if (option) {
+            if (a == "-c") job.compileOnly = true;
+            else if (a == "-o") { if (i + 1 >= args.size()) return false; exe = args[++i]; }
+            else if (a.compare(0, 2, "-o") == 0) exe = a.substr(2);
+            else if (a == "-E" || a == "-S" || a == "-x" || a.compare(0, 2, "-M") == 0 || a.compare(0, 11, "-save-temps") == 0 ||
+                     a.compare(0, 10, "-fprofile-") == 0 || a == "--coverage" || a.compare(0, 6, "-print") == 0 ||
+                     a == "-v" || a == "--version" || a == "-###")
+                return false;
+            else {
+                job.flags.push_back(a);
+                if (IsOneOf(a, { "-I", "-D", "-U", "-L", "-l", "-include", "-isystem", "-iquote", "-Xlinker" }) && i + 1 < args.size())
+                    job.flags.push_back(args[++i]);
+            }
+        } else {
+            std::string ext = LowerAscii(fs::u8path(a).extension().u8string());
+            if (IsOneOf(ext, { ".c", ".cc", ".cpp", ".cxx", ".c++" })) {
+                if (a.find_first_of("*?") == std::string::npos) job.sources.push_back(a);
+                else if (!ExpandSourceWildcard(a, job.dir, job.sources)) return false;
+            }
+            else if (IsOneOf(ext, { ".obj", ".lib", ".res", ".o", ".a", ".so" })) job.inputs.push_back(a);
+            else return false;
+        }
+    }
+    if (job.sources.empty()) return false;
+
+    // Where the compiler puts things: objects in the folder it runs in, the program next to them
+    auto stem = [](const std::string& src) { return fs::u8path(src).stem().u8string(); };
+    auto at = [&](const std::string& name) { return NativePath(name, job.dir, !job.msvc).u8string(); };
+    auto endsWithSep = [](const std::string& s) { return !s.empty() && (s.back() == '\\' || s.back() == '/'); };
+    if (job.msvc) {
+        if (job.compileOnly) {
+            if (!exe.empty()) return false;
+            if (!obj.empty() && !endsWithSep(obj) && job.sources.size() > 1) return false;
+            for (const std::string& s : job.sources)
+                job.outputs.push_back(obj.empty() ? at(stem(s) + ".obj") : endsWithSep(obj) ? at(obj + stem(s) + ".obj")
+                                      : at(fs::u8path(obj).has_extension() ? obj : obj + ".obj"));
+        } else {
+            if (!obj.empty() || endsWithSep(exe)) return false;
+            std::string name = exe.empty() ? stem(job.sources[0]) + ".exe" : fs::u8path(exe).has_extension() ? exe : exe + ".exe";
+            job.outputs.push_back(at(name));
+            for (const std::string& s : job.sources) job.outputs.push_back(at(stem(s) + ".obj"));
+        }
+    } else {
+        if (job.compileOnly) {
+            if (!exe.empty() && job.sources.size() > 1) return false;
+            for (const std::string& s : job.sources) job.outputs.push_back(at(exe.empty() ? stem(s) + ".o" : exe));
+        } else {
+            job.outputs.push_back(at(exe.empty() ? "a.out" : exe));
+        }
+    }
+    return true;
+}
+
+class CompileCache {
+public:
+    CompileCache() = default;
+    explicit CompileCache(std::string dir) : m_dir(std::move(dir)) {}   // benchmarks keep their own
+
+    // Key of a job: the compiler (its file and the toolchain), flags, sources as typed, the content of
+    // object/library inputs and the preprocessor's output. Empty if the preprocessor failed; the
+    // compile then runs uncached and reports the problem itself.
+    std::string Key(const CompileJob& job, const EnvOverrides& env, const std::string& toolchainKey, const std::atomic<bool>* abort,
+                    double& seconds) {
+        auto t0 = std::chrono::steady_clock::now();
+        std::string cmd = QuoteArg(job.program) + (job.msvc ? " /nologo /E" : " -E");   // with line markers: diagnostics quote lines
+        for (const std::string& f : job.flags)   cmd += " " + QuoteArg(f);
+        for (const std::string& s : job.sources) cmd += " " + QuoteArg(s);
+        std::string text;
+        ExecLimits limits;
+        limits.timeoutMs = 120000;
+        limits.maxOutputBytes = 1ull << 30;
+        ExecResult pre = RunCommand(cmd, job.dir, limits, [&](const char* p, size_t n) { text.append(p, n); }, abort, &env);
+        if (!pre.started || pre.exitCode != 0 || pre.aborted || pre.timedOut) {
+            DevLog("[CompileCache] Preprocessor failed (exit %d) — compiling uncached\n", pre.exitCode);
+            return "";
+        }
+
+        std::string head = "nova-compile-cache 1\n" + toolchainKey + "\n" + CompilerStamp(job.program, env) + "\n" +
+                           job.program + (job.compileOnly ? " -c" : " link") + "\n";
+        bool debugInfo = false;
+        for (const std::string& f : job.flags) {
+            head += f + "\x1f";
+            debugInfo |= job.msvc ? f == "/Z7" || f == "-Z7" : f.compare(0, 2, "-g") == 0;
+        }
+        head += "\n";
+        if (debugInfo) head += job.dir + "\n";   // debug info records the build folder
+        for (const std::string& s : job.sources) head += s + "\x1f";
+        head += "\n";
+        for (const std::string& in : job.inputs) {
+            MappedFile f(StringToWString(NativePath(in, job.dir, !job.msvc).u8string()));
+            char buf[40];
+            sprintf_s(buf, "%016llx", f.IsOpen() ? (unsigned long long)XXH64(f.Data(), (size_t)f.Size()) : 0ull);
+            head += in + "=" + buf + "\n";
+        }
+        ULONGLONG a = XXH64(text, XXH64(head, 1)), b = XXH64(text, XXH64(head, 2));
+        char key[40];
+        sprintf_s(key, "%016llx%016llx", (unsigned long long)a, (unsigned long long)b);
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        return key;
+    }
+
+    // Restores the outputs and replays the diagnostics of a cached compile; false on a miss.
+    // keySeconds (the preprocessor run) counts towards the time reported for a hit.
+    bool Lookup(const std::string& key, double keySeconds, const CompileJob& job, const ExecOutputFn& onOutput, ExecResult& res) {
+        namespace fs = std::filesystem;
+        std::lock_guard<std::mutex> lk(m_mutex);
+        Scan();
+        auto t0 = std::chrono::steady_clock::now();
+        auto it = m_entries.find(key);
+        fs::path entry = fs::u8path(Root()) / key;
+        int exitCode = -1;
+        double seconds = 0;
+        std::string output;
+        if (it == m_entries.end() || !ReadMeta(entry, exitCode, seconds, output)) {
+            m_misses++;
+            return false;
+        }
+        std::string err;
+        for (size_t i = 0; exitCode == 0 && i < job.outputs.size(); i++) {
+            if (!CopyFileAtomic(entry / std::to_string(i), fs::u8path(job.outputs[i]), err)) {
+                // e.g. the program is still running and its .exe is locked: the real compile reports that
+                DevLog("[CompileCache] Could not restore a cached output (%s) — compiling\n", err.c_str());
+                m_misses++;
+                return false;
+            }
+        }
+        std::error_code ec;
+        fs::last_write_time(entry / "meta", fs::file_time_type::clock::now(), ec);
+        it->second.lastUse = m_clock++;
+        if (onOutput && !output.empty()) onOutput(output.data(), output.size());
+
+        res.started    = true;
+        res.exitCode   = exitCode;
+        res.output     = output;
+        res.totalBytes = output.size();
+        res.seconds    = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() + keySeconds;
+        m_hits++;
+        m_savedSec += seconds - res.seconds;
+        DevLog("[CompileCache] hit %s: exit %d, compiled in %.2f s, served in %.0f ms — %s\n",
+               fs::u8path(job.outputs[0]).filename().u8string().c_str(), exitCode, seconds, res.seconds * 1000.0, StatsLocked().c_str());
+        return true;
+    }
+
+    // Files a finished compile under `key`: successful ones with their outputs, failed ones only if the
+    // failure is a compile error (the same source would fail the same way)
+    void Store(const std::string& key, const CompileJob& job, const ExecResult& res, unsigned long long capBytes) {
+        namespace fs = std::filesystem;
+        if (!res.started || res.timedOut || res.aborted || res.outputLimit) return;
+        if (res.exitCode != 0) {
+            bool compileError = job.msvc ? res.output.find(": error C") != std::string::npos && res.output.find("LNK") == std::string::npos
+                                         : res.output.find(": error:") != std::string::npos && res.output.find("ld:") == std::string::npos &&
+                                           res.output.find("collect2") == std::string::npos;
+            if (!compileError) return;
+        }
+        std::lock_guard<std::mutex> lk(m_mutex);
+        Scan();
+        std::error_code ec;
+        fs::path root = fs::u8path(Root()), entry = root / key;
+        fs::path tmp = root / (key + ".tmp-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+        fs::create_directories(tmp, ec);
+        unsigned long long size = 0;
+        for (size_t i = 0; res.exitCode == 0 && i < job.outputs.size(); i++) {
+            fs::copy_file(fs::u8path(job.outputs[i]), tmp / std::to_string(i), ec);
+            if (ec) { fs::remove_all(tmp, ec); return; }   // the compiler did not write what was expected
+            size += (unsigned long long)fs::file_size(tmp / std::to_string(i), ec);
+        }
+        char head[64];
+        sprintf_s(head, "exit %d\nseconds %.3f\n---\n", res.exitCode, res.seconds);
+        std::string meta = head + res.output;
+        std::ofstream(tmp / "meta", std::ios::binary).write(meta.data(), (std::streamsize)meta.size());
+        size += meta.size();
+        if (size > capBytes) { fs::remove_all(tmp, ec); return; }
+        fs::remove_all(entry, ec);
+        fs::rename(tmp, entry, ec);
+        if (ec) { fs::remove_all(tmp, ec); return; }
+        if (m_entries.count(key)) m_total -= m_entries[key].size;
+        m_entries[key] = { size, m_clock++ };
+        m_total += size;
+        Evict(capBytes);
+        DevLog("[CompileCache] stored %s (exit %d, %.2f s, %llu KB) — %s\n", fs::u8path(job.outputs[0]).filename().u8string().c_str(),
+               res.exitCode, res.seconds, size >> 10, StatsLocked().c_str());
+    }
+
+    void NoteUncached() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_uncached++;
+    }
+
+    std::string Stats() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return StatsLocked();
+    }
+
+private:
+    struct Entry { unsigned long long size = 0, lastUse = 0; };
+
+    std::string Root() const { return m_dir.empty() ? GetExeDir() + "nova_compile_cache" : m_dir; }
+
+    // The compiler binary found on the PATH the compile will see, with its size and mtime
+    static std::string CompilerStamp(const std::string& program, const EnvOverrides& env) {
+        namespace fs = std::filesystem;
+        std::string path;
+        for (const auto& kv : env) if (LowerAscii(kv.first) == "path") path = kv.second;
+        const char sep = ';';
+        std::string exe = program + ".exe";
+        if (path.empty()) { char buf[32767]; if (GetEnvironmentVariableA("PATH", buf, sizeof(buf))) path = buf; }
+        std::stringstream ss(path);
+        std::string dir;
+        std::error_code ec;
+        while (std::getline(ss, dir, sep)) {
+            if (dir.empty()) continue;
+            fs::path p = fs::u8path(dir) / exe;
+            if (!fs::is_regular_file(p, ec)) continue;
+            fs::path real = fs::canonical(p, ec);
+            if (ec) real = p;
+            return real.u8string() + " " + std::to_string((unsigned long long)fs::file_size(real, ec)) + "@" +
+                   std::to_string((long long)fs::last_write_time(real, ec).time_since_epoch().count());
+        }
+        return program + " (not on PATH)";
+    }
+
+    static bool ReadMeta(const std::filesystem::path& entry, int& exitCode, double& seconds, std::string& output) {
+        std::ifstream f(entry / "meta", std::ios::binary);
+        std::string line;
+        if (!f || !std::getline(f, line) || sscanf(line.c_str(), "exit %d", &exitCode) != 1) return false;
+        if (!std::getline(f, line) || sscanf(line.c_str(), "seconds %lf", &seconds) != 1) return false;
+        if (!std::getline(f, line) || line != "---") return false;
+        std::stringstream rest;
+        rest << f.rdbuf();
+        output = rest.str();
+        return true;
+    }
+
+    // Entries on disk, oldest use first, on first access in this session
+    void Scan() {
+        namespace fs = std::filesystem;
+        if (m_scanned) return;
+        m_scanned = true;
+        std::error_code ec;
+        std::vector<std::pair<fs::file_time_type, std::string>> order;
+        for (fs::directory_iterator it(fs::u8path(Root()), ec), end; !ec && it != end; it.increment(ec)) {
+            std::string name = it->path().filename().u8string();
+            if (!it->is_directory(ec)) continue;
+            if (name.size() != 32) { fs::remove_all(it->path(), ec); continue; }   // an interrupted store
+            Entry e;
+            for (fs::directory_iterator f(it->path(), ec), fend; !ec && f != fend; f.increment(ec)) e.size += (unsigned long long)f->file_size(ec);
+            order.emplace_back(fs::last_write_time(it->path() / "meta", ec), name);
+            m_entries[name] = e;
+            m_total += e.size;
+        }
+        std::sort(order.begin(), order.end());
+        for (const auto& o : order) m_entries[o.second].lastUse = m_clock++;
+    }
+
+    void Evict(unsigned long long capBytes) {
+        namespace fs = std::filesystem;
+        while (m_total > capBytes && !m_entries.empty()) {
+            auto oldest = std::min_element(m_entries.begin(), m_entries.end(),
+                                           [](const std::pair<const std::string, Entry>& a, const std::pair<const std::string, Entry>& b) { return a.second.lastUse < b.second.lastUse; });
+            std::error_code ec;
+            fs::remove_all(fs::u8path(Root()) / oldest->first, ec);
+            m_total -= oldest->second.size;
+            m_entries.erase(oldest);
+            m_evicted++;
+        }
+    }
+
+    std::string StatsLocked() const {
+        unsigned looked = m_hits + m_misses;
+        char buf[200];
+        sprintf_s(buf, "%u hits / %u misses (%.0f%%), %u uncacheable, %.1f s saved, %zu entries, %.1f MB, %u evicted",
+                  m_hits, m_misses, looked ? 100.0 * m_hits / looked : 0.0, m_uncached, m_savedSec,
+                  m_entries.size(), m_total / 1048576.0, m_evicted);
+        return buf;
+    }
+
+    std::string m_dir;
+    std::mutex  m_mutex;
+    bool        m_scanned = false;
+    std::unordered_map<std::string, Entry> m_entries;
+    unsigned long long m_total = 0, m_clock = 1;
+    unsigned    m_hits = 0, m_misses = 0, m_uncached = 0, m_evicted = 0;
+    double      m_savedSec = 0;
+};
+
+static CompileCache g_compileCache;
+
+// ── Project builds ──
+// A compile of several sources into one program runs as a small build instead of one serial
+// compiler call: each translation unit is compiled on its own, in parallel, into
+// nova-build/<program>/ under the folder, and only when it, a header it includes or the flags have
+// changed (the compiler lists the headers: -MMD or /showIncludes). The objects are linked once,
+// and only if one of them changed. The result opens with the diagnostics grouped by file, so the
+// model sees what to fix where before the raw compiler output.
+
+struct BuildDiagnostic {
+    std::string file;       // as the compiler printed it; "" for the linker
+    int line = 0, col = 0;
+    std::string severity;   // fatal error, error, warning, note
+    std::string code;       // C2065, LNK2019... (MSVC)
+    std::string message;
+};
+
+static bool TakeSeverity(const std::string& s, size_t& pos, std::string& severity) {
+    for (const char* sev : { "fatal error", "error", "warning", "note" }) {
+        size_t n = strlen(sev);
+        if (s.compare(pos, n, sev) == 0) { severity = sev; pos += n; return true; }
+    }
+    return false;
+}
+
+// One error, warning or note line of cl/link or gcc/clang/ld output; false for anything else
+static bool ParseDiagnosticLine(const std::string& line, bool msvc, BuildDiagnostic& d) {
+    size_t rest = std::string::npos;
+    if (msvc) {
+        // file(line[,col]): error C2065: message      file.obj : error LNK2019: message
+        size_t p = line.find("): ");
+        size_t open = p == std::string::npos ? std::string::npos : line.rfind('(', p);
+        if (open != std::string::npos && open > 0 && isdigit((unsigned char)line[open + 1])) {
+            d.file = line.substr(0, open);
+            sscanf(line.c_str() + open + 1, "%d,%d", &d.line, &d.col);
+            rest = p + 3;
+        } else if ((p = line.find(" : ")) != std::string::npos && p > 0) {
+            d.file = line.substr(0, p);
+            if (d.file == "LINK") d.file.clear();
+            rest = p + 3;
+        }
+        if (rest == std::string::npos || !TakeSeverity(line, rest, d.severity)) return false;
+        size_t colon = line.find(':', rest);
+        if (colon == std::string::npos) return false;
+        d.code = TrimAscii(line.substr(rest, colon - rest));
+        d.message = TrimAscii(line.substr(colon + 1));
+    } else {
+        // file:line:col: error: message      /usr/bin/ld: x.o: in function ...: undefined reference to ...
+        size_t at = std::string::npos;
+        for (const char* sev : { ": fatal error: ", ": error: ", ": warning: ", ": note: " }) {
+            size_t p = line.find(sev);
+            if (p != std::string::npos && p < at) at = p;
+        }
+        if (at != std::string::npos) {
+            rest = at + 2;
+            TakeSeverity(line, rest, d.severity);
+            d.message = TrimAscii(line.substr(rest + 1));
+            std::string where = line.substr(0, at);
+            std::string tool = where.substr(where.find_last_of('/') + 1);
+            if (IsOneOf(tool, { "ld", "ld.lld", "ld.gold", "collect2", "gcc", "g++", "clang", "clang++", "cc", "c++" })) {
+                if (d.message.find("returned 1 exit status") != std::string::npos) return false;   // sums up errors already listed
+                where.clear();
+            }
+            // peel :col and :line off the end
+            int nums[2] = { 0, 0 }, count = 0;
+            size_t colon;
+            while (count < 2 && (colon = where.rfind(':')) != std::string::npos && colon + 1 < where.size() &&
+                   where.find_first_not_of("0123456789", colon + 1) == std::string::npos) {
+                nums[count++] = atoi(where.c_str() + colon + 1);
+                where.resize(colon);
+            }
+            d.line = count == 2 ? nums[1] : nums[0];
+            d.col  = count == 2 ? nums[0] : 0;
+            d.file = where;
+        } else {
+            size_t p = std::string::npos;
+            for (const char* what : { "undefined reference to", "multiple definition of", "cannot find -l" })
+                if ((p = line.find(what)) != std::string::npos) break;
+            if (p == std::string::npos) return false;
+            d.severity = "error";
+            d.message  = line.substr(p);
+            size_t section = line.find(":(");   // main.cpp:(.text+0x5): the reference is in main.cpp
+            if (section != std::string::npos && section < p) d.file = line.substr(0, section);
+        }
+    }
+    return true;
+}
+
+// Errors, warnings and notes in cl/link or gcc/clang/ld output; context lines are skipped
+static std::vector<BuildDiagnostic> ParseDiagnostics(const std::string& output, bool msvc) {
+    std::vector<BuildDiagnostic> out;
+    std::istringstream in(output);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        BuildDiagnostic d;
+        if (ParseDiagnosticLine(line, msvc, d)) out.push_back(d);
+    }
+    return out;
+}
+
+// "3 errors, 1 warning in 2 files", then each file's diagnostics in the order they were reported
+static std::string FormatDiagnostics(const std::vector<BuildDiagnostic>& diags) {
+    std::vector<std::string> files;
+    std::map<std::string, std::vector<const BuildDiagnostic*>> byFile;
+    int errors = 0, warnings = 0;
+    for (const BuildDiagnostic& d : diags) {
+        if (!byFile.count(d.file)) files.push_back(d.file);
+        byFile[d.file].push_back(&d);
+        if (d.severity == "warning") warnings++;
+        else if (d.severity != "note") errors++;
+    }
+    char head[128];
+    sprintf_s(head, "%d error%s, %d warning%s in %zu file%s\n", errors, errors == 1 ? "" : "s", warnings, warnings == 1 ? "" : "s",
+              files.size(), files.size() == 1 ? "" : "s");
+    std::string s = head;
+    const size_t kMaxShown = 60;
+    size_t shown = 0;
+    for (const std::string& f : files) {
+        s += (f.empty() ? "(link)" : f) + ":\n";
+        for (const BuildDiagnostic* d : byFile[f]) {
+            if (shown++ == kMaxShown) { s += "  ...\n"; return s; }
+            char where[32] = "";
+            if (d->line && d->col) sprintf_s(where, "%d:%d ", d->line, d->col);
+            else if (d->line)      sprintf_s(where, "%d ", d->line);
+            s += (d->severity == "note" ? "    " : "  ") + std::string(where) + d->severity +
+                 (d->code.empty() ? "" : " " + d->code) + ": " + d->message + "\n";
+        }
+    }
+    return s;
+}
+
+static std::string FileStamp(const std::string& path) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path p = fs::u8path(path);
+    unsigned long long size = (unsigned long long)fs::file_size(p, ec);
+    if (ec) return "";
+    return std::to_string(size) + "@" + std::to_string((long long)fs::last_write_time(p, ec).time_since_epoch().count());
+}
+
+// Headers named by a gcc -MMD depfile ("obj: src a.h b\ c.h \")
+static std::vector<std::string> ReadDepFile(const std::string& path) {
+    std::ifstream f(std::filesystem::u8path(path), std::ios::binary);
+    std::stringstream ss;
+    ss << f.rdbuf();
+    std::string text = ss.str();
+    size_t start = text.find(": ");
+    std::vector<std::string> deps;
+    if (start == std::string::npos) return deps;
+    std::string cur;
+    for (size_t i = start + 2; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '\\' && i + 1 < text.size() && (text[i + 1] == '\n' || text[i + 1] == '\r')) continue;
+        if (c == '\\' && i + 1 < text.size() && text[i + 1] == ' ') { cur += ' '; i++; continue; }
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            if (!cur.empty()) deps.push_back(cur);
+            cur.clear();
+            if (c == '\n' && i + 1 < text.size() && text[i + 1] != ' ' && text[i + 1] != '\t') break;   // next rule
+            continue;
+        }
+        cur += c;
+    }
+    if (!cur.empty()) deps.push_back(cur);
+    return deps;
+}
+
+// Takes cl /showIncludes lines out of the output; headers under the toolchain's INCLUDE folders are left out
+static std::vector<std::string> TakeShowIncludes(std::string& output, const EnvOverrides& env) {
+    std::vector<std::string> systemDirs;
+    for (const auto& kv : env) {
+        if (LowerAscii(kv.first) != "include") continue;
+        std::stringstream ss(kv.second);
+        std::string dir;
+        while (std::getline(ss, dir, ';')) if (!dir.empty()) systemDirs.push_back(LowerAscii(dir));
+    }
+    std::vector<std::string> deps;
+    std::string kept, line;
+    std::istringstream in(output);
+    const char* kNote = "Note: including file:";
+    while (std::getline(in, line)) {
+        if (line.compare(0, strlen(kNote), kNote) != 0) { kept += line + "\n"; continue; }
+        std::string path = TrimAscii(line.substr(strlen(kNote)));
+        std::string lower = LowerAscii(path);
+        bool system = false;
+        for (const std::string& d : systemDirs) system |= lower.compare(0, d.size(), d) == 0;
+        if (!system) deps.push_back(path);
+    }
+    output = kept;
+    return deps;
+}
+
+static ExecResult RunBuild(const CompileJob& job, const EnvOverrides& env, const ExecLimits& limits,
+                           const ExecOutputFn& onOutput, const std::atomic<bool>* abort) {
+    namespace fs = std::filesystem;
+    auto t0 = std::chrono::steady_clock::now();
+    ExecResult res;
+    res.started = true;
+    const bool posixPaths = !job.msvc;
+    std::string program = job.outputs[0];
+    std::string buildDir = NativePath("nova-build/" + fs::u8path(program).stem().u8string(), job.dir, false).u8string();
+    std::error_code ec;
+    fs::create_directories(fs::u8path(buildDir), ec);
+    if (ec) { res.exitCode = 1; res.error = "cannot create " + buildDir + ": " + ec.message(); return res; }
+
+    // Linker-only options stay off the compile lines; compile options are harmless when linking
+    std::vector<std::string> compileFlags;
+    for (size_t i = 0; i < job.flags.size(); i++) {
+        const std::string& f = job.flags[i];
+        if (!job.msvc && IsOneOf(f, { "-l", "-L", "-Xlinker" })) { i++; continue; }
+        if (!job.msvc && (f.compare(0, 2, "-l") == 0 || f.compare(0, 2, "-L") == 0 || f.compare(0, 4, "-Wl,") == 0 ||
+                          f == "-static" || f == "-shared" || f == "-rdynamic")) continue;
+        compileFlags.push_back(f);
+    }
+    std::string flagLine = g_toolchain.Identity() + "\x1f" + job.program;
+    for (const std::string& f : compileFlags) flagLine += "\x1f" + f;
+    char flagsHash[24];
+    sprintf_s(flagsHash, "%016llx", (unsigned long long)XXH64(flagLine));
+
+    struct Unit {
+        std::string source, path, object, record;
+        bool rebuilt = false;
+        ExecResult result;
+    };
+    std::vector<Unit> units(job.sources.size());
+    for (size_t i = 0; i < units.size(); i++) {
+        Unit& u = units[i];
+        u.source = job.sources[i];
+        u.path   = NativePath(u.source, job.dir, posixPaths).u8string();
+        char tag[24];
+        sprintf_s(tag, "-%08llx", (unsigned long long)(XXH64(u.path) & 0xffffffffull));   // util.cpp in two folders
+        u.object = (fs::u8path(buildDir) / (fs::u8path(u.source).stem().u8string() + tag + (job.msvc ? ".obj" : ".o"))).u8string();
+        u.record = u.object + ".deps";
+    }
+
+    // Up to date: the object exists and the flags, the source and every header it included are as recorded
+    auto upToDate = [&](const Unit& u) {
+        std::ifstream f(fs::u8path(u.record));
+        std::string line;
+        if (!f || !std::getline(f, line) || line != flagsHash || FileStamp(u.object).empty()) return false;
+        while (std::getline(f, line)) {
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos || FileStamp(line.substr(tab + 1)) != line.substr(0, tab)) return false;
+        }
+        return true;
+    };
+
+    std::mutex outputMutex;
+    std::atomic<int> failed{ 0 };
+    auto compile = [&](Unit& u) {
+        if (abort && abort->load()) return;
+        std::string cmd = QuoteArg(job.program);
+        if (job.msvc) cmd += " /nologo /c /showIncludes";
+        else          cmd += " -c -MMD -MF " + QuoteArg(u.object + ".d");
+        for (const std::string& f : compileFlags) cmd += " " + QuoteArg(f);
+        cmd += job.msvc ? " " + QuoteArg("/Fo" + u.object) : " -o " + QuoteArg(u.object);
+        cmd += " " + QuoteArg(u.source);
+        std::error_code rec;
+        fs::remove(fs::u8path(u.record), rec);
+        u.result = RunCommand(cmd, job.dir, limits, nullptr, abort, &env);
+        u.rebuilt = true;
+        std::vector<std::string> deps = job.msvc ? TakeShowIncludes(u.result.output, env) : ReadDepFile(u.object + ".d");
+        if (job.msvc) {
+            // cl echoes the file name it compiles; without it the output is just the diagnostics
+            std::string name = fs::u8path(u.source).filename().u8string();
+            if (u.result.output.compare(0, name.size(), name) == 0) u.result.output.erase(0, u.result.output.find('\n') + 1);
+        }
+        if (u.result.exitCode == 0 && !u.result.timedOut && !u.result.aborted) {
+            std::ofstream rec(fs::u8path(u.record));
+            rec << flagsHash << "\n" << FileStamp(u.path) << "\t" << u.path << "\n";
+            for (const std::string& d : deps) {
+                std::string full = NativePath(d, job.dir, posixPaths).u8string();
+                if (full != u.path) rec << FileStamp(full) << "\t" << full << "\n";
+            }
+        } else {
+            failed++;
+        }
+        std::lock_guard<std::mutex> lk(outputMutex);
+        std::string line = "[build] " + u.source + (u.result.exitCode == 0 ? "" : " FAILED") + "\n" + u.result.output;
+        if (onOutput) onOutput(line.data(), line.size());
+    };
+
+    std::vector<Unit*> stale;
+    for (Unit& u : units) if (!upToDate(u)) stale.push_back(&u);
+    int jobs = g_config.buildJobs > 0 ? g_config.buildJobs : (int)(std::max)(std::thread::hardware_concurrency(), 1u);
+    jobs = (std::min)(jobs, (int)(std::max)(stale.size(), (size_t)1));
+    if (!stale.empty()) {
+        WorkerPool pool(jobs);
+        for (Unit* u : stale) pool.Submit([&compile, u] { compile(*u); });
+        pool.Wait();
+    }
+    double compileSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    // Link once, unless nothing changed and the program is still the one linked last time
+    std::string linkCmd = QuoteArg(job.program) + (job.msvc ? " /nologo" : "");
+    for (const Unit& u : units)               linkCmd += " " + QuoteArg(u.object);
+    for (const std::string& in : job.inputs)  linkCmd += " " + QuoteArg(in);
+    for (const std::string& f : job.flags)    linkCmd += " " + QuoteArg(f);
+    linkCmd += job.msvc ? " " + QuoteArg("/Fe" + program) : " -o " + QuoteArg(program);
+    std::string linkRecord = (fs::u8path(buildDir) / "link.txt").u8string(), linkState = linkCmd;
+    for (const Unit& u : units)              linkState += "\n" + FileStamp(u.object);
+    for (const std::string& in : job.inputs) linkState += "\n" + FileStamp(NativePath(in, job.dir, posixPaths).u8string());
+    char linkHash[24];
+    sprintf_s(linkHash, "%016llx", (unsigned long long)XXH64(linkState));
+    ExecResult link;
+    bool linked = false, linkSkipped = false;
+    if (!failed) {
+        std::ifstream f(fs::u8path(linkRecord));
+        std::string hash, stamp;
+        linkSkipped = f && std::getline(f, hash) && std::getline(f, stamp) && hash == linkHash && stamp == FileStamp(program);
+        if (!linkSkipped && !(abort && abort->load())) {
+            link = RunCommand(linkCmd, job.dir, limits, nullptr, abort, &env);
+            linked = true;
+            if (link.exitCode == 0) std::ofstream(fs::u8path(linkRecord)) << linkHash << "\n" << FileStamp(program) << "\n";
+            else fs::remove(fs::u8path(linkRecord), ec);
+            std::lock_guard<std::mutex> lk(outputMutex);
+            std::string line = "[build] link " + fs::u8path(program).filename().u8string() + (link.exitCode == 0 ? "" : " FAILED") + "\n" + link.output;
+            if (onOutput) onOutput(line.data(), line.size());
+        }
+    }
+
+    // Result: a summary line, the diagnostics by file, then the raw output of each step
+    std::string raw;
+    std::vector<BuildDiagnostic> diags;
+    int rebuilt = 0, exitCode = 0;
+    for (const Unit& u : units) {
+        if (!u.rebuilt) continue;
+        rebuilt++;
+        res.timedOut |= u.result.timedOut;
+        res.aborted  |= u.result.aborted;
+        if (!exitCode && u.result.exitCode != 0) exitCode = u.result.exitCode;
+        std::vector<BuildDiagnostic> d = ParseDiagnostics(u.result.output, job.msvc);
+        diags.insert(diags.end(), d.begin(), d.end());
+        if (!u.result.output.empty() || !u.result.error.empty()) raw += "[" + u.source + "]\n" + u.result.output + u.result.error;
+    }
+    if (linked) {
+        res.timedOut |= link.timedOut;
+        res.aborted  |= link.aborted;
+        if (link.exitCode != 0) exitCode = link.exitCode;
+        std::vector<BuildDiagnostic> d = ParseDiagnostics(link.output, job.msvc);
+        diags.insert(diags.end(), d.begin(), d.end());
+        if (!link.output.empty() || !link.error.empty()) raw += "[link]\n" + link.output + link.error;
+    }
+    res.exitCode = exitCode;
+    res.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    char summary[256];
+    sprintf_s(summary, "BUILD %s: %zu files, %d compiled (%d at a time), %zu up to date, %s — %.1f s\n",
+              res.exitCode == 0 ? "OK" : "FAILED", units.size(), rebuilt, rebuilt ? jobs : 0, units.size() - rebuilt,
+              failed ? "not linked" : linkSkipped ? "program up to date" : link.exitCode == 0 ? "linked" : "link failed", res.seconds);
+    res.output = summary;
+    if (!diags.empty()) res.output += FormatDiagnostics(diags);
+    if (!raw.empty()) res.output += "--- compiler output ---\n" + raw;
+    res.totalBytes = res.output.size();
+    DevLog("[Build] %s: %zu units, %d compiled on %d workers in %.2f s, link %s, total %.2f s, %zu diagnostics\n",
+           fs::u8path(program).filename().u8string().c_str(), units.size(), rebuilt, jobs, compileSec,
+           failed ? "skipped (errors)" : linkSkipped ? "up to date" : link.exitCode == 0 ? "ok" : "failed", res.seconds, diags.size());
+    return res;
+}
+
+// ── Pre-flight checks ──
+// Many failed EXECs are malformed rather than wrong: a quote that never closes (often an apostrophe
+// inside a PowerShell '...' string, see rule 10), a cd into a folder that is not there, a source file
+// the compiler cannot find, a redirect into a missing folder or onto a program that is still running.
+// Those are caught from the parsed command and a few file lookups before any shell starts, and the
+// model gets the exact problem back, with the folder listing or the real Desktop path it would
+// otherwise spend another round trip looking up. Checks stop at the first step whose effect on the
+// file system is unknown (another program, a compile, a conditional), so nothing the line creates
+// first is reported missing.
+
+struct PreflightStats {
+    std::mutex mutex;
+    unsigned checked = 0, rejected = 0, lookupsSaved = 0;
+    double   us = 0;
+};
+static PreflightStats g_preflightStats;
+
+// Offset of the quote that is never closed (by TokenizeCommandLine's rules), npos if they all pair up
+static size_t UnclosedQuote(const std::string& line, ShellDialect dialect) {
+    const bool ps = dialect == ShellDialect::PowerShell, posix = dialect == ShellDialect::Posix;
+    const char escape = ps ? '`' : posix ? '\\' : '^';
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (c == escape) { i++; continue; }
+        if (c != '"' && !(c == '\'' && (ps || posix))) continue;
+        size_t j = i + 1;
+        for (; j < line.size(); j++) {
+            if (line[j] == c) {
+                if (ps && c == '\'' && j + 1 < line.size() && line[j + 1] == '\'') { j++; continue; }
+                break;
+            }
+            if (c == '"' && ((ps && line[j] == '`') || (posix && line[j] == '\\'))) j++;
+        }
+        if (j >= line.size()) return i;
+        i = j;
+    }
+    return std::string::npos;
+}
+
+// An argument with environment variables filled in as the shell will; false if only the shell can
+// (its own variables, subexpressions, arrays)
+static bool PreflightExpand(const CommandSegment& seg, std::string& s) {
+    auto env = [](const std::string& name, std::string& value) {
+        if (name.empty()) return false;
+        wchar_t buf[4096];
+        DWORD n = GetEnvironmentVariableW(StringToWString(name).c_str(), buf, 4096);
+        if (n == 0 || n >= 4096) return false;
+        value = WStringToString(buf);
+        return true;
+    };
+    if (seg.dialect == ShellDialect::Cmd) {
+        for (int guard = 0; guard < 8; guard++) {
+            size_t a = s.find('%'), b = a == std::string::npos ? a : s.find('%', a + 1);
+            if (b == std::string::npos) break;
+            std::string value;
+            if (!env(s.substr(a + 1, b - a - 1), value)) return false;
+            s.replace(a, b - a + 1, value);
+        }
+        return s.find('%') == std::string::npos;
+    }
+    const size_t prefix = seg.dialect == ShellDialect::PowerShell ? 5 : 1;   // $env:NAME, $NAME
+    for (int guard = 0; guard < 8; guard++) {
+        size_t a = s.find('$');
+        if (a == std::string::npos) break;
+        if (prefix == 5 && LowerAscii(s.substr(a, 5)) != "$env:") return false;
+        size_t b = a + prefix;
+        if (prefix == 1 && b < s.size() && s[b] == '{') b++;
+        size_t e = b;
+        while (e < s.size() && (isalnum((unsigned char)s[e]) || s[e] == '_')) e++;
+        std::string value;
+        if (!env(s.substr(b, e - b), value)) return false;
+        if (prefix == 1 && b > a + 1) { if (e >= s.size() || s[e] != '}') return false; e++; }
+        s.replace(a, e - a, value);
+    }
+    return s.find('$') == std::string::npos && !(seg.dialect == ShellDialect::PowerShell && s.find(',') != std::string::npos);
+}
+
+static bool PathIsUnder(const std::string& path, const std::string& dir) {
+    std::string p = LowerAscii(path), d = LowerAscii(dir);
+    while (!d.empty() && (d.back() == '\\' || d.back() == '/')) d.pop_back();
+    return !d.empty() && p.compare(0, d.size(), d) == 0 && (p.size() == d.size() || p[d.size()] == '\\' || p[d.size()] == '/');
+}
+
+// Why an existing file cannot be overwritten, empty if it can. Opening it for writing (without
+// writing) is what tells a running program or another process's lock apart.
+static std::string WriteProblem(const std::filesystem::path& p) {
+    DWORD attr = GetFileAttributesW(p.wstring().c_str());
+    if (attr == INVALID_FILE_ATTRIBUTES) return "";
+    if (attr & FILE_ATTRIBUTE_DIRECTORY) return "it is a folder";
+    if (attr & FILE_ATTRIBUTE_READONLY) return "it is read-only";
+    HANDLE h = CreateFileW(p.wstring().c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h != INVALID_HANDLE_VALUE) { CloseHandle(h); return ""; }
+    DWORD e = GetLastError();
+    if (e == ERROR_SHARING_VIOLATION || e == ERROR_LOCK_VIOLATION) return "it is in use by another program (still running?)";
+    if (e == ERROR_ACCESS_DENIED) return "access is denied (a running program or a protected file)";
+    return "";
+}
+
+// A folder only administrators can create files in, when Nova is not elevated
+static bool AdminOnlyFolder(const std::filesystem::path& dir) {
+    if (IsUserAnAdmin()) return false;
+    for (int id : { CSIDL_WINDOWS, CSIDL_PROGRAM_FILES, CSIDL_PROGRAM_FILESX86, CSIDL_COMMON_DESKTOPDIRECTORY }) {
+        wchar_t p[MAX_PATH];
+        if (SHGetSpecialFolderPathW(NULL, p, id, FALSE) && PathIsUnder(dir.u8string(), WStringToString(p))) return true;
+    }
+    return false;
+}
+
+// The nearest existing folder above a missing path and what it holds, so the name can be fixed
+// without looking
+static std::string PreflightNearby(const std::filesystem::path& missing) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path dir = missing.parent_path();
+    while (!fs::is_directory(dir, ec)) {
+        fs::path up = dir.parent_path();
+        if (up.empty() || up == dir) return "";
+        dir = up;
+    }
+    const char* sep = "\\";
+    std::string ext = LowerAscii(missing.extension().u8string());
+    std::vector<std::string> same, other;
+    size_t seen = 0;
+    for (fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end && seen < 200; it.increment(ec), seen++) {
+        std::string name = it->path().filename().u8string();
+        if (it->is_directory(ec)) name += sep;
+        (!ext.empty() && LowerAscii(it->path().extension().u8string()) == ext ? same : other).push_back(name);
+    }
+    std::sort(same.begin(), same.end());
+    std::sort(other.begin(), other.end());
+    same.insert(same.end(), other.begin(), other.end());
+    std::string s = "Nearest existing folder: " + dir.u8string();
+    if (same.empty()) return s + " (empty)\n";
+    s += " — holds ";
+    for (size_t i = 0; i < same.size() && i < 15; i++) s += (i ? ", " : "") + same[i];
+    if (same.size() > 15) s += ", ... (" + std::to_string(same.size() - 15) + (seen >= 200 ? "+" : "") + " more)";
+    return s + "\n";
+}
+
+// A …\Desktop path that is not the user's Desktop (OneDrive moves it; the Public one is admin-only)
+static std::string DesktopHint(const std::filesystem::path& path) {
+    std::string desk = GetDesktopDir(), p = path.u8string();
+    size_t at = LowerAscii(p).find("desktop");
+    if (desk.empty() || at == std::string::npos || PathIsUnder(p, desk)) return "";
+    return "The user's Desktop is " + desk + " — use that path.\n";
+}
+
+// Empty if the command may run; otherwise the problem, as the model should read it. `lookedUp` says
+// the answer carries what the model would have run another command to find out.
+static std::string PreflightCommand(const std::string& command, const CommandInfo& info, const std::string& cwd, bool& lookedUp) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    lookedUp = false;
+
+    // Quoting, in the shell that reads the line and then in the shells it starts
+    ShellDialect outer = info.cmdlet ? ShellDialect::PowerShell : ShellDialect::Cmd;
+    size_t q = UnclosedQuote(command, outer);
+    bool hereString = command.find("@'") != std::string::npos || command.find("@\"") != std::string::npos;   // quoted by their own rules
+    if ((q != std::string::npos || info.unbalanced) && !hereString) {
+        // An apostrophe between letters ("don't") closes a '...' string early
+        size_t apos = std::string::npos;
+        if (q == std::string::npos || command[q] == '\'')
+            for (size_t i = 1; i + 1 < command.size() && apos == std::string::npos; i++)
+                if (command[i] == '\'' && isalpha((unsigned char)command[i - 1]) && isalpha((unsigned char)command[i + 1])) apos = i;
+        std::string problem;
+        if (q != std::string::npos) {
+            size_t from = q > 30 ? q - 30 : 0;
+            problem = std::string("the ") + (command[q] == '"' ? "double" : "single") + " quote at column " + std::to_string(q + 1) +
+                      " is never closed: ..." + command.substr(from, 60) + "...\n";
+        } else {
+            std::string l = LowerAscii(command);
+            const char* shell = l.find("powershell") != std::string::npos || l.find("pwsh") != std::string::npos ? "PowerShell" : "the inner shell";
+            problem = std::string("the quotes in the command given to ") + shell + " do not pair up, so it would fail to parse.\n";
+        }
+        if (apos != std::string::npos) {
+            size_t a = apos, b = apos + 1;
+            while (a > 0 && isalpha((unsigned char)command[a - 1])) a--;
+            while (b < command.size() && isalpha((unsigned char)command[b])) b++;
+            problem += "The apostrophe in \"" + command.substr(a, b - a) + "\" ends a '...' string there. Double it ('') or write the text "
+                       "through a here-string variable, see rule 10.\n";
+        }
+        return problem;
+    }
+
+    // File checks follow the line step by step; an `||` or a multi-line script has branches they cannot follow
+    if (command.find("||") != std::string::npos || command.find('\n') != std::string::npos) return "";
+    fs::path dir = cwd.empty() ? fs::current_path(ec) : fs::u8path(cwd);
+    std::vector<std::string> created;   // made by earlier steps of the line
+    auto made = [&](const fs::path& p) {
+        for (const std::string& c : created) if (PathIsUnder(p.u8string(), c) || PathIsUnder(c, p.u8string())) return true;
+        return false;
+    };
+    auto exists = [&](const fs::path& p) { return made(p) || fs::exists(p, ec); };
+    auto missing = [&](const std::string& what, const fs::path& p) {
+        std::string s = what + " " + p.u8string() + " does not exist.\n", near = PreflightNearby(p), desk = DesktopHint(p);
+        lookedUp = !near.empty() || !desk.empty();
+        return s + desk + near;
+    };
+    // A file the step writes: its folder has to exist and the file, if there, be writable
+    auto writable = [&](const std::string& what, const fs::path& p) -> std::string {
+        if (made(p)) return "";
+        fs::path parent = p.parent_path();
+        if (!exists(parent)) return missing("the folder for " + what, parent);
+        if (fs::exists(p, ec)) {
+            std::string why = WriteProblem(p);
+            if (!why.empty()) return "cannot write " + what + " " + p.u8string() + ": " + why + ".\n";
+        } else if (AdminOnlyFolder(parent)) {
+            lookedUp = true;
+            return "cannot create " + what + " " + p.u8string() + ": only administrators can write to " + parent.u8string() + ".\n" + DesktopHint(p);
+        }
+        return "";
+    };
+
+    for (const CommandSegment& seg : info.segments) {
+        const std::string& p = seg.program;
+        const bool tilde = seg.dialect != ShellDialect::Cmd, ps = seg.dialect == ShellDialect::PowerShell;
+        auto resolve = [&](std::string a, fs::path& out) {
+            if (!PreflightExpand(seg, a) || a.empty() || a.find_first_of("*?") != std::string::npos ||
+                IsOneOf(LowerAscii(a), { "nul", "con", "prn", "aux", "$null", "/dev/null" }))
+                return false;
+            out = NativePath(a, dir.u8string(), tilde);
+            return true;
+        };
+        // The path a file cmdlet or command works on: -Path (or the names given) or its first operand
+        std::string pathArg;
+        bool unknownParam = false, ignoreErrors = false;
+        for (size_t i = 0; i < seg.args.size(); i++) {
+            const std::string& a = seg.args[i];
+            if (ps && a.size() > 1 && a[0] == '-') {
+                std::string n = LowerAscii(a.substr(1));
+                if (IsOneOf(n, { "path", "literalpath", "filepath", "lp", "pspath" }) && i + 1 < seg.args.size()) pathArg = seg.args[++i];
+                else if (IsOneOf(n, { "value", "encoding", "destination", "itemtype", "type", "name", "filter", "include", "exclude",
+                                      "delimiter", "width", "inputobject", "totalcount", "tail", "head", "first" })) i++;
+                else if (IsOneOf(n, { "erroraction", "ea" })) { ignoreErrors = true; i++; }   // failures are expected
+                else if (!IsOneOf(n, { "force", "nonewline", "append", "noclobber", "raw", "recurse", "passthru" })) unknownParam = true;
+            } else if (!ps && a.size() > 1 && (a[0] == '-' || (seg.dialect == ShellDialect::Cmd && a[0] == '/'))) {
+                continue;
+            } else if (pathArg.empty() && !unknownParam) {
+                pathArg = a;   // the first positional parameter is the path
+            }
+        }
+        bool knownArgs = !pathArg.empty() && !ignoreErrors;
+        fs::path target;
+        bool haveTarget = knownArgs && !pathArg.empty() && resolve(pathArg, target);
+
+        // Output redirections
+        for (const std::string& w : seg.writes) {
+            fs::path t;
+            if (!resolve(w, t)) continue;
+            std::string problem = writable("the output file", t);
+            if (!problem.empty()) return problem;
+            created.push_back(t.u8string());
+        }
+
+        // A program given by its path
+        if (!seg.typed.empty() && seg.typed.find_first_of("\\/") != std::string::npos) {
+            fs::path exe;
+            if (resolve(seg.typed, exe) && !exists(exe)) {
+                bool found = false;
+                for (const char* ext : { ".exe", ".bat", ".cmd", ".com", ".ps1" }) found |= !exe.has_extension() && fs::exists(exe.u8string() + ext, ec);
+                if (!found) {
+                    if (!seg.args.empty() && fs::exists(NativePath(seg.typed + " " + seg.args[0], dir.u8string(), tilde), ec))
+                        return "the program path " + seg.typed + " " + seg.args[0] + " contains a space and is not quoted.\n";
+                    return missing("the program", exe);
+                }
+            }
+        }
+
+        if (IsOneOf(p, { "cd", "chdir", "pushd", "set-location", "sl", "push-location" })) {
+            std::string to;
+            for (const std::string& a : seg.args) {
+                if (LowerAscii(a) == "/d") continue;
+                to += (to.empty() ? "" : " ") + a;   // cmd's cd takes an unquoted path with spaces
+            }
+            if (ps) to = pathArg;
+            if (to.empty()) continue;
+            if (to == "-" || (ps && !knownArgs)) return "";
+            fs::path d;
+            if (!resolve(to, d)) return "";
+            if (!exists(d)) return missing(p + ": the folder", d);
+            if (!made(d) && !fs::is_directory(d, ec)) return p + ": " + d.u8string() + " is a file, not a folder.\n";
+            dir = d;
+        } else if (IsOneOf(p, { "mkdir", "md", "new-item", "ni" })) {
+            if (ps && !knownArgs) return "";
+            std::vector<std::string> names;
+            if (ps) names.push_back(pathArg);
+            else for (const std::string& a : seg.args) if (a.size() < 2 || a[0] != '-') names.push_back(a);
+            for (const std::string& n : names) {
+                fs::path d;
+                if (n.empty() || !resolve(n, d)) return "";
+                fs::path parent = d.parent_path();
+                while (!parent.empty() && !exists(parent) && parent != parent.parent_path()) parent = parent.parent_path();
+                if (!exists(d) && AdminOnlyFolder(parent)) {
+                    lookedUp = true;
+                    return p + ": only administrators can create " + d.u8string() + ".\n" + DesktopHint(d);
+                }
+                created.push_back(d.u8string());
+            }
+        } else if (IsOneOf(p, { "cl", "clang-cl", "gcc", "g++", "clang", "clang++", "cc", "c++" })) {
+            const bool msvc = p == "cl" || p == "clang-cl";
+            for (size_t i = 0; i < seg.args.size(); i++) {
+                const std::string& a = seg.args[i];
+                if (a.size() > 1 && (a[0] == '-' || (msvc && a[0] == '/'))) {
+                    std::string o = a.substr(1);
+                    if (msvc && LowerAscii(o) == "link") break;   // libraries after /link come from the LIB folders
+                    if (msvc ? (IsOneOf(o, { "I", "D", "U", "FI", "Fe", "Fe:", "Fo", "Fo:" }))
+                             : IsOneOf(a, { "-o", "-I", "-D", "-U", "-L", "-l", "-include", "-imacros", "-isystem", "-iquote", "-Xlinker",
+                                            "-MF", "-MT", "-MQ", "-x" }))
+                        i++;
+                    continue;
+                }
+                std::string ext = LowerAscii(fs::u8path(a).extension().u8string());
+                bool source = IsOneOf(ext, { ".c", ".cc", ".cpp", ".cxx", ".c++" });
+                bool object = IsOneOf(ext, { ".obj", ".o", ".res" }) ||
+                              (IsOneOf(ext, { ".lib", ".a", ".so" }) && a.find_first_of("\\/") != std::string::npos);
+                if (!source && !object) continue;
+                std::string name = a;
+                if (!PreflightExpand(seg, name)) continue;
+                if (name.find_first_of("*?") != std::string::npos) {
+                    std::vector<std::string> found;
+                    if (!made(NativePath(name, dir.u8string(), tilde)) && !ExpandSourceWildcard(name, dir.u8string(), found)) {
+                        std::string near = PreflightNearby(NativePath(name, dir.u8string(), tilde));
+                        lookedUp = !near.empty();
+                        return p + ": no files match " + name + " in " + dir.u8string() + ".\n" + near;
+                    }
+                    continue;
+                }
+                fs::path f = NativePath(name, dir.u8string(), tilde);
+                if (!exists(f)) return missing(p + ": the " + std::string(source ? "source file" : "input file"), f);
+            }
+            // What it writes: a program that is still running cannot be replaced
+            CommandInfo one;
+            one.segments.push_back(seg);
+            CompileJob job;
+            if (ParseCompileJob(one, dir.u8string(), job)) {
+                for (const std::string& out : job.outputs) {
+                    std::string problem = writable("the output", fs::u8path(out));
+                    if (!problem.empty()) return p + ": " + problem;
+                }
+            }
+            return "";   // what the compile leaves behind is not known from here
+        } else if (seg.dialect == ShellDialect::Cmd ? p == "type" : IsOneOf(p, { "get-content", "gc", "type", "cat" })) {
+            if (haveTarget && !exists(target)) return missing(p + ": the file", target);
+        } else if (IsOneOf(p, { "set-content", "add-content", "ac", "out-file" })) {
+            if (!haveTarget) continue;
+            std::string problem = writable("the file", target);
+            if (!problem.empty()) return p + ": " + problem;
+            created.push_back(target.u8string());
+        } else if (IsOneOf(p, { "copy", "xcopy", "move", "copy-item", "cpi", "cp", "move-item", "mi", "mv" })) {
+            if (haveTarget && pathArg.find('+') == std::string::npos && !exists(target)) return missing(p + ": the source", target);
+            return "";   // where it puts things is left to the command
+        } else if ((p == "powershell" || p == "pwsh") && seg.args.size() > 1) {
+            for (size_t i = 0; i + 1 < seg.args.size(); i++) {
+                fs::path script;
+                if (IsOneOf(LowerAscii(seg.args[i]), { "-file", "-f" }) && resolve(seg.args[i + 1], script) && !exists(script))
+                    return missing(p + ": the script", script);
+            }
+            return "";
+        } else if (!IsOneOf(p, { "echo", "cls", "title", "ver", "where", "dir", "ls", "gci", "get-childitem", "rem", "write-host",
+                                 "write-output", "get-location", "pwd", "test-path", "get-date" })) {
+            return "";   // a program whose effects are not known: the rest is left to the shell
+        }
+    }
+    return "";
+}
+
+// The EXEC as a failed result if the checks reject it (the shell is not started), else null
+static ExecResult* PreflightResult(const std::string& command, const CommandInfo& info, const std::string& cwd) {
+    auto t0 = std::chrono::steady_clock::now();
+    bool lookedUp = false;
+    std::string problem = PreflightCommand(command, info, cwd, lookedUp);
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+    std::lock_guard<std::mutex> lk(g_preflightStats.mutex);
+    g_preflightStats.checked++;
+    g_preflightStats.us += us;
+    if (problem.empty()) return nullptr;
+    g_preflightStats.rejected++;
+    g_preflightStats.lookupsSaved += lookedUp;
+
+    ExecResult* res = new ExecResult;
+    res->started  = true;
+    res->exitCode = 1;
+    res->source   = "PREFLIGHT";
+    res->seconds  = us / 1e6;
+    res->output = "Not run (pre-flight check): " + problem + "Fix the command and send it again.\n";
+    res->totalBytes = res->output.size();
+    std::string* header = new std::string("\r\n[EXEC] " + command + "\r\n");
+    if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 1, (LPARAM)header)) delete header;
+    std::string* shown = new std::string(res->output);
+    if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 0, (LPARAM)shown)) delete shown;
+
+    // Every rejection is a shell run avoided; one that answers with a listing or a path also spares
+    // the model the command it would have run to look
+    double shellMs = 0;
+    {
+        std::lock_guard<std::mutex> g(g_execStats.mutex);
+        if (g_execStats.shellShort) shellMs = g_execStats.shellShortMs / g_execStats.shellShort;
+    }
+    DevLog("[Preflight] Rejected in %.0f us: %.160s — session: %u of %u EXECs rejected, %u shell runs (~%.0f ms) and ~%u look-up round trips avoided\n",
+           us, problem.substr(0, problem.find('\n')).c_str(), g_preflightStats.rejected, g_preflightStats.checked, g_preflightStats.rejected,
+           shellMs * g_preflightStats.rejected, g_preflightStats.lookupsSaved);
+    return res;
+}
+
+// ── Output condensing ──
+// What goes back to the model after a command is the output condensed to exec_feedback_tokens
+// (about 4 characters each), not its first few thousand characters: compiler diagnostics and other
+// error lines come first, the first of each distinct one with the lines that explain it (source
+// excerpt, carets, notes, a few stack frames); repeated lines, progress meters and long stack
+// traces are counted instead of shown; then the beginning and the end of what is left. It reads the
+// output as it streams, holding only what it may show, so a build that prints 50 MB costs no more
+// memory than one that prints 5 KB. Output that fits the budget is passed on unchanged.
+
+class OutputCondenser {
+public:
+    explicit OutputCondenser(size_t tokens) : m_budget((std::max)(tokens, (size_t)250) * 4) {}
+
+    void Feed(const char* p, size_t n) {
+        m_bytes += n;
+        if (!m_overflow) {
+            m_verbatim.append(p, n);
+            if (m_verbatim.size() > m_budget) { m_overflow = true; std::string().swap(m_verbatim); }
+        }
+        while (n) {
+            const char* nl = (const char*)memchr(p, '\n', n);
+            size_t len = nl ? (size_t)(nl - p) : n, room = kMaxLine - (std::min)(m_partial.size(), kMaxLine);
+            m_partial.append(p, (std::min)(len, room));
+            if (len > room) m_cut = true;   // one huge line (minified output, a binary dump) is kept to its start
+            if (!nl) break;
+            Line();
+            p = nl + 1;
+            n -= len + 1;
+        }
+    }
+    void Feed(const std::string& s) { Feed(s.data(), s.size()); }
+
+    // Whether the output was larger than the budget (Finish then condenses it)
+    bool Condensed() const { return m_overflow; }
+
+    std::string Finish() {
+        if (!m_partial.empty() || m_cut) Line();
+        FlushRuns();
+        if (!m_overflow) return m_verbatim;
+
+        auto tokens = [](size_t chars) { return (chars + 3) / 4; };
+        char buf[320];
+        std::string kept;
+        size_t shownErrors = 0, shownWarnings = 0;
+        const size_t errorBudget = m_budget * 3 / 5;
+        for (int pass = 0; pass < 2; pass++) {   // errors, then warnings if there is room
+            for (const Entry& e : m_entries) {
+                if (e.warning != (pass == 1)) continue;
+                std::string text = e.line + "\n";
+                for (const std::string& c : e.context) text += c + "\n";
+                if (e.more) text += "  [... " + std::to_string(e.more) + " more lines]\n";
+                if (kept.size() + text.size() > errorBudget) { text = e.line + "\n"; if (kept.size() + text.size() > errorBudget) break; }
+                kept += text;
+                (e.warning ? shownWarnings : shownErrors)++;
+            }
+        }
+
+        sprintf_s(buf, "[Output condensed: %llu lines, %.1f KB", m_lines, m_bytes / 1024.0);
+        std::string out = buf;
+        if (m_errors) {
+            sprintf_s(buf, "; %u error%s (%zu distinct, %zu shown)", m_errors, m_errors == 1 ? "" : "s", m_distinctErrors, shownErrors);
+            out += buf;
+        }
+        if (m_warnings) {
+            sprintf_s(buf, "; %u warning%s (%zu distinct, %zu shown)", m_warnings, m_warnings == 1 ? "" : "s", m_distinctWarnings, shownWarnings);
+            out += buf;
+        }
+        std::string dropped;
+        for (auto n : { std::make_pair(m_repeats, " repeated"), std::make_pair(m_progress, " progress"), std::make_pair(m_frames, " stack frame") })
+            if (n.first) dropped += (dropped.empty() ? "" : ", ") + std::to_string(n.first) + n.second;
+        out += (dropped.empty() ? "" : "; left out: " + dropped + " lines") + "]\n";
+        if (!kept.empty()) out += "--- diagnostics (the first of each) ---\n" + kept;
+
+        // The rest: the beginning up to a third of what is left, then as much of the end as fits
+        size_t left = m_budget > out.size() + 80 ? m_budget - out.size() - 80 : 0;
+        std::string head, tail;
+        unsigned long long lastHead = 0;
+        for (const Kept& k : m_head) {
+            if (head.size() + k.text.size() + 1 > left / 3) break;
+            head += k.text + "\n";
+            lastHead = k.seq;
+        }
+        left -= head.size();
+        std::vector<const Kept*> end;
+        size_t tailSize = 0;
+        for (auto it = m_tail.rbegin(); it != m_tail.rend() && it->seq > lastHead; ++it) {
+            if (tailSize + it->text.size() + 1 > left) break;
+            tailSize += it->text.size() + 1;
+            end.push_back(&*it);
+        }
+        for (auto it = end.rbegin(); it != end.rend(); ++it) tail += (*it)->text + "\n";
+        unsigned long long skipped = m_seq - lastHead - end.size();
+        if (!head.empty()) out += "--- beginning ---\n" + head;
+        if (skipped) {
+            sprintf_s(buf, "[... %llu lines left out ...]\n", skipped);
+            out += buf;
+        }
+        if (!tail.empty()) out += (head.empty() && !skipped ? "--- output ---\n" : "--- end ---\n") + tail;
+        sprintf_s(buf, "Output condensed: %.1f KB, %llu lines -> %.1f KB (~%zu tokens), %zu of %zu distinct errors shown, "
+                       "%llu repeated, %llu progress lines and %llu frames left out",
+                  m_bytes / 1024.0, m_lines, out.size() / 1024.0, tokens(out.size()), shownErrors, m_distinctErrors,
+                  m_repeats, m_progress, m_frames);
+        m_stats = buf;
+        return out;
+    }
+
+    // One line for the dev log, after Finish
+    const std::string& Stats() const { return m_stats; }
+
+private:
+    struct Entry { std::string line; std::vector<std::string> context; size_t more = 0; bool warning = false; };
+    struct Kept  { unsigned long long seq; std::string text; };
+    static const size_t kMaxLine = 4096, kShownLine = 300, kHeadLines = 60, kTailLines = 120;
+    static const size_t kMaxEntries = 24, kContextLines = 8, kFrameLinesShown = 8, kMaxSeen = 1 << 16;
+    static const int kRepeat = -2;
+
+    static std::string Cut(std::string s) {
+        if (s.size() <= kShownLine) return s;
+        s.resize(kShownLine);
+        s.resize(s.size() - IncompleteUtf8Tail(s));
+        return s + " [...]";
+    }
+    static std::string Shape(const std::string& s) {   // digits vary between otherwise equal lines
+        std::string r;
+        for (char c : s) if (!isdigit((unsigned char)c) || r.empty() || r.back() != '#') r += isdigit((unsigned char)c) ? '#' : c;
+        return r;
+    }
+    static bool IsProgress(const std::string& s) {
+        size_t pct = s.find('%');
+        if (pct != std::string::npos && pct > 0 && isdigit((unsigned char)s[pct - 1]) && s.size() < 200) return true;
+        return s.find("=====") != std::string::npos || s.find("#####") != std::string::npos;   // bars
+    }
+    static bool IsFrame(const std::string& t) {
+        return t.compare(0, 3, "at ") == 0 || t.compare(0, 6, "File \"") == 0 ||
+               (t.size() > 2 && t[0] == '#' && isdigit((unsigned char)t[1])) ||
+               (t.find(": 0x") != std::string::npos && isdigit((unsigned char)t[0]));
+    }
+    // Lines that explain the diagnostic above them: source excerpts and carets, notes, frames, PowerShell's error record
+    static bool IsContext(const std::string& line, const std::string& t) {
+        return (!line.empty() && (line[0] == ' ' || line[0] == '\t')) || t[0] == '|' || t[0] == '^' || t[0] == '~' ||
+               t.compare(0, 2, "+ ") == 0 || t.compare(0, 8, "At line:") == 0 || IsFrame(t);
+    }
+    static bool IsErrorLine(const std::string& t) {
+        std::string l = LowerAscii(t.substr(0, 200));
+        for (const char* start : { "error", "fatal", "traceback", "exception", "unhandled exception", "build failed", "panic" })
+            if (l.compare(0, strlen(start), start) == 0) return true;
+        for (const char* part : { "error:", "error[", "exception:", "is not recognized as", "no such file or directory", "cannot find",
+                                  "could not find", "access is denied", "command not found", "permission denied", "failed with" })
+            if (l.find(part) != std::string::npos) return true;
+        return false;
+    }
+
+    void Line() {
+        std::string line;
+        line.swap(m_partial);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t cr = line.rfind('\r');
+        if (cr != std::string::npos) line.erase(0, cr + 1);   // a terminal redraw: the last state is what was seen
+        while (!line.empty() && (line.back() == ' ' || line.back() == '\t')) line.pop_back();
+        if (m_cut) { line += " [... line cut]"; m_cut = false; }
+        m_lines++;
+        size_t lead = line.find_first_not_of(" \t");
+        std::string t = lead == std::string::npos ? "" : line.substr(lead);
+
+        if (m_context != -1 && !t.empty() && IsContext(line, t)) {
+            if (m_context == kRepeat) { m_repeats++; return; }   // the excerpt under a diagnostic already shown
+            Entry& e = m_entries[m_context];
+            if (e.context.size() < kContextLines) e.context.push_back(Cut(line));
+            else e.more++;
+            return;
+        }
+        int entry = m_context;
+        m_context = -1;
+
+        BuildDiagnostic d;
+        bool diag = !t.empty() && (ParseDiagnosticLine(line, true, d) || ParseDiagnosticLine(line, false, (d = BuildDiagnostic())));
+        if (diag || (!t.empty() && IsErrorLine(t))) {
+            if (diag && d.severity == "note") {   // belongs to the diagnostic above it
+                if (entry >= 0 && m_entries[entry].context.size() < kContextLines) m_entries[entry].context.push_back(Cut(line));
+                else m_repeats++;
+                m_context = entry;
+                return;
+            }
+            bool warning = diag && d.severity == "warning";
+            (warning ? m_warnings : m_errors)++;
+            std::string key = diag ? LowerAscii(d.file) + ":" + std::to_string(d.line) + ":" + d.code + ":" + d.message : Shape(t);
+            ULONGLONG h = XXH64(key);
+            m_context = kRepeat;
+            if (m_diagKeys.count(h)) { m_repeats++; return; }
+            if (m_diagKeys.size() < kMaxSeen) m_diagKeys.insert(h);
+            (warning ? m_distinctWarnings : m_distinctErrors)++;
+            if (m_entries.size() < kMaxEntries) {
+                Entry e;
+                e.line = Cut(line);
+                e.warning = warning;
+                m_entries.push_back(e);
+                m_context = (int)m_entries.size() - 1;
+            }
+            return;
+        }
+
+        // Progress meters: a run is shown as its last line
+        if (!t.empty() && IsProgress(t)) {
+            if (m_progressRun++) m_progress++;
+            m_lastProgress = line;
+            return;
+        }
+        FlushProgress();
+
+        // Stack frames: the first few of each trace (with the source lines Python prints under them)
+        if (!t.empty() && (IsFrame(t) || (m_frameRun && lead > 0))) {
+            if (++m_frameRun > kFrameLinesShown) { m_frames++; m_framesCut++; return; }
+        } else {
+            FlushFrames();
+            m_frameRun = 0;
+        }
+
+        // The same line again: right after itself, or anywhere earlier
+        if (line == m_prev && m_seq) { m_repeatRun++; m_repeats++; return; }
+        FlushRepeats();
+        m_prev = line;
+        if (t.size() > 3) {
+            ULONGLONG h = XXH64(line);
+            if (m_seen.count(h)) { m_repeats++; return; }
+            if (m_seen.size() < kMaxSeen) m_seen.insert(h);
+        }
+        Keep(Cut(line));
+    }
+
+    void Keep(std::string text) {
+        m_seq++;
+        if (m_head.size() < kHeadLines) { m_head.push_back({ m_seq, std::move(text) }); return; }
+        m_tail.push_back({ m_seq, std::move(text) });
+        if (m_tail.size() > kTailLines) m_tail.pop_front();
+    }
+    // A run like the one before it (the same meter after a line of other output) is only counted
+    void FlushProgress(bool last = false) {
+        if (!m_progressRun) return;
+        std::string shape = Shape(m_lastProgress);
+        if (shape == m_progressShape && !last) {
+            m_progress++;
+        } else {
+            if (m_progressRun > 1) Keep("[... " + std::to_string(m_progressRun - 1) + " progress lines ...]");
+            Keep(Cut(m_lastProgress));
+        }
+        m_progressShape = shape;
+        m_progressRun = 0;
+    }
+    void FlushFrames() {
+        if (!m_framesCut) return;
+        Keep("[... " + std::to_string(m_framesCut) + " more stack frame lines]");
+        m_framesCut = 0;
+    }
+    void FlushRepeats() {
+        if (!m_repeatRun) return;
+        Keep("[previous line repeated " + std::to_string(m_repeatRun) + " more times]");
+        m_repeatRun = 0;
+    }
+    void FlushRuns() { FlushProgress(true); FlushFrames(); FlushRepeats(); }
+
+    size_t      m_budget;                   // characters
+    bool        m_overflow = false, m_cut = false;
+    std::string m_verbatim, m_partial, m_prev, m_lastProgress, m_progressShape, m_stats;
+    unsigned long long m_bytes = 0, m_lines = 0, m_seq = 0, m_repeats = 0, m_progress = 0, m_frames = 0;
+    unsigned    m_errors = 0, m_warnings = 0;
+    size_t      m_distinctErrors = 0, m_distinctWarnings = 0, m_progressRun = 0, m_frameRun = 0, m_framesCut = 0, m_repeatRun = 0;
+    int         m_context = -1;             // entry that context lines attach to, or kRepeat
+    std::vector<Entry> m_entries;
+    std::deque<Kept>   m_head, m_tail;
+    std::unordered_set<ULONGLONG> m_seen, m_diagKeys;
+};
+
+// Define tracking globals somewhere at the top of your file if they aren't already:
+// std::string g_currentAgentDir = "";
+
+// Runs one EXEC command to completion on the calling thread, in `cwd`: live output goes to the
+// transcript and the result is returned for WM_EXEC_DONE or a plan (see "Plans") to report
+static ExecResult* RunNovaCommand(const std::string& command, const CommandInfo& info, bool toolchain, std::string cwd) {
+    if (!cwd.empty() && GetFileAttributesA(cwd.c_str()) == INVALID_FILE_ATTRIBUTES) {
+        DevLog("[Exec] Working folder %s is missing — using Nova's own\n", cwd.c_str());
+        cwd.clear();
+    }
+    unsigned long long maxOutput = (unsigned long long)(std::max)(g_config.execMaxOutputMB, 1) << 20;
+
+    // Malformed commands are answered without starting anything (see "Pre-flight checks")
+    if (ExecResult* rejected = PreflightResult(command, info, cwd)) return rejected;
+
+    // File operations run in-process when they can (see "Native built-ins")
+    if (info.route == CommandInfo::Route::Native) {
+        ExecResult* res = new ExecResult;
+        auto t0 = std::chrono::steady_clock::now();
+        if (RunNativeCommand(info.segments[0], info.native, cwd, maxOutput, *res)) {
+            res->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            std::string* header = new std::string("\r\n[EXEC] " + command + "\r\n");
+            if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 1, (LPARAM)header)) delete header;
+            if (!res->output.empty()) {
+                std::string* shown = new std::string(res->output.substr(0, kLiveOutputLimit));
+                shown->resize(shown->size() - IncompleteUtf8Tail(*shown));
+                if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 0, (LPARAM)shown)) delete shown;
+            }
+            {
+                std::lock_guard<std::mutex> lk(g_execStats.mutex);
+                g_execStats.execs++;
+                g_execStats.native++;
+                g_execStats.nativeMs += res->seconds * 1000.0;
+                if (g_execStats.shellShort) {
+                    double saved = g_execStats.native * (g_execStats.shellShortMs / g_execStats.shellShort) - g_execStats.nativeMs;
+                    DevLog("[Exec] native %s: exit=%d in %.2f ms — %u of %u EXECs native this session, ~%.0f ms saved against the shell\n",
+                           info.segments[0].program.c_str(), res->exitCode, res->seconds * 1000.0, g_execStats.native, g_execStats.execs, saved);
+                } else {
+                    DevLog("[Exec] native %s: exit=%d in %.2f ms — %u of %u EXECs native this session\n",
+                           info.segments[0].program.c_str(), res->exitCode, res->seconds * 1000.0, g_execStats.native, g_execStats.execs);
+                }
+            }
+            return res;
+        }
+        delete res;
+        DevLog("[Exec] %s is not handled natively in this form — running it in the shell\n", info.segments[0].program.c_str());
+    }
+
+    // Auto-detect Visual Studio environment if compiling C++: the cached capture is applied to the
+    // command directly; calling vcvars64.bat is the fallback if it cannot be captured
+    std::string full = command, envFile;
+    EnvOverrides toolchainVars;
+    if (toolchain) {
+        if (g_toolchain.Ensure()) {
+            envFile = g_toolchain.File();
+            toolchainVars = g_toolchain.Vars();
+        } else if (const char* vcvars = FindVcvars()) {
+            full = "call \"" + std::string(vcvars) + "\" >nul 2>&1 && " + command; // Hide the massive VS splash output
+        }
+    }
+
+    ExecLimits limits;
+    limits.timeoutMs      = (unsigned)(std::max)(g_config.execTimeoutSec, 1) * 1000;
+    limits.maxOutputBytes = maxOutput;
+
+    std::string* header = new std::string("\r\n[EXEC] " + command + "\r\n");
+    if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 1, (LPARAM)header)) delete header;
+    size_t live = 0;
+    std::string carry;
+    OutputCondenser condenser((size_t)(std::max)(g_config.execFeedbackTokens, 1));   // what the model gets (see "Output condensing")
+    auto onOutput = [&](const char* p, size_t n) {
+        condenser.Feed(p, n);
+        if (live >= kLiveOutputLimit) return;
+        std::string* chunk = new std::string(carry);
+        chunk->append(p, n);
+        size_t hold = IncompleteUtf8Tail(*chunk);
+        carry.assign(*chunk, chunk->size() - hold, hold);
+        chunk->resize(chunk->size() - hold);
+        live += chunk->size();
+        if (live >= kLiveOutputLimit) *chunk += "\n[... live output paused; the end of it follows when the command finishes]\n";
+        if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 0, (LPARAM)chunk)) delete chunk;
+    };
+
+    CompileJob job;
+    bool compileJob = toolchain && !toolchainVars.empty() && ParseCompileJob(info, cwd, job);
+
+    // Several sources into one program: a parallel, incremental build (see "Project builds")
+    if (compileJob && !job.compileOnly && job.sources.size() > 1) {
+        ExecResult* res = new ExecResult(RunBuild(job, toolchainVars, limits, onOutput, &AppStateManager::Instance().abortInference));
+        if (job.changesDir) res->cwd = job.dir;
+        {
+            std::lock_guard<std::mutex> lk(g_execStats.mutex);
+            g_execStats.execs++;
+        }
+        return res;
+    }
+
+    // A compile whose preprocessed sources, flags and compiler match an earlier one is served from
+    // the compile cache (see "Compile cache")
+    std::string cacheKey;
+    if (toolchain && !toolchainVars.empty() && g_config.compileCacheMB > 0) {
+        double keySeconds = 0;
+        if (compileJob)
+            cacheKey = g_compileCache.Key(job, toolchainVars, g_toolchain.Identity(), &AppStateManager::Instance().abortInference, keySeconds);
+        else
+            g_compileCache.NoteUncached();
+        ExecResult* hit = new ExecResult;
+        if (!cacheKey.empty() && g_compileCache.Lookup(cacheKey, keySeconds, job, onOutput, *hit)) {
+            if (job.changesDir) hit->cwd = job.dir;   // the shell would have ended up there too
+            hit->output = condenser.Finish();
+            {
+                std::lock_guard<std::mutex> lk(g_execStats.mutex);
+                g_execStats.execs++;
+            }
+            return hit;
+        }
+        delete hit;
+    }
+
+    std::string payload;
+    ShellKind kind = SplitShellCommand(full, payload);
+    if (info.cmdlet && full == command) { kind = ShellKind::PowerShell; payload = command; }   // bare cmdlet: PowerShell, not cmd.exe
+    ExecResult* res = new ExecResult(g_shell.Run(payload, kind, cwd, limits, onOutput, &AppStateManager::Instance().abortInference, envFile));
+    if (!res->started) {
+        DevLog("[Exec] Shell host unavailable (%s) — running the command cold\n", res->error.c_str());
+        // No host to report where the command ended up: cmd writes its exit code and folder to a
+        // state file, as the host script does
+        wchar_t tmp[MAX_PATH];
+        std::string state = (GetTempPathW(MAX_PATH, tmp) ? WStringToString(tmp) : std::string()) +
+                            "nova_cold_" + std::to_string(GetCurrentProcessId()) + "_" + std::to_string(GetTickCount64()) + ".txt";
+        *res = RunCommand(full + " & >\"" + state + "\" call echo %^ERRORLEVEL% %^CD%", cwd, limits, onOutput,
+                          &AppStateManager::Instance().abortInference, &toolchainVars);
+        {
+            std::ifstream f(std::filesystem::u8path(state));
+            int code = 0;
+            std::string dir;
+            if (f >> code && std::getline(f >> std::ws, dir)) {
+                while (!dir.empty() && (dir.back() == '\r' || dir.back() == ' ')) dir.pop_back();
+                res->exitCode = code;
+                res->cwd = dir;
+            }
+        }
+        DeleteFileW(StringToWString(state).c_str());
+    }
+    if (!g_shell.Warm()) g_shell.PrewarmAsync();   // killed or exited: have the next one ready
+    if (!cacheKey.empty()) g_compileCache.Store(cacheKey, job, *res, (unsigned long long)g_config.compileCacheMB << 20);
+    if (res->started) {
+        res->output = condenser.Finish();
+        if (condenser.Condensed()) DevLog("[Exec] %s\n", condenser.Stats().c_str());
+    }
+    {
+        std::lock_guard<std::mutex> lk(g_execStats.mutex);
+        g_execStats.execs++;
+        if (res->started && !toolchain && res->seconds < 1.0) {
+            g_execStats.shellShort++;
+            g_execStats.shellShortMs += res->seconds * 1000.0;
+        }
+    }
+    DevLog("[Exec] exit=%d in %.2f s, %llu bytes%s%s%s%s\n", res->exitCode, res->seconds, res->totalBytes,
+           res->timedOut ? " [timeout]" : "", res->outputLimit ? " [output limit]" : "",
+           res->aborted ? " [stopped]" : "", res->error.empty() ? "" : (" — " + res->error).c_str());
+    return res;
+}
+
+void ExecuteNovaCommand(const std::string& command, bool needsVS_Param) {
+    CommandInfo info = ClassifyCommand(command);
+    DevLog("[Exec] %s: %.200s\n", info.Describe().c_str(), command.c_str());
+
+    // Execution Thread with Universal Compiler Detection
+    // (the working folder is whatever the shell host reports after each command; see WM_EXEC_DONE)
+    AppStateManager::Instance().execRunning.store(true);
+    bool toolchain = needsVS_Param || info.route == CommandInfo::Route::Toolchain;
+    std::thread([command, toolchain, info]() {
+        ExecResult* res = RunNovaCommand(command, info, toolchain, g_currentAgentDir);
+        if (!PostMessageW(hMainWnd, WM_EXEC_DONE, 0, (LPARAM)res)) delete res;
+    }).detach();
+}
+
+// ── File edits (EDIT: blocks) ──
+// Changing a few lines no longer means re-sending the whole file inside a Set-Content string. The
+// model names the file on an `EDIT: <path>` line and follows it with SEARCH/REPLACE blocks or
+// unified-diff hunks. Each hunk is found exactly, then ignoring whitespace, then by the share of
+// lines that agree, and the result is written atomically. A hunk that cannot be placed leaves the
+// file untouched and the model is shown the closest candidate.
+
+struct EditHunk {
+    std::vector<std::string> find, replace;
+    int hint = -1;   // 0-based line from a diff's @@ header
+};
+
+struct EditBlock {
+    std::string path;
+    std::vector<EditHunk> hunks;
+    size_t chars = 0;   // size of the block in the reply, for the dev log
+};
+
+// Offset of the first `EDIT:` line in a reply, npos if there is none
+static size_t FindEditHeader(const std::string& reply) {
+    for (size_t pos = 0; pos < reply.size();) {
+        size_t end = reply.find('\n', pos);
+        if (end == std::string::npos) end = reply.size();
+        size_t a = reply.find_first_not_of(" \t*", pos);
+        if (a < end && reply.compare(a, 5, "EDIT:") == 0) return pos;
+        pos = end + 1;
+    }
+    return std::string::npos;
+}
+
+// Every EDIT: block in a reply. SEARCH/REPLACE blocks run to their >>>>>>> REPLACE line; diff hunks
+// run while lines look like a diff (a blank line inside a hunk is taken as blank context)
+static std::vector<EditBlock> ParseEditBlocks(const std::string& reply) {
+    std::vector<std::string> lines;
+    std::vector<size_t> offsets;
+    for (size_t pos = 0; pos <= reply.size();) {
+        size_t end = reply.find('\n', pos);
+        if (end == std::string::npos) end = reply.size();
+        std::string line = reply.substr(pos, end - pos);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        lines.push_back(line);
+        offsets.push_back(pos);
+        pos = end + 1;
+    }
+    auto startsWith = [](const std::string& s, const char* p) { return s.compare(0, strlen(p), p) == 0; };
+
+    std::vector<EditBlock> blocks;
+    size_t i = 0;
+    while (i < lines.size()) {
+        std::string head = TrimAscii(lines[i]);
+        while (!head.empty() && head[0] == '*') head.erase(0, 1);
+        if (!startsWith(head, "EDIT:")) { i++; continue; }
+        EditBlock block;
+        block.path = head.substr(5);
+        while (!block.path.empty() && strchr("*`'\" \t", block.path.back())) block.path.pop_back();
+        while (!block.path.empty() && strchr("*`'\" \t", block.path[0])) block.path.erase(0, 1);
+        size_t from = i++;
+
+        bool fenced = false;
+        while (i < lines.size()) {
+            std::string t = TrimAscii(lines[i]);
+            if (t.empty()) { i++; continue; }
+            if (startsWith(t, "```")) { fenced = !fenced; i++; continue; }
+
+            if (startsWith(t, "<<<<<<<")) {
+                // <<<<<<< SEARCH / ======= / >>>>>>> REPLACE
+                EditHunk h;
+                bool replacing = false, closed = false;
+                for (i++; i < lines.size(); i++) {
+                    const std::string& l = lines[i];
+                    if (!replacing && startsWith(l, "=======")) { replacing = true; continue; }
+                    if (replacing && startsWith(l, ">>>>>>>")) { closed = true; i++; break; }
+                    (replacing ? h.replace : h.find).push_back(l);
+                }
+                if (closed) block.hunks.push_back(std::move(h));
+                continue;
+            }
+
+            if (startsWith(t, "---") || startsWith(t, "+++") || startsWith(t, "diff ") || startsWith(t, "index ")) { i++; continue; }
+            if (startsWith(lines[i], "@@")) {
+                EditHunk h;
+                int oldLine = 0;
+                if (sscanf(lines[i].c_str(), "@@ -%d", &oldLine) == 1 && oldLine > 0) h.hint = oldLine - 1;
+                for (i++; i < lines.size(); i++) {
+                    const std::string& l = lines[i];
+                    if (startsWith(l, "@@") || startsWith(l, "```") ||
+                        (startsWith(l, "--- ") && i + 1 < lines.size() && startsWith(lines[i + 1], "+++ "))) break;   // next file's header
+                    if (l.empty())    { h.find.push_back(""); h.replace.push_back(""); continue; }
+                    if (l[0] == ' ')  { h.find.push_back(l.substr(1)); h.replace.push_back(l.substr(1)); }
+                    else if (l[0] == '-') h.find.push_back(l.substr(1));
+                    else if (l[0] == '+') h.replace.push_back(l.substr(1));
+                    else if (l[0] != '\\') break;   // "\ No newline at end of file"
+                }
+                // Blank lines after the last hunk are the reply's, not the file's
+                while (!h.find.empty() && !h.replace.empty() && h.find.back().empty() && h.replace.back().empty()) { h.find.pop_back(); h.replace.pop_back(); }
+                block.hunks.push_back(std::move(h));
+                continue;
+            }
+            if (fenced) { i++; continue; }
+            break;   // prose after the block
+        }
+        block.chars = (i < offsets.size() ? offsets[i] : reply.size()) - offsets[from];
+        if (!block.path.empty() && !block.hunks.empty()) blocks.push_back(std::move(block));
+    }
+    return blocks;
+}
+
+static std::string StripWhitespace(const std::string& s) {
+    std::string out;
+    for (char c : s) if (c != ' ' && c != '\t' && c != '\r') out += c;
+    return out;
+}
+
+// Where `find` sits in `lines`, or -1. quality: 0 exact, 1 whitespace differs, 2 fuzzy (at least 3 in 4
+// lines agree ignoring whitespace). Ties go to the candidate nearest `hint`; without a hint a repeated
+// match is ambiguous (-2). `best`/`bestAgree` describe the closest candidate when nothing matches.
+static int FindHunk(const std::vector<std::string>& lines, const std::vector<std::string>& find, int hint,
+                    int& quality, int& best, int& bestAgree) {
+    best = -1;
+    bestAgree = 0;
+    if (find.empty() || find.size() > lines.size()) return -1;
+    const size_t m = find.size(), last = lines.size() - m;
+    std::vector<std::string> fileNorm(lines.size()), findNorm(m);
+    for (size_t i = 0; i < lines.size(); i++) fileNorm[i] = StripWhitespace(lines[i]);
+    for (size_t i = 0; i < m; i++) findNorm[i] = StripWhitespace(find[i]);
+
+    for (quality = 0; quality < 3; quality++) {
+        std::vector<int> hits;
+        int top = 0, second = 0;
+        for (size_t s = 0; s <= last; s++) {
+            int agree = 0;
+            for (size_t k = 0; k < m; k++) {
+                bool same = quality == 0 ? lines[s + k] == find[k] : fileNorm[s + k] == findNorm[k];
+                if (same) agree++;
+                else if (quality < 2) break;
+            }
+            if (quality < 2) { if (agree == (int)m) hits.push_back((int)s); continue; }
+            if (agree > top) { second = top; top = agree; hits.assign(1, (int)s); }
+            else if (agree == top && agree > 0) { second = top; hits.push_back((int)s); }
+            else if (agree > second) second = agree;
+        }
+        if (quality == 2) {
+            best = hits.empty() ? -1 : hits[0];
+            bestAgree = top;
+            if (top * 4 < (int)m * 3 || top == second || m < 2) return -1;
+        }
+        if (hits.empty()) continue;
+        if (hits.size() == 1) return hits[0];
+        if (hint < 0) return -2;
+        return *std::min_element(hits.begin(), hits.end(), [hint](int a, int b) { return std::abs(a - hint) < std::abs(b - hint); });
+    }
+    return -1;
+}
+
+static std::string LeadingWhitespace(const std::string& line) {
+    return line.substr(0, (std::min)(line.find_first_not_of(" \t"), line.size()));
+}
+
+// Applies every hunk of `edit` or none of them; `report` gets the compact result either way
+static bool ApplyEditBlock(const EditBlock& edit, const std::string& cwd, std::string& report) {
+    namespace fs = std::filesystem;
+    fs::path path = NativePath(edit.path, cwd, true);
+    std::string shown = path.filename().u8string();
+    std::error_code ec;
+
+    std::string text;
+    bool exists = fs::exists(path, ec);
+    if (exists && !ReadFileNative(path, ~0ull, false, text, report)) return false;
+    bool crlf = text.find("\r\n") != std::string::npos;
+    bool finalNewline = text.empty() || text.back() == '\n';
+    std::vector<std::string> lines;
+    for (size_t pos = 0; pos < text.size();) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        std::string line = text.substr(pos, end - pos);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        lines.push_back(line);
+        pos = end + 1;
+    }
+
+    int added = 0, removed = 0, delta = 0;
+    std::string notes;
+    for (size_t h = 0; h < edit.hunks.size(); h++) {
+        EditHunk hunk = edit.hunks[h];
+        int at = -1, quality = 0, best = -1, bestAgree = 0;
+        if (hunk.find.empty() && hunk.hint >= 0) {
+            at = (std::min)(hunk.hint + delta, (int)lines.size());   // a diff hunk that only adds lines
+        } else if (hunk.find.empty()) {
+            // Nothing to find: a new file, or the text of an empty one
+            if (!lines.empty()) { report = shown + ": hunk " + std::to_string(h + 1) + " has no SEARCH text; the file is not empty."; return false; }
+            at = 0;
+        } else {
+            int hint = hunk.hint >= 0 ? hunk.hint + delta : -1;
+            at = FindHunk(lines, hunk.find, hint, quality, best, bestAgree);
+            // Like patch's fuzz factor: drop up to two stale context lines from each end of a diff hunk
+            for (int fuzz = 1; at == -1 && hunk.hint >= 0 && fuzz <= 2; fuzz++) {
+                bool trimmed = false;
+                if (hunk.find.size() > 1 && hunk.replace.size() > 1 && hunk.find.front() == hunk.replace.front()) {
+                    hunk.find.erase(hunk.find.begin()); hunk.replace.erase(hunk.replace.begin()); hint++; trimmed = true;
+                }
+                if (hunk.find.size() > 1 && hunk.replace.size() > 1 && hunk.find.back() == hunk.replace.back()) {
+                    hunk.find.pop_back(); hunk.replace.pop_back(); trimmed = true;
+                }
+                if (!trimmed) break;
+                int b2, a2;
+                at = FindHunk(lines, hunk.find, hint, quality, b2, a2);
+            }
+            if (at == -2) {
+                report = shown + ": hunk " + std::to_string(h + 1) + " matches more than one place — add surrounding lines to make it unique.";
+                return false;
+            }
+            if (at < 0) {
+                if (!exists) { report = "Cannot find path '" + path.u8string() + "' because it does not exist."; return false; }
+                report = shown + ": hunk " + std::to_string(h + 1) + " was not found";
+                if (best >= 0 && bestAgree > 0) {
+                    report += "; closest is line " + std::to_string(best + 1) + " (" + std::to_string(bestAgree) + " of " +
+                              std::to_string(hunk.find.size()) + " lines agree). The file there reads:\n";
+                    for (size_t k = (size_t)best; k < (std::min)(lines.size(), (size_t)best + hunk.find.size() + 2); k++)
+                        report += lines[k] + "\n";
+                } else {
+                    report += ". Its SEARCH text must be copied from the file as it is now.";
+                }
+                return false;
+            }
+        }
+
+        // Re-indent the replacement when the model's copy was indented differently from the file
+        std::vector<std::string> replace = hunk.replace;
+        for (size_t k = 0; quality > 0 && k < hunk.find.size(); k++) {
+            const std::string& mine = lines[at + k];
+            const std::string& theirs = hunk.find[k];
+            if (TrimAscii(mine).empty() || TrimAscii(theirs).empty()) continue;
+            std::string want = LeadingWhitespace(mine), got = LeadingWhitespace(theirs);
+            if (want == got) continue;
+            for (std::string& l : replace)
+                if (!TrimAscii(l).empty() && l.compare(0, got.size(), got) == 0) l = want + l.substr(got.size());
+            break;   // the first line indented differently sets the shift
+        }
+        if (quality > 0) notes += "; hunk " + std::to_string(h + 1) + (quality == 1 ? " matched ignoring whitespace" : " matched approximately") +
+                                  " at line " + std::to_string(at + 1);
+        lines.erase(lines.begin() + at, lines.begin() + at + hunk.find.size());
+        lines.insert(lines.begin() + at, replace.begin(), replace.end());
+        added   += (int)replace.size();
+        removed += (int)hunk.find.size();
+        delta   += (int)replace.size() - (int)hunk.find.size();
+    }
+
+    std::string out;
+    for (size_t i = 0; i < lines.size(); i++) {
+        out += lines[i];
+        if (i + 1 < lines.size() || finalNewline) out += crlf ? "\r\n" : "\n";
+    }
+    if (!WriteFileAtomic(path, out, report)) return false;
+    report = shown + ": " + std::to_string(edit.hunks.size()) + (edit.hunks.size() == 1 ? " hunk" : " hunks") + " applied, +" +
+             std::to_string(added) + " -" + std::to_string(removed) + " lines, now " + std::to_string(lines.size()) + " lines" + notes + ".";
+    return true;
+}
+
+// EDIT: counterpart of RunNovaCommand: applies the blocks on the calling thread, relative to `cwd`
+static ExecResult* RunNovaEdit(const std::vector<EditBlock>& edits, const std::string& cwd) {
+    auto t0 = std::chrono::steady_clock::now();
+    ExecResult* res = new ExecResult;
+    res->started = true;
+    res->exitCode = 0;
+    res->source = "EDIT";
+    if (edits.empty()) {
+        res->exitCode = 1;
+        res->output = "The EDIT: block had no SEARCH/REPLACE blocks or @@ hunks under its file name; nothing was changed.\n";
+    }
+    for (const EditBlock& e : edits) {
+        std::string report;
+        bool ok = ApplyEditBlock(e, cwd, report);
+        if (!ok) res->exitCode = 1;
+        res->output += report + "\n";
+        std::string* header = new std::string("\r\n[EDIT] " + e.path + "\r\n");
+        if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 1, (LPARAM)header)) delete header;
+        std::string* shown = new std::string(report + "\r\n");
+        if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 0, (LPARAM)shown)) delete shown;
+        std::error_code ec;
+        unsigned long long size = (unsigned long long)std::filesystem::file_size(NativePath(e.path, cwd, true), ec);
+        DevLog("[Edit] %s: %s — %zu-char edit against a %llu-byte file\n", ok ? "applied" : "FAILED", report.c_str(), e.chars, ec ? 0ull : size);
+    }
+    res->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    res->totalBytes = res->output.size();
+    return res;
+}
+
+// ...and of ExecuteNovaCommand: off the UI thread, reported through WM_EXEC_DONE
+void ExecuteNovaEdit(std::vector<EditBlock> edits) {
+    AppStateManager::Instance().execRunning.store(true);
+    std::thread([edits]() {
+        ExecResult* res = RunNovaEdit(edits, g_currentAgentDir);
+        if (!PostMessageW(hMainWnd, WM_EXEC_DONE, 0, (LPARAM)res)) delete res;
+    }).detach();
+}
+
+// ── Plans (PLAN: blocks) ──
+// Several EXEC:/EDIT: steps in one reply, so "make a folder, write three files, compile" is one
+// round trip instead of five. Each step may name the steps it waits for ("3 after 1:"); a step
+// without one waits for the step before it. Steps whose dependencies are met run at the same time
+// (file writes and edits in-process; shell commands still take turns on the shell host). The first
+// failure stops the plan: running steps finish, the rest are not started, and the model gets one
+// report covering every step.
+
+struct PlanStep {
+    int id = 0;
+    std::vector<int> after;        // ids of earlier steps
+    bool edit = false;
+    std::string command;           // EXEC: one line
+    std::string editText;          // EDIT: the header line and its blocks
+};
+
+// Offset of a `PLAN:` line in a reply, npos if there is none
+static size_t FindPlanHeader(const std::string& reply) {
+    for (size_t pos = 0; pos < reply.size();) {
+        size_t end = reply.find('\n', pos);
+        if (end == std::string::npos) end = reply.size();
+        std::string line = TrimAscii(reply.substr(pos, end - pos));
+        while (!line.empty() && (line[0] == '*' || line[0] == '#')) line.erase(0, 1);
+        if (line.compare(0, 5, "PLAN:") == 0) return pos;
+        pos = end + 1;
+    }
+    return std::string::npos;
+}
+
+// "2 after 1:", "3. [after 1, 2]", "4) after none -" in front of EXEC:/EDIT:
+static bool ParsePlanStepHeader(const std::string& line, PlanStep& step, size_t& actionPos) {
+    size_t i = line.find_first_not_of(" \t*-");
+    if (i == std::string::npos || !isdigit((unsigned char)line[i])) return false;
+    size_t exec = line.find("EXEC:", i), edit = line.find("EDIT:", i);
+    actionPos = (std::min)(exec, edit);
+    if (actionPos == std::string::npos || actionPos - i > 40) return false;
+    std::string prefix = LowerAscii(line.substr(i, actionPos - i));
+    step = PlanStep();
+    step.id = atoi(prefix.c_str());
+    step.edit = actionPos == edit;
+    size_t a = prefix.find("after");
+    if (a == std::string::npos) return true;
+    step.after.push_back(-1);   // explicit, possibly empty ("after none")
+    for (size_t p = a + 5; p < prefix.size();) {
+        if (!isdigit((unsigned char)prefix[p])) { p++; continue; }
+        int dep = atoi(prefix.c_str() + p);
+        if (dep > 0) step.after.push_back(dep);
+        while (p < prefix.size() && isdigit((unsigned char)prefix[p])) p++;
+    }
+    return true;
+}
+
+// Steps from `PLAN:` to `END PLAN` (or the end of the reply). False with a reason if the plan
+// cannot run as written; nothing is run then.
+static bool ParsePlan(const std::string& text, std::vector<PlanStep>& steps, std::string& err) {
+    const size_t kMaxSteps = 20;
+    std::istringstream in(text);
+    std::string line;
+    std::getline(in, line);   // PLAN:
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        std::string trimmed = TrimAscii(line);
+        if (trimmed == "END PLAN" || trimmed == "END PLAN." || trimmed == "END_PLAN") break;
+        PlanStep step;
+        size_t actionPos = 0;
+        if (ParsePlanStepHeader(line, step, actionPos)) {
+            if (step.edit) step.editText = line.substr(actionPos) + "\n";
+            else           step.command = TrimAscii(line.substr(actionPos + 5));
+            steps.push_back(step);
+        } else if (!steps.empty() && steps.back().edit) {
+            steps.back().editText += line + "\n";
+        }
+    }
+    if (steps.empty()) { err = "the PLAN: block has no numbered EXEC:/EDIT: steps"; return false; }
+    if (steps.size() > kMaxSteps) { err = "the plan has " + std::to_string(steps.size()) + " steps; split it (at most 20)"; return false; }
+    std::unordered_set<int> seen;
+    for (size_t i = 0; i < steps.size(); i++) {
+        PlanStep& s = steps[i];
+        if (s.id <= 0 || !seen.insert(s.id).second) { err = "step numbers must be unique and positive (step " + std::to_string(s.id) + ")"; return false; }
+        if (!s.edit && s.command.empty()) { err = "step " + std::to_string(s.id) + " has an empty EXEC:"; return false; }
+        if (s.after.empty()) {
+            if (i > 0) s.after.push_back(steps[i - 1].id);   // no "after": waits for the step before it
+        } else {
+            s.after.erase(s.after.begin());                    // the explicit marker
+        }
+        for (int dep : s.after) {
+            if (!seen.count(dep) || dep == s.id) {
+                err = "step " + std::to_string(s.id) + " waits for step " + std::to_string(dep) + ", which does not come before it";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+struct PlanStats {
+    std::mutex mutex;
+    unsigned   plans = 0, steps = 0, roundTripsSaved = 0;
+};
+static PlanStats g_planStats;
+
+// Runs a parsed plan on the calling thread and returns one result covering every step. `label`
+// names it in the transcript and the feedback (saved recipes replay as plans, see "RECIPES").
+static ExecResult* RunNovaPlan(const std::vector<PlanStep>& steps, std::string cwd, const char* label = "PLAN") {
+    enum class State { Waiting, Running, Done, Failed };
+    const int kMaxParallel = 4;
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<State> state(steps.size(), State::Waiting);
+    std::vector<std::unique_ptr<ExecResult>> results(steps.size());
+    std::vector<double> startedAt(steps.size(), 0.0);
+    std::unordered_map<int, size_t> index;
+    for (size_t i = 0; i < steps.size(); i++) index[steps[i].id] = i;
+
+    char head[96];
+    sprintf_s(head, "\r\n[%s] %zu steps\r\n", label, steps.size());
+    std::string* shown = new std::string(head);
+    if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 1, (LPARAM)shown)) delete shown;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::thread> threads;
+    int running = 0, peak = 0;
+    bool failed = false;
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        for (;;) {
+            if (!failed && !AppStateManager::Instance().abortInference.load()) {
+                for (size_t i = 0; i < steps.size() && running < kMaxParallel; i++) {
+                    if (state[i] != State::Waiting) continue;
+                    bool ready = true;
+                    for (int dep : steps[i].after) ready &= state[index[dep]] == State::Done;
+                    if (!ready) continue;
+                    state[i] = State::Running;
+                    peak = (std::max)(peak, ++running);
+                    startedAt[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                    threads.emplace_back([&, i, stepCwd = cwd]() {
+                        const PlanStep& s = steps[i];
+                        ExecResult* r;
+                        if (s.edit) {
+                            r = RunNovaEdit(ParseEditBlocks(s.editText), stepCwd);
+                        } else {
+                            CommandInfo info = ClassifyCommand(s.command);
+                            DevLog("[Plan] step %d %s: %.200s\n", s.id, info.Describe().c_str(), s.command.c_str());
+                            r = RunNovaCommand(s.command, info, info.route == CommandInfo::Route::Toolchain, stepCwd);
+                        }
+                        std::lock_guard<std::mutex> g(mutex);
+                        bool ok = r->started && r->exitCode == 0 && !r->timedOut && !r->aborted && !r->outputLimit;
+                        state[i] = ok ? State::Done : State::Failed;
+                        failed |= !ok;
+                        if (ok && !r->cwd.empty()) cwd = r->cwd;   // later steps start where this one ended
+                        results[i].reset(r);
+                        running--;
+                        changed.notify_all();
+                    });
+                }
+            }
+            if (running == 0) break;
+            changed.wait(lk);
+        }
+    }
+    for (std::thread& t : threads) t.join();
+
+    // One report: a line per step, then the output of the failed step and of the others
+    ExecResult* res = new ExecResult;
+    res->started = true;
+    res->exitCode = 0;
+    res->source = label;
+    res->cwd = cwd;
+    res->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    int done = 0, failedCount = 0, notRun = 0;
+    std::string lines, failedOutput, otherOutput;
+    for (size_t i = 0; i < steps.size(); i++) {
+        const PlanStep& s = steps[i];
+        std::string what = s.edit ? TrimAscii(s.editText.substr(0, s.editText.find('\n'))) : "EXEC: " + s.command;
+        if (what.size() > 120) what = what.substr(0, 117) + "...";
+        char tag[96];
+        const ExecResult* r = results[i].get();
+        if (!r) {
+            notRun++;
+            sprintf_s(tag, "[%d] NOT RUN  ", s.id);
+            lines += tag + what + "\n";
+            continue;
+        }
+        if (state[i] == State::Done) {
+            done++;
+            sprintf_s(tag, "[%d] OK       ", s.id);
+            lines += tag + what;
+            sprintf_s(tag, " (%.1f s)\n", r->seconds);
+            lines += tag;
+            if (!r->output.empty()) {
+                std::string out = r->output.size() > 600 ? r->output.substr(0, 600) + "\n... [Truncated]\n" : r->output;
+                sprintf_s(tag, "--- step %d output ---\n", s.id);
+                otherOutput += tag + out + (out.back() == '\n' ? "" : "\n");
+            }
+        } else {
+            failedCount++;
+            if (res->exitCode == 0) {
+                res->exitCode    = r->started && r->exitCode != 0 ? r->exitCode : 1;
+                res->timedOut    = r->timedOut;
+                res->outputLimit = r->outputLimit;
+                res->aborted     = r->aborted;
+            }
+            if (!r->started) sprintf_s(tag, "[%d] FAILED   ", s.id);
+            else             sprintf_s(tag, "[%d] FAILED (exit %d) ", s.id, r->exitCode);
+            lines += tag + what + "\n";
+            sprintf_s(tag, "--- step %d output (failed) ---\n", s.id);
+            failedOutput += tag + r->output + r->error + "\n";
+        }
+    }
+    int ran = done + failedCount;
+    char summary[200];
+    sprintf_s(summary, "Plan: %zu steps — %d done, %d failed, %d not run, up to %d at once, %.1f s\n",
+              steps.size(), done, failedCount, notRun, peak, res->seconds);
+    res->output = summary + lines + failedOutput + otherOutput;
+    res->totalBytes = res->output.size();
+
+    std::lock_guard<std::mutex> lk(g_planStats.mutex);
+    g_planStats.plans++;
+    g_planStats.steps += ran;
+    g_planStats.roundTripsSaved += ran > 1 ? ran - 1 : 0;
+    DevLog("[Plan] %zu steps (%d done, %d failed, %d not run) in %.2f s, up to %d at once — %d round trips saved, %u over %u plans this session\n",
+           steps.size(), done, failedCount, notRun, res->seconds, peak, ran > 1 ? ran - 1 : 0, g_planStats.roundTripsSaved, g_planStats.plans);
+    return res;
+}
+
+void ExecuteNovaPlan(const std::string& text) {
+    AppStateManager::Instance().execRunning.store(true);
+    std::thread([text]() {
+        std::vector<PlanStep> steps;
+        std::string err;
+        ExecResult* res;
+        if (ParsePlan(text, steps, err)) {
+            res = RunNovaPlan(steps, g_currentAgentDir);
+        } else {
+            DevLog("[Plan] Not run: %s\n", err.c_str());
+            res = new ExecResult;
+            res->started = true;
+            res->exitCode = 1;
+            res->source = "PLAN";
+            res->output = "The plan was not run: " + err + ".\n";
+        }
+        if (!PostMessageW(hMainWnd, WM_EXEC_DONE, 0, (LPARAM)res)) delete res;
+    }).detach();
+}
+
+// ════════════════════════════════════════════════════════════════
+// HISTORY & PERSONALITY
+// ════════════════════════════════════════════════════════════════
+void TrimHistory() {
+    if (conversationHistory.size() <= MAX_HISTORY_CHARS) return;
+    size_t cut = conversationHistory.size() - MAX_HISTORY_CHARS;
+    size_t nl = conversationHistory.find(L'\n', cut);
+    conversationHistory = (nl != std::wstring::npos) ? conversationHistory.substr(nl + 1) : conversationHistory.substr(cut);
+}
+
+void SaveHistory() {
+    std::ofstream f(GetExeDir() + g_historyFile);
+    if (f) f << WStringToString(conversationHistory);
+}
+
+void LoadHistory() {
+    std::ifstream f(GetExeDir() + g_historyFile);
+    if (!f) return;
+    std::stringstream ss; ss << f.rdbuf();
+    std::wstring raw = StringToWString(ss.str());
+    std::wstring clean;
+    std::wstringstream wss(raw);
+    std::wstring line;
+    while (std::getline(wss, line)) {
+        if (!line.empty() && line.back() == L'\r') line.pop_back();
+        bool isRefusal = (line.find(L"Nova: I cannot") == 0 || line.find(L"Nova: I am unable") == 0 ||
+                          line.find(L"Nova: I can't") == 0 || line.find(L"Nova: Sorry, I") == 0);
+        if (isRefusal) continue;
+        clean += line + L"\n";
+    }
+    conversationHistory = clean;
+    TrimHistory();
 }
 
 std::string LoadPersonality() {
@@ -1234,441 +10448,1652 @@ std::string LoadPersonality() {
         std::stringstream ss; ss << f.rdbuf();
         basePrompt = ss.str();
     }
-    
-    // Dynamically inject the true hardware path of the user's desktop
-    basePrompt += "\n\n[SYSTEM ENVIRONMENT VARIABLES]\n";
-    basePrompt += "USER DESKTOP PATH: " + GetDesktopDir() + "\n";
-    basePrompt += "CRITICAL RULE: Always use the exact path above when saving or reading files from the desktop.\n";
-    
-    return basePrompt;
-}
+    
+    // Dynamically inject the true hardware path of the user's desktop
+    basePrompt += "\n\n[SYSTEM ENVIRONMENT VARIABLES]\n";
+    basePrompt += "USER DESKTOP PATH: " + GetDesktopDir() + "\n";
+    basePrompt += "CRITICAL RULE: Always use the exact path above when saving or reading files from the desktop.\n";
+    
+    return basePrompt;
+}
+
+void SavePersonality(const std::string& n) {
+    std::ofstream f(GetExeDir() + g_personalityFile);
+    if (f) f << n;
+}
+
+void EvolvePersonality(const std::string& current, const std::string& exchange) {
+    static int counter = 0;
+    if (++counter % 3 != 0) return;
+
+    std::string safeExchange = exchange;
+    if (safeExchange.size() > 4000) safeExchange = safeExchange.substr(0, 4000);
+
+    DevLog("[Personality] Evolution started (call #%d)\n", counter);
+    std::string p = "Current Personality:\n" + current + "\n\nRecent exchange:\n" + safeExchange
+                  + "\n\nBriefly update the personality. Keep the tone warm, encouraging, inquisitive.";
+
+    // Use the configured provider for personality evolution too
+    ProtocolType proto = g_providerPresets[g_config.provider].protocol;
+    std::string body;
+
+    if (proto == ProtocolType::LlamaLegacy) {
+        body = "{\"prompt\":\"" + PrecisionEscape(p) + "\",\"n_predict\":512,\"temperature\":0.5,\"stream\":false}";
+    } else {
+        body = "{\"model\":\"" + PrecisionEscape(g_config.model) + "\","
+               "\"messages\":[{\"role\":\"user\",\"content\":\"" + PrecisionEscape(p) + "\"}],"
+               "\"max_tokens\":512,\"temperature\":0.5,\"stream\":false}";
+    }
+
+    std::wstring host = StringToWString(g_config.host);
+    INTERNET_PORT port = (INTERNET_PORT)g_config.port;
+    std::wstring endpoint = StringToWString(g_config.endpointPath);
+    DWORD flags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE;
+    if (g_config.useSSL) flags |= INTERNET_FLAG_SECURE | INTERNET_FLAG_IGNORE_CERT_CN_INVALID | INTERNET_FLAG_IGNORE_CERT_DATE_INVALID;
+
+    HINTERNET hS = InternetOpenW(L"NovaEvolve", 1, 0, 0, 0);
+    if (!hS) return;
+    HINTERNET hC = InternetConnectW(hS, host.c_str(), port, 0, 0, 3, 0, 0);
+    if (!hC) { InternetCloseHandle(hS); return; }
+
+    HINTERNET hR = HttpOpenRequestW(hC, L"POST", endpoint.c_str(), 0, 0, 0, flags, 0);
+    if (hR) {
+        std::string headers = "Content-Type: application/json\r\n";
+        if (!g_config.apiKey.empty()) {
+            if (proto == ProtocolType::Anthropic) {
+                headers += "x-api-key: " + g_config.apiKey + "\r\nanthropic-version: 2023-06-01\r\n";
+            } else {
+                headers += "Authorization: Bearer " + g_config.apiKey + "\r\n";
+            }
+        }
+        if (HttpSendRequestA(hR, headers.c_str(), (DWORD)headers.size(), (void*)body.c_str(), (DWORD)body.size())) {
+            std::string full; char b[4096]; DWORD r;
+            while (InternetReadFile(hR, b, 4096, &r) && r > 0) full.append(b, r);
+            std::string up = ExtractReply(full, proto);
+            if (!up.empty()) { SavePersonality(up); DevLog("[Personality] Updated OK\n"); }
+        }
+        InternetCloseHandle(hR);
+    }
+    InternetCloseHandle(hC);
+    InternetCloseHandle(hS);
+}
+
+// ════════════════════════════════════════════════════════════════
+// NETWORK FETCHERS (Weather, News, Wiki)
+// ════════════════════════════════════════════════════════════════
+std::string FetchUrl(const std::string& url, const std::string& ua) {
+    std::string res;
+    HINTERNET hS = InternetOpenA(ua.c_str(), INTERNET_OPEN_TYPE_DIRECT, 0, 0, 0);
+    if (!hS) return "";
+    DWORD toConn = 10000, toRecv = 15000;
+    InternetSetOptionA(hS, INTERNET_OPTION_CONNECT_TIMEOUT, &toConn, sizeof(toConn));
+    InternetSetOptionA(hS, INTERNET_OPTION_RECEIVE_TIMEOUT, &toRecv, sizeof(toRecv));
+    HINTERNET hU = InternetOpenUrlA(hS, url.c_str(), 0, 0, INTERNET_FLAG_RELOAD, 0);
+    if (hU) {
+        char buf[8192]; DWORD bR;
+        while (InternetReadFile(hU, buf, sizeof(buf)-1, &bR) && bR > 0) { buf[bR] = 0; res.append(buf, bR); }
+        InternetCloseHandle(hU);
+    }
+    InternetCloseHandle(hS);
+    return res;
+}
+
+std::string FetchWeather(const std::string& loc) { return FetchUrl("https://wttr.in/" + UrlEncode(loc) + "?format=3", "curl"); }
+
+std::string FetchNews(const std::string&) {
+    std::string rss = FetchUrl("https://feeds.bbci.co.uk/news/world/rss.xml");
+    std::string h; size_t p = 0; int c = 0;
+    while (c < 5) {
+        p = rss.find("<title>", p); if (p == std::string::npos) break; p += 7;
+        size_t e = rss.find("</title>", p); if (e == std::string::npos) break;
+        std::string t = rss.substr(p, e - p);
+        // Strip CDATA wrapper
+        if (t.rfind("<![CDATA[", 0) == 0) t = t.substr(9);
+        if (t.size() >= 3 && t.substr(t.size() - 3) == "]]>") t = t.substr(0, t.size() - 3);
+        if (t.find("BBC") == std::string::npos && !t.empty()) { h += "* " + t + "\n"; c++; }
+        p = e + 1;
+    }
+    return h;
+}
+
+std::string FetchWiki(const std::string& q) {
+    return DecodeJsonString(FetchUrl("https://en.wikipedia.org/api/rest_v1/page/summary/" + UrlEncode(q)), "extract");
+}
+
+std::string AnalyzeAndFetch(const std::string& lower, const std::string& orig) {
+    if (lower.find("weather") != std::string::npos) {
+        // Extract location: look for "weather in X", "weather for X", or fall back to "weather X"
+        std::string loc;
+        for (const char* prefix : { "weather in ", "weather for ", "weather at ", "weather " }) {
+            size_t p = lower.find(prefix);
+            if (p != std::string::npos) {
+                loc = orig.substr(p + strlen(prefix));
+                // Trim trailing punctuation/whitespace
+                while (!loc.empty() && (loc.back() == '?' || loc.back() == '.' || loc.back() == ' '))
+                    loc.pop_back();
+                break;
+            }
+        }
+        if (loc.empty()) loc = "auto"; // wttr.in auto-detects from IP
+        return "Weather: " + FetchWeather(loc);
+    }
+    if (lower.find("news") != std::string::npos) return "World News:\n" + FetchNews(orig);
+    if ((lower.find("who is") != std::string::npos || lower.find("what is") != std::string::npos) && orig.size() < 60)
+        return "Wiki: " + FetchWiki(orig);
+    return "";
+}
+
+// ════════════════════════════════════════════════════════════════
+// SPEECH
+// ════════════════════════════════════════════════════════════════
+void SpeakAsync(const std::wstring& text) {
+    if (g_muted || text.empty()) return;
+    std::lock_guard<std::mutex> lk(g_voiceMutex);
+    if (g_pVoice) g_pVoice->Speak(text.c_str(), SPF_ASYNC | SPF_PURGEBEFORESPEAK, nullptr);
+}
+
+// ════════════════════════════════════════════════════════════════
+// RICH TEXT
+// ════════════════════════════════════════════════════════════════
+void AppendRichText(HWND hRich, const std::wstring& text, bool bBold, COLORREF color) {
+    CHARFORMAT2W cf = {};
+    cf.cbSize      = sizeof(cf);
+    cf.dwMask      = CFM_BOLD | CFM_FACE | CFM_SIZE | CFM_COLOR;
+    cf.dwEffects   = bBold ? CFE_BOLD : 0;
+    cf.yHeight     = 320;
+    cf.crTextColor = color;
+    wcscpy_s(cf.szFaceName, L"Times New Roman");
+    SendMessageW(hRich, EM_SETSEL, (WPARAM)-1, (LPARAM)-1);
+    SendMessageW(hRich, EM_SETCHARFORMAT, SCF_SELECTION, (LPARAM)&cf);
+    SendMessageW(hRich, EM_REPLACESEL, 0, (LPARAM)text.c_str());
+    SendMessageW(hRich, WM_VSCROLL, SB_BOTTOM, 0);
+}
+
+// ════════════════════════════════════════════════════════════════
+// UNIFIED AI REQUEST BUILDER & SENDER
+// ════════════════════════════════════════════════════════════════
+
+// Append image parts in the provider's wire format, base64-encoding straight into the body
+static void AppendImageParts(std::string& arr, const std::vector<ImagePayload>& images, ProtocolType proto) {
+    for (const auto& img : images) {
+        if (proto == ProtocolType::Anthropic) {
+            arr += "{\"type\":\"image\",\"source\":{\"type\":\"base64\",\"media_type\":\"" + img.mime + "\",\"data\":\"";
+            Base64EncodeInto(arr, img.bytes.data(), img.bytes.size());
+            arr += "\"}},";
+        } else if (proto == ProtocolType::Gemini) {
+            arr += "{\"inline_data\":{\"mime_type\":\"" + img.mime + "\",\"data\":\"";
+            Base64EncodeInto(arr, img.bytes.data(), img.bytes.size());
+            arr += "\"}},";
+        } else {
+            arr += "{\"type\":\"image_url\",\"image_url\":{\"url\":\"data:" + img.mime + ";base64,";
+            Base64EncodeInto(arr, img.bytes.data(), img.bytes.size());
+            arr += "\"}},";
+        }
+    }
+}
+
+static size_t EncodedImageBytes(const std::vector<ImagePayload>& images) {
+    size_t n = 0;
+    for (const auto& img : images) n += ((img.bytes.size() + 2) / 3) * 4 + 128;
+    return n;
+}
+
+// Build chat history as JSON message array for OpenAI/Anthropic/Gemini
+static std::string BuildChatMessages(const std::string& snapshot, const std::string& userPrompt, ProtocolType proto,
+                                     const std::vector<ImagePayload>& images) {
+    // Parse history into user/assistant turns
+    struct Turn { std::string role; std::string content; };
+    std::vector<Turn> turns;
+
+    std::istringstream hs(snapshot);
+    std::string line;
+    std::string currentRole, currentContent;
+
+    auto flush = [&]() {
+        if (!currentContent.empty()) {
+            if (!currentContent.empty() && currentContent.back() == '\n') currentContent.pop_back();
+            turns.push_back({ currentRole, currentContent });
+            currentContent.clear();
+        }
+    };
+
+    while (std::getline(hs, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.rfind("User: ", 0) == 0) { flush(); currentRole = "user"; currentContent = line.substr(6) + "\n"; }
+        else if (line.rfind("Nova: ", 0) == 0) { flush(); currentRole = "assistant"; currentContent = line.substr(6) + "\n"; }
+        else if (line.rfind("[System]: ", 0) == 0) { flush(); currentRole = "user"; currentContent = "[Command Output] " + line.substr(10) + "\n"; }
+        else if (!currentRole.empty()) currentContent += line + "\n";
+    }
+    flush();
 
-void SavePersonality(const std::string& n) {
-    std::ofstream f(GetExeDir() + g_personalityFile);
-    if (f) f << n;
+    // Add current user message
+    turns.push_back({ "user", userPrompt });
+
+    // Anthropic requires: first message = "user", alternating roles, no consecutive same-role.
+    // Merge consecutive same-role messages.
+    if (proto == ProtocolType::Anthropic || proto == ProtocolType::OpenAICompat) {
+        std::vector<Turn> merged;
+        for (auto& t : turns) {
+            if (!merged.empty() && merged.back().role == t.role) {
+                merged.back().content += "\n" + t.content;
+            } else {
+                merged.push_back(t);
+            }
+        }
+        // Anthropic: first message must be "user"
+        if (proto == ProtocolType::Anthropic && !merged.empty() && merged.front().role != "user") {
+            merged.insert(merged.begin(), { "user", "[conversation history]" });
+        }
+        turns = std::move(merged);
+    }
+
+    // Build JSON array — images ride on the final user turn as multi-part content
+    std::string arr;
+    arr.reserve(snapshot.size() + userPrompt.size() + EncodedImageBytes(images) + 256);
+    if (proto == ProtocolType::Gemini) {
+        // Gemini uses "contents" with "role" = "user"/"model"
+        arr = "[";
+        for (size_t i = 0; i < turns.size(); i++) {
+            std::string gRole = (turns[i].role == "assistant") ? "model" : "user";
+            if (i > 0) arr += ",";
+            arr += "{\"role\":\"" + gRole + "\",\"parts\":[";
+            if (i + 1 == turns.size()) AppendImageParts(arr, images, proto);
+            arr += "{\"text\":\"" + PrecisionEscape(turns[i].content) + "\"}]}";
+        }
+        arr += "]";
+    } else {
+        // OpenAI / Anthropic format
+        arr = "[";
+        for (size_t i = 0; i < turns.size(); i++) {
+            if (i > 0) arr += ",";
+            if (i + 1 == turns.size() && !images.empty()) {
+                arr += "{\"role\":\"" + turns[i].role + "\",\"content\":[";
+                AppendImageParts(arr, images, proto);
+                arr += "{\"type\":\"text\",\"text\":\"" + PrecisionEscape(turns[i].content) + "\"}]}";
+            } else {
+                arr += "{\"role\":\"" + turns[i].role + "\",\"content\":\"" + PrecisionEscape(turns[i].content) + "\"}";
+            }
+        }
+        arr += "]";
+    }
+    return arr;
 }
 
-void EvolvePersonality(const std::string& current, const std::string& exchange) {
-    static int counter = 0;
-    if (++counter % 3 != 0) return;
+// Build the full HTTP request body for the configured provider. `tools` is extra top-level members
+// (tool declarations) and `toolTurns` the tool-call turns after the user message (see "Plugin tools");
+// the chat protocols only.
+static std::string BuildRequestBody(const std::string& sysPrompt, const std::string& snapshot,
+                                     const std::string& userPrompt, ProtocolType proto,
+                                     const std::vector<ImagePayload>& images = {},
+                                     const std::string& tools = "", const std::string& toolTurns = "")
+{
+    switch (proto) {
+    case ProtocolType::LlamaLegacy: {
+        // llama-server /completion with Llama-3 chat template
+        std::string formattedHistory;
+        {
+            std::istringstream hs(snapshot);
+            std::string line, curRole, curContent;
+            auto flush = [&]() {
+                if (!curContent.empty()) {
+                    if (curContent.back() == '\n') curContent.pop_back();
+                    std::string rid = (curRole == "user") ? "user" : "assistant";
+                    formattedHistory += "<|start_header_id|>" + rid + "<|end_header_id|>\n\n" + curContent + "<|eot_id|>";
+                    curContent.clear();
+                }
+            };
+            while (std::getline(hs, line)) {
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.rfind("User: ", 0) == 0)       { flush(); curRole = "user"; curContent = line.substr(6) + "\n"; }
+                else if (line.rfind("Nova: ", 0) == 0)   { flush(); curRole = "assistant"; curContent = line.substr(6) + "\n"; }
+                else if (line.rfind("[System]: ", 0) == 0) { flush(); curRole = "user"; curContent = "[Command Output] " + line.substr(10) + "\n"; }
+                else if (!curRole.empty()) curContent += line + "\n";
+            }
+            flush();
+        }
 
-    std::string safeExchange = exchange;
-    if (safeExchange.size() > 4000) safeExchange = safeExchange.substr(0, 4000);
+        std::string fewShot =
+            "<|start_header_id|>user<|end_header_id|>\n\ncreate a new folder on the desktop<|eot_id|>"
+            "<|start_header_id|>assistant<|end_header_id|>\n\nEXEC: cmd /c mkdir \"%USERPROFILE%\\Desktop\\NewNovaFolder\"<|eot_id|>"
+            "<|start_header_id|>user<|end_header_id|>\n\nthanks!<|eot_id|>"
+            "<|start_header_id|>assistant<|end_header_id|>\n\ndone.<|eot_id|>";
 
-    DevLog("[Personality] Evolution started (call #%d)\n", counter);
-    std::string p = "Current Personality:\n" + current + "\n\nRecent exchange:\n" + safeExchange
-                  + "\n\nBriefly update the personality. Keep the tone warm, encouraging, inquisitive.";
+        // llama-server multimodal: [img-N] markers in the prompt reference image_data ids
+        std::string imgRefs, imageData;
+        if (!images.empty()) {
+            imageData.reserve(EncodedImageBytes(images) + 32);
+            imageData = ",\"image_data\":[";
+            for (size_t i = 0; i < images.size(); i++) {
+                std::string id = std::to_string(10 + i);
+                imgRefs += "[img-" + id + "]";
+                if (i > 0) imageData += ",";
+                imageData += "{\"data\":\"";
+                Base64EncodeInto(imageData, images[i].bytes.data(), images[i].bytes.size());
+                imageData += "\",\"id\":" + id + "}";
+            }
+            imageData += "]";
+            imgRefs += "\n";
+        }
 
-    // Use the configured provider for personality evolution too
-    ProtocolType proto = g_providerPresets[g_config.provider].protocol;
-    std::string body;
+        std::string fullPrompt = "<|begin_of_text|><|start_header_id|>system<|end_header_id|>\n\n"
+                               + sysPrompt + "<|eot_id|>"
+                               + fewShot + formattedHistory
+                               + "<|start_header_id|>user<|end_header_id|>\n\n"
+                               + imgRefs + userPrompt + "<|eot_id|>"
+                               + "<|start_header_id|>assistant<|end_header_id|>\n\n";
 
-    if (proto == ProtocolType::LlamaLegacy) {
-        body = "{\"prompt\":\"" + PrecisionEscape(p) + "\",\"n_predict\":512,\"temperature\":0.5,\"stream\":false}";
-    } else {
-        body = "{\"model\":\"" + PrecisionEscape(g_config.model) + "\","
-               "\"messages\":[{\"role\":\"user\",\"content\":\"" + PrecisionEscape(p) + "\"}],"
-               "\"max_tokens\":512,\"temperature\":0.5,\"stream\":false}";
+        return "{\"prompt\":\"" + PrecisionEscape(fullPrompt) + "\","
+               "\"n_predict\":" + std::to_string(g_config.maxTokens) + ","
+               "\"temperature\":" + std::to_string(g_config.temperature) + ","
+               "\"stream\":false,\"special\":true,"
+               "\"stop\":[\"<|eot_id|>\",\"User:\",\"Nova:\"]" + imageData + "}";
+    }
+
+    case ProtocolType::OpenAICompat: {
+        std::string messages = BuildChatMessages(snapshot, userPrompt, proto, images);
+        if (!toolTurns.empty()) messages.insert(messages.size() - 1, "," + toolTurns);
+        // Insert system message at front
+        std::string sysMsg = "{\"role\":\"system\",\"content\":\"" + PrecisionEscape(sysPrompt) + "\"}";
+        // Replace leading [ with [sysMsg,
+        if (messages.size() > 1) messages = "[" + sysMsg + "," + messages.substr(1);
+        else messages = "[" + sysMsg + "]";
+
+        return "{\"model\":\"" + PrecisionEscape(g_config.model) + "\","
+               "\"messages\":" + messages + ","
+               "\"temperature\":" + std::to_string(g_config.temperature) + ","
+               "\"max_tokens\":" + std::to_string(g_config.maxTokens) + ","
+               "\"stream\":false" + tools + "}";
+    }
+
+    case ProtocolType::Anthropic: {
+        std::string messages = BuildChatMessages(snapshot, userPrompt, proto, images);
+        if (!toolTurns.empty()) messages.insert(messages.size() - 1, "," + toolTurns);
+        return "{\"model\":\"" + PrecisionEscape(g_config.model) + "\","
+               "\"system\":\"" + PrecisionEscape(sysPrompt) + "\","
+               "\"messages\":" + messages + ","
+               "\"max_tokens\":" + std::to_string(g_config.maxTokens) + ","
+               "\"temperature\":" + std::to_string(g_config.temperature) + ","
+               "\"stream\":false" + tools + "}";
+    }
+
+    case ProtocolType::Gemini: {
+        std::string contents = BuildChatMessages(snapshot, userPrompt, proto, images);
+        if (!toolTurns.empty()) contents.insert(contents.size() - 1, "," + toolTurns);
+        return "{\"contents\":" + contents + ","
+               "\"systemInstruction\":{\"parts\":[{\"text\":\"" + PrecisionEscape(sysPrompt) + "\"}]},"
+               "\"generationConfig\":{\"temperature\":" + std::to_string(g_config.temperature) + ","
+               "\"maxOutputTokens\":" + std::to_string(g_config.maxTokens) + "}" + tools + "}";
+    }
+    }
+    return "{}";
+}
+
+// Extract the assistant's reply text from the provider's JSON response
+static std::string ExtractReply(const std::string& raw, ProtocolType proto) {
+    switch (proto) {
+    case ProtocolType::LlamaLegacy:
+        return DecodeJsonString(raw, "content");
+    case ProtocolType::OpenAICompat: {
+        size_t msgPos = raw.find("\"message\"");
+        if (msgPos != std::string::npos) {
+            std::string sub = raw.substr(msgPos);
+            return DecodeJsonString(sub, "content");
+        }
+        return DecodeJsonString(raw, "content");
+    }
+    case ProtocolType::Anthropic: {
+        size_t cPos = raw.find("\"content\"");
+        if (cPos != std::string::npos) {
+            std::string sub = raw.substr(cPos);
+            size_t tPos = sub.find("\"text\"");
+            if (tPos != std::string::npos) {
+                size_t second = sub.find("\"text\"", tPos + 6);
+                if (second != std::string::npos) {
+                    std::string sub2 = sub.substr(second);
+                    return DecodeJsonString("{" + sub2 + "}", "text");
+                }
+            }
+            return DecodeJsonString(sub, "text");
+        }
+        return "";
+    }
+    case ProtocolType::Gemini:
+        return DecodeJsonString(raw, "text");
     }
+    return "";
+}
 
+// Send request to the configured provider and return reply (`path` replaces the endpoint path)
+static std::string SendToProvider(const std::string& body, const std::string& path = "") {
     std::wstring host = StringToWString(g_config.host);
     INTERNET_PORT port = (INTERNET_PORT)g_config.port;
-    std::wstring endpoint = StringToWString(g_config.endpointPath);
+    ProtocolType proto = g_providerPresets[g_config.provider].protocol;
+
+    // Build endpoint — Gemini needs model name and API key in URL
+    std::string ep = path.empty() ? g_config.endpointPath : path;
+    if (proto == ProtocolType::Gemini) {
+        ep = "/v1beta/models/" + g_config.model + ":generateContent?key=" + g_config.apiKey;
+    }
+    std::wstring endpoint = StringToWString(ep);
+
     DWORD flags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE;
     if (g_config.useSSL) flags |= INTERNET_FLAG_SECURE | INTERNET_FLAG_IGNORE_CERT_CN_INVALID | INTERNET_FLAG_IGNORE_CERT_DATE_INVALID;
 
-    HINTERNET hS = InternetOpenW(L"NovaEvolve", 1, 0, 0, 0);
-    if (!hS) return;
+    HINTERNET hS = InternetOpenW(L"NovaAI/2.0", 1, 0, 0, 0);
+    if (!hS) { DevLog("[Provider] ERROR: InternetOpen failed\n"); return ""; }
+
+    DWORD toConn = 15000, toRecv = 180000;
+    InternetSetOptionW(hS, INTERNET_OPTION_CONNECT_TIMEOUT, &toConn, sizeof(toConn));
+    InternetSetOptionW(hS, INTERNET_OPTION_RECEIVE_TIMEOUT, &toRecv, sizeof(toRecv));
+    InternetSetOptionW(hS, INTERNET_OPTION_SEND_TIMEOUT,    &toRecv, sizeof(toRecv));
+
     HINTERNET hC = InternetConnectW(hS, host.c_str(), port, 0, 0, 3, 0, 0);
-    if (!hC) { InternetCloseHandle(hS); return; }
+    if (!hC) {
+        DevLog("[Provider] ERROR: Cannot connect to %s:%d GLE=%lu\n", g_config.host.c_str(), port, GetLastError());
+        InternetCloseHandle(hS); return "";
+    }
 
     HINTERNET hR = HttpOpenRequestW(hC, L"POST", endpoint.c_str(), 0, 0, 0, flags, 0);
+    std::string result;
+
     if (hR) {
+        // Build headers based on provider
         std::string headers = "Content-Type: application/json\r\n";
-        if (!g_config.apiKey.empty()) {
+        if (!g_config.apiKey.empty() && proto != ProtocolType::Gemini) { // Gemini uses URL key
             if (proto == ProtocolType::Anthropic) {
-                headers += "x-api-key: " + g_config.apiKey + "\r\nanthropic-version: 2023-06-01\r\n";
+                headers += "x-api-key: " + g_config.apiKey + "\r\n";
+                headers += "anthropic-version: 2023-06-01\r\n";
             } else {
                 headers += "Authorization: Bearer " + g_config.apiKey + "\r\n";
             }
         }
+
+        DevLog("[Provider] Sending %zu bytes to %s:%d%s\n", body.size(), g_config.host.c_str(), port, ep.c_str());
+
         if (HttpSendRequestA(hR, headers.c_str(), (DWORD)headers.size(), (void*)body.c_str(), (DWORD)body.size())) {
-            std::string full; char b[4096]; DWORD r;
-            while (InternetReadFile(hR, b, 4096, &r) && r > 0) full.append(b, r);
-            std::string up = ExtractReply(full, proto);
-            if (!up.empty()) { SavePersonality(up); DevLog("[Personality] Updated OK\n"); }
+            // Log HTTP status code for debugging
+            DWORD statusCode = 0, szStatus = sizeof(statusCode);
+            HttpQueryInfoA(hR, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &statusCode, &szStatus, nullptr);
+            
+            char buf[8192]; DWORD r;
+            while (InternetReadFile(hR, buf, 8192, &r) && r > 0) {
+                // THE HARDWARE KILL-SWITCH CHECK
+                if (AppStateManager::Instance().abortInference.load()) {
+                    DevLog("[Network] Abort signal detected. Severing socket.\n");
+                    break; 
+                }
+                result.append(buf, r);
+            }
+            // Add a visual indicator to the response if aborted
+            if (AppStateManager::Instance().abortInference.load()) {
+                result += "\n\n[System: Generation aborted by user.]";
+            }
+            
+            DevLog("[Provider] HTTP %lu — %zu bytes received\n", statusCode, result.size());
+        }
+        InternetCloseHandle(hR);
+    }
+    InternetCloseHandle(hC);
+    InternetCloseHandle(hS);
+    return result;
+}
+
+// ── Plugin tools (native function calling) ──
+// Plugin DLLs in plugins\ next to the exe (GetToolSchema/ExecuteTool) are declared to the model as
+// tools in each protocol's own format: OpenAI "tools", Anthropic "tools" with input_schema, Gemini
+// functionDeclarations. While plugins are loaded, llama-server is asked through its OpenAI-compatible
+// endpoint (it is started with --jinja so its chat template handles tools). A reply that calls
+// tools is answered in-process: the calls run at the same time and every result goes back in one
+// follow-up request, so a lookup takes one model round trip instead of an EXEC feedback cycle.
+// A plugin schema is {"name", "description", "parameters"}; "input_schema" is read as "parameters".
+
+// Just enough JSON to walk provider replies: offsets into the text, no tree
+static size_t JsonSkipSpace(const std::string& s, size_t p) {
+    while (p < s.size() && isspace((unsigned char)s[p])) p++;
+    return p;
+}
+
+// One past the end of the value that starts at p, npos if it is malformed
+static size_t JsonValueEnd(const std::string& s, size_t p) {
+    p = JsonSkipSpace(s, p);
+    if (p >= s.size()) return std::string::npos;
+    if (s[p] == '"') {
+        for (p++; p < s.size(); p++) {
+            if (s[p] == '\\') p++;
+            else if (s[p] == '"') return p + 1;
+        }
+        return std::string::npos;
+    }
+    if (s[p] == '{' || s[p] == '[') {
+        int depth = 0;
+        for (; p < s.size(); p++) {
+            char c = s[p];
+            if (c == '"') {
+                p = JsonValueEnd(s, p);
+                if (p == std::string::npos) return p;
+                p--;
+            } else if (c == '{' || c == '[') {
+                depth++;
+            } else if ((c == '}' || c == ']') && --depth == 0) {
+                return p + 1;
+            }
+        }
+        return std::string::npos;
+    }
+    while (p < s.size() && !strchr(",}] \t\r\n", s[p])) p++;   // number, true, false, null
+    return p;
+}
+
+static std::string JsonRaw(const std::string& s, size_t p) {
+    if (p == std::string::npos) return "";
+    p = JsonSkipSpace(s, p);
+    size_t end = JsonValueEnd(s, p);
+    return end == std::string::npos ? "" : s.substr(p, end - p);
+}
+
+// A string value decoded; other values as written
+static std::string JsonText(const std::string& s, size_t p) {
+    std::string raw = JsonRaw(s, p);
+    if (raw.empty() || raw[0] != '"') return raw == "null" ? "" : raw;
+    return DecodeJsonString("{\"v\":" + raw + "}", "v");
+}
+
+// Offsets of the elements of an array, or of the values of an object (with their keys)
+static std::vector<size_t> JsonItems(const std::string& s, size_t p, std::vector<std::string>* keys = nullptr) {
+    std::vector<size_t> items;
+    if (p == std::string::npos) return items;
+    p = JsonSkipSpace(s, p);
+    if (p >= s.size() || (s[p] != '[' && s[p] != '{')) return items;
+    bool object = s[p] == '{';
+    for (p = JsonSkipSpace(s, p + 1); p < s.size() && s[p] != ']' && s[p] != '}';) {
+        if (object) {
+            size_t keyEnd = JsonValueEnd(s, p);
+            if (s[p] != '"' || keyEnd == std::string::npos) break;
+            if (keys) keys->push_back(JsonText(s, p));
+            p = JsonSkipSpace(s, keyEnd);
+            if (p >= s.size() || s[p] != ':') break;
+            p = JsonSkipSpace(s, p + 1);
         }
-        InternetCloseHandle(hR);
+        size_t end = JsonValueEnd(s, p);
+        if (end == std::string::npos) break;
+        items.push_back(p);
+        p = JsonSkipSpace(s, end);
+        if (p < s.size() && s[p] == ',') p = JsonSkipSpace(s, p + 1);
     }
-    InternetCloseHandle(hC);
-    InternetCloseHandle(hS);
+    return items;
 }
 
-// ════════════════════════════════════════════════════════════════
-// NETWORK FETCHERS (Weather, News, Wiki)
-// ════════════════════════════════════════════════════════════════
-std::string FetchUrl(const std::string& url, const std::string& ua) {
-    std::string res;
-    HINTERNET hS = InternetOpenA(ua.c_str(), INTERNET_OPEN_TYPE_DIRECT, 0, 0, 0);
-    if (!hS) return "";
-    DWORD toConn = 10000, toRecv = 15000;
-    InternetSetOptionA(hS, INTERNET_OPTION_CONNECT_TIMEOUT, &toConn, sizeof(toConn));
-    InternetSetOptionA(hS, INTERNET_OPTION_RECEIVE_TIMEOUT, &toRecv, sizeof(toRecv));
-    HINTERNET hU = InternetOpenUrlA(hS, url.c_str(), 0, 0, INTERNET_FLAG_RELOAD, 0);
-    if (hU) {
-        char buf[8192]; DWORD bR;
-        while (InternetReadFile(hU, buf, sizeof(buf)-1, &bR) && bR > 0) { buf[bR] = 0; res.append(buf, bR); }
-        InternetCloseHandle(hU);
+// The value at `path` below the one at p: member names, or element numbers for arrays
+static size_t JsonGet(const std::string& s, size_t p, std::initializer_list<const char*> path) {
+    for (const char* step : path) {
+        if (p == std::string::npos) return p;
+        p = JsonSkipSpace(s, p);
+        if (p >= s.size()) return std::string::npos;
+        std::vector<std::string> keys;
+        std::vector<size_t> items = JsonItems(s, p, s[p] == '{' ? &keys : nullptr);
+        size_t next = std::string::npos;
+        if (s[p] == '[') {
+            size_t i = (size_t)atoi(step);
+            if (i < items.size()) next = items[i];
+        } else {
+            for (size_t i = 0; i < keys.size() && i < items.size(); i++)
+                if (keys[i] == step) { next = items[i]; break; }
+        }
+        p = next;
     }
-    InternetCloseHandle(hS);
-    return res;
+    return p;
 }
 
-std::string FetchWeather(const std::string& loc) { return FetchUrl("https://wttr.in/" + UrlEncode(loc) + "?format=3", "curl"); }
+struct ToolCall {
+    std::string id, name, args;    // args: a JSON object
+    std::string result;
+    double seconds = 0;
+};
 
-std::string FetchNews(const std::string&) {
-    std::string rss = FetchUrl("https://feeds.bbci.co.uk/news/world/rss.xml");
-    std::string h; size_t p = 0; int c = 0;
-    while (c < 5) {
-        p = rss.find("<title>", p); if (p == std::string::npos) break; p += 7;
-        size_t e = rss.find("</title>", p); if (e == std::string::npos) break;
-        std::string t = rss.substr(p, e - p);
-        // Strip CDATA wrapper
-        if (t.rfind("<![CDATA[", 0) == 0) t = t.substr(9);
-        if (t.size() >= 3 && t.substr(t.size() - 3) == "]]>") t = t.substr(0, t.size() - 3);
-        if (t.find("BBC") == std::string::npos && !t.empty()) { h += "* " + t + "\n"; c++; }
-        p = e + 1;
+// Top-level request members declaring the loaded plugins, in the protocol's format ("" if none)
+static std::string ToolDeclarations(ProtocolType proto) {
+    std::string list;
+    for (const std::string& schema : AppStateManager::Instance().GetPluginManager().Schemas()) {
+        std::string name = JsonText(schema, JsonGet(schema, 0, { "name" }));
+        std::string desc = JsonText(schema, JsonGet(schema, 0, { "description" }));
+        std::string params = JsonRaw(schema, JsonGet(schema, 0, { "parameters" }));
+        if (params.empty()) params = JsonRaw(schema, JsonGet(schema, 0, { "input_schema" }));
+        if (params.empty() || params[0] != '{') params = "{\"type\":\"object\",\"properties\":{}}";
+        std::string head = "\"name\":\"" + name + "\",\"description\":\"" + PrecisionEscape(desc) + "\",";
+        if (!list.empty()) list += ",";
+        if (proto == ProtocolType::Anthropic)   list += "{" + head + "\"input_schema\":" + params + "}";
+        else if (proto == ProtocolType::Gemini) list += "{" + head + "\"parameters\":" + params + "}";
+        else                                    list += "{\"type\":\"function\",\"function\":{" + head + "\"parameters\":" + params + "}}";
     }
-    return h;
+    if (list.empty()) return "";
+    if (proto == ProtocolType::Gemini) return ",\"tools\":[{\"functionDeclarations\":[" + list + "]}]";
+    return ",\"tools\":[" + list + "]";
 }
 
-std::string FetchWiki(const std::string& q) {
-    return DecodeJsonString(FetchUrl("https://en.wikipedia.org/api/rest_v1/page/summary/" + UrlEncode(q)), "extract");
+// Added to the declarations for the last follow-up: the model must answer in text now
+static std::string NoMoreToolCalls(ProtocolType proto) {
+    if (proto == ProtocolType::Anthropic) return ",\"tool_choice\":{\"type\":\"none\"}";
+    if (proto == ProtocolType::Gemini)    return ",\"toolConfig\":{\"functionCallingConfig\":{\"mode\":\"NONE\"}}";
+    return ",\"tool_choice\":\"none\"";
 }
 
-std::string AnalyzeAndFetch(const std::string& lower, const std::string& orig) {
-    if (lower.find("weather") != std::string::npos) {
-        // Extract location: look for "weather in X", "weather for X", or fall back to "weather X"
-        std::string loc;
-        for (const char* prefix : { "weather in ", "weather for ", "weather at ", "weather " }) {
-            size_t p = lower.find(prefix);
-            if (p != std::string::npos) {
-                loc = orig.substr(p + strlen(prefix));
-                // Trim trailing punctuation/whitespace
-                while (!loc.empty() && (loc.back() == '?' || loc.back() == '.' || loc.back() == ' '))
-                    loc.pop_back();
-                break;
-            }
+// The tool calls in a reply, and the assistant turn that made them (sent back ahead of the results)
+static std::vector<ToolCall> ExtractToolCalls(const std::string& raw, ProtocolType proto, std::string& turn) {
+    std::vector<ToolCall> calls;
+    if (proto == ProtocolType::Anthropic) {
+        size_t content = JsonGet(raw, 0, { "content" });
+        for (size_t p : JsonItems(raw, content)) {
+            if (JsonText(raw, JsonGet(raw, p, { "type" })) != "tool_use") continue;
+            calls.push_back({ JsonText(raw, JsonGet(raw, p, { "id" })), JsonText(raw, JsonGet(raw, p, { "name" })),
+                              JsonRaw(raw, JsonGet(raw, p, { "input" })) });
         }
-        if (loc.empty()) loc = "auto"; // wttr.in auto-detects from IP
-        return "Weather: " + FetchWeather(loc);
+        if (!calls.empty()) turn = "{\"role\":\"assistant\",\"content\":" + JsonRaw(raw, content) + "}";
+    } else if (proto == ProtocolType::Gemini) {
+        size_t parts = JsonGet(raw, 0, { "candidates", "0", "content", "parts" });
+        for (size_t p : JsonItems(raw, parts)) {
+            size_t call = JsonGet(raw, p, { "functionCall" });
+            if (call == std::string::npos) continue;
+            std::string name = JsonText(raw, JsonGet(raw, call, { "name" }));
+            calls.push_back({ name, name, JsonRaw(raw, JsonGet(raw, call, { "args" })) });
+        }
+        if (!calls.empty()) turn = "{\"role\":\"model\",\"parts\":" + JsonRaw(raw, parts) + "}";
+    } else {
+        size_t list = JsonGet(raw, 0, { "choices", "0", "message", "tool_calls" });
+        for (size_t p : JsonItems(raw, list)) {
+            size_t args = JsonGet(raw, p, { "function", "arguments" });
+            calls.push_back({ JsonText(raw, JsonGet(raw, p, { "id" })), JsonText(raw, JsonGet(raw, p, { "function", "name" })),
+                              JsonText(raw, args) });   // a string holding the object (an object from some servers)
+        }
+        if (!calls.empty()) turn = "{\"role\":\"assistant\",\"content\":null,\"tool_calls\":" + JsonRaw(raw, list) + "}";
     }
-    if (lower.find("news") != std::string::npos) return "World News:\n" + FetchNews(orig);
-    if ((lower.find("who is") != std::string::npos || lower.find("what is") != std::string::npos) && orig.size() < 60)
-        return "Wiki: " + FetchWiki(orig);
-    return "";
+    for (ToolCall& c : calls) if (TrimAscii(c.args).empty()) c.args = "{}";
+    return calls;
 }
 
-// ════════════════════════════════════════════════════════════════
-// SPEECH
-// ════════════════════════════════════════════════════════════════
-void SpeakAsync(const std::wstring& text) {
-    if (g_muted || text.empty()) return;
-    std::lock_guard<std::mutex> lk(g_voiceMutex);
-    if (g_pVoice) g_pVoice->Speak(text.c_str(), SPF_ASYNC | SPF_PURGEBEFORESPEAK, nullptr);
+// The turn(s) answering `calls`, in the protocol's format
+static std::string ToolResultsTurn(const std::vector<ToolCall>& calls, ProtocolType proto) {
+    std::string out;
+    for (const ToolCall& c : calls) {
+        std::string text = PrecisionEscape(c.result);
+        if (!out.empty()) out += ",";
+        if (proto == ProtocolType::Anthropic)
+            out += "{\"type\":\"tool_result\",\"tool_use_id\":\"" + PrecisionEscape(c.id) + "\",\"content\":\"" + text + "\"}";
+        else if (proto == ProtocolType::Gemini)
+            out += "{\"functionResponse\":{\"name\":\"" + PrecisionEscape(c.name) + "\",\"response\":{\"result\":\"" + text + "\"}}}";
+        else
+            out += "{\"role\":\"tool\",\"tool_call_id\":\"" + PrecisionEscape(c.id) + "\",\"content\":\"" + text + "\"}";
+    }
+    if (proto == ProtocolType::Anthropic) return "{\"role\":\"user\",\"content\":[" + out + "]}";
+    if (proto == ProtocolType::Gemini)    return "{\"role\":\"user\",\"parts\":[" + out + "]}";
+    return out;
 }
 
-// ════════════════════════════════════════════════════════════════
-// RICH TEXT
-// ════════════════════════════════════════════════════════════════
-void AppendRichText(HWND hRich, const std::wstring& text, bool bBold, COLORREF color) {
-    CHARFORMAT2W cf = {};
-    cf.cbSize      = sizeof(cf);
-    cf.dwMask      = CFM_BOLD | CFM_FACE | CFM_SIZE | CFM_COLOR;
-    cf.dwEffects   = bBold ? CFE_BOLD : 0;
-    cf.yHeight     = 320;
-    cf.crTextColor = color;
-    wcscpy_s(cf.szFaceName, L"Times New Roman");
-    SendMessageW(hRich, EM_SETSEL, (WPARAM)-1, (LPARAM)-1);
-    SendMessageW(hRich, EM_SETCHARFORMAT, SCF_SELECTION, (LPARAM)&cf);
-    SendMessageW(hRich, EM_REPLACESEL, 0, (LPARAM)text.c_str());
-    SendMessageW(hRich, WM_VSCROLL, SB_BOTTOM, 0);
+struct ToolStats {
+    std::mutex mutex;
+    unsigned   rounds = 0, calls = 0;
+    double     seconds = 0, callSeconds = 0;   // wall clock, and the sum of the calls (what one at a time would take)
+};
+static ToolStats g_toolStats;
+
+// Runs the calls of one reply, each on its own thread. Results are usually one line of JSON, which
+// the output condenser would cut into nonsense: long ones keep their head, cut at a character
+// boundary, with the cut marked.
+static void RunToolCalls(std::vector<ToolCall>& calls) {
+    const size_t kMaxCalls = 16;
+    auto t0 = std::chrono::steady_clock::now();
+    PluginManager& plugins = AppStateManager::Instance().GetPluginManager();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < calls.size(); i++) {
+        ToolCall& c = calls[i];
+        if (i >= kMaxCalls) {
+            c.result = "{\"error\": \"Not run: at most 16 tool calls per reply\"}";
+            continue;
+        }
+        threads.emplace_back([&plugins, &c]() {
+            auto s0 = std::chrono::steady_clock::now();
+            std::string out = plugins.ExecutePlugin(c.name, c.args);
+            c.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - s0).count();
+            for (char& ch : out) if ((unsigned char)ch < 0x20 && ch != '\n' && ch != '\r' && ch != '\t') ch = ' ';
+            size_t cap = (size_t)(std::max)(g_config.execFeedbackTokens, 1) * 4;   // ~4 chars per token
+            if (out.size() > cap) {
+                size_t total = out.size();
+                out.resize(cap);
+                out.resize(cap - IncompleteUtf8Tail(out));
+                out += "\n[truncated: first " + std::to_string(out.size()) + " of " + std::to_string(total) + " chars shown]";
+            }
+            c.result = std::move(out);
+        });
+    }
+    for (std::thread& t : threads) t.join();
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count(), sum = 0;
+    for (const ToolCall& c : calls) {
+        sum += c.seconds;
+        DevLog("[Tools] %s %.200s -> %zu chars in %.3f s\n", c.name.c_str(), c.args.c_str(), c.result.size(), c.seconds);
+    }
+    std::lock_guard<std::mutex> lk(g_toolStats.mutex);
+    g_toolStats.rounds++;
+    g_toolStats.calls += (unsigned)calls.size();
+    g_toolStats.seconds += wall;
+    g_toolStats.callSeconds += sum;
+    DevLog("[Tools] %zu calls in %.3f s (%.3f s one at a time) — session: %u calls in %u rounds, %.2f s\n",
+           calls.size(), wall, sum, g_toolStats.calls, g_toolStats.rounds, g_toolStats.seconds);
 }
 
 // ════════════════════════════════════════════════════════════════
-// UNIFIED AI REQUEST BUILDER & SENDER
+// LARGE TEXT MAP-REDUCE
 // ════════════════════════════════════════════════════════════════
+// Text attachments over kInlineTextLimit are cut on structural boundaries, each part is
+// summarised by the configured provider (several at once for cloud APIs), and the part
+// summaries are merged until they fit the prompt. Map prompts never include the user's
+// question, so part summaries are cached by content hash and reused across questions.
+
+static const size_t kChunkTarget      = 6000;   // chars per map call
+static const size_t kSummaryCacheCap  = 4096;   // entries; the cache is simply reset when full
+
+static const char* kMapInstruction =
+    "You condense one part of a larger file for another assistant that cannot see the file. "
+    "Summarise the part faithfully in at most 150 words: what it contains or does, key names "
+    "(functions, classes, headings, settings) verbatim, and any notable numbers, errors, warnings "
+    "or TODOs. Plain text, no preamble.";
+
+static const char* kMergeInstruction =
+    "You merge consecutive part summaries of one file into a single shorter summary. Keep the "
+    "[Part/lines] markers of major sections, key names verbatim, and every error, warning or TODO. "
+    "At most 250 words. Plain text, no preamble.";
+
+static std::mutex                                 g_summaryCacheMutex;
+static std::unordered_map<ULONGLONG, std::string> g_summaryCache;
+
+// Strength of a cut just before the line starting at pos: markdown headings and the close of
+// a top-level block beat a paragraph or definition after a blank line, which beats any other
+// blank line. 0 = ordinary line break.
+static int BreakScore(const std::string& t, size_t pos) {
+    if (pos == 0 || pos >= t.size() || t[pos - 1] != '\n') return 0;
+    size_t prevEnd   = pos - 1;
+    size_t prevStart = prevEnd ? t.rfind('\n', prevEnd - 1) : std::string::npos;
+    prevStart = (prevStart == std::string::npos) ? 0 : prevStart + 1;
+    while (prevEnd > prevStart && (t[prevEnd - 1] == '\r' || t[prevEnd - 1] == ' ' || t[prevEnd - 1] == '\t')) prevEnd--;
+
+    char c = t[pos];
+    if (c == '#' && pos + 1 < t.size() && (t[pos + 1] == '#' || t[pos + 1] == ' ')) return 3;
+    if (prevEnd > prevStart && t[prevStart] == '}') return 3;
+    if (prevEnd == prevStart) return (c != ' ' && c != '\t' && c != '\r' && c != '\n') ? 2 : 1;
+    return 0;
+}
 
-// Build chat history as JSON message array for OpenAI/Anthropic/Gemini
-static std::string BuildChatMessages(const std::string& snapshot, const std::string& userPrompt, ProtocolType proto) {
-    // Parse history into user/assistant turns
-    struct Turn { std::string role; std::string content; };
-    std::vector<Turn> turns;
+// End of the chunk starting at `start`: the strongest break in the back half of the target
+// window (latest wins ties), else a space, else a hard cut. The tail is kept whole when it is
+// only slightly over target.
+static size_t NextChunkEnd(const std::string& t, size_t start, size_t target) {
+    if (t.size() - start <= target + target / 4) return t.size();
+    size_t lo = start + target / 2, hi = start + target;
+    size_t cut = 0;
+    int best = -1;
+    for (size_t nl = t.find('\n', lo); nl != std::string::npos && nl < hi; nl = t.find('\n', nl + 1)) {
+        int sc = BreakScore(t, nl + 1);
+        if (sc >= best) { best = sc; cut = nl + 1; }
+    }
+    if (cut) return cut;
+    size_t sp = t.find_last_of(" \t", hi);
+    return (sp != std::string::npos && sp >= lo) ? sp + 1 : hi;
+}
 
-    std::istringstream hs(snapshot);
-    std::string line;
-    std::string currentRole, currentContent;
+// One map or merge call through the configured provider, cached by (provider, model, instruction, text)
+static std::string SummarizeCached(const std::string& instruction, const std::string& text, bool* cacheHit) {
+    ULONGLONG key = XXH64(text, XXH64(g_config.model + '\x1f' + instruction, (ULONGLONG)g_config.provider));
+    {
+        std::lock_guard<std::mutex> lk(g_summaryCacheMutex);
+        auto it = g_summaryCache.find(key);
+        if (it != g_summaryCache.end()) { *cacheHit = true; return it->second; }
+    }
+    ProtocolType proto = g_providerPresets[g_config.provider].protocol;
+    std::string reply = ExtractReply(SendToProvider(BuildRequestBody(instruction, "", text, proto)), proto);
+    if (AppStateManager::Instance().abortInference.load()) return "";
+
+    size_t a = reply.find_first_not_of(" \t\r\n"), b = reply.find_last_not_of(" \t\r\n");
+    reply = (a == std::string::npos) ? "" : reply.substr(a, b - a + 1);
+    if (!reply.empty()) {
+        std::lock_guard<std::mutex> lk(g_summaryCacheMutex);
+        if (g_summaryCache.size() >= kSummaryCacheCap) g_summaryCache.clear();
+        g_summaryCache[key] = reply;
+    }
+    return reply;
+}
 
-    auto flush = [&]() {
-        if (!currentContent.empty()) {
-            if (!currentContent.empty() && currentContent.back() == '\n') currentContent.pop_back();
-            turns.push_back({ currentRole, currentContent });
-            currentContent.clear();
+// Local servers usually decode one request at a time; cloud APIs take a handful in parallel
+static int SummaryWorkerCount() {
+    if (g_config.summaryWorkers > 0) return (std::min)(g_config.summaryWorkers, 16);
+    return g_providerPresets[g_config.provider].needsApiKey ? 4 : 1;
+}
+
+// Streaming map-reduce: Feed() may be called repeatedly as text is produced (extractors can
+// push pages as they decode); complete chunks are dispatched to the pool immediately.
+// Finish() flushes the tail, waits for the map stage and merges down to `budget` chars.
+class ChunkSummarizer {
+public:
+    ChunkSummarizer(const std::string& docName, size_t budget)
+        : m_name(docName), m_budget(budget), m_pool(SummaryWorkerCount()) {}
+
+    void Feed(const std::string& text) {
+        m_buf += text;
+        // Hold back enough look-ahead that the next cut still sees its whole window
+        while (m_buf.size() - m_pos > 2 * kChunkTarget) Dispatch(NextChunkEnd(m_buf, m_pos, kChunkTarget));
+    }
+
+    std::string Finish() {
+        while (m_pos < m_buf.size()) Dispatch(NextChunkEnd(m_buf, m_pos, kChunkTarget));
+        m_pool.Wait();
+
+        std::vector<Section> level(m_parts.begin(), m_parts.end());
+        std::string joined = Join(level);
+        for (int depth = 0; joined.size() > m_budget && level.size() > 1 && depth < 4; depth++) {
+            if (AppStateManager::Instance().abortInference.load()) return "";
+            level = MergeLevel(level);
+            joined = Join(level);
+            DevLog("[MapReduce] Merge pass %d: %zu sections, %zu chars\n", depth + 1, level.size(), joined.size());
         }
+        if (joined.size() > m_budget) joined = joined.substr(0, m_budget) + "\n... [summary truncated]";
+        return joined;
+    }
+
+    size_t Parts()     const { return m_parts.size(); }
+    int    CacheHits() const { return m_cacheHits.load(); }
+    int    Workers()   const { return m_pool.Size(); }
+
+private:
+    struct Section {
+        int firstPart = 0, lastPart = 0, firstLine = 0, lastLine = 0;
+        std::string summary;
     };
 
-    while (std::getline(hs, line)) {
-        if (!line.empty() && line.back() == '\r') line.pop_back();
-        if (line.rfind("User: ", 0) == 0) { flush(); currentRole = "user"; currentContent = line.substr(6) + "\n"; }
-        else if (line.rfind("Nova: ", 0) == 0) { flush(); currentRole = "assistant"; currentContent = line.substr(6) + "\n"; }
-        else if (line.rfind("[System]: ", 0) == 0) { flush(); currentRole = "user"; currentContent = "[Command Output] " + line.substr(10) + "\n"; }
-        else if (!currentRole.empty()) currentContent += line + "\n";
+    void Dispatch(size_t cut) {
+        Section& s = m_parts.emplace_back();   // deque: the slot stays put while workers fill others
+        s.firstPart = s.lastPart = (int)m_parts.size();
+        s.firstLine = m_line;
+        m_line += (int)std::count(m_buf.begin() + m_pos, m_buf.begin() + cut, '\n');
+        s.lastLine = (m_buf[cut - 1] == '\n') ? m_line - 1 : m_line;
+        std::string text = m_buf.substr(m_pos, cut - m_pos);
+        m_pos = cut;
+        if (m_pos > (1u << 20)) { m_buf.erase(0, m_pos); m_pos = 0; }
+        m_total++;
+
+        Section* slot = &s;
+        m_pool.Submit([this, slot, text = std::move(text)] {
+            if (!AppStateManager::Instance().abortInference.load()) {
+                bool hit = false;
+                slot->summary = SummarizeCached(kMapInstruction, "File: " + m_name + "\n\n" + text, &hit);
+                if (hit) m_cacheHits++;
+                if (slot->summary.empty()) slot->summary = "[no summary — opening lines]\n" + text.substr(0, 400);
+            }
+            PostMessageW(hMainWnd, WM_AI_PROGRESS, (WPARAM)++m_done, (LPARAM)m_total.load());
+        });
     }
-    flush();
-
-    // Add current user message
-    turns.push_back({ "user", userPrompt });
 
-    // Anthropic requires: first message = "user", alternating roles, no consecutive same-role.
-    // Merge consecutive same-role messages.
-    if (proto == ProtocolType::Anthropic || proto == ProtocolType::OpenAICompat) {
-        std::vector<Turn> merged;
-        for (auto& t : turns) {
-            if (!merged.empty() && merged.back().role == t.role) {
-                merged.back().content += "\n" + t.content;
-            } else {
-                merged.push_back(t);
+    // Merge runs of consecutive sections whose combined text fits one call
+    std::vector<Section> MergeLevel(const std::vector<Section>& in) {
+        std::vector<Section> out;
+        for (size_t i = 0; i < in.size();) {
+            Section g = in[i];
+            std::string text = Render(in[i]);
+            size_t j = i + 1;
+            for (; j < in.size() && text.size() + Render(in[j]).size() <= kChunkTarget; j++) {
+                text += Render(in[j]);
+                g.lastPart = in[j].lastPart;
+                g.lastLine = in[j].lastLine;
             }
+            g.summary = (j - i > 1) ? text : in[i].summary;   // singletons pass through unchanged
+            out.push_back(std::move(g));
+            i = j;
         }
-        // Anthropic: first message must be "user"
-        if (proto == ProtocolType::Anthropic && !merged.empty() && merged.front().role != "user") {
-            merged.insert(merged.begin(), { "user", "[conversation history]" });
+        m_done = 0;
+        m_total = 0;
+        for (auto& g : out) {
+            if (g.firstPart == g.lastPart || g.summary.empty()) continue;
+            m_total++;
+            Section* slot = &g;
+            m_pool.Submit([this, slot] {
+                std::string text = slot->summary;
+                if (!AppStateManager::Instance().abortInference.load()) {
+                    bool hit = false;
+                    std::string merged = SummarizeCached(kMergeInstruction, "File: " + m_name + "\n\n" + text, &hit);
+                    if (hit) m_cacheHits++;
+                    if (!merged.empty()) slot->summary = merged;
+                }
+                PostMessageW(hMainWnd, WM_AI_PROGRESS, (WPARAM)++m_done, (LPARAM)m_total.load());
+            });
         }
-        turns = std::move(merged);
+        m_pool.Wait();
+        return out;
     }
 
-    // Build JSON array
-    std::string arr;
-    if (proto == ProtocolType::Gemini) {
-        // Gemini uses "contents" with "role" = "user"/"model"
-        arr = "[";
-        for (size_t i = 0; i < turns.size(); i++) {
-            std::string gRole = (turns[i].role == "assistant") ? "model" : "user";
-            if (i > 0) arr += ",";
-            arr += "{\"role\":\"" + gRole + "\",\"parts\":[{\"text\":\"" + PrecisionEscape(turns[i].content) + "\"}]}";
-        }
-        arr += "]";
+    std::string Render(const Section& s) const {
+        char hdr[96];
+        if (s.firstPart == s.lastPart) sprintf_s(hdr, "[Part %d/%zu, lines %d-%d]\n", s.firstPart, m_parts.size(), s.firstLine, s.lastLine);
+        else                           sprintf_s(hdr, "[Parts %d-%d, lines %d-%d]\n", s.firstPart, s.lastPart, s.firstLine, s.lastLine);
+        return hdr + s.summary + "\n\n";
+    }
+
+    std::string Join(const std::vector<Section>& v) const {
+        std::string out;
+        for (const auto& s : v) out += Render(s);
+        return out;
+    }
+
+    std::string         m_name, m_buf;
+    size_t              m_budget;
+    size_t              m_pos  = 0;
+    int                 m_line = 1;
+    std::deque<Section> m_parts;
+    std::atomic<int>    m_done{0}, m_total{0}, m_cacheHits{0};
+    WorkerPool          m_pool;
+};
+
+// Replace a large text attachment's placeholder with its map-reduced summary of at most `budget` chars
+static void CondenseAttachment(Attachment& attach, size_t budget) {
+    auto t0 = std::chrono::steady_clock::now();
+    ChunkSummarizer cs(WStringToString(attach.displayName), budget);
+    size_t fed = attach.fullText.size();
+    bool capped = false;
+    if (attach.streamExtract) {
+        // Pages go to the summarizer as they are decoded, so map calls start on page 1
+        fed = 0;
+        std::string err;
+        ExtractDocumentText(attach.path, ExtensionOf(attach.path), [&](const std::string& s) {
+            if (AppStateManager::Instance().abortInference.load()) return false;
+            cs.Feed(s);
+            fed += s.size();
+            capped = fed >= kMaxCondenseBytes;
+            return !capped;
+        }, err);
+        if (capped) cs.Feed("\n[... extraction stopped at " + std::to_string(kMaxCondenseBytes / 1024) + " KB of text]\n");
     } else {
-        // OpenAI / Anthropic format
-        arr = "[";
-        for (size_t i = 0; i < turns.size(); i++) {
-            if (i > 0) arr += ",";
-            arr += "{\"role\":\"" + turns[i].role + "\",\"content\":\"" + PrecisionEscape(turns[i].content) + "\"}";
-        }
-        arr += "]";
+        cs.Feed(attach.fullText);
     }
-    return arr;
+    std::string summary = cs.Finish();
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+    PostMessageW(hMainWnd, WM_AI_PROGRESS, 0, 0);
+
+    DevLog("[MapReduce] %zu bytes%s -> %zu parts -> %zu chars in %lld ms (%d cached, %d workers)\n",
+           fed, attach.streamExtract ? " extracted" : "", cs.Parts(), summary.size(), ms, cs.CacheHits(), cs.Workers());
+    attach.textContent += "\n" + summary + "=== END ===\n"
+                          "The file was too large to include whole; above is a part-by-part summary with line ranges. "
+                          "Analyse this file.";
+    attach.fullText.clear();
+    attach.streamExtract = false;
 }
 
-// Build the full HTTP request body for the configured provider
-static std::string BuildRequestBody(const std::string& sysPrompt, const std::string& snapshot,
-                                     const std::string& userPrompt, ProtocolType proto)
-{
-    switch (proto) {
-    case ProtocolType::LlamaLegacy: {
-        // llama-server /completion with Llama-3 chat template
-        std::string formattedHistory;
-        {
-            std::istringstream hs(snapshot);
-            std::string line, curRole, curContent;
-            auto flush = [&]() {
-                if (!curContent.empty()) {
-                    if (curContent.back() == '\n') curContent.pop_back();
-                    std::string rid = (curRole == "user") ? "user" : "assistant";
-                    formattedHistory += "<|start_header_id|>" + rid + "<|end_header_id|>\n\n" + curContent + "<|eot_id|>";
-                    curContent.clear();
-                }
-            };
-            while (std::getline(hs, line)) {
-                if (!line.empty() && line.back() == '\r') line.pop_back();
-                if (line.rfind("User: ", 0) == 0)       { flush(); curRole = "user"; curContent = line.substr(6) + "\n"; }
-                else if (line.rfind("Nova: ", 0) == 0)   { flush(); curRole = "assistant"; curContent = line.substr(6) + "\n"; }
-                else if (line.rfind("[System]: ", 0) == 0) { flush(); curRole = "user"; curContent = "[Command Output] " + line.substr(10) + "\n"; }
-                else if (!curRole.empty()) curContent += line + "\n";
+// ════════════════════════════════════════════════════════════════
+// ATTACHMENT PROMPT ASSEMBLY
+// ════════════════════════════════════════════════════════════════
+static const size_t kAttachPromptBudget = 48000;   // chars of attachment text per request
+static const size_t kMaxVisionImages    = 8;
+
+// Whether the configured model takes image input. The preset flag covers each provider's default
+// model and other models are judged by name; vision=0/1 in the config overrides both (llama-server
+// reads images only when it was started with an --mmproj projector).
+static bool ModelHasVision() {
+    if (g_config.vision >= 0) return g_config.vision == 1;
+    const ProviderPreset& preset = g_providerPresets[g_config.provider];
+    std::string model = LowerAscii(g_config.model);
+    if (model.empty() || model == LowerAscii(preset.defaultModel)) return preset.vision;
+    for (const char* tag : { "vision", "-vl", "vl-", "llava", "pixtral", "gpt-4o", "gpt-4.1", "gpt-5", "claude-3", "claude-sonnet",
+                             "claude-opus", "claude-haiku", "gemini", "gemma3", "gemma-3", "minicpm-v", "moondream" })
+        if (model.find(tag) != std::string::npos) return true;
+    return false;
+}
+
+// Provider and model that answered a request with images by an error: text summaries only from then on
+static std::mutex  g_visionMutex;
+static std::string g_visionRejected;
+
+static std::string VisionKey() { return std::to_string((int)g_config.provider) + "|" + g_config.model; }
+static bool VisionRejected() {
+    std::lock_guard<std::mutex> lk(g_visionMutex);
+    return g_visionRejected == VisionKey();
+}
+static void NoteVisionRejected() {
+    std::lock_guard<std::mutex> lk(g_visionMutex);
+    g_visionRejected = VisionKey();
+}
+
+// Adds attachments in priority order (they arrive sorted) until the budget is spent; the rest
+// are listed by name. Oversized text is only condensed when its turn comes, with whatever
+// budget is left. Image pixels ride along for the first kMaxVisionImages images.
+static std::string BuildAttachmentPrompt(std::vector<Attachment>& atts, std::vector<ImagePayload>& images) {
+    // Local servers: roughly half the context window at ~4 chars/token
+    size_t budget = kAttachPromptBudget;
+    if (!g_providerPresets[g_config.provider].needsApiKey)
+        budget = (std::min)(budget, (size_t)(std::max)(g_config.contextSize, 2048) * 2);
+
+    bool pixels = g_config.sendImages && ModelHasVision() && !VisionRejected();
+    std::string out;
+    std::vector<std::string> omitted;
+    for (auto& a : atts) {
+        if (AppStateManager::Instance().abortInference.load()) break;
+        size_t left = budget > out.size() ? budget - out.size() : 0;
+        if (a.isText && (!a.fullText.empty() || a.streamExtract)) {
+            if (left < 2000) { omitted.push_back(WStringToString(a.displayName)); continue; }
+            CondenseAttachment(a, (std::min)(kInlineTextLimit, left - 600));
+        }
+        if (a.textContent.size() + 2 > left) { omitted.push_back(WStringToString(a.displayName)); continue; }
+        out += "\n\n" + a.textContent;
+
+        if (a.isImage && pixels && images.size() < kMaxVisionImages) {
+            ImagePayload img;
+            if (PrepareImagePayload(a.path, AppStateManager::Instance().config.provider, img)) {
+                DevLog("[Vision] %ux%u %s — %zu bytes\n", img.width, img.height, img.mime.c_str(), img.bytes.size());
+                images.push_back(std::move(img));
             }
-            flush();
         }
+    }
+    if (!omitted.empty()) {
+        out += "\n\n[" + std::to_string(omitted.size()) + " more attached file(s) left out to fit the context: ";
+        for (size_t i = 0; i < omitted.size() && i < 40; i++) out += (i ? ", " : "") + omitted[i];
+        if (omitted.size() > 40) out += ", ...";
+        out += "]";
+    }
+    DevLog("[Attach] Prompt: %zu of %zu attachments, %zu chars, %zu images\n",
+           atts.size() - omitted.size(), atts.size(), out.size(), images.size());
+    return out;
+}
 
-        std::string fewShot =
-            "<|start_header_id|>user<|end_header_id|>\n\ncreate a new folder on the desktop<|eot_id|>"
-            "<|start_header_id|>assistant<|end_header_id|>\n\nEXEC: cmd /c mkdir \"%USERPROFILE%\\Desktop\\NewNovaFolder\"<|eot_id|>"
-            "<|start_header_id|>user<|end_header_id|>\n\nthanks!<|eot_id|>"
-            "<|start_header_id|>assistant<|end_header_id|>\n\ndone.<|eot_id|>";
+// ════════════════════════════════════════════════════════════════
+// AGENT LOOP (EXEC feedback cycle)
+// ════════════════════════════════════════════════════════════════
+// A task is one user message plus the EXEC/EDIT/PLAN results fed back to the model after it. The
+// loop feeds a result back only while the task is inside its step, time and token budgets
+// (agent_max_* in the config; tokens are estimated at 4 chars each), and stops early when the
+// model keeps repeating itself: the same action with the same outcome three times, the same
+// failure four times in a row, or an action that already succeeded run again with the same output.
+// The feedback turns run on a thread the loop owns and joins.
+
+class AgentLoop {
+public:
+    ~AgentLoop() { Shutdown(); }
+
+    // A user message starts a new task
+    void Begin() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_active) EndLocked("superseded by a new message");
+        StartLocked();
+        m_pendingAction = 0;
+    }
 
-        std::string fullPrompt = "<|begin_of_text|><|start_header_id|>system<|end_header_id|>\n\n"
-                               + sysPrompt + "<|eot_id|>"
-                               + fewShot + formattedHistory
-                               + "<|start_header_id|>user<|end_header_id|>\n\n"
-                               + userPrompt + "<|eot_id|>"
-                               + "<|start_header_id|>assistant<|end_header_id|>\n\n";
+    // Every model call of the task (AIThreadFunc): request and reply sizes
+    void NoteModelCall(size_t requestChars, size_t replyChars) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_calls++;
+        m_tokens += (requestChars + replyChars) / 4;
+        m_sessionTokens += (requestChars + replyChars) / 4;
+    }
 
-        return "{\"prompt\":\"" + PrecisionEscape(fullPrompt) + "\","
-               "\"n_predict\":" + std::to_string(g_config.maxTokens) + ","
-               "\"temperature\":" + std::to_string(g_config.temperature) + ","
-               "\"stream\":false,\"special\":true,"
-               "\"stop\":[\"<|eot_id|>\",\"User:\",\"Nova:\"]}";
+    // The action a reply asked for (WM_AI_DONE), or none: a reply without one ends the task
+    void NoteAction(const std::string& action) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_pendingAction = XXH64(action);
+    }
+    void NoteAnswer() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_active) EndLocked(m_steps ? "answered" : "");
     }
 
-    case ProtocolType::OpenAICompat: {
-        std::string messages = BuildChatMessages(snapshot, userPrompt, proto);
-        // Insert system message at front
-        std::string sysMsg = "{\"role\":\"system\",\"content\":\"" + PrecisionEscape(sysPrompt) + "\"}";
-        // Replace leading [ with [sysMsg,
-        if (messages.size() > 1) messages = "[" + sysMsg + "," + messages.substr(1);
-        else messages = "[" + sysMsg + "]";
+    // Whether the result of the last action goes back to the model. False ends the task, with
+    // the reason in `why`.
+    bool Continue(const ExecResult* res, std::string& why) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (!m_active) StartLocked();   // a result with no task open (the loop had already stopped it)
+        bool ok = res && res->started && res->exitCode == 0 && !res->timedOut;
+        ULONGLONG outcome = XXH64(NormalizedOutput(res), ok ? 1 : 2);
+        ULONGLONG step = XXH64(&outcome, sizeof(outcome), m_pendingAction);
+        m_steps++;
+        m_sessionSteps++;
+
+        int repeats = 0;
+        bool succeededBefore = false;
+        for (const Step& s : m_recent) {
+            repeats += s.hash == step;
+            succeededBefore |= ok && s.ok && s.hash == step;
+        }
+        m_failStreak = ok ? 0 : (outcome == m_lastFailure ? m_failStreak + 1 : 1);
+        m_lastFailure = ok ? 0 : outcome;
+        m_recent.push_back({ step, m_pendingAction, ok });
+        if (m_recent.size() > kWindow) m_recent.pop_front();
+
+        double minutes = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count() / 60.0;
+        char buf[200] = "";
+        const char* kind = nullptr;
+        if (succeededBefore) {
+            kind = "done";
+            sprintf_s(buf, "the same action already succeeded with the same output earlier in this task");
+        } else if (repeats >= 2) {
+            kind = "repeating";
+            sprintf_s(buf, "the same action gave the same result %d times", repeats + 1);
+        } else if (m_failStreak >= 4) {
+            kind = "stuck";
+            sprintf_s(buf, "the same failure %d times in a row", m_failStreak);
+        } else if (g_config.agentMaxSteps > 0 && m_steps > g_config.agentMaxSteps) {   // the limit-th result still goes back
+            kind = "steps";
+            sprintf_s(buf, "reached the limit of %d steps", g_config.agentMaxSteps);
+        } else if (g_config.agentMaxMinutes > 0 && minutes >= g_config.agentMaxMinutes) {
+            kind = "time";
+            sprintf_s(buf, "reached the limit of %d minutes", g_config.agentMaxMinutes);
+        } else if (g_config.agentMaxTokens > 0 && m_tokens >= (unsigned long long)g_config.agentMaxTokens) {
+            kind = "tokens";
+            sprintf_s(buf, "reached the limit of ~%d tokens", g_config.agentMaxTokens);
+        }
+        why = buf;
+        if (!kind) return true;
+        m_stops[kind]++;
+        EndLocked("stopped: " + why);
+        return false;
+    }
 
-        return "{\"model\":\"" + PrecisionEscape(g_config.model) + "\","
-               "\"messages\":" + messages + ","
-               "\"temperature\":" + std::to_string(g_config.temperature) + ","
-               "\"max_tokens\":" + std::to_string(g_config.maxTokens) + ","
-               "\"stream\":false}";
+    // Position of the current step against the step budget, for the transcript ("step 3 of 12")
+    std::string Progress() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        char buf[64];
+        if (g_config.agentMaxSteps > 0) sprintf_s(buf, "step %d of %d", m_steps, g_config.agentMaxSteps);
+        else                             sprintf_s(buf, "step %d", m_steps);
+        return buf;
+    }
+
+    // Runs the next model turn with the feedback
+    void Feed(std::wstring feedback) {
+        std::lock_guard<std::mutex> lk(m_threadMutex);
+        if (m_thread.joinable()) m_thread.join();   // the previous turn posted its reply before this result existed
+        m_thread = std::thread([feedback]() { AIThreadFunc(feedback, "", {}); });
+    }
+
+    // At exit: the running turn (if any) is stopped and joined
+    void Shutdown() {
+        std::lock_guard<std::mutex> lk(m_threadMutex);
+        if (!m_thread.joinable()) return;
+        AppStateManager::Instance().abortInference.store(true);
+        m_thread.join();
+    }
+
+private:
+    struct Step { ULONGLONG hash, action; bool ok; };
+    static const size_t kWindow = 8;
+
+    // Digits vary between otherwise identical runs (temp file names, timings, addresses)
+    static std::string NormalizedOutput(const ExecResult* res) {
+        if (!res) return "";
+        std::string s;
+        s.reserve((std::min)(res->output.size(), (size_t)16384));
+        for (size_t i = 0; i < res->output.size() && s.size() < 16384; i++)
+            if (!isdigit((unsigned char)res->output[i])) s += res->output[i];
+        return s + res->error;
+    }
+
+    void StartLocked() {
+        m_active = true;
+        m_steps = m_calls = m_failStreak = 0;
+        m_tokens = 0;
+        m_lastFailure = 0;
+        m_recent.clear();
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    void EndLocked(const std::string& how) {
+        if (!m_active) return;
+        m_active = false;
+        m_tasks++;
+        if (how.empty()) return;   // a plain chat answer: nothing to report
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+        std::string stops;
+        for (const auto& kv : m_stops) stops += (stops.empty() ? "" : ", ") + kv.first + " ×" + std::to_string(kv.second);
+        DevLog("[Agent] Task %s after %d steps, %d model calls, ~%llu tokens, %.0f s — session: %u tasks, %u steps, ~%llu tokens%s%s\n",
+               how.c_str(), m_steps, m_calls, m_tokens, seconds, m_tasks, m_sessionSteps, m_sessionTokens,
+               stops.empty() ? "" : ", early stops: ", stops.c_str());
     }
 
-    case ProtocolType::Anthropic: {
-        std::string messages = BuildChatMessages(snapshot, userPrompt, proto);
-        return "{\"model\":\"" + PrecisionEscape(g_config.model) + "\","
-               "\"system\":\"" + PrecisionEscape(sysPrompt) + "\","
-               "\"messages\":" + messages + ","
-               "\"max_tokens\":" + std::to_string(g_config.maxTokens) + ","
-               "\"temperature\":" + std::to_string(g_config.temperature) + ","
-               "\"stream\":false}";
+    std::mutex m_mutex;
+    bool       m_active = false;
+    int        m_steps = 0, m_calls = 0, m_failStreak = 0;
+    unsigned long long m_tokens = 0, m_sessionTokens = 0;
+    unsigned   m_tasks = 0, m_sessionSteps = 0;
+    ULONGLONG  m_pendingAction = 0, m_lastFailure = 0;
+    std::deque<Step> m_recent;
+    std::map<std::string, unsigned> m_stops;
+    std::chrono::steady_clock::time_point m_start;
+
+    std::mutex  m_threadMutex;
+    std::thread m_thread;
+};
+
+static AgentLoop g_agentLoop;
+
+// ════════════════════════════════════════════════════════════════
+// RECIPES (saved EXEC sequences)
+// ════════════════════════════════════════════════════════════════
+// A request that ended with an answer after commands that all succeeded is saved as a recipe: the
+// request's words, and the commands that worked (failed attempts are dropped). Words of the request
+// that name a file or folder in the commands (a path component or name operand, never the program
+// or a switch) become parameters ("make the {{1}} folder"), and the Desktop and
+// profile folders become {{desktop}} and {{home}}, in the commands and in the folder the task started
+// in. A later request with the same words in the same places, parameters aside, is offered for
+// replay: the user confirms the filled-in commands, they run as a plan from that folder, and no
+// model is called. If the replay fails the model takes over with its report, and
+// what it does then replaces the recipe. Requests with attachments, EDIT: blocks or destructive
+// commands are never saved. The recipes live in nova_recipes.txt next to the exe.
+
+class RecipeBook {
+public:
+    enum class Action { Exec, Plan, Edit };
+
+    // A user message starts a new recording (empty: the task is not recorded); `startDir` is the
+    // working folder its commands will run from
+    void Begin(const std::wstring& request, const std::string& startDir) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_request = WStringToString(request);
+        m_startDir = startDir;
+        m_recording = !m_request.empty() && m_request.size() <= 300;
+        m_commands.clear();
+        m_pending.clear();
+        m_lastOk = false;
+        m_calls = 0;
     }
 
-    case ProtocolType::Gemini: {
-        std::string contents = BuildChatMessages(snapshot, userPrompt, proto);
-        return "{\"contents\":" + contents + ","
-               "\"systemInstruction\":{\"parts\":[{\"text\":\"" + PrecisionEscape(sysPrompt) + "\"}]},"
-               "\"generationConfig\":{\"temperature\":" + std::to_string(g_config.temperature) + ","
-               "\"maxOutputTokens\":" + std::to_string(g_config.maxTokens) + "}}";
+    // The action of a model reply, then its result (WM_AI_DONE, WM_EXEC_DONE)
+    void NoteAction(Action kind, const std::string& text) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_calls++;
+        m_pending.clear();
+        if (!m_recording) return;
+        if (kind == Action::Exec) {
+            m_pending.push_back(text);
+        } else if (kind == Action::Plan) {
+            std::vector<PlanStep> steps;
+            std::string err;
+            if (ParsePlan(text, steps, err)) for (const PlanStep& s : steps) {
+                if (s.edit) { m_pending.clear(); break; }
+                m_pending.push_back(s.command);
+            }
+        }
+        for (const std::string& c : m_pending)
+            if (ClassifyCommand(c).destructive || c.find("{{") != std::string::npos) m_pending.clear();
+        if (m_pending.empty()) m_recording = false;
     }
+    void NoteResult(bool ok) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_lastOk = ok;
+        if (ok && m_recording) m_commands.insert(m_commands.end(), m_pending.begin(), m_pending.end());
+        m_pending.clear();
+        if (m_commands.size() > kMaxCommands) m_recording = false;
+    }
+    // A reply without an action ends the task; it is saved if its last command worked
+    void NoteAnswer(bool ok) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_calls++;
+        if (m_recording && ok && m_lastOk && !m_commands.empty()) SaveTask();
+        m_recording = false;
+    }
+    void Abandon() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_recording = false;
     }
-    return "{}";
-}
 
-// Extract the assistant's reply text from the provider's JSON response
-static std::string ExtractReply(const std::string& raw, ProtocolType proto) {
-    switch (proto) {
-    case ProtocolType::LlamaLegacy:
-        return DecodeJsonString(raw, "content");
-    case ProtocolType::OpenAICompat: {
-        size_t msgPos = raw.find("\"message\"");
-        if (msgPos != std::string::npos) {
-            std::string sub = raw.substr(msgPos);
-            return DecodeJsonString(sub, "content");
+    // The saved recipe for a request, with its commands and starting folder filled in (`dir` is left
+    // alone for recipes saved without one); false if none matches
+    bool Match(const std::wstring& request, std::string& pattern, std::vector<std::string>& commands, std::string& dir, unsigned& uses) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        LoadOnce();
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<Token> tokens = Tokenize(WStringToString(request));
+        const Recipe* best = nullptr;
+        std::vector<std::string> bestValues;
+        auto range = m_byLength.equal_range(tokens.size());
+        for (auto it = range.first; it != range.second; ++it) {
+            const Recipe& r = m_recipes[it->second];
+            std::vector<std::string> values;
+            if (!Fits(r, tokens, values)) continue;
+            if (!best || values.size() < bestValues.size() || (values.size() == bestValues.size() && r.uses > best->uses)) {
+                best = &r;
+                bestValues = values;
+            }
         }
-        return DecodeJsonString(raw, "content");
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+        if (!best) return false;
+        pattern = Join(best->pattern);
+        commands.clear();
+        for (const std::string& c : best->commands) commands.push_back(Fill(c, bestValues));
+        if (best->hasDir) dir = Fill(best->dir, bestValues);
+        uses = best->uses;
+        m_replaying = pattern;
+        m_replayRequest = request;
+        m_replayDir = dir;
+        DevLog("[Recipe] \"%s\" matches \"%s\" in %.1f us (%zu recipes)\n", WStringToString(request).c_str(), pattern.c_str(), us, m_recipes.size());
+        return true;
     }
-    case ProtocolType::Anthropic: {
-        size_t cPos = raw.find("\"content\"");
-        if (cPos != std::string::npos) {
-            std::string sub = raw.substr(cPos);
-            size_t tPos = sub.find("\"text\"");
-            if (tPos != std::string::npos) {
-                size_t second = sub.find("\"text\"", tPos + 6);
-                if (second != std::string::npos) {
-                    std::string sub2 = sub.substr(second);
-                    return DecodeJsonString("{" + sub2 + "}", "text");
-                }
+
+    // How the replay offered by Match went (WM_RECIPE_DONE)
+    void Replayed(bool ok) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        for (size_t i = 0; i < m_recipes.size(); i++) {
+            Recipe& r = m_recipes[i];
+            if (Join(r.pattern) != m_replaying) continue;
+            r.lastUsed = (long long)time(nullptr);
+            if (ok) {
+                r.uses++;
+                m_sessionReplays++;
+                m_sessionCallsSaved += r.calls;
+            } else if (++r.fails >= 2 && r.fails > r.uses) {
+                DevLog("[Recipe] \"%s\" failed %u times — dropped\n", m_replaying.c_str(), r.fails);
+                m_recipes.erase(m_recipes.begin() + i);
+                Reindex();
             }
-            return DecodeJsonString(sub, "text");
+            Save();
+            break;
         }
-        return "";
+        if (ok)
+            DevLog("[Recipe] Replayed \"%s\" without a model call — session: %u replays, ~%u model calls saved\n",
+                   m_replaying.c_str(), m_sessionReplays, m_sessionCallsSaved);
     }
-    case ProtocolType::Gemini:
-        return DecodeJsonString(raw, "text");
+    std::wstring ReplayRequest() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_replayRequest;
     }
-    return "";
-}
-
-// Send request to the configured provider and return reply
-static std::string SendToProvider(const std::string& body) {
-    std::wstring host = StringToWString(g_config.host);
-    INTERNET_PORT port = (INTERNET_PORT)g_config.port;
-    ProtocolType proto = g_providerPresets[g_config.provider].protocol;
-
-    // Build endpoint — Gemini needs model name and API key in URL
-    std::string ep = g_config.endpointPath;
-    if (proto == ProtocolType::Gemini) {
-        ep = "/v1beta/models/" + g_config.model + ":generateContent?key=" + g_config.apiKey;
+    std::string ReplayDir() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_replayDir;
     }
-    std::wstring endpoint = StringToWString(ep);
 
-    DWORD flags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE;
-    if (g_config.useSSL) flags |= INTERNET_FLAG_SECURE | INTERNET_FLAG_IGNORE_CERT_CN_INVALID | INTERNET_FLAG_IGNORE_CERT_DATE_INVALID;
-
-    HINTERNET hS = InternetOpenW(L"NovaAI/2.0", 1, 0, 0, 0);
-    if (!hS) { DevLog("[Provider] ERROR: InternetOpen failed\n"); return ""; }
-
-    DWORD toConn = 15000, toRecv = 180000;
-    InternetSetOptionW(hS, INTERNET_OPTION_CONNECT_TIMEOUT, &toConn, sizeof(toConn));
-    InternetSetOptionW(hS, INTERNET_OPTION_RECEIVE_TIMEOUT, &toRecv, sizeof(toRecv));
-    InternetSetOptionW(hS, INTERNET_OPTION_SEND_TIMEOUT,    &toRecv, sizeof(toRecv));
+private:
+    struct Token { std::string text, lower; };
+    struct Recipe {
+        std::string request;                  // as first typed
+        std::vector<std::string> pattern;     // lower-case words; {{n}} for a parameter
+        std::vector<std::string> commands;    // with {{n}}, {{n:stem}} (no extension), {{desktop}}, {{home}}
+        std::string dir;                      // working folder the task started in, same markers
+        bool hasDir = false;                  // false for recipes saved before the folder was kept
+        unsigned uses = 0, fails = 0, calls = 0;   // calls: model calls the recorded task took
+        long long lastUsed = 0;
+    };
+    static const size_t kMaxCommands = 20, kMaxRecipes = 200, kMaxParams = 4;
 
-    HINTERNET hC = InternetConnectW(hS, host.c_str(), port, 0, 0, 3, 0, 0);
-    if (!hC) {
-        DevLog("[Provider] ERROR: Cannot connect to %s:%d GLE=%lu\n", g_config.host.c_str(), port, GetLastError());
-        InternetCloseHandle(hS); return "";
+    static std::string Join(const std::vector<std::string>& words) {
+        std::string s;
+        for (const std::string& w : words) s += (s.empty() ? "" : " ") + w;
+        return s;
     }
 
-    HINTERNET hR = HttpOpenRequestW(hC, L"POST", endpoint.c_str(), 0, 0, 0, flags, 0);
-    std::string result;
+    // Words and names (README.txt, my-app, v2) without the politeness around them
+    static std::vector<Token> Tokenize(const std::string& text) {
+        std::vector<Token> out;
+        std::string word;
+        auto flush = [&]() {
+            while (!word.empty() && strchr(".-_", word.back())) word.pop_back();
+            std::string lower = LowerAscii(word);
+            if (!word.empty() && !IsOneOf(lower, { "please", "pls", "can", "could", "would", "will", "you", "kindly", "hey", "nova",
+                                                   "the", "a", "an", "my", "me", "for", "just", "now", "again", "thanks", "thank" }))
+                out.push_back({ word, lower });
+            word.clear();
+        };
+        for (char c : text) {
+            if (isalnum((unsigned char)c) || (unsigned char)c >= 0x80 || (!word.empty() && strchr("._-", c))) word += c;
+            else flush();
+        }
+        flush();
+        return out;
+    }
 
-    if (hR) {
-        // Build headers based on provider
-        std::string headers = "Content-Type: application/json\r\n";
-        if (!g_config.apiKey.empty() && proto != ProtocolType::Gemini) { // Gemini uses URL key
-            if (proto == ProtocolType::Anthropic) {
-                headers += "x-api-key: " + g_config.apiKey + "\r\n";
-                headers += "anthropic-version: 2023-06-01\r\n";
-            } else {
-                headers += "Authorization: Bearer " + g_config.apiKey + "\r\n";
+    // Whole-word, case-insensitive occurrences of `word` in `s` ("new" is not in New-Item)
+    static std::vector<size_t> FindWord(const std::string& s, const std::string& word) {
+        std::vector<size_t> at;
+        std::string ls = LowerAscii(s), lw = LowerAscii(word);
+        auto inWord = [](char c) { return isalnum((unsigned char)c) || c == '_' || c == '-'; };
+        for (size_t p = ls.find(lw); p != std::string::npos; p = ls.find(lw, p + lw.size()))
+            if ((p == 0 || !inWord(ls[p - 1])) && (p + lw.size() >= ls.size() || !inWord(ls[p + lw.size()]))) at.push_back(p);
+        return at;
+    }
+    static void ReplaceFolder(std::string& s, std::string folder, const std::string& marker) {
+        while (!folder.empty() && (folder.back() == '\\' || folder.back() == '/')) folder.pop_back();
+        if (folder.size() < 3) return;
+        std::string lower = LowerAscii(folder);
+        for (size_t p; (p = LowerAscii(s).find(lower)) != std::string::npos;) s.replace(p, folder.size(), marker);
+    }
+    static std::string HomeDir() {
+        char buf[MAX_PATH] = "";
+        return GetEnvironmentVariableA("USERPROFILE", buf, MAX_PATH) ? buf : "";
+    }
+    static std::string Fill(std::string c, const std::vector<std::string>& values) {
+        for (size_t i = 0; i < values.size(); i++) {
+            std::string m = "{{" + std::to_string(i + 1) + "}}", stem = "{{" + std::to_string(i + 1) + ":stem}}";
+            for (size_t p; (p = c.find(m)) != std::string::npos;) c.replace(p, m.size(), values[i]);
+            for (size_t p; (p = c.find(stem)) != std::string::npos;) c.replace(p, stem.size(), values[i].substr(0, values[i].rfind('.')));
+        }
+        std::string desk = GetDesktopDir(), home = HomeDir();
+        while (!desk.empty() && (desk.back() == '\\' || desk.back() == '/')) desk.pop_back();
+        for (size_t p; (p = c.find("{{desktop}}")) != std::string::npos;) c.replace(p, 11, desk);
+        for (size_t p; (p = c.find("{{home}}")) != std::string::npos;) c.replace(p, 8, home);
+        return c;
+    }
+    // Whether `word` names something the command works on: a component of a path argument, or the
+    // argument itself, with its extension or without. Program names, switches and the text given
+    // to -Value / -Content do not count.
+    static bool IsOperand(const std::string& command, const std::string& word) {
+        bool unused = false;
+        std::vector<CommandSegment> segs;
+        TokenizeCommandLine(command, ShellDialect::Cmd, segs, unused, 0);
+        for (const CommandSegment& seg : segs) {
+            bool text = false;
+            for (const std::string& arg : seg.args) {
+                std::string lower = LowerAscii(arg);
+                if (text) { text = false; continue; }
+                if (!lower.empty() && lower[0] == '-') {
+                    text = seg.dialect == ShellDialect::PowerShell && IsOneOf(lower, { "-value", "-content", "-inputobject" });
+                    continue;
+                }
+                if (lower.size() > 1 && lower[0] == '/' && lower.find_first_of("\\/", 1) == std::string::npos) continue;   // cmd switch
+                std::stringstream ss(lower);
+                for (std::string part; std::getline(ss, part, '\\');) {
+                    std::stringstream inner(part);
+                    for (std::string name; std::getline(inner, name, '/');) {
+                        if (name == word) return true;
+                        size_t dot = name.rfind('.');
+                        if (dot != std::string::npos && name.compare(0, dot, word) == 0 && dot == word.size()) return true;
+                    }
+                }
             }
         }
+        return false;
+    }
 
-        DevLog("[Provider] Sending %zu bytes to %s:%d%s\n", body.size(), g_config.host.c_str(), port, ep.c_str());
+    static bool Fits(const Recipe& r, const std::vector<Token>& tokens, std::vector<std::string>& values) {
+        if (r.pattern.size() != tokens.size()) return false;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            const std::string& p = r.pattern[i];
+            if (p.compare(0, 2, "{{") != 0) { if (p != tokens[i].lower) return false; continue; }
+            size_t n = (size_t)atoi(p.c_str() + 2);
+            if (n == 0 || n > kMaxParams) return false;
+            if (values.size() < n) values.resize(n);
+            if (!values[n - 1].empty() && LowerAscii(values[n - 1]) != tokens[i].lower) return false;
+            values[n - 1] = tokens[i].text;
+        }
+        for (const std::string& v : values) if (v.empty()) return false;
+        return true;
+    }
 
-        if (HttpSendRequestA(hR, headers.c_str(), (DWORD)headers.size(), (void*)body.c_str(), (DWORD)body.size())) {
-            // Log HTTP status code for debugging
-            DWORD statusCode = 0, szStatus = sizeof(statusCode);
-            HttpQueryInfoA(hR, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &statusCode, &szStatus, nullptr);
-            
-            char buf[8192]; DWORD r;
-            while (InternetReadFile(hR, buf, 8192, &r) && r > 0) {
-                // THE HARDWARE KILL-SWITCH CHECK
-                if (AppStateManager::Instance().abortInference.load()) {
-                    DevLog("[Network] Abort signal detected. Severing socket.\n");
-                    break; 
+    void SaveTask() {
+        std::vector<Token> tokens = Tokenize(m_request);
+        if (tokens.size() < 2 || tokens.size() > 24) return;
+        Recipe r;
+        r.request = m_request;
+        r.commands = m_commands;
+        r.calls = m_calls;
+        r.lastUsed = (long long)time(nullptr);
+        r.dir = m_startDir;
+        r.hasDir = true;
+        r.commands.push_back(r.dir);   // the folder gets the same markers and parameters as the commands
+        for (std::string& c : r.commands) {
+            ReplaceFolder(c, GetDesktopDir(), "{{desktop}}");   // before {{home}}, which contains it
+            ReplaceFolder(c, HomeDir(), "{{home}}");
+        }
+        // Request words the commands use as file or folder names are parameters
+        std::vector<std::string> params;
+        size_t literals = 0;
+        for (const Token& t : tokens) {
+            std::string slot = t.lower;
+            if (t.text.size() >= 3 && !IsOneOf(t.lower, { "desktop", "folder", "file", "files", "home" })) {
+                bool used = false;
+                for (const std::string& c : r.commands) used |= IsOperand(c, t.lower);
+                if (used) {
+                    size_t n = std::find(params.begin(), params.end(), t.lower) - params.begin();
+                    if (n == params.size()) params.push_back(t.lower);
+                    slot = "{{" + std::to_string(n + 1) + "}}";
                 }
-                result.append(buf, r);
             }
-            // Add a visual indicator to the response if aborted
-            if (AppStateManager::Instance().abortInference.load()) {
-                result += "\n\n[System: Generation aborted by user.]";
+            if (slot == t.lower && !IsOneOf(t.lower, { "in", "on", "to", "of", "at", "and", "or", "with", "from", "into", "it", "is",
+                                                       "this", "that", "called", "named", "some", "new" }))
+                literals++;
+            r.pattern.push_back(slot);
+        }
+        if (params.size() > kMaxParams || literals < 2) return;   // too little left to recognise it by
+        std::vector<size_t> order(params.size());
+        for (size_t n = 0; n < order.size(); n++) order[n] = n;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return params[a].size() > params[b].size(); });   // notes.txt before notes
+        for (std::string& c : r.commands) {
+            for (size_t n : order) {
+                std::vector<size_t> at = FindWord(c, params[n]);
+                std::string m = "{{" + std::to_string(n + 1) + "}}";
+                for (auto it = at.rbegin(); it != at.rend(); ++it) c.replace(*it, params[n].size(), m);
+            }
+            for (size_t n : order) {   // hello.cpp -> hello.exe
+                size_t dot = params[n].rfind('.');
+                if (dot == std::string::npos || dot < 3) continue;
+                std::vector<size_t> at = FindWord(c, params[n].substr(0, dot));
+                std::string m = "{{" + std::to_string(n + 1) + ":stem}}";
+                for (auto it = at.rbegin(); it != at.rend(); ++it) c.replace(*it, dot, m);
             }
-            
-            DevLog("[Provider] HTTP %lu — %zu bytes received\n", statusCode, result.size());
         }
-        InternetCloseHandle(hR);
+        r.dir = r.commands.back();
+        r.commands.pop_back();
+
+        LoadOnce();
+        std::string key = Join(r.pattern);
+        bool replaced = false;
+        for (Recipe& old : m_recipes) {
+            if (Join(old.pattern) != key) continue;
+            r.uses = old.uses;
+            old = r;
+            replaced = true;
+        }
+        if (!replaced) {
+            if (m_recipes.size() >= kMaxRecipes) {
+                auto lru = std::min_element(m_recipes.begin(), m_recipes.end(), [](const Recipe& a, const Recipe& b) { return a.lastUsed < b.lastUsed; });
+                m_recipes.erase(lru);
+            }
+            m_recipes.push_back(r);
+        }
+        Reindex();
+        Save();
+        DevLog("[Recipe] %s \"%s\": %zu commands, %u model calls to work out\n", replaced ? "Updated" : "Saved", key.c_str(),
+               r.commands.size(), r.calls);
     }
-    InternetCloseHandle(hC);
-    InternetCloseHandle(hS);
-    return result;
+
+    void Reindex() {
+        m_byLength.clear();
+        for (size_t i = 0; i < m_recipes.size(); i++) m_byLength.emplace(m_recipes[i].pattern.size(), i);
+    }
+
+    static std::string File() { return GetExeDir() + "nova_recipes.txt"; }
+
+    void LoadOnce() {
+        if (m_loaded) return;
+        m_loaded = true;
+        std::ifstream f(std::filesystem::u8path(File()), std::ios::binary);
+        std::string line;
+        Recipe r;
+        while (std::getline(f, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            size_t sp = line.find(' ');
+            std::string tag = line.substr(0, sp), rest = sp == std::string::npos ? "" : line.substr(sp + 1);
+            if (tag == "recipe") {
+                r = Recipe();
+                sscanf(rest.c_str(), "%u %u %u %lld", &r.uses, &r.fails, &r.calls, &r.lastUsed);
+            } else if (tag == "request") {
+                r.request = rest;
+            } else if (tag == "pattern") {
+                std::istringstream in(rest);
+                for (std::string w; in >> w;) r.pattern.push_back(w);
+            } else if (tag == "exec") {
+                r.commands.push_back(rest);
+            } else if (tag == "dir") {
+                r.dir = rest;
+                r.hasDir = true;
+            } else if (tag == "end" && !r.pattern.empty() && !r.commands.empty()) {
+                m_recipes.push_back(r);
+            }
+        }
+        Reindex();
+        if (!m_recipes.empty()) DevLog("[Recipe] %zu recipes loaded\n", m_recipes.size());
+    }
+
+    void Save() {
+        std::string out = "# Nova recipes: commands that carried out a request, replayed when it comes again. Delete a block to forget it.\n";
+        char head[96];
+        for (const Recipe& r : m_recipes) {
+            sprintf_s(head, "recipe %u %u %u %lld\n", r.uses, r.fails, r.calls, r.lastUsed);
+            out += head;
+            out += "request " + r.request.substr(0, r.request.find_first_of("\r\n")) + "\n";
+            out += "pattern " + Join(r.pattern) + "\n";
+            if (r.hasDir) out += "dir " + r.dir + "\n";
+            for (const std::string& c : r.commands) out += "exec " + c + "\n";
+            out += "end\n";
+        }
+        std::string err;
+        if (!WriteFileAtomic(std::filesystem::u8path(File()), out, err)) DevLog("[Recipe] ERROR: could not save: %s\n", err.c_str());
+    }
+
+    std::mutex m_mutex;
+    bool m_loaded = false, m_recording = false, m_lastOk = false;
+    std::string m_request, m_startDir, m_replaying, m_replayDir;
+    std::wstring m_replayRequest;
+    std::vector<std::string> m_commands, m_pending;
+    unsigned m_calls = 0, m_sessionReplays = 0, m_sessionCallsSaved = 0;
+    std::vector<Recipe> m_recipes;
+    std::unordered_multimap<size_t, size_t> m_byLength;   // pattern length -> recipe
+};
+
+static RecipeBook g_recipes;
+
+// Offers the saved recipe for a request, if there is one, and starts the replay if the user agrees
+static bool OfferRecipe(const std::wstring& request) {
+    std::string pattern;
+    std::vector<std::string> commands;
+    std::string dir = g_currentAgentDir;
+    unsigned uses = 0;
+    if (!g_recipes.Match(request, pattern, commands, dir, uses)) return false;
+    std::wstring text = L"Nova has carried out this request before. Run the same commands again, without asking the model?\n\n";
+    for (size_t i = 0; i < commands.size(); i++) text += std::to_wstring(i + 1) + L". " + StringToWString(commands[i]) + L"\n";
+    if (!dir.empty()) text += L"\nin " + StringToWString(dir) + L"\n";
+    if (uses) text += L"\n(replayed " + std::to_wstring(uses) + L" time" + (uses == 1 ? L"" : L"s") + L" before)";
+    if (MessageBoxW(hMainWnd, text.c_str(), L"Nova — saved recipe", MB_YESNO | MB_ICONQUESTION) != IDYES) {
+        DevLog("[Recipe] Declined — asking the model\n");
+        return false;
+    }
+    std::vector<PlanStep> steps;
+    for (size_t i = 0; i < commands.size(); i++) {
+        PlanStep s;
+        s.id = (int)i + 1;
+        if (i) s.after.push_back((int)i);
+        s.command = commands[i];
+        steps.push_back(s);
+    }
+    AppStateManager::Instance().execRunning.store(true);
+    std::thread([steps, dir]() {
+        ExecResult* res = RunNovaPlan(steps, dir, "RECIPE");
+        if (!PostMessageW(hMainWnd, WM_RECIPE_DONE, 0, (LPARAM)res)) delete res;
+    }).detach();
+    return true;
 }
 
 // ════════════════════════════════════════════════════════════════
 // AI THREAD (Unified — works with all 17 providers)
 // ════════════════════════════════════════════════════════════════
-void AIThreadFunc(std::wstring userMsg, std::string webInfo, bool hasAttach, Attachment attach) {
+void AIThreadFunc(std::wstring userMsg, std::string webInfo, std::vector<Attachment> attachments) {
     DevLog("[AI] Thread started — provider: %S\n", g_providerPresets[AppStateManager::Instance().config.provider].displayName);
 
     // 1. Dynamically get paths for Universal Release
@@ -1692,30 +12117,62 @@ void AIThreadFunc(std::wstring userMsg, std::string webInfo, bool hasAttach, Att
     sys += "4. Use '`n' for new lines and '\\\"' for quotes inside the code.\n";
     sys += "5. COMPILATION: Always cd to the desktop first. Format:\n";
     sys += "   EXEC: cmd /c \"cd /d " + uniDesktop + " && cl /nologo /O2 /EHsc /std:c++17 /Fe:app.exe app.cpp\"\n";
-    sys += "6. If user provides code or asks for an application, GENERATE THE FULL SOURCE and save via EXEC: using powershell Set-Content.\n";
+    sys += "   For a program in several .cpp files, list them all (or *.cpp) in one cl command: they are compiled in parallel, unchanged files are not recompiled, and errors come back grouped by file.\n";
+    sys += "6. If user provides code or asks for a new application, GENERATE THE FULL SOURCE and save via EXEC: using powershell Set-Content. To change a file that already exists, use EDIT: (rule 11) instead of rewriting it.\n";
     
     // --- ADD THESE 3 LINES ---
-    sys += "7. ATOMIC PROTOCOL: You may only issue ONE EXEC: command per message.\n";
-    sys += "8. WAIT FOR FEEDBACK: After issuing an EXEC: command, YOU MUST STOP GENERATING TEXT.\n";
+    sys += "7. ATOMIC PROTOCOL: You may only issue ONE EXEC:, EDIT: or PLAN: action per message.\n";
+    sys += "8. WAIT FOR FEEDBACK: After issuing an EXEC:, EDIT: or PLAN: action, YOU MUST STOP GENERATING TEXT.\n";
     sys += "9. NEVER generate or type '[SYSTEM FEEDBACK]' — that is injected by the hardware after execution.\n";
     sys += "10. FILE CONTENT RULE: When writing text content to a file (especially news, quotes, or multi-line data), NEVER embed the raw text inside a PowerShell -Value '...' string — apostrophes and quotes will break the shell. Instead use a temp variable: $t = @'...content...'@; Set-Content -Path '...' -Value $t. Or write to a .txt file via cmd /c echo with redirection.\n";
+    sys += "11. EDITING FILES: To change part of an existing file, send only the change — never the whole file. Format:\n";
+    sys += "EDIT: " + uniDesktop + "\\app.cpp\n<<<<<<< SEARCH\nexact lines as they are in the file now\n=======\nthe lines that replace them\n>>>>>>> REPLACE\n";
+    sys += "   Several SEARCH/REPLACE blocks may follow one EDIT: line; a unified diff with @@ hunks is also accepted. Keep each SEARCH short but unique in the file.\n";
+    sys += "12. PLANS: When a task needs several actions (make a folder, write files, compile), send them as one PLAN: instead of one per message. Number the steps; a step waits for the one before it unless it says which steps it waits for, and steps that wait for the same step run at the same time. The plan stops at the first failure and you get one report for all steps. Format:\n";
+    sys += "PLAN:\n1: EXEC: mkdir " + uniDesktop + "\\calc\n2 after 1: EXEC: powershell -Command \"Set-Content -Path '" + uniDesktop + "\\calc\\a.cpp' -Value 'code_here'\"\n"
+           "3 after 1: EXEC: powershell -Command \"Set-Content -Path '" + uniDesktop + "\\calc\\b.cpp' -Value 'code_here'\"\n"
+           "4 after 2,3: EXEC: cmd /c \"cd /d " + uniDesktop + "\\calc && cl /nologo /EHsc a.cpp b.cpp /Fe:calc.exe\"\nEND PLAN\n";
+    sys += "   EDIT: steps work too (the blocks follow the step line). Use a single EXEC: or EDIT: when one action is enough.\n";
     // -------------------------
 
     sys += "\n=== CAPABILITIES ===\n";
     sys += "- ATTACH: File content analysis.\n";
     sys += "- SPEECH: Responses read via SAPI TTS.\n";
     sys += "- INTERNET: For weather, news, and Wikipedia queries the system pre-fetches real data and injects it as 'Context:' at the bottom of this prompt. When Context is present, respond naturally using that information — DO NOT output the word 'Context:' or the raw bullet list. Just talk about it like you already know it. NEVER use EXEC: for internet lookups — the data is already there.\n";
+    sys += AppStateManager::Instance().GetPluginManager().GetPluginSystemPrompt();
     
     sys += "\n=== CONSTRAINTS ===\n";
     sys += "Always use absolute paths starting with " + uniProfile + "\\\n";
     sys += "NEVER use C:\\Users\\Public\\Desktop — always use %USERPROFILE%\\Desktop or the Desktop path above.\n";
     sys += "Be direct. No disclaimers, no apologies, no 'let me know if this works'.\n";
 
+    // The workspace map only for requests about it; feedback turns continue a task that already had it
+    bool feedback = userMsg.compare(0, 18, L"[SYSTEM FEEDBACK]:") == 0;
+    if (!feedback && g_workspace.Relevant(WStringToString(userMsg))) {
+        std::string workspace = g_workspace.Summary(WStringToString(userMsg), WorkspaceBudget());
+        if (!workspace.empty()) sys += "\n=== WORKSPACE (most relevant files first) ===\n" + workspace;
+    }
+    if (!feedback && !g_config.workspaceDir.empty()) {
+        g_retriever.Sync(g_workspace, false);
+        std::string code = g_retriever.Context(WStringToString(userMsg), RetrievalBudget());
+        if (!code.empty()) sys += "\n=== RELEVANT CODE FROM THE WORKSPACE (path:lines) ===\n" + code;
+    }
+
     if (!webInfo.empty()) sys += "\n\nContext:\n" + webInfo;
 
     // 3. Prepare the request
+    // Vision providers also get the pixels; the GDI+ summaries stay as the text fallback
     std::string userPrompt = WStringToString(userMsg);
-    if (hasAttach) userPrompt += "\n\nAttached file content:\n" + attach.textContent;
+    std::vector<ImagePayload> images;
+    if (!attachments.empty()) {
+        std::string attached = BuildAttachmentPrompt(attachments, images);
+        if (AppStateManager::Instance().abortInference.load()) {
+            DevLog("[AI] Aborted while preparing attachments.\n");
+            PostMessageW(hMainWnd, WM_AI_DONE, FALSE, 0);
+            return;
+        }
+        userPrompt += (attachments.size() == 1 ? "\n\nAttached file content:" : "\n\nAttached files:") + attached;
+    }
 
     std::string snapshot;
     { 
@@ -1724,11 +12181,58 @@ void AIThreadFunc(std::wstring userMsg, std::string webInfo, bool hasAttach, Att
     }
 
     ProtocolType proto = g_providerPresets[AppStateManager::Instance().config.provider].protocol;
-    std::string body = BuildRequestBody(sys, snapshot, userPrompt, proto);
-
-    // 4. Send and Process
-    std::string rawResponse = SendToProvider(body);
+    std::string tools, path;
+    if (AppStateManager::Instance().GetPluginManager().Count()) {
+        if (proto == ProtocolType::LlamaLegacy) {   // /completion has no tools
+            proto = ProtocolType::OpenAICompat;
+            path = "/v1/chat/completions";
+        }
+        tools = ToolDeclarations(proto);
+    }
+    std::string body = BuildRequestBody(sys, snapshot, userPrompt, proto, images, tools);
+
+    // 4. Send and Process. Tool calls are answered here and the model asked again (see "Plugin tools")
+    const int kMaxToolRounds = 4;
+    std::string rawResponse = SendToProvider(body, path);
+    if (!images.empty() && !rawResponse.empty() && !AppStateManager::Instance().abortInference.load()) {
+        // A provider that answers the pixels with an error gets the request again with the text summaries alone
+        std::string turn;
+        if (ExtractReply(rawResponse, proto).empty() && (tools.empty() || ExtractToolCalls(rawResponse, proto, turn).empty())) {
+            DevLog("[Vision] %s rejected the images (%.200s) — resending with the text summaries\n", g_config.model.c_str(), rawResponse.c_str());
+            NoteVisionRejected();
+            images.clear();
+            body = BuildRequestBody(sys, snapshot, userPrompt, proto, images, tools);
+            rawResponse = SendToProvider(body, path);
+        }
+    }
+    std::string toolTurns;
+    for (int round = 1; !tools.empty() && !AppStateManager::Instance().abortInference.load(); round++) {
+        std::string turn;
+        std::vector<ToolCall> calls = ExtractToolCalls(rawResponse, proto, turn);
+        if (calls.empty() || round > kMaxToolRounds) break;
+        g_agentLoop.NoteModelCall(body.size(), turn.size());
+        for (const ToolCall& c : calls) {
+            std::string* line = new std::string("\r\n[TOOL] " + c.name + " " + c.args.substr(0, 200) + "\r\n");
+            if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 1, (LPARAM)line)) delete line;
+        }
+        RunToolCalls(calls);
+        std::string seen;
+        for (const ToolCall& c : calls) {
+            std::string brief = c.result.size() > 400 ? c.result.substr(0, 400) + "..." : c.result;
+            std::string* shown = new std::string(brief + "\r\n");
+            if (!PostMessageW(hMainWnd, WM_EXEC_OUTPUT, 0, (LPARAM)shown)) delete shown;
+            seen += "[System]: tool " + c.name + " returned: " + (c.result.size() > 1000 ? c.result.substr(0, 1000) + "..." : c.result) + "\n";
+        }
+        {   // later messages see what the tools returned
+            std::lock_guard<std::mutex> lk(historyMutex);
+            conversationHistory += StringToWString(seen);
+        }
+        toolTurns += (toolTurns.empty() ? "" : ",") + turn + "," + ToolResultsTurn(calls, proto);
+        body = BuildRequestBody(sys, snapshot, userPrompt, proto, images, tools + (round >= kMaxToolRounds ? NoMoreToolCalls(proto) : ""), toolTurns);
+        rawResponse = SendToProvider(body, path);
+    }
     std::string clean = ExtractReply(rawResponse, proto);
+    g_agentLoop.NoteModelCall(body.size(), clean.size());
 
     bool ok = !clean.empty();
     std::wstring reply;
@@ -1764,8 +12268,7 @@ void AIThreadFunc(std::wstring userMsg, std::string webInfo, bool hasAttach, Att
 DWORD WINAPI ChatThreadProc(LPVOID p) {
     ChatRequest* r = (ChatRequest*)p;
     std::wstring txt = r->userText;
-    bool hasAttach = r->hasAttachment;
-    Attachment attach = r->attachment;
+    std::vector<Attachment> attachments = std::move(r->attachments);
     delete r;
 
     std::string orig = WStringToString(txt);
@@ -1774,7 +12277,7 @@ DWORD WINAPI ChatThreadProc(LPVOID p) {
     DevLog("[Chat] User: %.120s\n", orig.c_str());
 
     std::string info = AnalyzeAndFetch(low, orig);
-    AIThreadFunc(txt, info, hasAttach, attach);
+    AIThreadFunc(txt, info, std::move(attachments));
     return 0;
 }
 
@@ -1782,7 +12285,7 @@ DWORD WINAPI ChatThreadProc(LPVOID p) {
 // UI CHAT SUBMISSION
 // ════════════════════════════════════════════════════════════════
 void ProcessChat() {
-    if (AppStateManager::Instance().aiRunning.load()) return;
+    if (AppStateManager::Instance().aiRunning.load() || g_attachLoads > 0) return;
 
     int len = GetWindowTextLengthW(hEditInput);
     if (len <= 0) return;
@@ -1799,12 +12302,14 @@ void ProcessChat() {
     AppendRichText(hEditDisplay, L"You: ", true);
     AppendRichText(hEditDisplay, txt + L"\r\n", false);
 
-    if (g_hasAttachment) {
-        AppendRichText(hEditDisplay, L"\U0001F4CE  " + g_attachment.displayName + L"\r\n", false);
-    }
+    for (size_t i = 0; i < g_attachments.size() && i < 10; i++)
+        AppendRichText(hEditDisplay, L"\U0001F4CE  " + g_attachments[i].displayName + L"\r\n", false);
+    if (g_attachments.size() > 10)
+        AppendRichText(hEditDisplay, L"\U0001F4CE  + " + std::to_wstring(g_attachments.size() - 10) + L" more\r\n", false);
 
     SetWindowTextW(hEditInput, L"");
     AppStateManager::Instance().abortInference.store(false); // Reset kill switch
+    g_agentLoop.Begin();
     
     // Toggle UI buttons
     EnableWindow(hButtonSend, FALSE);
@@ -1813,10 +12318,13 @@ void ProcessChat() {
     AppStateManager::Instance().aiRunning.store(true);
     SetAppState(AppState::Busy);
 
+    // A request Nova has carried out before can be replayed without the model (see "RECIPES")
+    if (g_attachments.empty() && OfferRecipe(txt)) return;
+    g_recipes.Begin(g_attachments.empty() ? txt : L"", g_currentAgentDir);
+
     ChatRequest* req = new ChatRequest;
     req->userText      = txt;
-    req->hasAttachment = g_hasAttachment;
-    req->attachment    = g_attachment;
+    req->attachments   = std::move(g_attachments);
     ClearAttachment();
 
     HANDLE hThread = CreateThread(0, 0, ChatThreadProc, req, 0, 0);
@@ -2209,7 +12717,7 @@ LRESULT CALLBACK WindowProc(HWND h, UINT m, WPARAM w, LPARAM l) {
             break;
 
         case IDC_BTN_STOP:
-            if (AppStateManager::Instance().aiRunning.load()) {
+            if (AppStateManager::Instance().aiRunning.load() || AppStateManager::Instance().execRunning.load()) {
                 DevLog("[UI] Abort clicked. Signaling inference engine...\n");
                 AppStateManager::Instance().abortInference.store(true); 
                 EnableWindow(hButtonStop, FALSE);
@@ -2241,12 +12749,23 @@ LRESULT CALLBACK WindowProc(HWND h, UINT m, WPARAM w, LPARAM l) {
         std::wstring reply = heapStr ? heapStr : L"";
         delete[] heapStr;
 
-        if (reply.size() > 10000) reply = reply.substr(0, 10000) + L"\n[Truncated]";
+        // Actions are read from the whole reply; only the transcript copy is truncated
         std::string cleanReply = WStringToString(reply);
+        if (reply.size() > 10000) reply = reply.substr(0, 10000) + L"\n[Truncated]";
 
         if (ok) {
             size_t execPos = cleanReply.find("EXEC:");
-            if (execPos != std::string::npos) {
+            size_t editPos = FindEditHeader(cleanReply);
+            size_t planPos = FindPlanHeader(cleanReply);
+            if (planPos != std::string::npos && planPos < execPos && planPos < editPos) {
+                g_agentLoop.NoteAction(cleanReply.substr(planPos));
+                g_recipes.NoteAction(RecipeBook::Action::Plan, cleanReply.substr(planPos));
+                ExecuteNovaPlan(cleanReply.substr(planPos));
+            } else if (editPos != std::string::npos && editPos < execPos) {
+                g_agentLoop.NoteAction(cleanReply.substr(editPos));
+                g_recipes.NoteAction(RecipeBook::Action::Edit, cleanReply.substr(editPos));
+                ExecuteNovaEdit(ParseEditBlocks(cleanReply.substr(editPos)));
+            } else if (execPos != std::string::npos) {
                 std::string cmd = cleanReply.substr(execPos + 5);
                 
                 // ANTI-HALLUCINATION: Slice string at the first newline
@@ -2259,58 +12778,175 @@ LRESULT CALLBACK WindowProc(HWND h, UINT m, WPARAM w, LPARAM l) {
                 size_t last = cmd.find_last_not_of(" \t");
                 if (first != std::string::npos) {
                     cmd = cmd.substr(first, last - first + 1);
-                    ExecuteNovaCommand(cmd, (cmd.find("cl") != std::string::npos));
+                    g_agentLoop.NoteAction(cmd);
+                    g_recipes.NoteAction(RecipeBook::Action::Exec, cmd);
+                    ExecuteNovaCommand(cmd);
+                } else {
+                    g_agentLoop.NoteAnswer();
+                    g_recipes.NoteAnswer(true);
                 }
+            } else {
+                g_agentLoop.NoteAnswer();
+                g_recipes.NoteAnswer(true);
             }
+        } else {
+            g_agentLoop.NoteAnswer();
+            g_recipes.NoteAnswer(false);
         }
 
         AppendRichText(hEditDisplay, L"Nova: ", true, RGB(0, 120, 215));
         AppendRichText(hEditDisplay, (ok ? reply : L"[No response]") + L"\r\n\r\n", false, RGB(30, 30, 30));
 
         SetWindowTextW(hButtonSend, L"Send"); 
-        EnableWindow(hButtonSend, TRUE);
+        EnableWindow(hButtonSend, g_attachLoads == 0);
+        EnableWindow(hButtonStop, AppStateManager::Instance().execRunning.load());
         aiRunning = false;
         SetAppState(ok ? AppState::Online : AppState::Offline);
         SetFocus(hEditInput);
         return 0;
     }
 
+    case WM_AI_PROGRESS:
+        // The label is free once the attachment has been sent; leave it alone if a new one is staged
+        if (hAttachLabel && g_attachments.empty() && g_attachLoads == 0) {
+            wchar_t buf[96] = L"";
+            if (l) swprintf_s(buf, L"Condensing attachment: %d / %d parts", (int)w, (int)l);
+            SetWindowTextW(hAttachLabel, buf);
+        }
+        return 0;
+
+    case WM_ATTACH_PROGRESS:
+        if (hAttachLabel) {
+            wchar_t buf[96];
+            swprintf_s(buf, L"Analysing attachments: %d / %d", (int)w, (int)l);
+            SetWindowTextW(hAttachLabel, buf);
+        }
+        return 0;
+
+    case WM_ATTACH_DONE:
+        OnAttachmentsLoaded((std::vector<Attachment>*)l);
+        return 0;
+
+    case WM_DROPFILES:
+        OnDropFiles((HDROP)w);
+        return 0;
+
+    case WM_EXEC_OUTPUT: {
+        std::unique_ptr<std::string> chunk((std::string*)l);
+        if (w) AppendRichText(hEditDisplay, StringToWString(*chunk), true, RGB(255, 140, 0));
+        else   AppendRichText(hEditDisplay, StringToWString(*chunk), false, RGB(120, 120, 120));
+        return 0;
+    }
+
     case WM_EXEC_DONE: {
+        std::unique_ptr<ExecResult> res((ExecResult*)l);
+        AppStateManager::Instance().execRunning.store(false);
+        if (res && !res->cwd.empty()) g_currentAgentDir = res->cwd;
         if (!AppStateManager::Instance().abortInference.load()) {
-            // 1. Read the shell output from the batch file
-            std::string oPath = GetExeDir() + "nova_exec_out.txt";
-            std::ifstream inFile(oPath);
-            std::string output((std::istreambuf_iterator<char>(inFile)), std::istreambuf_iterator<char>());
-            inFile.close();
-            DeleteFileA(oPath.c_str());
-
-            // 2. Format the feedback
+            // 1. Format the feedback (the output itself was already streamed to the transcript)
+            std::string output = res ? res->output : "";
+            std::string verdict;
+            if (!res || !res->started) {
+                verdict = "ERROR: the command could not be started" + (res ? " (" + res->error + ")" : std::string()) + ".";
+            } else {
+                char buf[160];
+                sprintf_s(buf, "exit code %d after %.1f s", res->exitCode, res->seconds);
+                verdict = buf;
+                if (res->timedOut)    verdict += " — killed: exceeded the " + std::to_string(g_config.execTimeoutSec) + " s time limit";
+                if (res->outputLimit) verdict += " — killed: printed more than " + std::to_string(g_config.execMaxOutputMB) + " MB";
+            }
+
             std::string statusMessage;
-            if (output.empty()) {
+            if (res && res->started && output.empty() && res->exitCode == 0) {
                 statusMessage = "SUCCESS: Command completed with no errors.";
             } else {
-                // Prevent massive log dumps from crashing the context window
-                if (output.size() > 2000) output = output.substr(0, 2000) + "\n... [Truncated]";
-                statusMessage = "SHELL OUTPUT:\n" + output;
+                // Errors first, noise counted rather than shown (see "Output condensing"); commands
+                // condensed their output as it streamed, so this only shortens built-in and plan reports
+                OutputCondenser condenser((size_t)(std::max)(g_config.execFeedbackTokens, 1));
+                condenser.Feed(output);
+                output = condenser.Finish();
+                statusMessage = (res && !res->source.empty() ? res->source + " RESULT (" : "SHELL OUTPUT (") + verdict + "):\n" + output;
             }
 
-            // 3. Show it in the UI using your native RichText function
-            std::wstring wStatus = StringToWString(statusMessage);
-            AppendRichText(hEditDisplay, L"\r\n[SYSTEM FEEDBACK]:\r\n", true, RGB(255, 140, 0));
-            AppendRichText(hEditDisplay, wStatus + L"\r\n", false, RGB(120, 120, 120));
+            // 2. Show the verdict in the UI using your native RichText function
+            std::string why;
+            bool more = g_agentLoop.Continue(res.get(), why);
+            g_recipes.NoteResult(res && res->started && res->exitCode == 0 && !res->timedOut && !res->outputLimit);
+            if (!more) g_recipes.Abandon();
+            AppendRichText(hEditDisplay, L"\r\n[SYSTEM FEEDBACK]: ", true, RGB(255, 140, 0));
+            AppendRichText(hEditDisplay, StringToWString(verdict + " (" + g_agentLoop.Progress() + ")") + L"\r\n", false, RGB(120, 120, 120));
+
+            // 3. Feed it back into Nova's brain so she can self-correct (see "AGENT LOOP")
+            if (more) {
+                g_agentLoop.Feed(L"[SYSTEM FEEDBACK]:\n" + StringToWString(statusMessage));
+            } else {
+                AppendRichText(hEditDisplay, L"[AGENT LOOP]: stopped — " + StringToWString(why) + L". Send a message to continue.\r\n", true, RGB(255, 140, 0));
+                SetWindowTextW(hButtonSend, L"Send");
+                EnableWindow(hButtonSend, g_attachLoads == 0);
+                EnableWindow(hButtonStop, FALSE);
+                SetAppState(AppState::Online);
+            }
 
-            // 4. Feed it back into Nova's brain so she can self-correct
-            std::wstring feedback = L"[SYSTEM FEEDBACK]:\n" + wStatus;
-            std::thread([feedback]() { 
-                AIThreadFunc(feedback, "", false, Attachment()); 
-            }).detach();
-            
         } else {
             // User hit the Stop button
+            g_recipes.Abandon();
+            AppendRichText(hEditDisplay, L"\r\n[SYSTEM FEEDBACK]: command stopped.\r\n", true, RGB(255, 140, 0));
             AppStateManager::Instance().aiRunning.store(false);
             AppStateManager::Instance().abortInference.store(false);
             SetWindowTextW(hButtonSend, L"Send");
             EnableWindow(hButtonSend, TRUE);
+            EnableWindow(hButtonStop, FALSE);
+        }
+        return 0;
+    }
+
+    case WM_RECIPE_DONE: {
+        std::unique_ptr<ExecResult> res((ExecResult*)l);
+        AppStateManager::Instance().execRunning.store(false);
+        if (res && !res->cwd.empty()) g_currentAgentDir = res->cwd;
+        bool stopped = AppStateManager::Instance().abortInference.load();
+        bool ok = res && res->started && res->exitCode == 0 && !res->timedOut && !res->aborted;
+        if (!stopped) g_recipes.Replayed(ok);
+        if (ok || stopped) {
+            std::wstring note = stopped ? L"stopped." : L"done — the saved commands ran without a model call.";
+            AppendRichText(hEditDisplay, L"\r\n[RECIPE]: ", true, RGB(255, 140, 0));
+            AppendRichText(hEditDisplay, note + L"\r\n\r\n", false, RGB(120, 120, 120));
+            {
+                std::lock_guard<std::mutex> lk(historyMutex);
+                conversationHistory += L"Nova: (replayed a saved recipe for this request; " + std::wstring(stopped ? L"stopped by the user" : L"it succeeded") + L")\r\n";
+            }
+            g_agentLoop.NoteAnswer();
+            AppStateManager::Instance().aiRunning.store(false);
+            AppStateManager::Instance().abortInference.store(false);
+            SetWindowTextW(hButtonSend, L"Send");
+            EnableWindow(hButtonSend, g_attachLoads == 0);
+            EnableWindow(hButtonStop, FALSE);
+            SetAppState(AppState::Online);
+            SetFocus(hEditInput);
+            return 0;
+        }
+
+        // The recipe no longer fits: the model takes over with the report, and what works replaces it
+        AppendRichText(hEditDisplay, L"\r\n[RECIPE]: ", true, RGB(255, 140, 0));
+        AppendRichText(hEditDisplay, L"a saved command failed — asking Nova.\r\n", false, RGB(120, 120, 120));
+        OutputCondenser condenser((size_t)(std::max)(g_config.execFeedbackTokens, 1));
+        condenser.Feed(res ? res->output + res->error : std::string());
+        std::wstring request = g_recipes.ReplayRequest();
+        g_currentAgentDir = g_recipes.ReplayDir();   // the model starts over from where the task starts
+        g_recipes.Begin(request, g_currentAgentDir);
+        ChatRequest* req = new ChatRequest;
+        req->userText = request + L"\n\n[SYSTEM FEEDBACK]: a saved recipe for this request was replayed and failed; do not repeat it unchanged. Report:\n"
+                      + StringToWString(condenser.Finish());
+        HANDLE hThread = CreateThread(0, 0, ChatThreadProc, req, 0, 0);
+        if (!hThread) {
+            delete req;
+            AppStateManager::Instance().aiRunning.store(false);
+            SetWindowTextW(hButtonSend, L"Send");
+            EnableWindow(hButtonSend, TRUE);
+            EnableWindow(hButtonStop, FALSE);
+            SetAppState(AppState::Offline);
+        } else {
+            CloseHandle(hThread);
         }
         return 0;
     }
@@ -2321,7 +12957,14 @@ LRESULT CALLBACK WindowProc(HWND h, UINT m, WPARAM w, LPARAM l) {
         return 0;
 
     case WM_DESTROY:
+        g_agentLoop.Shutdown();
         StopLocalEngine();
+        g_workspace.Cancel();
+        if (g_workspaceThread.joinable()) g_workspaceThread.join();
+        g_workspace.Close();
+        g_shell.Stop();
+        StopAttachmentLoads();
+        AnalysisCache::Instance().Flush(true);   // keeps the recency of cache hits for eviction
         Gdiplus::GdiplusShutdown(g_gdipToken);
         DeleteObject(hFontMain); 
         DeleteObject(hFontBtn); 
@@ -2339,10 +12982,410 @@ LRESULT CALLBACK WindowProc(HWND h, UINT m, WPARAM w, LPARAM l) {
     return DefWindowProcW(h, m, w, l);
 } // This closes the WindowProc function
 
+// ════════════════════════════════════════════════════════════════
+// BENCHMARKS  (nova.exe --bench <name> [args]; results go to the dev log)
+// ════════════════════════════════════════════════════════════════
+// Writes a 16-bit stereo WAV alternating a 120 BPM kick/chord pattern with speech-like noise bursts
+static bool WriteSyntheticWav(const std::wstring& path, double seconds, DWORD rate) {
+    FILE* f = nullptr;
+    if (_wfopen_s(&f, path.c_str(), L"wb") != 0 || !f) return false;
+    const ULONGLONG frames = (ULONGLONG)(seconds * rate);
+    const DWORD dataBytes = (DWORD)std::min<ULONGLONG>(frames * 4, 0xFFFFFFF0ull);
+    BYTE hdr[44] = {};
+    memcpy(hdr, "RIFF", 4); DWORD riff = 36 + dataBytes; memcpy(hdr + 4, &riff, 4);
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    DWORD fmtLen = 16, byteRate = rate * 4; WORD tag = 1, ch = 2, align = 4, bits = 16;
+    memcpy(hdr + 16, &fmtLen, 4); memcpy(hdr + 20, &tag, 2); memcpy(hdr + 22, &ch, 2);
+    memcpy(hdr + 24, &rate, 4); memcpy(hdr + 28, &byteRate, 4); memcpy(hdr + 32, &align, 2); memcpy(hdr + 34, &bits, 2);
+    memcpy(hdr + 36, "data", 4); memcpy(hdr + 40, &dataBytes, 4);
+    fwrite(hdr, 1, sizeof(hdr), f);
+
+    std::vector<int16_t> block(65536 * 2);
+    uint32_t rng = 0x12345678;
+    double lp = 0, lp2 = 0;
+    for (ULONGLONG i = 0; i < dataBytes / 4; ) {
+        size_t n = (size_t)std::min<ULONGLONG>(65536, dataBytes / 4 - i);
+        for (size_t k = 0; k < n; k++, i++) {
+            double t = (double)i / rate, v;
+            rng = rng * 1664525u + 1013904223u;
+            double noise = (rng >> 8) * (1.0 / 16777216.0) - 0.5;
+            if (fmod(t, 60.0) < 30.0) {
+                double ph = fmod(t, 0.5);
+                double kick = ph < 0.08 ? sin(2 * M_PI * 55 * t) * exp(-ph * 40) : 0;
+                v = 0.5 * kick + 0.08 * (sin(2 * M_PI * 261.6 * t) + sin(2 * M_PI * 329.6 * t) + sin(2 * M_PI * 392.0 * t));
+            } else {
+                lp += 0.3 * (noise - lp); lp2 += 0.05 * (lp - lp2);
+                double syl = std::max(0.0, sin(2 * M_PI * 4.3 * t + sin(2 * M_PI * 0.7 * t)));
+                v = (fmod(t, 3.3) < 2.2 ? 1.0 : 0.0) * syl * syl * ((lp - lp2) * 1.5 + 0.2 * sin(2 * M_PI * 140 * t));
+            }
+            int16_t s = (int16_t)std::max(-32768.0, std::min(32767.0, v * 32767.0));
+            block[k * 2] = s; block[k * 2 + 1] = s;
+        }
+        fwrite(block.data(), sizeof(int16_t), n * 2, f);
+    }
+    fclose(f);
+    return true;
+}
+
+static void BenchAudio(const std::string& args) {
+    std::vector<double> minutes = { 1, 10, 60 };
+    if (!args.empty()) minutes = { std::max(0.1, atof(args.c_str())) };
+    wchar_t tmp[MAX_PATH];
+    GetTempPathW(MAX_PATH, tmp);
+    for (double m : minutes) {
+        std::wstring path = std::wstring(tmp) + L"nova_bench_audio.wav";
+        auto t0 = std::chrono::steady_clock::now();
+        if (!WriteSyntheticWav(path, m * 60.0, 44100)) { DevLog("[Bench] audio: could not write %S\n", path.c_str()); return; }
+        double genMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        DevLog("[Bench] audio: %.1f min synthetic stereo WAV generated in %.0f ms\n", m, genMs);
+
+        t0 = std::chrono::steady_clock::now();
+        std::string report = AnalyzeWavDetailed(path);  // logs the per-stage timings itself
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        DevLog("[Bench] audio: %.1f min analysed in %.0f ms (%.0fx realtime)\n", m, ms, m * 60000.0 / std::max(ms, 1e-3));
+        DevLog("%s\n", report.c_str());
+        DeleteFileW(path.c_str());
+    }
+}
+
+// Cold index of a folder, a no-change rescan, one single-file update and a ranked summary
+static void BenchWorkspace(const std::string& args) {
+    std::wstring root = !args.empty() ? StringToWString(args) : !g_config.workspaceDir.empty() ? WorkspaceRoot() : StringToWString(GetDesktopDir());
+    WorkspaceIndex index;
+    auto t0 = std::chrono::steady_clock::now();
+    index.Open(root, "", false);
+    double coldMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    DevLog("[Bench] workspace: cold index of %s — %zu files, %zu symbols in %.0f ms\n",
+           WStringToString(root).c_str(), index.Files(), index.Symbols(), coldMs);
+
+    t0 = std::chrono::steady_clock::now();
+    index.Rescan();
+    DevLog("[Bench] workspace: no-change rescan in %.1f ms\n",
+           std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+
+    std::vector<std::string> paths = index.Paths();
+    if (!paths.empty()) {
+        // Simulate one edit: the watcher hands Update() a single path
+        std::string victim = paths[paths.size() / 2];
+        index.Invalidate(victim);
+        t0 = std::chrono::steady_clock::now();
+        size_t n = index.Update({ victim });
+        DevLog("[Bench] workspace: single-file update (%s) — %zu re-parsed in %.3f ms\n", victim.c_str(), n,
+               std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+    }
+
+    t0 = std::chrono::steady_clock::now();
+    std::string summary = index.Summary("main config parse", 4000);
+    DevLog("[Bench] workspace: ranked summary (%zu chars) in %.1f ms\n%s\n", summary.size(),
+           std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count(), summary.c_str());
+}
+
+// Deterministic synthetic code base of ~500-line C++ and Python files built from a small
+// vocabulary: camelCase and snake_case definitions with comments, calling each other.
+// Returns the number of lines written; `names` receives every defined function.
+static size_t WriteRetrievalCorpus(const std::string& dir, size_t totalLines, std::vector<std::string>& names) {
+    static const char* verbs[] = { "parse","load","read","write","build","update","compute","resolve","encode","decode",
+                                   "flush","merge","split","scan","render","apply","validate","fetch","send","open",
+                                   "close","reset","find","sort","emit","queue","trim","hash" };
+    static const char* nouns[] = { "frame","header","buffer","index","token","cache","config","socket","packet","record",
+                                   "entry","chunk","stream","image","audio","sample","channel","window","layout","symbol",
+                                   "path","node","tree","session","request","reply","model","engine","plugin","prompt",
+                                   "history","vertex","shader","texture","mesh","account","invoice","ledger","budget","schema" };
+    const int nv = sizeof(verbs) / sizeof(verbs[0]), nn = sizeof(nouns) / sizeof(nouns[0]);
+    unsigned rng = 12345;
+    auto next = [&](int n) { rng = rng * 1664525u + 1013904223u; return (int)((rng >> 8) % (unsigned)n); };
+    auto cap = [](std::string s) { s[0] = (char)toupper((unsigned char)s[0]); return s; };
+
+    size_t written = 0;
+    for (int fileNo = 0; written < totalLines; fileNo++) {
+        bool py = fileNo % 4 == 3;
+        std::string sub = dir + "/mod" + std::to_string(fileNo % 40);
+        std::error_code ec;
+        std::filesystem::create_directories(sub, ec);
+        std::string a = nouns[next(nn)], b = nouns[next(nn)];
+        std::string path = sub + "/" + a + "_" + b + (py ? ".py" : ".cpp");
+        std::ofstream f(path, std::ios::binary | std::ios::trunc);
+        if (!f) break;
+        std::vector<std::string> local;
+        size_t lines = 0;
+        if (!py) { f << "#include \"" << a << "_" << b << ".h\"\n#include <vector>\n\n"; lines += 3; }
+        else     { f << "import os\nimport " << a << "\n\n"; lines += 3; }
+        while (lines < 500) {
+            std::string v = verbs[next(nv)], n1 = nouns[next(nn)], n2 = nouns[next(nn)];
+            std::string name = py ? v + "_" + n1 + "_" + n2 : v + cap(n1) + cap(n2);
+            int body = 8 + next(30);
+            if (py) {
+                f << "# " << v << " the " << n1 << " " << n2 << " for the " << a << " pipeline\n";
+                f << "def " << name << "(" << n1 << ", " << n2 << "_count=" << next(64) << "):\n";
+            } else {
+                f << "// " << cap(v) << " the " << n1 << " " << n2 << " for the " << a << " pipeline\n";
+                f << "static int " << name << "(const " << cap(n1) << "& " << n1 << ", int " << n2 << "Count) {\n";
+            }
+            lines += 2;
+            for (int k = 0; k < body; k++) {
+                std::string x = nouns[next(nn)], y = nouns[next(nn)];
+                std::string callee = !local.empty() && next(3) == 0 ? local[next((int)local.size())]
+                                   : py ? std::string(verbs[next(nv)]) + "_" + x : std::string(verbs[next(nv)]) + cap(x);
+                if (py) f << "    " << x << "_" << y << " = " << callee << "(" << n1 << ", " << next(1000) << ")\n";
+                else    f << "    auto " << x << cap(y) << " = " << callee << "(" << n1 << ", " << n2 << "Count + " << next(1000) << ");\n";
+            }
+            f << (py ? "    return " + n1 + "\n\n" : "    return " + n2 + "Count;\n}\n\n");
+            lines += body + 2;
+            local.push_back(name);
+            names.push_back(name);
+        }
+        written += lines;
+    }
+    return written;
+}
+
+// Indexes a generated corpus (default 1M lines), then times queries and a single-file re-sync
+static void BenchRetrieval(const std::string& args) {
+    size_t target = args.empty() ? 1000000 : (size_t)(std::max)(1000.0, atof(args.c_str()));
+    wchar_t tmp[MAX_PATH];
+    GetTempPathW(MAX_PATH, tmp);
+    std::string dir = WStringToString(tmp) + "nova_bench_corpus";
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::string> names;
+    size_t lines = WriteRetrievalCorpus(dir, target, names);
+    DevLog("[Bench] retrieval: %zu-line corpus (%zu functions) generated in %.0f ms\n", lines, names.size(),
+           std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+    if (names.empty()) return;
+
+    WorkspaceIndex index;
+    t0 = std::chrono::steady_clock::now();
+    index.Open(StringToWString(dir), "", false);
+    double walkMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    CodeRetriever retriever;
+    t0 = std::chrono::steady_clock::now();
+    retriever.Sync(index);
+    double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    DevLog("[Bench] retrieval: workspace index %.0f ms, chunk index %.0f ms on %u threads — %zu chunks, %zu terms\n",
+           walkMs, buildMs, (std::max)(std::thread::hardware_concurrency(), 2u), retriever.Chunks(), retriever.Terms());
+
+    // Half the queries name the function, half paraphrase it in words ("the frame header")
+    std::vector<double> lat;
+    size_t top1 = 0;
+    unsigned rng = 7;
+    for (int q = 0; q < 500; q++) {
+        rng = rng * 1664525u + 1013904223u;
+        const std::string& name = names[(rng >> 8) % names.size()];
+        std::string query = "how does " + name + " work";
+        if (q % 2) {
+            std::string words;
+            ForEachCodeToken(name.data(), name.size(), [&](const std::string& t) { if (t.size() < name.size()) words += t + " "; });
+            query = "where do we " + words + "in my project";
+        }
+        auto a = std::chrono::steady_clock::now();
+        std::vector<CodeRetriever::Hit> hits = retriever.Query(query, 8);
+        lat.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - a).count());
+        if (!hits.empty() && hits[0].title == name) top1++;
+    }
+    std::sort(lat.begin(), lat.end());
+    double sum = 0;
+    for (double v : lat) sum += v;
+    DevLog("[Bench] retrieval: %zu queries — mean %.2f ms, p50 %.2f ms, p99 %.2f ms, max %.2f ms (target < 10 ms); "
+           "defining chunk ranked first for %zu\n", lat.size(), sum / lat.size(), lat[lat.size() / 2],
+           lat[lat.size() * 99 / 100], lat.back(), top1);
+
+    // One edited file: the watcher path is Update() on the workspace, then a re-sync
+    std::vector<std::string> paths = index.Paths();
+    {
+        std::ofstream f(dir + "/" + paths[0], std::ios::binary | std::ios::app);
+        f << "\nstatic int benchInsertedMarker(int x) {\n    return x;\n}\n";
+    }
+    t0 = std::chrono::steady_clock::now();
+    index.Update({ paths[0] });
+    size_t n = retriever.Sync(index);
+    DevLog("[Bench] retrieval: single-file edit re-synced (%zu file) in %.2f ms; marker found: %s\n", n,
+           std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count(),
+           retriever.Query("bench inserted marker", 1).empty() ? "no" : "yes");
+
+    std::filesystem::remove_all(dir, ec);
+}
+
+// Per-command overhead of EXEC: a fresh cmd.exe / powershell.exe per command against the warm host
+static void BenchShell(const std::string& args) {
+    int n = args.empty() ? 20 : (std::max)(atoi(args.c_str()), 1);
+    ExecLimits limits;
+    ShellHost host;
+    auto t0 = std::chrono::steady_clock::now();
+    host.Prewarm();
+    double startMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    if (!host.Warm()) { DevLog("[Bench] shell: host did not start\n"); return; }
+
+    struct Case { const char* label; const char* command; };
+    const Case cases[] = {
+        { "cmd  ", "echo hi" },
+        { "ps   ", "powershell -NoProfile -Command \"Write-Output hi\"" },
+    };
+    for (const Case& c : cases) {
+        std::string payload;
+        ShellKind kind = SplitShellCommand(c.command, payload);
+        double cold = 0, warm = 0;
+        for (int i = 0; i < n; i++) {
+            ExecResult a = RunCommand(c.command, "", limits);
+            ExecResult b = host.Run(payload, kind, "", limits);
+            cold += a.seconds * 1000.0;
+            warm += b.seconds * 1000.0;
+            if (i == 0 && a.output != b.output) DevLog("[Bench] shell: %s outputs differ: cold '%s' warm '%s'\n", c.label, a.output.c_str(), b.output.c_str());
+        }
+        DevLog("[Bench] shell: %s %d runs — cold %.1f ms/command, warm %.1f ms/command (%.0fx)\n",
+               c.label, n, cold / n, warm / n, warm > 0 ? cold / warm : 0.0);
+    }
+    DevLog("[Bench] shell: host start-up %.0f ms (paid once, in the background at launch)\n", startMs);
+}
+
+// EXEC file operations run in-process against the same commands sent to the warm shell host
+static void BenchNative(const std::string& args) {
+    int n = args.empty() ? 20 : (std::max)(atoi(args.c_str()), 1);
+    std::string root = GetExeDir() + "nova_bench_native";
+    std::string nativeDir = root + "/native", shellDir = root + "/shell";
+    std::error_code ec;
+    std::filesystem::remove_all(std::filesystem::u8path(root), ec);
+    std::filesystem::create_directories(std::filesystem::u8path(nativeDir), ec);
+    std::filesystem::create_directories(std::filesystem::u8path(shellDir), ec);
+
+    ExecLimits limits;
+    ShellHost host;
+    host.Prewarm();
+    if (!host.Warm()) { DevLog("[Bench] native: shell host did not start\n"); return; }
+
+    // %d is the run number
+    struct Case { const char* label; const char* command; };
+    const Case cases[] = {
+        { "mkdir", "mkdir d%d" },
+        { "write", "powershell -NoProfile -Command \"Set-Content -Path 'f%d.txt' -Value 'hello from the bench'\"" },
+        { "read ", "type f%d.txt" },
+        { "copy ", "copy f%d.txt d%d\\c.txt" },
+        { "move ", "move f%d.txt d%d\\m.txt" },
+        { "list ", "dir /b /s" },
+    };
+    double nativeTotal = 0, shellTotal = 0;
+    for (const Case& c : cases) {
+        double nativeMs = 0, shellMs = 0;
+        int declined = 0, differ = 0;
+        for (int i = 0; i < n; i++) {
+            char command[512];
+            sprintf_s(command, c.command, i, i);
+            CommandInfo info = ClassifyCommand(command);
+            ExecResult a;
+            auto t0 = std::chrono::steady_clock::now();
+            bool native = info.route == CommandInfo::Route::Native && RunNativeCommand(info.segments[0], info.native, nativeDir, limits.maxOutputBytes, a);
+            nativeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            if (!native) declined++;
+
+            std::string payload;
+            ShellKind kind = SplitShellCommand(command, payload);
+            ExecResult b = host.Run(payload, kind, shellDir, limits);
+            shellMs += b.seconds * 1000.0;
+            if (native && a.exitCode != b.exitCode) differ++;
+        }
+        DevLog("[Bench] native: %s %d runs — native %.3f ms/command, warm shell %.2f ms/command (%.0fx)%s%s\n",
+               c.label, n, nativeMs / n, shellMs / n, nativeMs > 0 ? shellMs / nativeMs : 0.0,
+               declined ? " [some runs fell back to the shell]" : "", differ ? " [exit codes differ]" : "");
+        nativeTotal += nativeMs;
+        shellTotal  += shellMs;
+    }
+    DevLog("[Bench] native: %.1f ms saved over %d commands (%.2f ms each)\n", shellTotal - nativeTotal,
+           n * (int)(sizeof(cases) / sizeof(cases[0])), (shellTotal - nativeTotal) / (n * (int)(sizeof(cases) / sizeof(cases[0]))));
+    std::filesystem::remove_all(std::filesystem::u8path(root), ec);
+}
+
+// Compile cache: a cold compile, the same compile again, and a rebuild after a comment-only edit
+static void BenchCompile(const std::string& args) {
+    namespace fs = std::filesystem;
+    int n = args.empty() ? 5 : (std::max)(atoi(args.c_str()), 1);
+    std::string root = GetExeDir() + "nova_bench_compile";
+    std::error_code ec;
+    fs::remove_all(fs::u8path(root), ec);
+    fs::create_directories(fs::u8path(root + "/src"), ec);
+    if (!g_toolchain.Ensure()) { DevLog("[Bench] compile: no compiler found\n"); return; }
+    EnvOverrides env = g_toolchain.Vars();
+    const char* command = "cl /nologo /EHsc /O2 bench.cpp";
+    const char* source =
+        "#include <algorithm>\n#include <map>\n#include <string>\n#include <vector>\n#include <iostream>\n"
+        "int main() {\n"
+        "    std::map<std::string, std::vector<int>> m;\n"
+        "    for (int i = 0; i < 1000; i++) m[std::to_string(i % 37)].push_back(i);\n"
+        "    size_t total = 0;\n"
+        "    for (auto& kv : m) { std::sort(kv.second.rbegin(), kv.second.rend()); total += kv.second.size(); }\n"
+        "    std::cout << total << std::endl;   // %d\n"
+        "}\n";
+    CommandInfo info = ClassifyCommand(command);
+    CompileJob job;
+    if (!ParseCompileJob(info, root + "/src", job)) { DevLog("[Bench] compile: '%s' is not cacheable\n", command); return; }
+
+    ExecLimits limits;
+    double coldMs = 0, missMs = 0, hitMs = 0, editMs = 0;
+    int hits = 0, editHits = 0;
+    for (int i = 0; i < n; i++) {
+        CompileCache cache(root + "/cache" + std::to_string(i));
+        char text[1024];
+        sprintf_s(text, source, 0);
+        std::string err;
+        WriteFileAtomic(fs::u8path(root + "/src/bench.cpp"), text, err);
+
+        ExecResult cold = RunCommand(command, job.dir, limits, nullptr, nullptr, &env);
+        coldMs += cold.seconds * 1000.0;
+
+        // Miss: preprocess, compile, store
+        double keySec = 0;
+        ExecResult r;
+        auto t0 = std::chrono::steady_clock::now();
+        std::string key = cache.Key(job, env, g_toolchain.Identity(), nullptr, keySec);
+        if (!cache.Lookup(key, keySec, job, nullptr, r)) {
+            r = RunCommand(command, job.dir, limits, nullptr, nullptr, &env);
+            cache.Store(key, job, r, 1ull << 30);
+        }
+        missMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+        // The same compile again
+        t0 = std::chrono::steady_clock::now();
+        key = cache.Key(job, env, g_toolchain.Identity(), nullptr, keySec);
+        hits += cache.Lookup(key, keySec, job, nullptr, r) ? 1 : 0;
+        hitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+        // A comment changed on the same line
+        sprintf_s(text, source, i + 1);
+        WriteFileAtomic(fs::u8path(root + "/src/bench.cpp"), text, err);
+        t0 = std::chrono::steady_clock::now();
+        key = cache.Key(job, env, g_toolchain.Identity(), nullptr, keySec);
+        editHits += cache.Lookup(key, keySec, job, nullptr, r) ? 1 : 0;
+        editMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    }
+    DevLog("[Bench] compile: %d runs — uncached %.0f ms, miss %.0f ms (+%.0f%% for the preprocessor), hit %.0f ms (%d/%d), "
+           "after a comment edit %.0f ms (%d/%d) — %.1fx on a hit\n",
+           n, coldMs / n, missMs / n, coldMs > 0 ? 100.0 * (missMs - coldMs) / coldMs : 0.0, hitMs / n, hits, n,
+           editMs / n, editHits, n, hitMs > 0 ? coldMs / hitMs : 0.0);
+    fs::remove_all(fs::u8path(root), ec);
+}
+
+static int RunBenchmark(const std::string& cmdLine) {
+    std::string rest = cmdLine.substr(cmdLine.find("--bench") + 7);
+    size_t a = rest.find_first_not_of(' ');
+    std::string name = a == std::string::npos ? "" : rest.substr(a, rest.find(' ', a) - a);
+    size_t b = a == std::string::npos ? std::string::npos : rest.find_first_not_of(' ', a + name.size());
+    std::string args = b == std::string::npos ? "" : rest.substr(b);
+
+    DevLog("=== Nova Benchmark: %s ===\n", name.c_str());
+    if      (name == "audio")     BenchAudio(args);
+    else if (name == "workspace") BenchWorkspace(args);
+    else if (name == "retrieval") BenchRetrieval(args);
+    else if (name == "shell")     BenchShell(args);
+    else if (name == "native")    BenchNative(args);
+    else if (name == "compile")   BenchCompile(args);
+    else { DevLog("[Bench] Unknown benchmark '%s'. Available: audio, workspace, retrieval, shell, native, compile\n", name.c_str()); return 1; }
+    return 0;
+}
+
 // ════════════════════════════════════════════════════════════════
 // ENTRY POINT
 // ════════════════════════════════════════════════════════════════
-int WINAPI WinMain(HINSTANCE hI, HINSTANCE, LPSTR, int) {
+int WINAPI WinMain(HINSTANCE hI, HINSTANCE, LPSTR lpCmdLine, int) {
     CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
     
     // TTS Setup — Female American Voice (Zira)
@@ -2376,6 +13419,20 @@ int WINAPI WinMain(HINSTANCE hI, HINSTANCE, LPSTR, int) {
     // Load config FIRST — everything depends on this
     LoadConfig();
 
+    // Headless benchmark mode: report to the launching console and exit without a window
+    if (lpCmdLine && strstr(lpCmdLine, "--bench")) {
+        if (AttachConsole(ATTACH_PARENT_PROCESS) || AllocConsole()) {
+            FILE* con = nullptr;
+            freopen_s(&con, "CONOUT$", "w", stdout);
+            consoleAllocated = true;
+        }
+        int rc = RunBenchmark(lpCmdLine);
+        Gdiplus::GdiplusShutdown(g_gdipToken);
+        if (g_pVoice) g_pVoice->Release();
+        CoUninitialize();
+        return rc;
+    }
+
     hFontMain      = CreateFontW(17,0,0,0,FW_NORMAL,0,0,0,DEFAULT_CHARSET,0,0,CLEARTYPE_QUALITY,0,L"Segoe UI");
     hFontBtn       = CreateFontW(15,0,0,0,FW_MEDIUM,0,0,0,DEFAULT_CHARSET,0,0,CLEARTYPE_QUALITY,0,L"Segoe UI");
     hFontIndicator = CreateFontW(13,0,0,0,FW_NORMAL,0,0,0,DEFAULT_CHARSET,0,0,CLEARTYPE_QUALITY,0,L"Segoe UI");
@@ -2409,7 +13466,7 @@ int WINAPI WinMain(HINSTANCE hI, HINSTANCE, LPSTR, int) {
     int winY = (GetSystemMetrics(SM_CYSCREEN) - winH) / 2;
 
     // Create main window and controls centered on the screen
-    hMainWnd = CreateWindowExW(0, L"NovaMain", L"Nova", WS_OVERLAPPEDWINDOW,
+    hMainWnd = CreateWindowExW(WS_EX_ACCEPTFILES, L"NovaMain", L"Nova", WS_OVERLAPPEDWINDOW,
                                winX, winY, winW, winH, 0, 0, hI, 0);
 
     hIndicator    = CreateWindowExW(0, L"IndicatorCtrl", L"", WS_CHILD | WS_VISIBLE, 0,0,0,0, hMainWnd, 0, hI, 0);
@@ -2439,8 +13496,11 @@ int WINAPI WinMain(HINSTANCE hI, HINSTANCE, LPSTR, int) {
     LoadHistory();
     LayoutControls(hMainWnd);
 
-    // 2. Start engine and WAIT for it (the 5s buffer happens here)
+    // 2. Load plugins (offered to the model as tools), then start the engine and WAIT for it (the 5s buffer happens here)
+    AppStateManager::Instance().InitializePlugins(StringToWString(GetExeDir()) + L"plugins");
     StartLocalEngine();
+    StartWorkspaceIndex();
+    g_shell.PrewarmAsync([]() { g_toolchain.Ensure(); });
 
     // 3. Finally show the window
     ShowWindow(hMainWnd, SW_SHOW);